@@ -29,7 +29,28 @@ async fn build_lib() -> Result<()> {
 
     let files = glob::glob("./cxx_src/**/*.cpp")?.collect::<std::result::Result<Vec<_>, _>>()?;
 
-    cc::Build::new()
+    // Emitting rerun-if-env-changed disables the default change detection, so list sources too.
+    println!("cargo:rerun-if-changed=build.rs");
+    println!("cargo:rerun-if-changed=cxx_src");
+
+    let mut build = cc::Build::new();
+    // e.g. MIKANOS_USB_MAX_LOG_LEVEL=kTrace
+    println!("cargo:rerun-if-env-changed=MIKANOS_USB_MAX_LOG_LEVEL");
+    if let Ok(level) = env::var("MIKANOS_USB_MAX_LOG_LEVEL") {
+        build.define("MIKANOS_USB_MAX_LOG_LEVEL", level.as_str());
+    }
+    for flag in &[
+        "MIKANOS_USB_BINARY_LOG",
+        "MIKANOS_USB_LATENCY_TRACE",
+        "MIKANOS_USB_EVENT_TRACE",
+    ] {
+        println!("cargo:rerun-if-env-changed={}", flag);
+        if env::var_os(flag).is_some() {
+            build.define(flag, None);
+        }
+    }
+
+    build
         .cpp(true)
         .include(unpacked_dir.join("include"))
         .include(unpacked_dir.join("include/c++/v1"))
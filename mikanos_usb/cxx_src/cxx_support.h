@@ -12,6 +12,12 @@ extern "C" {
 int32_t sabios_log(int32_t level, const char *file, size_t file_len, uint32_t line, const char *msg,
                    size_t msg_len, bool cont_line);
 
+/* 物理的に連続した num_frames 個のフレームを確保し，同じ仮想アドレスに写像する．
+ * 確保できなければ 0 を返す． */
+uintptr_t sabios_alloc_dma_frames(size_t num_frames);
+/* sabios_alloc_dma_frames で確保したフレームを返す． */
+void sabios_free_dma_frames(uintptr_t base, size_t num_frames);
+
 #ifdef __cplusplus
 }
 #endif
@@ -22,6 +22,11 @@ public:
     kUnknownXHCISpeedID,
     kNoWaiter,
     kEndpointNotInCharge,
+    kRingFull,
+    kIndexOutOfRange,
+    kTimeout,
+    /** 同時に列挙できるポートの数を超えた */
+    kTooManyEnumerations,
     kLastOfCode, // この列挙子は常に最後に配置する
   };
 
@@ -43,6 +48,10 @@ private:
       "kUnknownXHCISpeedID",
       "kNoWaiter",
       "kEndpointNotInCharge",
+      "kRingFull",
+      "kIndexOutOfRange",
+      "kTimeout",
+      "kTooManyEnumerations",
   };
   static_assert(Error::Code::kLastOfCode == code_names_.size());
 
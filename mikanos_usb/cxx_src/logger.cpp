@@ -1,21 +1,183 @@
 #include "logger.hpp"
 
 #include "cxx_support.h"
+#include "usb/spinlock.hpp"
 
+#include <array>
+#include <cstdarg>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 
-int _Log(enum LogLevel level, const char *file, uint32_t line, bool cont_line, const char *format,
-         ...) {
+LogLevel log_level = kInfo;
+
+void SetLogLevel(LogLevel level) { log_level = level; }
+
+namespace {
+int VLogFormatted(enum LogLevel level, const char *file, uint32_t line, bool cont_line,
+                  const char *format, va_list ap) {
   char buf[1024];
+  int res = vsnprintf(buf, sizeof(buf) - 1, format, ap);
+
+  sabios_log(level, file, strlen(file), line, buf, strlen(buf), cont_line);
+
+  return res;
+}
+} // namespace
+
+int _LogFormatted(enum LogLevel level, const char *file, uint32_t line, bool cont_line,
+                  const char *format, ...) {
   va_list ap;
 
   va_start(ap, format);
-  int res = vsnprintf(buf, sizeof(buf) - 1, format, ap);
+  int res = VLogFormatted(level, file, line, cont_line, format, ap);
   va_end(ap);
 
-  sabios_log(level, file, strlen(file), line, buf, strlen(buf), cont_line);
+  return res;
+}
+
+#ifndef MIKANOS_USB_BINARY_LOG
+
+int _Log(enum LogLevel level, const char *file, uint32_t line, bool cont_line, const char *format,
+         ...) {
+  va_list ap;
+
+  va_start(ap, format);
+  int res = VLogFormatted(level, file, line, cont_line, format, ap);
+  va_end(ap);
 
   return res;
 }
+
+size_t FlushLog(size_t max_records) { return 0; }
+
+#else // MIKANOS_USB_BINARY_LOG
+
+namespace {
+/** 要素数．インデックスの計算をマスクで済ませるため 2 のべき乗にする． */
+const size_t kBinaryLogCapacity = 256;
+
+std::array<BinaryLogRecord, kBinaryLogCapacity> binary_log{};
+/** 次に書き込む位置と次に出力する位置．どちらも単調に増加する． */
+size_t binary_log_head = 0;
+size_t binary_log_tail = 0;
+/** バッファが溢れて上書きしたレコードの数 */
+size_t binary_log_lost = 0;
+/** バッファは全てのコントローラで共有するので，ここまでの 4 つをこれで守る． */
+usb::SpinLock binary_log_lock;
+
+/** @brief 1 つの変換指定を spec（'%' から変換文字まで）として書式化する．
+ *
+ * 64 ビットの長さ修飾子（l, ll, z, j, t）は ll に揃え，それ以外は int として渡す．
+ */
+int FormatOne(char *out, size_t size, const char *spec, size_t spec_len, uint64_t arg) {
+  char fmt[32];
+  size_t n = 0;
+  bool wide = false;
+  for (size_t i = 0; i < spec_len && n < sizeof(fmt) - 3; ++i) {
+    const char c = spec[i];
+    if (c == 'l' || c == 'z' || c == 'j' || c == 't') {
+      wide = true;
+      continue;
+    }
+    if (i == spec_len - 1 && wide) {
+      fmt[n++] = 'l';
+      fmt[n++] = 'l';
+    }
+    fmt[n++] = c;
+  }
+  fmt[n] = '\0';
+
+  switch (spec[spec_len - 1]) {
+  case 's':
+    return snprintf(out, size, fmt, reinterpret_cast<const char *>(arg));
+  case 'p':
+    return snprintf(out, size, fmt, reinterpret_cast<void *>(arg));
+  default:
+    if (wide) {
+      return snprintf(out, size, fmt, static_cast<unsigned long long>(arg));
+    }
+    return snprintf(out, size, fmt, static_cast<unsigned int>(arg));
+  }
+}
+
+void FormatRecord(const BinaryLogRecord &record, char *buf, size_t size) {
+  size_t pos = 0;
+  int next_arg = 0;
+  const char *p = record.format;
+  while (*p && pos < size - 1) {
+    if (*p != '%') {
+      buf[pos++] = *p++;
+      continue;
+    }
+    if (p[1] == '%') {
+      buf[pos++] = '%';
+      p += 2;
+      continue;
+    }
+
+    // フラグ・幅・精度・長さ修飾子を読み飛ばして変換文字を探す
+    size_t spec_len = 1;
+    while (p[spec_len] && !strchr("diouxXcsp", p[spec_len])) {
+      ++spec_len;
+    }
+    if (!p[spec_len] || next_arg >= record.num_args) {
+      // 解釈できない変換指定はそのまま出力する
+      buf[pos++] = *p++;
+      continue;
+    }
+    ++spec_len;
+
+    const int res = FormatOne(&buf[pos], size - pos, p, spec_len, record.args[next_arg++]);
+    if (res > 0) {
+      pos = pos + res < size - 1 ? pos + res : size - 1;
+    }
+    p += spec_len;
+  }
+  buf[pos] = '\0';
+}
+} // namespace
+
+void _LogBinary(const BinaryLogRecord &record) {
+  usb::LockGuard lock{binary_log_lock};
+  binary_log[binary_log_head % kBinaryLogCapacity] = record;
+  ++binary_log_head;
+  if (binary_log_head - binary_log_tail > kBinaryLogCapacity) {
+    ++binary_log_lost;
+    ++binary_log_tail;
+  }
+}
+
+size_t FlushLog(size_t max_records) {
+  size_t lost;
+  {
+    usb::LockGuard lock{binary_log_lock};
+    lost = binary_log_lost;
+    binary_log_lost = 0;
+  }
+  if (lost > 0) {
+    _LogFormatted(kWarn, __FILE__, __LINE__, false, "binary log: %lu records lost\n", lost);
+  }
+
+  // 書式化と出力はロックを外して行い，その間も他のコアがレコードを追加できるようにする
+  size_t num_records = 0;
+  char buf[1024];
+  while (num_records < max_records) {
+    BinaryLogRecord record;
+    {
+      usb::LockGuard lock{binary_log_lock};
+      if (binary_log_tail == binary_log_head) {
+        break;
+      }
+      record = binary_log[binary_log_tail % kBinaryLogCapacity];
+      ++binary_log_tail;
+    }
+    FormatRecord(record, buf, sizeof(buf));
+    sabios_log(record.level, record.file, strlen(record.file), record.line, buf, strlen(buf),
+               record.cont_line);
+    ++num_records;
+  }
+  return num_records;
+}
+
+#endif // MIKANOS_USB_BINARY_LOG
@@ -6,7 +6,9 @@
 
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <type_traits>
 
 enum LogLevel {
   kError = 3,
@@ -16,7 +18,30 @@ enum LogLevel {
   kTrace = 8,
 };
 
-#define Log(level, ...) _Log((level), __FILE__, __LINE__, false, ##__VA_ARGS__)
+/** @brief ビルド時に指定するログの優先度の下限．
+ *
+ * これより低い優先度の Log は呼び出しごと取り除かれ，引数の評価も行われない．
+ * 既定では kTrace のログを取り除く．
+ */
+#ifndef MIKANOS_USB_MAX_LOG_LEVEL
+#define MIKANOS_USB_MAX_LOG_LEVEL kDebug
+#endif
+constexpr LogLevel kMaxLogLevel = MIKANOS_USB_MAX_LOG_LEVEL;
+
+/** @brief 実行時のしきい値．これより低い優先度のログは書式化する前に捨てられる． */
+extern LogLevel log_level;
+
+/** @brief 実行時のしきい値を変更する． */
+void SetLogLevel(LogLevel level);
+
+#define Log(level, ...)                                                                            \
+  do {                                                                                             \
+    if constexpr ((level) <= kMaxLogLevel) {                                                       \
+      if ((level) <= log_level) {                                                                  \
+        _Log((level), __FILE__, __LINE__, false, ##__VA_ARGS__);                                   \
+      }                                                                                            \
+    }                                                                                              \
+  } while (false)
 
 /** @brief ログを指定された優先度で記録する．
  *
@@ -26,5 +51,62 @@ enum LogLevel {
  * @param level  ログの優先度．しきい値以上の優先度のログのみが記録される．
  * @param format  書式文字列．printk と互換．
  */
+int _LogFormatted(enum LogLevel level, const char *file, uint32_t line, bool cont_line,
+                  const char *format, ...) __attribute__((format(printf, 5, 6)));
+
+/** @brief バイナリログに記録されたレコードを書式化して出力する．
+ *
+ * @return 出力したレコードの数．バイナリログが無効なら常に 0．
+ */
+size_t FlushLog(size_t max_records);
+
+#ifndef MIKANOS_USB_BINARY_LOG
+
 int _Log(enum LogLevel level, const char *file, uint32_t line, bool cont_line, const char *format,
          ...) __attribute__((format(printf, 5, 6)));
+
+#else // MIKANOS_USB_BINARY_LOG
+
+/** @brief バイナリログの 1 レコードが保持できる引数の数 */
+const int kMaxBinaryLogArgs = 6;
+
+/** @brief 書式化を後回しにしたログ．
+ *
+ * format と file は文字列リテラルを，%s の引数は静的な文字列を指していなければならない．
+ */
+struct BinaryLogRecord {
+  const char *format;
+  const char *file;
+  uint32_t line;
+  uint8_t level;
+  bool cont_line;
+  uint8_t num_args;
+  uint64_t args[kMaxBinaryLogArgs];
+};
+
+void _LogBinary(const BinaryLogRecord &record);
+
+template <class T> uint64_t ToBinaryLogArg(T value) {
+  static_assert(!std::is_floating_point_v<T>, "binary log does not support floating point");
+  if constexpr (std::is_pointer_v<T>) {
+    return reinterpret_cast<uintptr_t>(value);
+  } else {
+    // 符号付きの値は符号拡張しておき，書式化の時に元の幅へ戻す
+    return static_cast<uint64_t>(static_cast<int64_t>(value));
+  }
+}
+
+/** @brief 書式化せずに，書式文字列のアドレスと引数をそのままリングバッファに記録する．
+ *
+ * 書式の検査は MIKANOS_USB_BINARY_LOG を定義しない通常のビルドで行われる．
+ */
+template <class... Args>
+int _Log(enum LogLevel level, const char *file, uint32_t line, bool cont_line, const char *format,
+         Args... args) {
+  static_assert(sizeof...(Args) <= kMaxBinaryLogArgs, "too many arguments for binary log");
+  _LogBinary(BinaryLogRecord{format, file, line, static_cast<uint8_t>(level), cont_line,
+                             sizeof...(Args), {ToBinaryLogArg(args)...}});
+  return 0;
+}
+
+#endif // MIKANOS_USB_BINARY_LOG
@@ -13,6 +13,23 @@ template <typename T> struct ArrayLength {};
 
 template <typename T, size_t N> struct ArrayLength<T[N]> { static const size_t value = N; };
 
+/** @brief 64 ビットのレジスタを読み書きする方法 */
+enum class Access64 {
+  /** 1 回の 64 ビットアクセス */
+  kNative,
+  /** 下位，上位の順に 2 回の 32 ビットアクセス．64 ビットアクセスを扱えないデバイス用． */
+  kSplit,
+};
+
+#ifdef MIKANOS_USB_MMIO_HOOK
+/** @brief レジスタに書き込んだ直後に呼ばれる．ホスト上でコントローラのモデルを動かすためのもの．
+ *
+ * 実機のレジスタは書き込みに反応して値を変える（RW1C のビットなど）が，ホスト上のレジスタは
+ * ただのメモリなので，モデルがここで書き込みを解釈して値を書き換える．
+ */
+void MMIOWriteHook(volatile void *reg, size_t size);
+#endif
+
 /**
  * MemMapRegister is a wrapper for a memory mapped register.
  *
@@ -34,11 +51,58 @@ public:
     for (size_t i = 0; i < len_; ++i) {
       value_.data[i] = value.data[i];
     }
+#ifdef MIKANOS_USB_MMIO_HOOK
+    MMIOWriteHook(&value_, sizeof(T));
+#endif
+  }
+
+  /** @brief 64 ビットのレジスタを access の方法で読む． */
+  T Read(Access64 access) const {
+    static_assert(sizeof(T::data[0]) == 8, "Access64 is only for 64-bit registers");
+    if (access == Access64::kNative) {
+      return Read();
+    }
+    const auto dwords = Dwords();
+    const uint64_t low = dwords[0];
+    const uint64_t high = dwords[1];
+    T tmp;
+    tmp.data[0] = high << 32 | low;
+    return tmp;
+  }
+
+  /** @brief 64 ビットのレジスタに access の方法で書き込む． */
+  void Write(const T &value, Access64 access) {
+    static_assert(sizeof(T::data[0]) == 8, "Access64 is only for 64-bit registers");
+    if (access == Access64::kNative) {
+      Write(value);
+      return;
+    }
+    const auto dwords = Dwords();
+    dwords[0] = static_cast<uint32_t>(value.data[0]);
+    dwords[1] = static_cast<uint32_t>(value.data[0] >> 32);
+#ifdef MIKANOS_USB_MMIO_HOOK
+    MMIOWriteHook(&value_, sizeof(T));
+#endif
+  }
+
+  /** @brief レジスタを 1 回だけ読み，update(T &) で書き換えた値を 1 回だけ書き込む． */
+  template <typename F> void Update(F update) {
+    T tmp = Read();
+    update(tmp);
+    Write(tmp);
   }
 
 private:
   volatile T value_;
   static const size_t len_ = ArrayLength<decltype(T::data)>::value;
+
+  /** @brief レジスタを 32 ビットずつ読み書きするためのポインタ．
+   *
+   * ビットマップの型は packed なので，value_ ではなく先頭が同じ this から求める．
+   */
+  volatile uint32_t *Dwords() const {
+    return reinterpret_cast<volatile uint32_t *>(reinterpret_cast<uintptr_t>(this));
+  }
 };
 
 template <typename T> struct DefaultBitmap {
@@ -1,23 +1,54 @@
 #include "logger.hpp"
-#include "usb/classdriver/keyboard.hpp"
-#include "usb/classdriver/mouse.hpp"
+#include "usb/async_transfer.hpp"
+#include "usb/classdriver/block_storage.hpp"
+#include "usb/classdriver/cdc.hpp"
+#include "usb/input_queue.hpp"
+#include "usb/latency_trace.hpp"
 #include "usb/memory.hpp"
+#include "usb/xhci/event_trace.hpp"
 #include "usb/xhci/xhci.hpp"
 
 #include <cstdint>
+#include <new>
 
 extern "C" usb::xhci::Controller *cxx_xhci_controller_new(uint64_t xhc_mmio_base) {
-  static usb::xhci::Controller xhc{xhc_mmio_base};
-  return &xhc;
+  // ホストコントローラごとに別のインスタンスを作る．破棄はしない．
+  auto xhc = usb::AllocArray<usb::xhci::Controller>(1, 64, 0);
+  if (xhc == nullptr) {
+    return nullptr;
+  }
+  return new (xhc) usb::xhci::Controller{xhc_mmio_base};
+}
+
+extern "C" int32_t cxx_xhci_controller_initialize(usb::xhci::Controller *xhc,
+                                                  uint16_t num_interrupters,
+                                                  size_t event_ring_size) {
+  auto err = xhc->Initialize(num_interrupters, event_ring_size);
+  return err.Cause();
+}
+
+extern "C" uint16_t cxx_xhci_controller_num_interrupters(usb::xhci::Controller *xhc) {
+  return xhc->NumInterrupters();
 }
 
-extern "C" void cxx_xhci_controller_initialize(usb::xhci::Controller *xhc) { xhc->Initialize(); }
+extern "C" int32_t cxx_xhci_controller_poll_bring_up(usb::xhci::Controller *xhc, uint64_t now_ms,
+                                                     bool *running) {
+  auto err = xhc->PollBringUp(now_ms);
+  *running = xhc->IsRunning();
+  return err.Cause();
+}
 
-extern "C" int32_t cxx_xhci_controller_run(usb::xhci::Controller *xhc) {
-  auto err = xhc->Run();
+extern "C" int32_t cxx_xhci_controller_check_timeouts(usb::xhci::Controller *xhc,
+                                                      uint64_t now_ms) {
+  auto err = CheckTimeouts(*xhc, now_ms);
   return err.Cause();
 }
 
+extern "C" void cxx_xhci_controller_set_interrupt_moderation(usb::xhci::Controller *xhc,
+                                                             uint16_t interval, uint16_t counter) {
+  xhc->SetInterruptModeration(interval, counter);
+}
+
 extern "C" void cxx_xhci_controller_configure_connected_ports(usb::xhci::Controller *xhc) {
   for (int i = 1; i <= xhc->MaxPorts(); i++) {
     auto port = xhc->PortAt(i);
@@ -37,23 +68,177 @@ extern "C" int32_t cxx_xhci_controller_process_event(usb::xhci::Controller *xhc)
   return err.Cause();
 }
 
+extern "C" size_t cxx_xhci_controller_process_events(usb::xhci::Controller *xhc,
+                                                     uint16_t interrupter, size_t max_events) {
+  return ProcessEvents(*xhc, interrupter, max_events);
+}
+
+extern "C" void cxx_xhci_controller_set_polling_policy(usb::xhci::Controller *xhc, bool enabled,
+                                                      uint32_t idle_poll_budget) {
+  xhc->SetPollingPolicy({enabled, idle_poll_budget});
+}
+
+extern "C" bool cxx_xhci_controller_poll_events(usb::xhci::Controller *xhc, size_t max_events) {
+  return xhc->PollEvents(max_events);
+}
+
 extern "C" bool cxx_xhci_controller_has_event(usb::xhci::Controller *xhc) {
   return xhc->PrimaryEventRing()->HasFront();
 }
 
-extern "C" typedef void (*MouseObserverType)(uint8_t buttons, int8_t displacement_x,
-                                             int8_t displacement_y);
+extern "C" void cxx_xhci_controller_note_interrupt(usb::xhci::Controller *xhc) {
+  xhc->NoteInterrupt();
+}
 
-extern "C" void cxx_xhci_hid_mouse_driver_set_default_observer(MouseObserverType observer) {
-  usb::HIDMouseDriver::default_observer = observer;
+extern "C" void cxx_xhci_controller_stats(usb::xhci::Controller *xhc,
+                                          usb::xhci::ControllerStats *out) {
+  *out = xhc->Stats();
 }
 
-extern "C" typedef void (*KeyboardObserverType)(uint8_t modifier, uint8_t keycode);
+extern "C" bool cxx_xhci_controller_endpoint_stats(usb::xhci::Controller *xhc, uint8_t slot_id,
+                                                   uint8_t dci, usb::xhci::EndpointStats *out) {
+  auto dev = xhc->DeviceManager()->FindBySlot(slot_id);
+  if (dev == nullptr) {
+    return false;
+  }
+  auto stats = dev->EndpointStatsAt(usb::xhci::DeviceContextIndex{dci});
+  if (stats == nullptr) {
+    return false;
+  }
+  *out = *stats;
+  return true;
+}
+
+extern "C" int32_t cxx_usb_async_control_queue(uint8_t queue, uint8_t slot_id,
+                                               uint8_t request_type, uint8_t request,
+                                               uint16_t value, uint16_t index, uint16_t length,
+                                               const void *data, uint32_t *token) {
+  usb::SetupData setup_data{};
+  setup_data.request_type.data = request_type;
+  setup_data.request = request;
+  setup_data.value = value;
+  setup_data.index = index;
+  setup_data.length = length;
+  auto [queued, err] = usb::QueueAsyncControl(queue, slot_id, setup_data, data);
+  *token = queued;
+  return err.Cause();
+}
+
+extern "C" void cxx_usb_async_issue_queued(usb::xhci::Controller *xhc, uint8_t queue) {
+  auto find_device = [](void *context, uint8_t slot_id) -> usb::Device * {
+    return static_cast<usb::xhci::Controller *>(context)->DeviceManager()->FindBySlot(slot_id);
+  };
+  usb::IssueQueuedAsyncTransfers(queue, find_device, xhc);
+}
+
+extern "C" bool cxx_usb_async_take(uint32_t token, void *buf, size_t buf_len,
+                                   usb::AsyncTransferResult *out) {
+  return usb::TakeAsyncTransfer(token, buf, buf_len, *out);
+}
+
+extern "C" void cxx_usb_async_release(uint32_t token) { usb::ReleaseAsyncTransfer(token); }
 
-extern "C" void cxx_xhci_hid_keyboard_driver_set_default_observer(KeyboardObserverType observer) {
-  usb::HIDKeyboardDriver::default_observer = observer;
+extern "C" void cxx_usb_async_set_notifier(usb::AsyncTransferNotifierType notifier) {
+  usb::SetAsyncTransferNotifier(notifier);
+}
+
+extern "C" usb::InputQueue *cxx_input_queue(uint32_t queue_id) {
+  return usb::GetInputQueue(static_cast<usb::InputQueueID>(queue_id));
+}
+
+extern "C" void cxx_input_queue_set_notifier(usb::InputQueueNotifierType notifier) {
+  usb::SetInputQueueNotifier(notifier);
+}
+
+extern "C" usb::PendingMotion *cxx_input_pending_motion() { return usb::GetPendingMotion(); }
+
+extern "C" void cxx_input_set_mouse_coalescing(bool enabled) {
+  usb::SetMouseCoalescing(enabled);
+}
+
+extern "C" typedef void (*MassStorageObserverType)(usb::BlockStorageDriver *driver,
+                                                   uint64_t num_blocks, uint32_t block_size);
+
+extern "C" void
+cxx_xhci_mass_storage_driver_set_default_observer(MassStorageObserverType observer) {
+  usb::BlockStorageDriver::default_observer = observer;
+}
+
+extern "C" uint64_t cxx_xhci_mass_storage_driver_num_blocks(usb::BlockStorageDriver *driver) {
+  return driver->NumBlocks();
+}
+
+extern "C" uint32_t cxx_xhci_mass_storage_driver_block_size(usb::BlockStorageDriver *driver) {
+  return driver->BlockSize();
+}
+
+extern "C" int32_t cxx_xhci_mass_storage_driver_read(
+    usb::BlockStorageDriver *driver, uint64_t lba, uint32_t num_blocks, void *buf,
+    usb::BlockStorageDriver::CompletionCallback callback, void *context) {
+  auto err = driver->Read(lba, num_blocks, buf, callback, context);
+  return err.Cause();
+}
+
+extern "C" int32_t cxx_xhci_mass_storage_driver_write(
+    usb::BlockStorageDriver *driver, uint64_t lba, uint32_t num_blocks, const void *buf,
+    usb::BlockStorageDriver::CompletionCallback callback, void *context) {
+  auto err = driver->Write(lba, num_blocks, buf, callback, context);
+  return err.Cause();
+}
+
+extern "C" typedef void (*CDCObserverType)(usb::CDCDriver *driver);
+
+extern "C" void cxx_xhci_cdc_driver_set_default_observer(CDCObserverType observer) {
+  usb::CDCDriver::default_observer = observer;
+}
+
+extern "C" uint32_t cxx_xhci_cdc_driver_kind(usb::CDCDriver *driver) {
+  return static_cast<uint32_t>(driver->Kind());
+}
+
+extern "C" void cxx_xhci_cdc_driver_set_receiver(usb::CDCDriver *driver,
+                                                 usb::CDCDriver::ReceiveCallback callback,
+                                                 void *context) {
+  driver->SetReceiver(callback, context);
+}
+
+extern "C" int32_t cxx_xhci_cdc_driver_send(usb::CDCDriver *driver, const void *buf, int32_t len,
+                                            usb::CDCDriver::SendCallback callback,
+                                            void *context) {
+  auto err = driver->Send(buf, len, callback, context);
+  return err.Cause();
 }
 
 extern "C" void cxx_set_memory_pool(uintptr_t pool_ptr, size_t pool_size) {
   usb::SetMemoryPool(pool_ptr, pool_size);
 }
+
+extern "C" void cxx_set_log_level(int32_t level) { SetLogLevel(static_cast<LogLevel>(level)); }
+
+extern "C" size_t cxx_flush_log(size_t max_records) { return FlushLog(max_records); }
+
+extern "C" bool cxx_latency_trace_histogram(uint8_t stage, usb::LatencyHistogram *out) {
+  return usb::GetLatencyHistogram(static_cast<usb::TraceStage>(stage), *out);
+}
+
+extern "C" size_t cxx_latency_trace_read(usb::TraceRecord *buf, size_t max_records) {
+  return usb::ReadTraceRecords(buf, max_records);
+}
+
+extern "C" void cxx_latency_trace_reset() { usb::ResetLatencyTrace(); }
+
+extern "C" bool cxx_event_trace_set_enabled(bool enabled) {
+  return usb::xhci::SetEventTraceEnabled(enabled);
+}
+
+extern "C" size_t cxx_event_trace_read(usb::xhci::EventTraceRecord *buf, size_t max_records) {
+  return usb::xhci::ReadEventTrace(buf, max_records);
+}
+
+extern "C" uint64_t cxx_event_trace_dropped() { return usb::xhci::EventTraceDropped(); }
+
+extern "C" void cxx_event_trace_reset() { usb::xhci::ResetEventTrace(); }
+
+extern "C" void cxx_latency_trace_input_consumed(uint32_t queue_id, uint32_t seq) {
+  usb::TraceInputConsumed(queue_id, seq);
+}
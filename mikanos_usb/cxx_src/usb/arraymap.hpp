@@ -21,14 +21,19 @@ public:
     return std::nullopt;
   }
 
-  void Put(const K &key, const V &value) {
+  /** @brief key と value の組を登録する．
+   *
+   * @return 登録できたら true．空きが無ければ false．
+   */
+  bool Put(const K &key, const V &value) {
     for (int i = 0; i < table_.size(); ++i) {
       if (!table_[i].first) {
         table_[i].first = key;
         table_[i].second = value;
-        break;
+        return true;
       }
     }
+    return false;
   }
 
   void Delete(const K &key) {
@@ -0,0 +1,350 @@
+#include "usb/async_transfer.hpp"
+
+#include "logger.hpp"
+#include "usb/classdriver/base.hpp"
+#include "usb/device.hpp"
+#include "usb/memory.hpp"
+#include "usb/spinlock.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <new>
+
+namespace {
+using namespace usb;
+
+/* 発行と完了の処理はホストコントローラのロックの下で行うが，列に入れること，結果の
+ * 取り出しとトークンの解放はそのロックを持たずに（他のコアからでも）行える．
+ * そのため転送の状態は表のエントリに atomic で持ち，次の遷移だけを許す．
+ *
+ *   kQueued  -> kPending    （イベント処理：リングに積む直前）
+ *   kQueued  -> kAbandoned  （トークンの持ち主：発行する代わりにイベント処理側が解放する）
+ *   kPending -> kCompleted  （イベント処理：結果を書いてから公開する）
+ *   kPending -> kAbandoned  （トークンの持ち主：完了時にイベント処理側が解放する）
+ *
+ * kCompleted の転送を解放するのはトークンの持ち主だけで，kAbandoned の転送を
+ * 解放するのはイベント処理側だけなので，同じ転送を両者が解放することはない．
+ * 表は全てのホストコントローラで共有するので，エントリの確保と解放，および
+ * 他の転送を覗く CancelAsyncTransfers と IssueQueuedAsyncTransfers は table_lock で守る．
+ * 状態の確認と結果の取り出しには table_lock は要らない．
+ */
+enum class State : uint8_t {
+  /** 発行待ちの列に入っていて，まだリングに積んでいない． */
+  kQueued,
+  kPending,
+  kCompleted,
+  /** 結果を受け取る者がいない．完了したら解放する． */
+  kAbandoned,
+};
+
+/** @brief 非同期転送 1 つ分の状態．
+ *
+ * コントロール転送の完了は発行元のクラスドライバに通知されるので，
+ * 転送ごとにクラスドライバとして振る舞うオブジェクトを作って発行元にする．
+ * 宛先のデバイスは発行するときに決まるので，ClassDriver としての親デバイスは持たない．
+ */
+class AsyncTransfer : public ClassDriver {
+public:
+  AsyncTransfer(AsyncToken token, uint8_t queue, uint32_t order, uint8_t slot_id,
+                SetupData setup_data, uint8_t *buf)
+      : ClassDriver{nullptr}, token_{token}, queue_{queue}, order_{order}, slot_id_{slot_id},
+        setup_data_{setup_data}, buf_{buf},
+        dir_in_{setup_data.request_type.bits.direction == request_type::kIn} {}
+  ~AsyncTransfer() override { FreeMem(buf_); }
+
+  Error Initialize() override { return MAKE_ERROR(Error::kSuccess); }
+  Error SetEndpoint(const EndpointConfig &config) override {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+  Error OnEndpointsConfigured() override { return MAKE_ERROR(Error::kSuccess); }
+  Error OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf,
+                           int len) override;
+  Error OnControlFailed(EndpointID ep_id, int completion_code) override;
+  Error OnInterruptCompleted(EndpointID ep_id, const void *buf, int len) override {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  AsyncToken Token() const { return token_; }
+  uint8_t Queue() const { return queue_; }
+  uint8_t SlotID() const { return slot_id_; }
+  /** @brief 列に入れた順番．小さい方が先． */
+  uint32_t Order() const { return order_; }
+  /** @brief 発行した宛先．発行する前は nullptr． */
+  Device *Target() const { return target_.load(std::memory_order_relaxed); }
+  /** @brief target のデフォルトコントロールパイプに発行する． */
+  Error Issue(Device &target);
+  /** @brief 結果を書き出す．IN 転送なら受信したデータを buf に書き写す． */
+  AsyncTransferResult TakeResult(void *buf, size_t buf_len) const;
+  /** @brief 完了を記録して通知する．結果を受け取る者がいなければ自身を解放する． */
+  void Complete(Error::Code code, int transferred);
+  /** @brief 結果を書いて kCompleted にする．持ち主がいなければ（kAbandoned なら）false． */
+  bool Publish(Error::Code code, int transferred);
+
+private:
+  const AsyncToken token_;
+  const uint8_t queue_;
+  const uint32_t order_;
+  const uint8_t slot_id_;
+  const SetupData setup_data_;
+  uint8_t *const buf_;
+  const bool dir_in_;
+  /** 他のホストコントローラの CancelAsyncTransfers からも覗かれる． */
+  std::atomic<Device *> target_{nullptr};
+  AsyncTransferResult result_{};
+};
+
+/** @brief 発行中および結果を受け取る前の転送を登録する表のエントリ */
+struct Entry {
+  /** 使用中のトークン．0 なら空き． */
+  std::atomic<AsyncToken> token;
+  std::atomic<State> state;
+  AsyncTransfer *transfer;
+  /** 最後に使ったときの世代．古いトークンを見分けるのに使う． */
+  uint32_t generation;
+};
+
+/** index = トークンの下位 8 ビット */
+std::array<Entry, kMaxAsyncTransfers> entries{};
+SpinLock table_lock;
+/** 次に列に入れる転送の順番．table_lock で守る． */
+uint32_t next_order = 0;
+AsyncTransferNotifierType transfer_notifier = nullptr;
+
+int IndexOf(AsyncToken token) { return token & 0xffu; }
+
+Entry *Find(AsyncToken token) {
+  const int index = IndexOf(token);
+  if (token == 0 || index >= kMaxAsyncTransfers) {
+    return nullptr;
+  }
+  auto &e = entries[index];
+  return e.token.load(std::memory_order_acquire) == token ? &e : nullptr;
+}
+
+/** @brief table_lock を持って呼ぶ． */
+void DestroyLocked(Entry &e) {
+  auto t = e.transfer;
+  e.transfer = nullptr;
+  if (t != nullptr) {
+    t->~AsyncTransfer();
+    FreeMem(t);
+  }
+  // エントリを空けるのは最後にする．以降は別の転送が確保できる．
+  e.token.store(0, std::memory_order_release);
+}
+
+void Destroy(Entry &e) {
+  LockGuard lock{table_lock};
+  DestroyLocked(e);
+}
+
+Error AsyncTransfer::OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf,
+                                        int len) {
+  Complete(Error::kSuccess, len);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error AsyncTransfer::OnControlFailed(EndpointID ep_id, int completion_code) {
+  Log(kDebug, "async control transfer %08x failed: completion code %d\n", token_,
+      completion_code);
+  // 失敗は結果として呼び出し側に伝わるので，イベント処理のエラーにはしない
+  Complete(Error::kTransferFailed, 0);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error AsyncTransfer::Issue(Device &target) {
+  // 初期化中のコントロール転送の完了は Device 自身が受け取ってしまう
+  if (!target.IsInitialized()) {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  target_.store(&target, std::memory_order_relaxed);
+  const int len = setup_data_.length;
+  return dir_in_ ? target.ControlIn(kDefaultControlPipeID, setup_data_, buf_, len, this)
+                 : target.ControlOut(kDefaultControlPipeID, setup_data_, buf_, len, this);
+}
+
+AsyncTransferResult AsyncTransfer::TakeResult(void *buf, size_t buf_len) const {
+  if (dir_in_ && buf && result_.error == Error::kSuccess) {
+    memcpy(buf, buf_, std::min<size_t>(buf_len, result_.transferred));
+  }
+  return result_;
+}
+
+bool AsyncTransfer::Publish(Error::Code code, int transferred) {
+  result_ = AsyncTransferResult{code, transferred};
+  auto expected = State::kPending;
+  return entries[IndexOf(token_)].state.compare_exchange_strong(expected, State::kCompleted,
+                                                                std::memory_order_acq_rel);
+}
+
+void AsyncTransfer::Complete(Error::Code code, int transferred) {
+  const auto token = token_;
+  if (!Publish(code, transferred)) {
+    // 持ち主は既にトークンを手放している
+    Destroy(entries[IndexOf(token)]);
+    return;
+  }
+  // 公開した後は持ち主がいつ解放してもよいので，メンバには触らない
+  if (transfer_notifier) {
+    transfer_notifier(token);
+  }
+}
+} // namespace
+
+namespace usb {
+void SetAsyncTransferNotifier(AsyncTransferNotifierType notifier) {
+  transfer_notifier = notifier;
+}
+
+WithError<AsyncToken> QueueAsyncControl(uint8_t queue, uint8_t slot_id, SetupData setup_data,
+                                        const void *data) {
+  const int len = setup_data.length;
+  const bool dir_in = setup_data.request_type.bits.direction == request_type::kIn;
+  if (len > kMaxAsyncTransferLength || (!dir_in && len > 0 && data == nullptr)) {
+    return {0, MAKE_ERROR(Error::kBufferTooSmall)};
+  }
+
+  uint8_t *buf = nullptr;
+  if (len > 0) {
+    // Data Stage は 1 つの TRB で送るので，ページ境界を跨がないバッファにする
+    buf = AllocArray<uint8_t>(len, 64, 4096);
+    if (buf == nullptr) {
+      return {0, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+    if (!dir_in) {
+      memcpy(buf, data, len);
+    }
+  }
+  auto t = AllocArray<AsyncTransfer>(1, 64, 0);
+  if (t == nullptr) {
+    FreeMem(buf);
+    return {0, MAKE_ERROR(Error::kNoEnoughMemory)};
+  }
+
+  LockGuard lock{table_lock};
+  int index = 0;
+  while (index < kMaxAsyncTransfers && entries[index].token.load(std::memory_order_relaxed)) {
+    ++index;
+  }
+  if (index == kMaxAsyncTransfers) {
+    FreeMem(t);
+    FreeMem(buf);
+    return {0, MAKE_ERROR(Error::kNoEnoughMemory)};
+  }
+
+  auto &e = entries[index];
+  // 世代は上位 24 ビットに収め，0 にはしない（トークン 0 は無効を表す）
+  uint32_t generation = (e.generation + 1) & 0xffffffu;
+  if (generation == 0) {
+    generation = 1;
+  }
+  e.generation = generation;
+  const AsyncToken token = (generation << 8) | index;
+  new (t) AsyncTransfer{token, queue, next_order++, slot_id, setup_data, buf};
+  e.transfer = t;
+  e.state.store(State::kQueued, std::memory_order_relaxed);
+  e.token.store(token, std::memory_order_release);
+  return {token, MAKE_ERROR(Error::kSuccess)};
+}
+
+void IssueQueuedAsyncTransfers(uint8_t queue, FindDeviceType find_device, void *context) {
+  // 発行や完了の通知は table_lock を放してから行う．列から取り出した転送は
+  // この列を受け持つ呼び出し側しか発行しないので，放している間に消えることはない．
+  std::array<Entry *, kMaxAsyncTransfers> queued;
+  int num_queued = 0;
+  {
+    LockGuard lock{table_lock};
+    for (auto &e : entries) {
+      if (e.token.load(std::memory_order_relaxed) == 0 || e.transfer->Queue() != queue ||
+          e.transfer->Target() != nullptr ||
+          e.state.load(std::memory_order_acquire) == State::kCompleted) {
+        continue;
+      }
+      // 入れた順に並べる．順番は一周し得るので差で比べる．
+      int i = num_queued++;
+      while (i > 0 && static_cast<int32_t>(queued[i - 1]->transfer->Order() -
+                                           e.transfer->Order()) > 0) {
+        queued[i] = queued[i - 1];
+        --i;
+      }
+      queued[i] = &e;
+    }
+  }
+
+  for (int i = 0; i < num_queued; ++i) {
+    auto &e = *queued[i];
+    auto expected = State::kQueued;
+    if (!e.state.compare_exchange_strong(expected, State::kPending, std::memory_order_acq_rel)) {
+      // 持ち主は発行前にトークンを手放している
+      Destroy(e);
+      continue;
+    }
+    auto t = e.transfer;
+    auto dev = find_device(context, t->SlotID());
+    auto err = dev ? t->Issue(*dev) : MAKE_ERROR(Error::kUnknownDevice);
+    if (err) {
+      Log(kDebug, "failed to issue async control transfer %08x: %s\n", t->Token(), err.Name());
+      t->Complete(err.Cause(), 0);
+    }
+  }
+}
+
+bool TakeAsyncTransfer(AsyncToken token, void *buf, size_t buf_len, AsyncTransferResult &out) {
+  auto e = Find(token);
+  if (e == nullptr) {
+    out = AsyncTransferResult{Error::kNoWaiter, 0};
+    return true;
+  }
+  if (e->state.load(std::memory_order_acquire) != State::kCompleted) {
+    return false;
+  }
+  out = e->transfer->TakeResult(buf, buf_len);
+  Destroy(*e);
+  return true;
+}
+
+void ReleaseAsyncTransfer(AsyncToken token) {
+  auto e = Find(token);
+  if (e == nullptr) {
+    return;
+  }
+  auto expected = State::kQueued;
+  if (e->state.compare_exchange_strong(expected, State::kAbandoned, std::memory_order_acq_rel)) {
+    return; // 発行する代わりにイベント処理側が解放する
+  }
+  expected = State::kPending;
+  if (!e->state.compare_exchange_strong(expected, State::kAbandoned,
+                                        std::memory_order_acq_rel)) {
+    Destroy(*e); // 既に完了している
+  }
+}
+
+void CancelAsyncTransfers(Device *dev) {
+  // 通知は table_lock を放してから行う
+  std::array<AsyncToken, kMaxAsyncTransfers> cancelled;
+  int num_cancelled = 0;
+  {
+    LockGuard lock{table_lock};
+    for (auto &e : entries) {
+      const auto token = e.token.load(std::memory_order_relaxed);
+      // 完了した転送はトークンの持ち主のものなので触らない．発行前の転送は宛先が無い．
+      if (token == 0 || e.state.load(std::memory_order_acquire) == State::kCompleted ||
+          e.transfer->Target() != dev) {
+        continue;
+      }
+      if (e.transfer->Publish(Error::kTransferFailed, 0)) {
+        cancelled[num_cancelled++] = token;
+      } else {
+        DestroyLocked(e);
+      }
+    }
+  }
+  for (int i = 0; i < num_cancelled; ++i) {
+    if (transfer_notifier) {
+      transfer_notifier(cancelled[i]);
+    }
+  }
+}
+} // namespace usb
@@ -0,0 +1,89 @@
+/**
+ * @file usb/async_transfer.hpp
+ *
+ * クラスドライバを介さずに発行する非同期のコントロール転送．
+ *
+ * 発行すると完了トークンが返り，完了するとトークンを引数に通知関数が呼ばれる．
+ * 結果は TakeAsyncTransfer で取り出す．データは転送ごとにメモリプールから確保した
+ * バッファを経由するので，呼び出し側のバッファは発行中に保持しておく必要がない．
+ *
+ * 転送は 2 段階で発行する．QueueAsyncControl はホストコントローラのロックを持たずに
+ * どのコアからでも呼べ，転送を発行待ちの列に入れるだけでリングには触らない．
+ * リングに積むのはホストコントローラのイベント処理側で，ロックを持って
+ * IssueQueuedAsyncTransfers を呼んだときに列に入れた順に発行する．
+ * これによりリングへの書き込みとデバイスの参照は常にイベント処理側だけが行う．
+ *
+ * 完了・取り消し（CancelAsyncTransfers）もホストコントローラのロックを持って呼ぶ．
+ * TakeAsyncTransfer と ReleaseAsyncTransfer はトークンの持ち主がロックを持たずに，
+ * イベント処理と並行して呼んでよい．
+ */
+
+#pragma once
+
+#include "error.hpp"
+#include "usb/setupdata.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace usb {
+class Device;
+
+/** @brief 非同期転送の完了トークン．下位 8 ビットが表の添字，上位が世代．0 は無効． */
+using AsyncToken = uint32_t;
+
+/** @brief 同時に発行しておける非同期転送の最大数 */
+const int kMaxAsyncTransfers = 32;
+/** @brief 1 回の非同期転送で送受信できる最大バイト数 */
+const int kMaxAsyncTransferLength = 4096;
+
+/** @brief 非同期転送の結果 */
+struct AsyncTransferResult {
+  /** Error::Code．0 なら成功 */
+  int32_t error;
+  /** 転送できたバイト数 */
+  int32_t transferred;
+};
+
+/** @brief 非同期転送が完了（または取り消し）されたときに呼ばれる関数．
+ *
+ * ホストコントローラのロックを持って（イベント処理中か，発行待ちの転送を発行する中で）
+ * 呼ばれるので，転送を発行し直したりしてはならない．
+ */
+using AsyncTransferNotifierType = void (*)(AsyncToken token);
+
+void SetAsyncTransferNotifier(AsyncTransferNotifierType notifier);
+
+/** @brief スロット ID からデバイスを引く関数．見つからなければ nullptr を返す． */
+using FindDeviceType = Device *(*)(void *context, uint8_t slot_id);
+
+/** @brief スロット slot_id のデバイスのデフォルトコントロールパイプへの非同期の
+ * コントロール転送を，queue 番の発行待ちの列に入れる．
+ *
+ * 方向は setup_data.request_type.bits.direction で決まる．OUT なら data の
+ * setup_data.length バイトをこの関数の中で書き写す（IN なら data は使わない）．
+ * 列の番号はホストコントローラごとに呼び出し側が決める．
+ */
+WithError<AsyncToken> QueueAsyncControl(uint8_t queue, uint8_t slot_id, SetupData setup_data,
+                                        const void *data);
+
+/** @brief queue 番の列に入れた転送を，入れた順に発行する．
+ *
+ * デバイスは find_device で引く．デバイスが無いか発行できなかった転送は，そのエラーで
+ * 完了させる．列を受け持つホストコントローラのロックを持って呼ぶ．
+ */
+void IssueQueuedAsyncTransfers(uint8_t queue, FindDeviceType find_device, void *context);
+
+/** @brief 完了していれば結果を out に書き出してトークンを解放する．
+ *
+ * IN 転送で受信したデータは buf に最大 buf_len バイトまで書き写す．
+ * まだ完了していなければ false を返す．無効なトークンには Error::kNoWaiter を返す．
+ */
+bool TakeAsyncTransfer(AsyncToken token, void *buf, size_t buf_len, AsyncTransferResult &out);
+
+/** @brief 結果を受け取らずにトークンを手放す．発行中なら完了時に解放する． */
+void ReleaseAsyncTransfer(AsyncToken token);
+
+/** @brief dev に発行中の非同期転送を全て失敗として完了させる．dev を破棄する前に呼ぶ． */
+void CancelAsyncTransfers(Device *dev);
+} // namespace usb
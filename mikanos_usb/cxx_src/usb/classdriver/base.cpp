@@ -4,4 +4,20 @@ namespace usb {
 ClassDriver::ClassDriver(Device *dev) : dev_{dev} {}
 
 ClassDriver::~ClassDriver() {}
+
+Error ClassDriver::OnControlFailed(EndpointID ep_id, int completion_code) {
+  return MAKE_ERROR(Error::kTransferFailed);
+}
+
+Error ClassDriver::OnBulkCompleted(EndpointID ep_id, const void *buf, int len) {
+  return MAKE_ERROR(Error::kNotImplemented);
+}
+
+Error ClassDriver::OnBulkFailed(EndpointID ep_id, const void *buf, int completion_code) {
+  return MAKE_ERROR(Error::kTransferFailed);
+}
+
+Error ClassDriver::OnIsochCompleted(EndpointID ep_id, IsochPacket *packets, int num_packets) {
+  return MAKE_ERROR(Error::kNotImplemented);
+}
 } // namespace usb
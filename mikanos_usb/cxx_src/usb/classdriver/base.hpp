@@ -12,6 +12,7 @@
 
 namespace usb {
 class Device;
+struct IsochPacket;
 
 class ClassDriver {
 public:
@@ -23,7 +24,22 @@ public:
   virtual Error OnEndpointsConfigured() = 0;
   virtual Error OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf,
                                    int len) = 0;
+  /** コントロール転送が失敗したときに呼ばれる．既定では Error::kTransferFailed を返す． */
+  virtual Error OnControlFailed(EndpointID ep_id, int completion_code);
   virtual Error OnInterruptCompleted(EndpointID ep_id, const void *buf, int len) = 0;
+  /** バルク転送の完了時に呼ばれる．バルクエンドポイントを使わないドライバは実装不要． */
+  virtual Error OnBulkCompleted(EndpointID ep_id, const void *buf, int len);
+  /** バルク転送が失敗（Stall, Babble, Transaction Error など）したときに呼ばれる．
+   *
+   * buf は失敗した転送の先頭区間．ホストコントローラ側のエンドポイントは回復済みで，
+   * 後続の転送は再開される．デバイス側の Halt の解除（Clear Feature）はドライバが行う．
+   * 既定では Error::kTransferFailed を返す．
+   */
+  virtual Error OnBulkFailed(EndpointID ep_id, const void *buf, int completion_code);
+  /** アイソクロナス転送の完了時に呼ばれる．アイソクロナスエンドポイントを使わないドライバは実装不要． */
+  virtual Error OnIsochCompleted(EndpointID ep_id, IsochPacket *packets, int num_packets);
+  /** 遅延より転送量を優先するドライバなら true．インタラプタの IMOD を決めるのに使う． */
+  virtual bool PrefersThroughput() const { return false; }
 
   /** このクラスドライバを保持する USB デバイスを返す． */
   Device *ParentDevice() const { return dev_; }
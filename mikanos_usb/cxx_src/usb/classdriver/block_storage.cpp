@@ -0,0 +1,5 @@
+#include "usb/classdriver/block_storage.hpp"
+
+namespace usb {
+std::function<BlockStorageDriver::ObserverType> BlockStorageDriver::default_observer;
+} // namespace usb
@@ -0,0 +1,65 @@
+/**
+ * @file usb/classdriver/block_storage.hpp
+ *
+ * ブロック単位で読み書きできるマスストレージのクラスドライバの共通部分．
+ *
+ * Bulk-Only Transport と USB Attached SCSI のどちらのドライバも，
+ * カーネルからはこのクラスを通して同じように扱われる．
+ */
+
+#pragma once
+
+#include "usb/classdriver/base.hpp"
+
+#include <cstdint>
+#include <functional>
+
+namespace usb {
+class BlockStorageDriver : public ClassDriver {
+public:
+  /** @brief ブロック I/O の完了通知．error は Error::Code */
+  using CompletionCallback = void (*)(void *context, int32_t error);
+
+  BlockStorageDriver(Device *dev) : ClassDriver{dev} {}
+
+  /** @brief デバイスが使用可能になったか（容量の取得が済んだか） */
+  virtual bool IsReady() const = 0;
+  /** @brief バルク転送が主体なので，完了の割り込みはまとめて受け取ればよい． */
+  bool PrefersThroughput() const override { return true; }
+  uint64_t NumBlocks() const { return num_blocks_; }
+  uint32_t BlockSize() const { return block_size_; }
+
+  /** @brief lba から num_blocks ブロックを buf に読み込む．
+   *
+   * 完了すると callback が呼ばれる．キャッシュに載っている場合は
+   * この関数の中で callback が呼ばれることがある．
+   * 要求を受け付けた後に起きたエラーは callback で通知される．
+   * buf はホストコントローラが直接書き込むため，物理アドレスと一致していなければならない．
+   */
+  virtual Error Read(uint64_t lba, uint32_t num_blocks, void *buf, CompletionCallback callback,
+                     void *context) = 0;
+  /** @brief buf の内容を lba から num_blocks ブロックに書き込む． */
+  virtual Error Write(uint64_t lba, uint32_t num_blocks, const void *buf,
+                      CompletionCallback callback, void *context) = 0;
+
+  using ObserverType = void(BlockStorageDriver *driver, uint64_t num_blocks, uint32_t block_size);
+  /** @brief デバイスが使用可能になったときに呼ばれる． */
+  static std::function<ObserverType> default_observer;
+
+protected:
+  uint64_t num_blocks_{0};
+  uint32_t block_size_{0};
+
+  /** @brief 容量が分かったことを default_observer に知らせる． */
+  void NotifyReady() {
+    if (default_observer) {
+      default_observer(this, num_blocks_, block_size_);
+    }
+  }
+
+  /** @brief [lba, lba + num_blocks) がデバイスの範囲内か */
+  bool InRange(uint64_t lba, uint32_t num_blocks) const {
+    return lba < num_blocks_ && num_blocks <= num_blocks_ - lba;
+  }
+};
+} // namespace usb
@@ -0,0 +1,169 @@
+#include "usb/classdriver/cdc.hpp"
+
+#include "logger.hpp"
+#include "usb/device.hpp"
+#include "usb/memory.hpp"
+
+namespace usb {
+std::function<CDCDriver::ObserverType> CDCDriver::default_observer;
+
+CDCDriver::CDCDriver(Device *dev, int interface_index)
+    : ClassDriver{dev}, interface_index_{interface_index} {}
+
+CDCDriver::~CDCDriver() { FreeMem(rx_bufs_); }
+
+Error CDCDriver::Initialize() { return MAKE_ERROR(Error::kSuccess); }
+
+Error CDCDriver::SetEndpoint(const EndpointConfig &config) {
+  if (config.ep_type == EndpointType::kInterrupt && config.ep_id.IsIn()) {
+    ep_interrupt_in_ = config.ep_id;
+    has_notification_ = true;
+  } else if (config.ep_type == EndpointType::kBulk) {
+    if (config.ep_id.IsIn()) {
+      ep_bulk_in_ = config.ep_id;
+    } else {
+      ep_bulk_out_ = config.ep_id;
+      bulk_out_max_packet_size_ = config.max_packet_size;
+    }
+    data_interface_index_ = config.interface_number;
+    data_alternate_setting_ = config.alternate_setting;
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error CDCDriver::OnEndpointsConfigured() {
+  Log(kDebug, "CDCDriver: interface %d, data interface %d (alt %d), bulk in %d, bulk out %d\n",
+      interface_index_, data_interface_index_, data_alternate_setting_, ep_bulk_in_.Address(),
+      ep_bulk_out_.Address());
+  if (data_interface_index_ < 0) {
+    return MAKE_ERROR(Error::kInvalidDescriptor);
+  }
+  rx_bufs_ = AllocArray<uint8_t>(kNumRxBuffers * kRxBufferSize, 64, 4096);
+  if (rx_bufs_ == nullptr) {
+    return MAKE_ERROR(Error::kNoEnoughMemory);
+  }
+  return StartFunction();
+}
+
+Error CDCDriver::OnInterruptCompleted(EndpointID ep_id, const void *buf, int len) {
+  OnNotification(notification_buf_.data(), len);
+  return ParentDevice()->InterruptIn(ep_interrupt_in_, notification_buf_.data(),
+                                     notification_buf_.size());
+}
+
+Error CDCDriver::OnBulkCompleted(EndpointID ep_id, const void *buf, int len) {
+  if (ep_id.IsIn()) {
+    if (receiver_) {
+      receiver_(receiver_context_, buf, len);
+    }
+    // 受け取ったバッファをそのまま次の受信に使う
+    return ParentDevice()->BulkIn(ep_bulk_in_, const_cast<void *>(buf), kRxBufferSize);
+  }
+
+  if (buf == nullptr) {
+    return MAKE_ERROR(Error::kSuccess); // フレームを区切る長さ 0 のパケット
+  }
+  if (num_sends_ == 0 || sends_[send_head_].buf != buf) {
+    return MAKE_ERROR(Error::kNoWaiter);
+  }
+  const auto request = sends_[send_head_];
+  send_head_ = (send_head_ + 1) % sends_.size();
+  --num_sends_;
+  request.callback(request.context, Error::kSuccess);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error CDCDriver::OnBulkFailed(EndpointID ep_id, const void *buf, int completion_code) {
+  Log(kWarn, "CDCDriver: bulk transfer on ep addr %d failed: completion code %d\n",
+      ep_id.Address(), completion_code);
+  if (ep_id.IsIn()) {
+    // Stall ならデバイス側のエンドポイントが止まっているので，受信を打ち切る
+    if (completion_code == 6 /* Stall */) {
+      return MAKE_ERROR(Error::kTransferFailed);
+    }
+    return ParentDevice()->BulkIn(ep_bulk_in_, const_cast<void *>(buf), kRxBufferSize);
+  }
+
+  if (buf == nullptr) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  if (num_sends_ == 0 || sends_[send_head_].buf != buf) {
+    return MAKE_ERROR(Error::kNoWaiter);
+  }
+  const auto request = sends_[send_head_];
+  send_head_ = (send_head_ + 1) % sends_.size();
+  --num_sends_;
+  request.callback(request.context, Error::kTransferFailed);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void CDCDriver::SetReceiver(ReceiveCallback callback, void *context) {
+  receiver_ = callback;
+  receiver_context_ = context;
+}
+
+Error CDCDriver::Send(const void *buf, int len, SendCallback callback, void *context) {
+  if (!IsReady()) {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  if (buf == nullptr || len <= 0) {
+    return MAKE_ERROR(Error::kBufferTooSmall);
+  }
+  if (num_sends_ == sends_.size()) {
+    return MAKE_ERROR(Error::kRingFull);
+  }
+
+  auto dev = ParentDevice();
+  SubmissionBatch batch{*dev};
+  if (auto err = dev->BulkOut(ep_bulk_out_, buf, len)) {
+    return err;
+  }
+  sends_[(send_head_ + num_sends_) % sends_.size()] = SendRequest{buf, callback, context};
+  ++num_sends_;
+
+  if (NeedsZeroLengthPacket() && bulk_out_max_packet_size_ > 0 &&
+      len % bulk_out_max_packet_size_ == 0) {
+    // 失敗してもフレームは送られているので，次のフレームと区別できなくなるだけ
+    if (auto err = dev->BulkOut(ep_bulk_out_, static_cast<const void *>(nullptr), 0)) {
+      Log(kWarn, "CDCDriver: failed to send ZLP: %s\n", err.Name());
+    }
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error CDCDriver::StartReceiving() {
+  auto dev = ParentDevice();
+  {
+    SubmissionBatch batch{*dev};
+    for (int i = 0; i < kNumRxBuffers; ++i) {
+      if (auto err = dev->BulkIn(ep_bulk_in_, rx_bufs_ + i * kRxBufferSize, kRxBufferSize)) {
+        return err;
+      }
+    }
+    if (has_notification_) {
+      if (auto err = dev->InterruptIn(ep_interrupt_in_, notification_buf_.data(),
+                                      notification_buf_.size())) {
+        return err;
+      }
+    }
+  }
+
+  ready_ = true;
+  if (default_observer) {
+    default_observer(this);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error CDCDriver::SendClassRequest(uint8_t request, uint16_t value, const void *data, int len) {
+  SetupData setup_data{};
+  setup_data.request_type.bits.direction = request_type::kOut;
+  setup_data.request_type.bits.type = request_type::kClass;
+  setup_data.request_type.bits.recipient = request_type::kInterface;
+  setup_data.request = request;
+  setup_data.value = value;
+  setup_data.index = interface_index_;
+  setup_data.length = len;
+  return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, data, len, this);
+}
+} // namespace usb
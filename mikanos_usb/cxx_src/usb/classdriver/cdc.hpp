@@ -0,0 +1,121 @@
+/**
+ * @file usb/classdriver/cdc.hpp
+ *
+ * USB Communications Device Class (CDC) のクラスドライバの共通部分．
+ *
+ * 通信インタフェース（通知用の Interrupt IN）とデータインタフェース（Bulk IN/OUT）の
+ * 組を 1 つのドライバで扱う．受信用のバッファはあらかじめ複数積んでおき，
+ * 送信は呼び出し側のバッファをそのままホストコントローラに渡す．
+ */
+
+#pragma once
+
+#include "usb/classdriver/base.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace usb {
+class CDCDriver : public ClassDriver {
+public:
+  /** @brief 通信インタフェースのクラスコード */
+  const static uint8_t kCommunicationsClass = 0x02;
+  /** @brief データインタフェースのクラスコード */
+  const static uint8_t kDataClass = 0x0a;
+
+  /** @brief 常に積んでおく受信バッファの数 */
+  const static int kNumRxBuffers = 8;
+  /** @brief 1 つの受信バッファの大きさ．Ethernet フレーム（1514 バイト）が収まる． */
+  const static int kRxBufferSize = 2048;
+  /** @brief 同時に受け付けられる送信要求の数 */
+  const static size_t kMaxPendingSends = 16;
+
+  /** @brief 受信したデータを渡す．buf は戻った後に次の受信に使われる． */
+  using ReceiveCallback = void (*)(void *context, const void *buf, int len);
+  /** @brief 送信の完了通知．error は Error::Code */
+  using SendCallback = void (*)(void *context, int32_t error);
+
+  /** @brief ドライバの種類 */
+  enum class Function : uint32_t {
+    kACM = 0, // 仮想シリアルポート
+    kECM = 1, // Ethernet
+  };
+
+  CDCDriver(Device *dev, int interface_index);
+  ~CDCDriver() override;
+
+  Error Initialize() override;
+  Error SetEndpoint(const EndpointConfig &config) override;
+  Error OnEndpointsConfigured() override;
+  Error OnInterruptCompleted(EndpointID ep_id, const void *buf, int len) override;
+  Error OnBulkCompleted(EndpointID ep_id, const void *buf, int len) override;
+  Error OnBulkFailed(EndpointID ep_id, const void *buf, int completion_code) override;
+
+  virtual Function Kind() const = 0;
+  /** @brief 受信の準備ができ，Send を呼べるか */
+  bool IsReady() const { return ready_; }
+  void SetReceiver(ReceiveCallback callback, void *context);
+  /** @brief buf の len バイトを送信する．
+   *
+   * buf はコピーせずにホストコントローラに渡すので，物理アドレスと一致し，
+   * callback が呼ばれるまで保持されていなければならない．
+   * ECM では buf が 1 つの Ethernet フレームになる．
+   */
+  Error Send(const void *buf, int len, SendCallback callback, void *context);
+
+  using ObserverType = void(CDCDriver *driver);
+  /** @brief デバイスが使用可能になったときに呼ばれる． */
+  static std::function<ObserverType> default_observer;
+
+protected:
+  /** @brief エンドポイントの構成後に機能ごとの初期化要求を発行する．
+   *
+   * 初期化が終わったら StartReceiving を呼ぶ．
+   */
+  virtual Error StartFunction() = 0;
+  /** @brief 通知エンドポイントで受け取った通知を処理する． */
+  virtual void OnNotification(const uint8_t *buf, int len) {}
+  /** @brief 最大パケットサイズの倍数の長さの送信を，長さ 0 のパケットで区切るか */
+  virtual bool NeedsZeroLengthPacket() const { return false; }
+
+  /** @brief 受信バッファを積み，使用可能になったことを default_observer に知らせる． */
+  Error StartReceiving();
+  /** @brief 通信インタフェース宛てのクラス要求を送る．data は発行から完了まで保持する． */
+  Error SendClassRequest(uint8_t request, uint16_t value, const void *data, int len);
+
+  int InterfaceIndex() const { return interface_index_; }
+  int DataInterfaceIndex() const { return data_interface_index_; }
+  int DataAlternateSetting() const { return data_alternate_setting_; }
+
+private:
+  struct SendRequest {
+    const void *buf;
+    SendCallback callback;
+    void *context;
+  };
+
+  const int interface_index_;
+  int data_interface_index_{-1};
+  int data_alternate_setting_{0};
+  EndpointID ep_interrupt_in_;
+  EndpointID ep_bulk_in_;
+  EndpointID ep_bulk_out_;
+  int bulk_out_max_packet_size_{0};
+  bool has_notification_{false};
+  bool ready_{false};
+
+  ReceiveCallback receiver_{nullptr};
+  void *receiver_context_{nullptr};
+
+  /** 受信バッファ．kNumRxBuffers 個をまとめてメモリプールから確保する． */
+  uint8_t *rx_bufs_{nullptr};
+  alignas(64) std::array<uint8_t, 64> notification_buf_{};
+
+  /** 送信中の要求の FIFO．Bulk OUT は発行順に完了する． */
+  std::array<SendRequest, kMaxPendingSends> sends_{};
+  size_t send_head_{0};
+  size_t num_sends_{0};
+};
+} // namespace usb
@@ -0,0 +1,74 @@
+#include "usb/classdriver/cdc_acm.hpp"
+
+#include "logger.hpp"
+#include "usb/memory.hpp"
+
+namespace {
+// CDC のクラス要求
+const uint8_t kSetLineCoding = 0x20;
+const uint8_t kSetControlLineState = 0x22;
+
+// SET_CONTROL_LINE_STATE の wValue
+const uint16_t kDTR = 1u << 0;
+const uint16_t kRTS = 1u << 1;
+
+// 通知
+const uint8_t kSerialState = 0x20;
+} // namespace
+
+namespace usb {
+CDCACMDriver::CDCACMDriver(Device *dev, int interface_index) : CDCDriver{dev, interface_index} {}
+
+void *CDCACMDriver::operator new(size_t size) { return AllocMem(sizeof(CDCACMDriver), 64, 0); }
+
+void CDCACMDriver::operator delete(void *ptr) noexcept { FreeMem(ptr); }
+
+Error CDCACMDriver::StartFunction() {
+  // 8N1
+  const uint32_t rate = kDefaultBaudRate;
+  line_coding_ = {static_cast<uint8_t>(rate),       static_cast<uint8_t>(rate >> 8),
+                  static_cast<uint8_t>(rate >> 16), static_cast<uint8_t>(rate >> 24),
+                  0,                                0,
+                  8};
+  return SendInitRequest(kSetLineCoding, 0, line_coding_.data(), line_coding_.size());
+}
+
+Error CDCACMDriver::SendInitRequest(uint8_t request, uint16_t value, const void *data, int len) {
+  pending_request_ = request;
+  return SendClassRequest(request, value, data, len);
+}
+
+Error CDCACMDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf,
+                                       int len) {
+  return Proceed(setup_data.request);
+}
+
+Error CDCACMDriver::OnControlFailed(EndpointID ep_id, int completion_code) {
+  // 回線の設定を持たない（STALL する）デバイスもあるので，失敗しても先に進む
+  Log(kDebug, "CDCACMDriver: request %02x failed (completion code %d)\n", pending_request_,
+      completion_code);
+  if (IsReady()) {
+    return MAKE_ERROR(Error::kTransferFailed);
+  }
+  return Proceed(pending_request_);
+}
+
+Error CDCACMDriver::Proceed(uint8_t last) {
+  switch (last) {
+  case kSetLineCoding:
+    // DTR を立てないとデータを送らないデバイスが多い
+    return SendInitRequest(kSetControlLineState, kDTR | kRTS, nullptr, 0);
+  case kSetControlLineState:
+    pending_request_ = 0;
+    return StartReceiving();
+  default:
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+}
+
+void CDCACMDriver::OnNotification(const uint8_t *buf, int len) {
+  if (len >= 10 && buf[1] == kSerialState) {
+    Log(kDebug, "CDCACMDriver: serial state %02x%02x\n", buf[9], buf[8]);
+  }
+}
+} // namespace usb
@@ -0,0 +1,46 @@
+/**
+ * @file usb/classdriver/cdc_acm.hpp
+ *
+ * CDC Abstract Control Model (virtual serial port) class driver.
+ */
+
+#pragma once
+
+#include "usb/classdriver/cdc.hpp"
+
+#include <array>
+#include <cstdint>
+
+namespace usb {
+class CDCACMDriver : public CDCDriver {
+public:
+  /** @brief 通信インタフェースのサブクラスコード */
+  const static uint8_t kSubClass = 0x02;
+  /** @brief 初期化時に設定するボーレート．USB 上の転送速度には影響しない． */
+  const static uint32_t kDefaultBaudRate = 115200;
+
+  CDCACMDriver(Device *dev, int interface_index);
+
+  void *operator new(size_t size);
+  void operator delete(void *ptr) noexcept;
+
+  Function Kind() const override { return Function::kACM; }
+  Error OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf,
+                           int len) override;
+  Error OnControlFailed(EndpointID ep_id, int completion_code) override;
+
+protected:
+  Error StartFunction() override;
+  void OnNotification(const uint8_t *buf, int len) override;
+
+private:
+  /** SET_LINE_CODING で送る設定（dwDTERate, bCharFormat, bParityType, bDataBits） */
+  alignas(64) std::array<uint8_t, 7> line_coding_{};
+  /** 発行中の初期化要求 */
+  uint8_t pending_request_{0};
+
+  Error SendInitRequest(uint8_t request, uint16_t value, const void *data, int len);
+  /** @brief 初期化要求の次の段階に進む．last は完了した（または失敗した）要求． */
+  Error Proceed(uint8_t last);
+};
+} // namespace usb
@@ -0,0 +1,92 @@
+#include "usb/classdriver/cdc_ecm.hpp"
+
+#include "logger.hpp"
+#include "usb/device.hpp"
+#include "usb/memory.hpp"
+
+namespace {
+// CDC ECM のクラス要求
+const uint8_t kSetEthernetPacketFilter = 0x43;
+
+// SET_ETHERNET_PACKET_FILTER の wValue
+const uint16_t kPacketTypeDirected = 1u << 2;
+const uint16_t kPacketTypeBroadcast = 1u << 3;
+
+// 通知
+const uint8_t kNetworkConnection = 0x00;
+const uint8_t kConnectionSpeedChange = 0x2a;
+
+uint32_t ReadLE32(const uint8_t *p) {
+  return static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 |
+         static_cast<uint32_t>(p[2]) << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+} // namespace
+
+namespace usb {
+CDCECMDriver::CDCECMDriver(Device *dev, int interface_index) : CDCDriver{dev, interface_index} {}
+
+void *CDCECMDriver::operator new(size_t size) { return AllocMem(sizeof(CDCECMDriver), 64, 0); }
+
+void CDCECMDriver::operator delete(void *ptr) noexcept { FreeMem(ptr); }
+
+Error CDCECMDriver::StartFunction() {
+  if (DataAlternateSetting() == 0) {
+    return SetPacketFilter();
+  }
+
+  // データインタフェースはエンドポイントを持つ代替設定に切り替えて初めて動く
+  SetupData setup_data{};
+  setup_data.request_type.bits.direction = request_type::kOut;
+  setup_data.request_type.bits.type = request_type::kStandard;
+  setup_data.request_type.bits.recipient = request_type::kInterface;
+  setup_data.request = request::kSetInterface;
+  setup_data.value = DataAlternateSetting();
+  setup_data.index = DataInterfaceIndex();
+  setup_data.length = 0;
+  return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this);
+}
+
+Error CDCECMDriver::SetPacketFilter() {
+  return SendClassRequest(kSetEthernetPacketFilter, kPacketTypeDirected | kPacketTypeBroadcast,
+                          nullptr, 0);
+}
+
+Error CDCECMDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf,
+                                       int len) {
+  switch (setup_data.request) {
+  case request::kSetInterface:
+    return SetPacketFilter();
+  case kSetEthernetPacketFilter:
+    return StartReceiving();
+  default:
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+}
+
+Error CDCECMDriver::OnControlFailed(EndpointID ep_id, int completion_code) {
+  if (IsReady()) {
+    return MAKE_ERROR(Error::kTransferFailed);
+  }
+  // パケットフィルタを設定できなくても，既定の設定で受信はできる
+  Log(kDebug, "CDCECMDriver: packet filter not set (completion code %d)\n", completion_code);
+  return StartReceiving();
+}
+
+void CDCECMDriver::OnNotification(const uint8_t *buf, int len) {
+  if (len < 8) {
+    return;
+  }
+  switch (buf[1]) {
+  case kNetworkConnection:
+    connected_ = buf[2] != 0;
+    Log(kInfo, "CDCECMDriver: link %s\n", connected_ ? "up" : "down");
+    break;
+  case kConnectionSpeedChange:
+    if (len >= 16) {
+      Log(kInfo, "CDCECMDriver: link speed down %u, up %u bit/s\n", ReadLE32(&buf[8]),
+          ReadLE32(&buf[12]));
+    }
+    break;
+  }
+}
+} // namespace usb
@@ -0,0 +1,44 @@
+/**
+ * @file usb/classdriver/cdc_ecm.hpp
+ *
+ * CDC Ethernet Control Model class driver.
+ *
+ * Ethernet フレームをそのまま送受信する．1 回の Bulk 転送が 1 つのフレームになる．
+ */
+
+#pragma once
+
+#include "usb/classdriver/cdc.hpp"
+
+#include <cstdint>
+
+namespace usb {
+class CDCECMDriver : public CDCDriver {
+public:
+  /** @brief 通信インタフェースのサブクラスコード */
+  const static uint8_t kSubClass = 0x06;
+
+  CDCECMDriver(Device *dev, int interface_index);
+
+  void *operator new(size_t size);
+  void operator delete(void *ptr) noexcept;
+
+  Function Kind() const override { return Function::kECM; }
+  Error OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf,
+                           int len) override;
+  Error OnControlFailed(EndpointID ep_id, int completion_code) override;
+
+  /** @brief デバイスが最後に通知したリンクの状態 */
+  bool IsConnected() const { return connected_; }
+
+protected:
+  Error StartFunction() override;
+  void OnNotification(const uint8_t *buf, int len) override;
+  bool NeedsZeroLengthPacket() const override { return true; }
+
+private:
+  bool connected_{false};
+
+  Error SetPacketFilter();
+};
+} // namespace usb
@@ -2,18 +2,30 @@
 
 #include "logger.hpp"
 #include "usb/device.hpp"
+#include "usb/latency_trace.hpp"
+#include "usb/memory.hpp"
 
 #include <algorithm>
 
 namespace usb {
-HIDBaseDriver::HIDBaseDriver(Device *dev, int interface_index, int in_packet_size)
-    : ClassDriver{dev}, interface_index_{interface_index}, in_packet_size_{in_packet_size} {}
+HIDBaseDriver::HIDBaseDriver(Device *dev, int interface_index, int in_packet_size,
+                             int num_in_flight_reports)
+    : ClassDriver{dev}, interface_index_{interface_index},
+      in_packet_size_{std::min(in_packet_size, static_cast<int>(kBufferSize))},
+      num_in_flight_reports_{std::clamp(num_in_flight_reports, 1, kMaxInFlightReports)} {}
+
+// レポートディスクリプタの取得中に破棄された場合に備える
+HIDBaseDriver::~HIDBaseDriver() {
+  FreeMem(report_desc_buf_);
+  FreeMem(report_bufs_);
+}
 
 Error HIDBaseDriver::Initialize() { return MAKE_ERROR(Error::kNotImplemented); }
 
 Error HIDBaseDriver::SetEndpoint(const EndpointConfig &config) {
   if (config.ep_type == EndpointType::kInterrupt && config.ep_id.IsIn()) {
     ep_interrupt_in_ = config.ep_id;
+    return AllocReportBuffers(config.max_packet_size);
   } else if (config.ep_type == EndpointType::kInterrupt && !config.ep_id.IsIn()) {
     ep_interrupt_out_ = config.ep_id;
   }
@@ -21,26 +33,95 @@ Error HIDBaseDriver::SetEndpoint(const EndpointConfig &config) {
 }
 
 Error HIDBaseDriver::OnEndpointsConfigured() {
+  if (WantsReportProtocol()) {
+    report_desc_buf_ = reinterpret_cast<uint8_t *>(AllocMem(kMaxReportDescriptorSize, 64, 0));
+  }
+  if (report_desc_buf_ == nullptr) {
+    return SetProtocol(false);
+  }
+
+  SetupData setup_data{};
+  setup_data.request_type.bits.direction = request_type::kIn;
+  setup_data.request_type.bits.type = request_type::kStandard;
+  setup_data.request_type.bits.recipient = request_type::kInterface;
+  setup_data.request = request::kGetDescriptor;
+  setup_data.value = descriptor_type::kReport << 8;
+  setup_data.index = interface_index_;
+  setup_data.length = kMaxReportDescriptorSize;
+
+  initialize_phase_ = 1;
+  return ParentDevice()->ControlIn(kDefaultControlPipeID, setup_data, report_desc_buf_,
+                                   kMaxReportDescriptorSize, this);
+}
+
+Error HIDBaseDriver::SetProtocol(bool report_protocol) {
   SetupData setup_data{};
   setup_data.request_type.bits.direction = request_type::kOut;
   setup_data.request_type.bits.type = request_type::kClass;
   setup_data.request_type.bits.recipient = request_type::kInterface;
   setup_data.request = request::kSetProtocol;
-  setup_data.value = 0; // boot protocol
+  setup_data.value = report_protocol ? 1 : 0; // 0: boot protocol, 1: report protocol
   setup_data.index = interface_index_;
   setup_data.length = 0;
 
-  initialize_phase_ = 1;
+  initialize_phase_ = 2;
   return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this);
 }
 
+bool HIDBaseDriver::SetInPacketSize(int in_packet_size) {
+  const int limit = report_bufs_ != nullptr ? report_size_ : static_cast<int>(kBufferSize);
+  in_packet_size_ = std::min(in_packet_size, limit);
+  return in_packet_size_ == in_packet_size;
+}
+
+Error HIDBaseDriver::AllocReportBuffers(int max_packet_size) {
+  if (report_bufs_ != nullptr) {
+    return MAKE_ERROR(Error::kAlreadyAllocated);
+  }
+  // ブートプロトコルのレポートは 3 - 8 バイトしかないので，wMaxPacketSize 分だけ確保する．
+  // ただしドライバが読む in_packet_size_ バイトは必ず収まるようにする．
+  report_size_ =
+      std::clamp(std::max(max_packet_size, in_packet_size_), 1, static_cast<int>(kBufferSize));
+  // 全体で高々 (8 + 1) * 64 バイトなので，ページ境界を跨がないように確保できる
+  report_bufs_ = AllocArray<uint8_t>(report_size_ * (kMaxInFlightReports + 1), 64, 4096);
+  if (report_bufs_ == nullptr) {
+    return MAKE_ERROR(Error::kNoEnoughMemory);
+  }
+  previous_buf_ = ReportAt(kMaxInFlightReports);
+  in_packet_size_ = std::min(in_packet_size_, report_size_);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
 Error HIDBaseDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf,
                                         int len) {
   Log(kTrace, "HIDBaseDriver::OnControlCompleted: dev %08lx, phase = %d, len = %d\n",
       reinterpret_cast<uintptr_t>(this), initialize_phase_, len);
   if (initialize_phase_ == 1) {
-    initialize_phase_ = 2;
-    return ParentDevice()->InterruptIn(ep_interrupt_in_, buf_.data(), in_packet_size_);
+    const bool report_protocol = OnReportDescriptorReceived(report_desc_buf_, len);
+    FreeMem(report_desc_buf_);
+    report_desc_buf_ = nullptr;
+    return SetProtocol(report_protocol);
+  } else if (initialize_phase_ == 2) {
+    if (report_bufs_ == nullptr) {
+      return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
+    initialize_phase_ = 3;
+    // リングに積んだ全てのレポートについて，ドアベルは最後に 1 回だけ鳴らす
+    SubmissionBatch batch{*ParentDevice()};
+    for (int i = 0; i < num_in_flight_reports_; ++i) {
+      if (auto err =
+              ParentDevice()->InterruptIn(ep_interrupt_in_, ReportAt(i), in_packet_size_)) {
+        if (i == 0) {
+          return err;
+        }
+        // リングに空きが無ければ，積めた分だけで動作する
+        Log(kWarn, "HIDBaseDriver: only %d of %d reports are queued: %s\n", i,
+            num_in_flight_reports_, err.Name());
+        num_in_flight_reports_ = i;
+        break;
+      }
+    }
+    return MAKE_ERROR(Error::kSuccess);
   }
 
   return MAKE_ERROR(Error::kNotImplemented);
@@ -48,9 +129,18 @@ Error HIDBaseDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data,
 
 Error HIDBaseDriver::OnInterruptCompleted(EndpointID ep_id, const void *buf, int len) {
   if (ep_id.IsIn()) {
+    const auto offset = static_cast<const uint8_t *>(buf) - report_bufs_;
+    if (report_bufs_ == nullptr || offset < 0 || offset % report_size_ != 0 ||
+        offset / report_size_ >= num_in_flight_reports_) {
+      return MAKE_ERROR(Error::kNoWaiter);
+    }
+    current_report_ = offset / report_size_;
+    uint8_t *report = ReportAt(current_report_);
+
+    TraceMark(TraceStage::kDataReceived);
     OnDataReceived();
-    std::copy_n(buf_.begin(), len, previous_buf_.begin());
-    return ParentDevice()->InterruptIn(ep_interrupt_in_, buf_.data(), in_packet_size_);
+    std::copy_n(report, std::min(len, in_packet_size_), previous_buf_);
+    return ParentDevice()->InterruptIn(ep_interrupt_in_, report, in_packet_size_);
   }
 
   return MAKE_ERROR(Error::kNotImplemented);
@@ -8,10 +8,19 @@
 
 #include "usb/classdriver/base.hpp"
 
+#include <cstdint>
+
 namespace usb {
 class HIDBaseDriver : public ClassDriver {
 public:
-  HIDBaseDriver(Device *dev, int interface_index, int in_packet_size);
+  /** @brief 同時に発行しておく Interrupt IN 転送の数の既定値 */
+  const static int kDefaultNumInFlightReports = 4;
+  /** @brief 同時に発行しておける Interrupt IN 転送の最大数 */
+  const static int kMaxInFlightReports = 8;
+
+  HIDBaseDriver(Device *dev, int interface_index, int in_packet_size,
+                int num_in_flight_reports = kDefaultNumInFlightReports);
+  ~HIDBaseDriver() override;
   Error Initialize() override;
   Error SetEndpoint(const EndpointConfig &config) override;
   Error OnEndpointsConfigured() override;
@@ -20,17 +29,59 @@ public:
   Error OnInterruptCompleted(EndpointID ep_id, const void *buf, int len) override;
 
   virtual Error OnDataReceived() = 0;
-  const static size_t kBufferSize = 1024;
-  const std::array<uint8_t, kBufferSize> &Buffer() const { return buf_; }
-  const std::array<uint8_t, kBufferSize> &PreviousBuffer() const { return previous_buf_; }
+  /** @brief 1 つのレポートバッファの大きさの上限．in_packet_size はこれ以下に切り詰める． */
+  const static size_t kBufferSize = 64;
+  /** @brief 処理中の（最後に受信した）レポート．大きさは in_packet_size 以上ある． */
+  const uint8_t *Buffer() const { return ReportAt(current_report_); }
+  /** @brief 1 つ前に受信したレポート */
+  const uint8_t *PreviousBuffer() const { return previous_buf_; }
+
+protected:
+  /** @brief Report プロトコルを使いたいドライバは true を返す．
+   *
+   * true なら初期化時に Report ディスクリプタを取得して OnReportDescriptorReceived を呼ぶ．
+   */
+  virtual bool WantsReportProtocol() const { return false; }
+  /** @brief Report ディスクリプタを解析する．
+   *
+   * @return Report プロトコルで受信できるなら true．false ならブートプロトコルを使う．
+   */
+  virtual bool OnReportDescriptorReceived(const uint8_t *desc, int len) { return false; }
+  /** @brief 1 回の Interrupt IN 転送で受信するバイト数を変更する（初期化中のみ）
+   *
+   * @return レポートバッファに収まらず切り詰めたなら false
+   */
+  bool SetInPacketSize(int in_packet_size);
 
 private:
+  /** @brief Report ディスクリプタとして受け取る最大バイト数 */
+  const static int kMaxReportDescriptorSize = 512;
+
+  Error SetProtocol(bool report_protocol);
+
   EndpointID ep_interrupt_in_;
   EndpointID ep_interrupt_out_;
   const int interface_index_;
   int in_packet_size_;
   int initialize_phase_{0};
+  /** Report ディスクリプタの受信バッファ．受信中のみ確保する． */
+  uint8_t *report_desc_buf_{nullptr};
+
+  /** ホストコントローラに渡しておくレポートバッファ．
+   * 転送はリング上の順番通り完了するので，受信したバッファを処理した後に
+   * 再び末尾へ積み直せば，レポートは常に到着順に処理される．
+   *
+   * Interrupt IN エンドポイントの wMaxPacketSize に合わせた大きさで，受信用の
+   * kMaxInFlightReports 個と 1 つ前のレポートの保存用をまとめてメモリプールから確保する．
+   */
+  uint8_t *report_bufs_{nullptr};
+  /** 1 つのレポートバッファの大きさ */
+  int report_size_{0};
+  int num_in_flight_reports_;
+  int current_report_{0};
+  uint8_t *previous_buf_{nullptr};
 
-  std::array<uint8_t, kBufferSize> buf_{}, previous_buf_{};
+  uint8_t *ReportAt(int index) const { return report_bufs_ + index * report_size_; }
+  Error AllocReportBuffers(int max_packet_size);
 };
 } // namespace usb
@@ -0,0 +1,384 @@
+#include "usb/classdriver/hid_report.hpp"
+
+#include "logger.hpp"
+
+#include <algorithm>
+
+namespace {
+using namespace usb::hid;
+
+namespace item_type {
+const int kMain = 0;
+const int kGlobal = 1;
+const int kLocal = 2;
+} // namespace item_type
+
+namespace main_tag {
+const int kInput = 8;
+} // namespace main_tag
+
+namespace global_tag {
+const int kUsagePage = 0;
+const int kLogicalMinimum = 1;
+const int kReportSize = 7;
+const int kReportID = 8;
+const int kReportCount = 9;
+const int kPush = 10;
+const int kPop = 11;
+} // namespace global_tag
+
+namespace local_tag {
+const int kUsage = 0;
+const int kUsageMinimum = 1;
+const int kUsageMaximum = 2;
+} // namespace local_tag
+
+const uint32_t kUsagePageGenericDesktop = 0x01;
+const uint32_t kUsagePageKeyboard = 0x07;
+const uint32_t kUsagePageButton = 0x09;
+const uint32_t kUsageX = 0x30;
+const uint32_t kUsageY = 0x31;
+const uint32_t kUsageWheel = 0x38;
+
+struct GlobalState {
+  uint32_t usage_page;
+  int32_t logical_minimum;
+  uint32_t report_size;
+  uint32_t report_count;
+  uint8_t report_id;
+};
+
+const int kMaxGlobalStack = 4;
+const int kMaxUsages = 16;
+const int kMaxReportIDs = 8;
+const int kMaxCandidates = 32;
+
+struct Candidate {
+  uint8_t report_id;
+  Field field;
+};
+
+struct KeyCandidate {
+  uint8_t report_id;
+  KeyField field;
+};
+
+/** 拡張 usage（上位 16 ビットが usage page）でなければ現在の usage page を補う */
+uint32_t ExtendUsage(uint32_t usage, int size, uint32_t usage_page) {
+  return size == 4 ? usage : (usage_page << 16 | usage);
+}
+
+bool ToFieldKind(uint32_t extended_usage, FieldKind &kind) {
+  const uint32_t page = extended_usage >> 16;
+  const uint32_t id = extended_usage & 0xffffu;
+  if (page == kUsagePageGenericDesktop) {
+    switch (id) {
+    case kUsageX:
+      kind = FieldKind::kX;
+      return true;
+    case kUsageY:
+      kind = FieldKind::kY;
+      return true;
+    case kUsageWheel:
+      kind = FieldKind::kWheel;
+      return true;
+    }
+  }
+  return false;
+}
+
+/** Report ID ごとに，次の入力フィールドが置かれるビット位置を記録する */
+class BitOffsets {
+public:
+  uint32_t &At(uint8_t report_id) {
+    for (int i = 0; i < num_ids_; ++i) {
+      if (ids_[i] == report_id) {
+        return offsets_[i];
+      }
+    }
+    if (num_ids_ == kMaxReportIDs) {
+      // 記録しきれない Report ID は最後の枠を使い回す（そのレポートは使われない）
+      return offsets_[kMaxReportIDs - 1];
+    }
+    ids_[num_ids_] = report_id;
+    // Report ID が付く場合は先頭の 1 バイトが Report ID になる
+    offsets_[num_ids_] = report_id == 0 ? 0 : 8;
+    return offsets_[num_ids_++];
+  }
+
+private:
+  std::array<uint8_t, kMaxReportIDs> ids_{};
+  std::array<uint32_t, kMaxReportIDs> offsets_{};
+  int num_ids_{0};
+};
+
+/** Input main item 1 つ分の情報 */
+struct InputItem {
+  const GlobalState &global;
+  /** Input item のデータ（Constant, Variable などのフラグ） */
+  uint32_t flags;
+  /** レポート先頭からのビット位置 */
+  uint32_t bit_offset;
+  const uint32_t *usages;
+  int num_usages;
+  bool has_usage_range;
+  uint32_t usage_minimum, usage_maximum;
+
+  bool IsConstant() const { return flags & 1; }
+  bool IsVariable() const { return flags & 2; }
+
+  /** @brief i 番目の要素の（拡張）usage を求める．usage の範囲を超えていれば false． */
+  bool UsageAt(uint32_t i, uint32_t &usage) const {
+    usage = 0;
+    if (has_usage_range) {
+      usage = usage_minimum + i;
+      return usage <= usage_maximum;
+    }
+    if (num_usages > 0) {
+      // usage が count より少なければ最後の usage が繰り返される
+      usage = usages[static_cast<int>(i) < num_usages ? i : num_usages - 1];
+    }
+    return true;
+  }
+};
+
+/** @brief Report ディスクリプタをたどり，Input main item ごとに on_input(const InputItem &) を呼ぶ．
+ *
+ * offsets には Report ID ごとの入力レポートのビット数が残る．
+ */
+template <typename F>
+Error ForEachInputItem(const uint8_t *desc, int len, BitOffsets &offsets, F on_input) {
+  std::array<GlobalState, kMaxGlobalStack> global_stack{};
+  int global_depth = 0;
+  GlobalState global{};
+
+  std::array<uint32_t, kMaxUsages> usages{};
+  int num_usages = 0;
+  uint32_t usage_minimum = 0, usage_maximum = 0;
+  bool has_usage_range = false;
+
+  int p = 0;
+  while (p < len) {
+    const uint8_t prefix = desc[p];
+    if (prefix == 0xfe) { // long item
+      if (p + 1 >= len) {
+        break;
+      }
+      p += 3 + desc[p + 1];
+      continue;
+    }
+
+    const int size = (prefix & 3) == 3 ? 4 : (prefix & 3);
+    const int type = (prefix >> 2) & 3;
+    const int tag = prefix >> 4;
+    if (p + 1 + size > len) {
+      return MAKE_ERROR(Error::kInvalidDescriptor);
+    }
+    uint32_t data = 0;
+    for (int i = size - 1; i >= 0; --i) {
+      data = data << 8 | desc[p + 1 + i];
+    }
+    // 符号付きの値（Logical Minimum など）として解釈する場合の値
+    int32_t sdata = static_cast<int32_t>(data);
+    if (size == 1) {
+      sdata = static_cast<int8_t>(data);
+    } else if (size == 2) {
+      sdata = static_cast<int16_t>(data);
+    }
+    p += 1 + size;
+
+    if (type == item_type::kGlobal) {
+      switch (tag) {
+      case global_tag::kUsagePage:
+        global.usage_page = data;
+        break;
+      case global_tag::kLogicalMinimum:
+        global.logical_minimum = sdata;
+        break;
+      case global_tag::kReportSize:
+        global.report_size = data;
+        break;
+      case global_tag::kReportID:
+        global.report_id = data;
+        break;
+      case global_tag::kReportCount:
+        global.report_count = data;
+        break;
+      case global_tag::kPush:
+        if (global_depth < kMaxGlobalStack) {
+          global_stack[global_depth++] = global;
+        }
+        break;
+      case global_tag::kPop:
+        if (global_depth > 0) {
+          global = global_stack[--global_depth];
+        }
+        break;
+      }
+    } else if (type == item_type::kLocal) {
+      switch (tag) {
+      case local_tag::kUsage:
+        if (num_usages < kMaxUsages) {
+          usages[num_usages++] = ExtendUsage(data, size, global.usage_page);
+        }
+        break;
+      case local_tag::kUsageMinimum:
+        usage_minimum = ExtendUsage(data, size, global.usage_page);
+        has_usage_range = true;
+        break;
+      case local_tag::kUsageMaximum:
+        usage_maximum = ExtendUsage(data, size, global.usage_page);
+        has_usage_range = true;
+        break;
+      }
+    } else if (type == item_type::kMain) {
+      if (tag == main_tag::kInput) {
+        auto &offset = offsets.At(global.report_id);
+        const InputItem item{global,     data,           offset,        usages.data(),
+                             num_usages, has_usage_range, usage_minimum, usage_maximum};
+        on_input(item);
+        offset += global.report_size * global.report_count;
+      }
+      // Main item の後は local item をリセットする
+      num_usages = 0;
+      has_usage_range = false;
+    }
+  }
+
+  return MAKE_ERROR(Error::kSuccess);
+}
+} // namespace
+
+namespace usb::hid {
+Error ParseMouseReportDescriptor(const uint8_t *desc, int len, ReportLayout &layout) {
+  BitOffsets offsets;
+  std::array<Candidate, kMaxCandidates> candidates{};
+  int num_candidates = 0;
+  auto add_candidate = [&](const GlobalState &global, FieldKind kind, uint32_t bit_offset,
+                           uint32_t bit_size) {
+    if (num_candidates < kMaxCandidates && bit_size >= 1 && bit_size <= 32) {
+      candidates[num_candidates++] = Candidate{
+          global.report_id,
+          Field{kind, global.logical_minimum < 0, static_cast<uint8_t>(bit_size),
+                static_cast<uint16_t>(bit_offset)}};
+    }
+  };
+
+  auto err = ForEachInputItem(desc, len, offsets, [&](const InputItem &item) {
+    const auto &global = item.global;
+    if (item.IsConstant() || !item.IsVariable()) {
+      return;
+    }
+    if (global.usage_page == kUsagePageButton && global.report_size == 1) {
+      // ボタンはまとめて 1 つのフィールドとして扱う
+      add_candidate(global, FieldKind::kButtons, item.bit_offset, global.report_count);
+      return;
+    }
+    for (uint32_t i = 0; i < global.report_count; ++i) {
+      uint32_t usage;
+      if (!item.UsageAt(i, usage)) {
+        break;
+      }
+      FieldKind kind;
+      if (ToFieldKind(usage, kind)) {
+        add_candidate(global, kind, item.bit_offset + i * global.report_size, global.report_size);
+      }
+    }
+  });
+  if (err) {
+    return err;
+  }
+
+  // X を持つ最初のレポートを採用する
+  int x_index = -1;
+  for (int i = 0; i < num_candidates; ++i) {
+    if (candidates[i].field.kind == FieldKind::kX) {
+      x_index = i;
+      break;
+    }
+  }
+  if (x_index < 0) {
+    return MAKE_ERROR(Error::kInvalidDescriptor);
+  }
+
+  layout = ReportLayout{};
+  layout.report_id = candidates[x_index].report_id;
+  bool has_y = false;
+  uint32_t report_bits = 0;
+  for (int i = 0; i < num_candidates && layout.num_fields < ReportLayout::kMaxFields; ++i) {
+    const auto &c = candidates[i];
+    if (c.report_id != layout.report_id) {
+      continue;
+    }
+    has_y |= c.field.kind == FieldKind::kY;
+    layout.fields[layout.num_fields++] = c.field;
+    report_bits = std::max<uint32_t>(report_bits, c.field.bit_offset + c.field.bit_size);
+  }
+  if (!has_y) {
+    return MAKE_ERROR(Error::kInvalidDescriptor);
+  }
+  layout.report_bytes = (std::max(report_bits, offsets.At(layout.report_id)) + 7) / 8;
+
+  Log(kDebug, "HID report layout: id %d, %d bytes, %d fields\n", layout.report_id,
+      layout.report_bytes, layout.num_fields);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error ParseKeyboardReportDescriptor(const uint8_t *desc, int len, KeyboardLayout &layout) {
+  BitOffsets offsets;
+  std::array<KeyCandidate, kMaxCandidates> candidates{};
+  int num_candidates = 0;
+
+  auto err = ForEachInputItem(desc, len, offsets, [&](const InputItem &item) {
+    const auto &global = item.global;
+    uint32_t first_usage;
+    if (item.IsConstant() || global.report_count == 0 || !item.UsageAt(0, first_usage)) {
+      return;
+    }
+    if ((first_usage >> 16) != kUsagePageKeyboard || num_candidates == kMaxCandidates) {
+      return;
+    }
+
+    KeyField field{};
+    field.bit_offset = item.bit_offset;
+    if (item.IsVariable() && global.report_size == 1) {
+      // 1 ビット 1 キーのビットマップ（モディファイアキーや N キーロールオーバー）
+      const uint32_t base = first_usage & 0xffffu;
+      if (base > 0xff) {
+        return;
+      }
+      field.is_array = false;
+      field.count = std::min<uint32_t>(global.report_count, 0x100 - base);
+      field.usage_base = base;
+    } else if (!item.IsVariable() && global.report_size == 8 && item.bit_offset % 8 == 0) {
+      // 押されているキーの usage を並べた配列（6 キーロールオーバー）
+      field.is_array = true;
+      field.count = global.report_count;
+      field.usage_base = static_cast<int16_t>((first_usage & 0xffffu) - global.logical_minimum);
+    } else {
+      return;
+    }
+    candidates[num_candidates++] = KeyCandidate{global.report_id, field};
+  });
+  if (err) {
+    return err;
+  }
+
+  // キーを持つ最初のレポートを採用する
+  if (num_candidates == 0) {
+    return MAKE_ERROR(Error::kInvalidDescriptor);
+  }
+  layout = KeyboardLayout{};
+  layout.report_id = candidates[0].report_id;
+  for (int i = 0; i < num_candidates && layout.num_fields < KeyboardLayout::kMaxFields; ++i) {
+    if (candidates[i].report_id == layout.report_id) {
+      layout.fields[layout.num_fields++] = candidates[i].field;
+    }
+  }
+  layout.report_bytes = (offsets.At(layout.report_id) + 7) / 8;
+
+  Log(kDebug, "HID keyboard layout: id %d, %d bytes, %d fields\n", layout.report_id,
+      layout.report_bytes, layout.num_fields);
+  return MAKE_ERROR(Error::kSuccess);
+}
+} // namespace usb::hid
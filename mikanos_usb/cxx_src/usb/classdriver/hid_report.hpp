@@ -0,0 +1,114 @@
+/**
+ * @file usb/classdriver/hid_report.hpp
+ *
+ * HID Report ディスクリプタの解析と，レポートからのフィールド抽出．
+ */
+
+#pragma once
+
+#include "error.hpp"
+
+#include <array>
+#include <cstdint>
+
+namespace usb::hid {
+/** @brief ドライバが関心を持つフィールドの種類 */
+enum class FieldKind : uint8_t {
+  kButtons, // 連続したボタン（1 ビット 1 ボタン）をまとめたもの
+  kX,
+  kY,
+  kWheel,
+};
+
+/** @brief レポート中の 1 つのフィールドの位置 */
+struct Field {
+  FieldKind kind;
+  bool is_signed;
+  /** ビット数（1 - 32） */
+  uint8_t bit_size;
+  /** レポート先頭（Report ID を含む）からのビット位置 */
+  uint16_t bit_offset;
+};
+
+/** @brief Report ディスクリプタを解析した結果．
+ *
+ * 1 つのレポート（Report ID）について，関心のあるフィールドの位置だけを持つ．
+ * レポート受信時はこの表を引くだけで値を取り出せる．
+ */
+struct ReportLayout {
+  static const int kMaxFields = 8;
+
+  /** Report ID．0 ならレポートに Report ID が付かない． */
+  uint8_t report_id;
+  /** Report ID を含むレポートのバイト数 */
+  uint16_t report_bytes;
+  int num_fields;
+  std::array<Field, kMaxFields> fields;
+
+  /** @brief report から field の値を取り出す．符号付きなら符号拡張する． */
+  static int32_t Extract(const uint8_t *report, const Field &field) {
+    const int first_byte = field.bit_offset / 8;
+    const int last_byte = (field.bit_offset + field.bit_size - 1) / 8;
+    uint64_t value = 0;
+    for (int i = last_byte; i >= first_byte; --i) {
+      value = value << 8 | report[i];
+    }
+    value >>= field.bit_offset % 8;
+
+    const uint32_t mask = field.bit_size >= 32 ? 0xffffffffu : (1u << field.bit_size) - 1;
+    const uint32_t bits = static_cast<uint32_t>(value) & mask;
+    if (field.is_signed && field.bit_size < 32) {
+      const uint32_t sign = 1u << (field.bit_size - 1);
+      return static_cast<int32_t>((bits ^ sign) - sign);
+    }
+    return static_cast<int32_t>(bits);
+  }
+};
+
+/** @brief マウス（X, Y と任意のボタン・ホイール）の入力レポートを探して layout を作る．
+ *
+ * X と Y を持つ入力レポートが見つからなければ kInvalidDescriptor を返す．
+ */
+Error ParseMouseReportDescriptor(const uint8_t *desc, int len, ReportLayout &layout);
+
+/** @brief キーボードの入力レポート中で，キーの状態を表す 1 つのフィールド */
+struct KeyField {
+  /** true なら押されているキーの usage を並べた配列（1 要素 8 ビット），
+   * false なら 1 ビット 1 キーのビットマップ */
+  bool is_array;
+  /** 要素（ビット）の数 */
+  uint16_t count;
+  /** レポート先頭（Report ID を含む）からのビット位置 */
+  uint16_t bit_offset;
+  /** ビットマップの i ビット目，または配列の値 v が表すキーコードは usage_base + i（v） */
+  int16_t usage_base;
+};
+
+/** @brief キーボードの入力レポートの形式．ReportLayout のキーボード版． */
+struct KeyboardLayout {
+  static const int kMaxFields = 4;
+
+  /** Report ID．0 ならレポートに Report ID が付かない． */
+  uint8_t report_id;
+  /** Report ID を含むレポートのバイト数 */
+  uint16_t report_bytes;
+  int num_fields;
+  std::array<KeyField, kMaxFields> fields;
+
+  /** @brief 1 つでもビットマップで表されるキー（モディファイアキー以外）があるか */
+  bool HasKeyBitmap() const {
+    for (int i = 0; i < num_fields; ++i) {
+      if (!fields[i].is_array && fields[i].usage_base < 0xe0) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+/** @brief キーボード（Keyboard/Keypad usage page のキー）の入力レポートを探して layout を作る．
+ *
+ * キーを持つ入力レポートが見つからなければ kInvalidDescriptor を返す．
+ */
+Error ParseKeyboardReportDescriptor(const uint8_t *desc, int len, KeyboardLayout &layout);
+} // namespace usb::hid
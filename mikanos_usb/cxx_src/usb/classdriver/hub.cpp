@@ -0,0 +1,311 @@
+#include "usb/classdriver/hub.hpp"
+
+#include "logger.hpp"
+#include "usb/device.hpp"
+#include "usb/memory.hpp"
+
+#include <algorithm>
+
+namespace {
+// Port Feature Selector
+const uint16_t kPortReset = 4;
+const uint16_t kPortPower = 8;
+
+// wPortStatus
+const uint16_t kPortStatusConnection = 1u << 0;
+const uint16_t kPortStatusEnable = 1u << 1;
+const uint16_t kPortStatusLowSpeed = 1u << 9;  // USB 2.0 ハブのみ
+const uint16_t kPortStatusHighSpeed = 1u << 10; // USB 2.0 ハブのみ
+
+// wPortChange
+const uint16_t kPortChangeConnection = 1u << 0;
+const uint16_t kPortChangeReset = 1u << 4;
+const uint16_t kPortChangeBHReset = 1u << 5; // SuperSpeed ハブのみ
+
+/** wPortChange のビット i をクリアする Feature Selector */
+constexpr std::array<uint16_t, 8> kChangeFeatures{
+    16, // C_PORT_CONNECTION
+    17, // C_PORT_ENABLE
+    18, // C_PORT_SUSPEND
+    19, // C_PORT_OVER_CURRENT
+    20, // C_PORT_RESET
+    29, // C_BH_PORT_RESET
+    25, // C_PORT_LINK_STATE
+    26, // C_PORT_CONFIG_ERROR
+};
+
+int LowestBit(uint16_t bits) { return __builtin_ctz(bits); }
+} // namespace
+
+namespace usb {
+HubDriver::HubDriver(Device *dev, int interface_index)
+    : ClassDriver{dev}, interface_index_{interface_index} {}
+
+void *HubDriver::operator new(size_t size) { return AllocMem(sizeof(HubDriver), 64, 0); }
+
+void HubDriver::operator delete(void *ptr) noexcept { FreeMem(ptr); }
+
+Error HubDriver::Initialize() { return MAKE_ERROR(Error::kNotImplemented); }
+
+Error HubDriver::SetEndpoint(const EndpointConfig &config) {
+  if (config.ep_type == EndpointType::kInterrupt && config.ep_id.IsIn()) {
+    ep_interrupt_in_ = config.ep_id;
+    in_packet_size_ = std::clamp(config.max_packet_size, 1, kMaxStatusChangeSize);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error HubDriver::OnEndpointsConfigured() {
+  super_speed_ = ParentDevice()->Speed() == DeviceSpeed::kSuper;
+  if (!super_speed_) {
+    return GetHubDescriptor();
+  }
+
+  // SuperSpeed ハブはルートストリングのどの段を見るかを知らされるまで転送を中継しない
+  SetupData setup_data{};
+  setup_data.request_type.bits.direction = request_type::kOut;
+  setup_data.request_type.bits.type = request_type::kClass;
+  setup_data.request_type.bits.recipient = request_type::kDevice;
+  setup_data.request = request::kSetHubDepth;
+  setup_data.value = ParentDevice()->HubDepth();
+  setup_data.index = 0;
+  setup_data.length = 0;
+
+  phase_ = Phase::kSettingHubDepth;
+  return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this);
+}
+
+Error HubDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf,
+                                    int len) {
+  Log(kTrace, "HubDriver::OnControlCompleted: request %d, value %d, index %d\n",
+      setup_data.request, setup_data.value, setup_data.index);
+
+  switch (phase_) {
+  case Phase::kSettingHubDepth:
+    return GetHubDescriptor();
+  case Phase::kGettingDescriptor:
+    return OnHubDescriptorReceived(reinterpret_cast<const uint8_t *>(buf), len);
+  case Phase::kPoweringPorts:
+    if (powering_port_ < num_ports_) {
+      ++powering_port_;
+      return SetPortFeature(kPortPower, powering_port_);
+    }
+    // 電源が安定するまでの待ち（bPwrOn2PwrGood）は取らない．
+    // 接続の検出は安定した後の Status Change で通知される．
+    phase_ = Phase::kRunning;
+    busy_ = false;
+    if (auto err = ArmStatusChange()) {
+      return err;
+    }
+    return Kick();
+  case Phase::kRunning:
+    break;
+  default:
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+
+  if (setup_data.request == request::kGetStatus) {
+    if (len < static_cast<int>(port_status_buf_.size())) {
+      return MAKE_ERROR(Error::kInvalidDescriptor);
+    }
+    const auto p = reinterpret_cast<const uint8_t *>(buf);
+    return OnPortStatusReceived(p[0] | p[1] << 8, p[2] | p[3] << 8);
+  } else if (setup_data.request == request::kClearFeature) {
+    // 変化ビットを 1 つクリアしたら，他の変化が残っていないか読み直す
+    return GetPortStatus(current_port_);
+  } else if (setup_data.request == request::kSetFeature) {
+    busy_ = false;
+    return Kick();
+  }
+  return MAKE_ERROR(Error::kInvalidPhase);
+}
+
+Error HubDriver::OnInterruptCompleted(EndpointID ep_id, const void *buf, int len) {
+  const auto bitmap = reinterpret_cast<const uint8_t *>(buf);
+  uint16_t changed = 0;
+  for (int i = 0; i < len && i < kMaxStatusChangeSize; ++i) {
+    changed |= bitmap[i] << (8 * i);
+  }
+  if (changed & 1u) {
+    // ハブ自身の過電流や外部電源の変化．ポートの管理には影響しないので記録だけする．
+    Log(kDebug, "HubDriver: hub status changed\n");
+  }
+  // ビット 0 はハブ自身を表すので除く
+  status_pending_ |= changed & ~1u & ((1u << (num_ports_ + 1)) - 1);
+
+  if (auto err = ArmStatusChange()) {
+    return err;
+  }
+  return Kick();
+}
+
+Error HubDriver::ResetPort(uint8_t port_num) {
+  if (port_num == 0 || port_num > num_ports_) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  reset_pending_ |= 1u << port_num;
+  return Kick();
+}
+
+Error HubDriver::GetHubDescriptor() {
+  SetupData setup_data{};
+  setup_data.request_type.bits.direction = request_type::kIn;
+  setup_data.request_type.bits.type = request_type::kClass;
+  setup_data.request_type.bits.recipient = request_type::kDevice;
+  setup_data.request = request::kGetDescriptor;
+  setup_data.value =
+      (super_speed_ ? descriptor_type::kSuperspeedHub : descriptor_type::kHub) << 8;
+  setup_data.index = 0;
+  setup_data.length = hub_desc_buf_.size();
+
+  phase_ = Phase::kGettingDescriptor;
+  return ParentDevice()->ControlIn(kDefaultControlPipeID, setup_data, hub_desc_buf_.data(),
+                                   hub_desc_buf_.size(), this);
+}
+
+Error HubDriver::OnHubDescriptorReceived(const uint8_t *buf, int len) {
+  // bDescLength, bDescriptorType, bNbrPorts, wHubCharacteristics, ...
+  if (len < 5) {
+    return MAKE_ERROR(Error::kInvalidDescriptor);
+  }
+  const uint16_t characteristics = buf[3] | buf[4] << 8;
+  if (buf[2] > kMaxPorts) {
+    Log(kWarn, "HubDriver: ports above %d are not used (hub has %d ports)\n", kMaxPorts,
+        buf[2]);
+  }
+  num_ports_ = std::min<uint8_t>(buf[2], kMaxPorts);
+
+  HubConfig config{};
+  config.num_ports = num_ports_;
+  config.think_time = super_speed_ ? 0 : (characteristics >> 5) & 3u;
+  // 代替設定 1 の Multi TT は選択しないので，常に Single TT として動作する
+  config.multi_tt = false;
+  Log(kInfo, "HubDriver: %d ports, think time %d\n", config.num_ports, config.think_time);
+  if (auto err = ParentDevice()->ConfigureHub(config)) {
+    return err;
+  }
+
+  if (num_ports_ == 0) {
+    phase_ = Phase::kRunning;
+    return ArmStatusChange();
+  }
+  phase_ = Phase::kPoweringPorts;
+  powering_port_ = 1;
+  busy_ = true;
+  return SetPortFeature(kPortPower, powering_port_);
+}
+
+Error HubDriver::OnPortStatusReceived(uint16_t status, uint16_t change) {
+  const uint8_t port_num = current_port_;
+  const uint16_t port_bit = 1u << port_num;
+  const uint16_t known_changes = (1u << kChangeFeatures.size()) - 1;
+
+  if (change & known_changes) {
+    const int bit = LowestBit(change & known_changes);
+    cleared_changes_ |= 1u << bit;
+    return ClearPortFeature(kChangeFeatures[bit], port_num);
+  }
+
+  // このポートの変化を全てクリアした．状態に応じてホストコントローラに通知する．
+  const uint16_t changes = cleared_changes_;
+  cleared_changes_ = 0;
+  status_pending_ &= ~port_bit;
+  busy_ = false;
+
+  Error err = MAKE_ERROR(Error::kSuccess);
+  if ((changes & (kPortChangeReset | kPortChangeBHReset)) && (resetting_ & port_bit)) {
+    resetting_ &= ~port_bit;
+    if ((status & kPortStatusConnection) && (status & kPortStatusEnable)) {
+      DeviceSpeed speed = DeviceSpeed::kFull;
+      if (super_speed_) {
+        speed = DeviceSpeed::kSuper;
+      } else if (status & kPortStatusLowSpeed) {
+        speed = DeviceSpeed::kLow;
+      } else if (status & kPortStatusHighSpeed) {
+        speed = DeviceSpeed::kHigh;
+      }
+      err = ParentDevice()->OnHubPortReset(port_num, speed);
+    } else {
+      Log(kWarn, "HubDriver: port %d was not enabled by reset\n", port_num);
+      err = ParentDevice()->OnHubPortDisconnected(port_num);
+    }
+  } else if (changes & kPortChangeConnection) {
+    if (status & kPortStatusConnection) {
+      err = ParentDevice()->OnHubPortConnected(port_num);
+    } else {
+      resetting_ &= ~port_bit;
+      err = ParentDevice()->OnHubPortDisconnected(port_num);
+    }
+  }
+
+  // 通知の中から ResetPort が呼ばれて次の要求を発行済みのこともある
+  if (auto kick_err = Kick()) {
+    return kick_err;
+  }
+  return err;
+}
+
+Error HubDriver::SetPortFeature(uint16_t feature, uint8_t port_num) {
+  SetupData setup_data{};
+  setup_data.request_type.bits.direction = request_type::kOut;
+  setup_data.request_type.bits.type = request_type::kClass;
+  setup_data.request_type.bits.recipient = request_type::kOther;
+  setup_data.request = request::kSetFeature;
+  setup_data.value = feature;
+  setup_data.index = port_num;
+  setup_data.length = 0;
+  return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this);
+}
+
+Error HubDriver::ClearPortFeature(uint16_t feature, uint8_t port_num) {
+  SetupData setup_data{};
+  setup_data.request_type.bits.direction = request_type::kOut;
+  setup_data.request_type.bits.type = request_type::kClass;
+  setup_data.request_type.bits.recipient = request_type::kOther;
+  setup_data.request = request::kClearFeature;
+  setup_data.value = feature;
+  setup_data.index = port_num;
+  setup_data.length = 0;
+  return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this);
+}
+
+Error HubDriver::GetPortStatus(uint8_t port_num) {
+  SetupData setup_data{};
+  setup_data.request_type.bits.direction = request_type::kIn;
+  setup_data.request_type.bits.type = request_type::kClass;
+  setup_data.request_type.bits.recipient = request_type::kOther;
+  setup_data.request = request::kGetStatus;
+  setup_data.value = 0;
+  setup_data.index = port_num;
+  setup_data.length = port_status_buf_.size();
+  return ParentDevice()->ControlIn(kDefaultControlPipeID, setup_data, port_status_buf_.data(),
+                                   port_status_buf_.size(), this);
+}
+
+Error HubDriver::ArmStatusChange() {
+  return ParentDevice()->InterruptIn(ep_interrupt_in_, status_change_buf_.data(),
+                                     in_packet_size_);
+}
+
+Error HubDriver::Kick() {
+  if (busy_ || phase_ != Phase::kRunning) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  // リセットはホストコントローラがアドレスの割り当てを待っているので先に行う
+  if (reset_pending_) {
+    const uint8_t port_num = LowestBit(reset_pending_);
+    reset_pending_ &= ~(1u << port_num);
+    resetting_ |= 1u << port_num;
+    busy_ = true;
+    return SetPortFeature(kPortReset, port_num);
+  }
+  if (status_pending_) {
+    current_port_ = LowestBit(status_pending_);
+    cleared_changes_ = 0;
+    busy_ = true;
+    return GetPortStatus(current_port_);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+} // namespace usb
@@ -0,0 +1,95 @@
+/**
+ * @file usb/classdriver/hub.hpp
+ *
+ * Hub class driver.
+ */
+
+#pragma once
+
+#include "usb/classdriver/base.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace usb {
+/** @brief USB ハブのクラスドライバ．
+ *
+ * Status Change エンドポイントで変化のあったポートの状態を読み，変化ビットを
+ * 1 つずつクリアしてから，接続・切断・リセット完了を Device 経由でホストコントローラに伝える．
+ * ハブへの制御要求は 1 つずつ順に発行する．
+ */
+class HubDriver : public ClassDriver {
+public:
+  static const uint8_t kInterfaceClass = 9;
+  /** @brief 扱えるポート番号の最大値．ルートストリングの 1 段は 4 ビットしかない． */
+  static const int kMaxPorts = 15;
+
+  HubDriver(Device *dev, int interface_index);
+
+  void *operator new(size_t size);
+  void operator delete(void *ptr) noexcept;
+
+  Error Initialize() override;
+  Error SetEndpoint(const EndpointConfig &config) override;
+  Error OnEndpointsConfigured() override;
+  Error OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf,
+                           int len) override;
+  Error OnInterruptCompleted(EndpointID ep_id, const void *buf, int len) override;
+
+  /** @brief ダウンストリームポートをリセットする．
+   *
+   * リセットからアドレスの割り当てまではバス全体で 1 ポートずつ行う必要があるので，
+   * ホストコントローラが順番を決めて呼び出す．完了は Device::OnHubPortReset で通知する．
+   */
+  Error ResetPort(uint8_t port_num);
+
+  uint8_t NumPorts() const { return num_ports_; }
+
+private:
+  enum class Phase {
+    kNotConfigured,
+    kSettingHubDepth,
+    kGettingDescriptor,
+    kPoweringPorts,
+    kRunning,
+  };
+
+  /** @brief Status Change ビットマップの最大長（ハブ自身とポート 1 - 15 の 16 ビット） */
+  static const int kMaxStatusChangeSize = 2;
+
+  const int interface_index_;
+  EndpointID ep_interrupt_in_;
+  int in_packet_size_{1};
+  Phase phase_{Phase::kNotConfigured};
+  bool super_speed_{false};
+  uint8_t num_ports_{0};
+
+  /** 制御要求を発行中なら true */
+  bool busy_{false};
+  /** 電源を入れている最中のポート */
+  uint8_t powering_port_{0};
+  /** 以下のビットマップはビット n がポート n を表す */
+  uint16_t status_pending_{0};
+  uint16_t reset_pending_{0};
+  uint16_t resetting_{0};
+  /** 状態を読んでいるポートと，そのポートでこれまでにクリアした変化ビット */
+  uint8_t current_port_{0};
+  uint16_t cleared_changes_{0};
+
+  std::array<uint8_t, 16> hub_desc_buf_{};
+  /** wPortStatus と wPortChange */
+  std::array<uint8_t, 4> port_status_buf_{};
+  std::array<uint8_t, kMaxStatusChangeSize> status_change_buf_{};
+
+  Error GetHubDescriptor();
+  Error OnHubDescriptorReceived(const uint8_t *buf, int len);
+  Error OnPortStatusReceived(uint16_t status, uint16_t change);
+  Error SetPortFeature(uint16_t feature, uint8_t port_num);
+  Error ClearPortFeature(uint16_t feature, uint8_t port_num);
+  Error GetPortStatus(uint8_t port_num);
+  Error ArmStatusChange();
+  /** @brief 待っている制御要求があれば 1 つ発行する． */
+  Error Kick();
+};
+} // namespace usb
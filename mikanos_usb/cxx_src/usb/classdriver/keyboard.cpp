@@ -1,27 +1,123 @@
 #include "usb/classdriver/keyboard.hpp"
 
+#include "logger.hpp"
 #include "usb/device.hpp"
+#include "usb/input_queue.hpp"
 #include "usb/memory.hpp"
 
 #include <algorithm>
 
+namespace {
+using usb::HIDKeyboardDriver;
+
+// Keyboard/Keypad usage page のキーコード
+const uint8_t kErrorRollOver = 0x01;
+/** これより小さいキーコードはキーではなくエラー等を表す */
+const int kFirstKeycode = 0x04;
+const int kLeftControl = 0xe0;
+
+void SetKey(HIDKeyboardDriver::KeyBitmap &keys, int keycode) {
+  if (kFirstKeycode <= keycode && keycode <= 0xff) {
+    keys[keycode / 64] |= uint64_t{1} << (keycode % 64);
+  }
+}
+
+/** モディファイアキー（0xe0 - 0xe7）の状態をブートレポートの先頭バイトと同じ形で取り出す */
+uint8_t Modifier(const HIDKeyboardDriver::KeyBitmap &keys) {
+  return keys[kLeftControl / 64] >> (kLeftControl % 64);
+}
+} // namespace
+
 namespace usb {
 HIDKeyboardDriver::HIDKeyboardDriver(Device *dev, int interface_index)
     : HIDBaseDriver{dev, interface_index, 8} {}
 
+bool HIDKeyboardDriver::OnReportDescriptorReceived(const uint8_t *desc, int len) {
+  if (auto err = hid::ParseKeyboardReportDescriptor(desc, len, layout_)) {
+    Log(kInfo, "keyboard: report descriptor not usable (%s), using boot protocol\n", err.Name());
+    return false;
+  }
+  // ブートレポートと同じ 6 キーロールオーバーなら，実績のあるブートプロトコルを使う
+  if (!layout_.HasKeyBitmap()) {
+    return false;
+  }
+  if (!SetInPacketSize(layout_.report_bytes)) {
+    Log(kInfo, "keyboard: report (%d bytes) does not fit in a packet, using boot protocol\n",
+        layout_.report_bytes);
+    SetInPacketSize(8);
+    return false;
+  }
+  use_report_protocol_ = true;
+  return true;
+}
+
 Error HIDKeyboardDriver::OnDataReceived() {
+  const uint8_t *report = Buffer();
+  if (use_report_protocol_ && layout_.report_id != 0 && report[0] != layout_.report_id) {
+    return MAKE_ERROR(Error::kSuccess); // 関心のないレポート
+  }
+
+  KeyBitmap keys{};
+  const bool valid = use_report_protocol_ ? DecodeReport(report, keys)
+                                          : DecodeBootReport(report, keys);
+  if (!valid) {
+    // 押されているキーが多すぎて判別できない．前の状態を保つ．
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  // 離されたキーを先に通知する．押下と解放の判定はワード単位の XOR で済ませる．
+  const uint8_t modifier = Modifier(keys);
+  for (int pressed = 0; pressed <= 1; ++pressed) {
+    for (size_t w = 0; w < keys.size(); ++w) {
+      uint64_t changed = (pressed_keys_[w] ^ keys[w]) & (pressed ? keys[w] : pressed_keys_[w]);
+      while (changed != 0) {
+        const int bit = __builtin_ctzll(changed);
+        changed &= changed - 1;
+        NotifyKeyEvent(modifier, w * 64 + bit, pressed);
+      }
+    }
+  }
+  pressed_keys_ = keys;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+bool HIDKeyboardDriver::DecodeBootReport(const uint8_t *report, KeyBitmap &keys) const {
   for (int i = 2; i < 8; ++i) {
-    const uint8_t key = Buffer()[i];
-    if (key == 0) {
-      continue;
+    if (report[i] == kErrorRollOver) {
+      return false;
     }
-    const auto &prev_buf = PreviousBuffer();
-    if (std::find(prev_buf.begin() + 2, prev_buf.end(), key) != prev_buf.end()) {
+    SetKey(keys, report[i]);
+  }
+  keys[kLeftControl / 64] |= uint64_t{report[0]} << (kLeftControl % 64);
+  return true;
+}
+
+bool HIDKeyboardDriver::DecodeReport(const uint8_t *report, KeyBitmap &keys) const {
+  for (int i = 0; i < layout_.num_fields; ++i) {
+    const auto &field = layout_.fields[i];
+    if (field.is_array) {
+      for (int j = 0; j < field.count; ++j) {
+        const int value = report[field.bit_offset / 8 + j];
+        if (field.usage_base + value == kErrorRollOver) {
+          return false;
+        }
+        SetKey(keys, field.usage_base + value);
+      }
       continue;
     }
-    NotifyKeyPush(Buffer()[0], key);
+    // ビットマップは 32 ビットずつ取り出し，立っているビットだけをたどる
+    for (int j = 0; j < field.count; j += 32) {
+      const hid::Field bits_field{hid::FieldKind::kButtons, false,
+                                  static_cast<uint8_t>(std::min(field.count - j, 32)),
+                                  static_cast<uint16_t>(field.bit_offset + j)};
+      uint32_t bits = hid::ReportLayout::Extract(report, bits_field);
+      while (bits != 0) {
+        SetKey(keys, field.usage_base + j + __builtin_ctz(bits));
+        bits &= bits - 1;
+      }
+    }
   }
-  return MAKE_ERROR(Error::kSuccess);
+  return true;
 }
 
 void *HIDKeyboardDriver::operator new(size_t size) {
@@ -30,15 +126,19 @@ void *HIDKeyboardDriver::operator new(size_t size) {
 
 void HIDKeyboardDriver::operator delete(void *ptr) noexcept { FreeMem(ptr); }
 
-void HIDKeyboardDriver::SubscribeKeyPush(std::function<ObserverType> observer) {
+void HIDKeyboardDriver::SubscribeKeyEvent(std::function<ObserverType> observer) {
   observers_[num_observers_++] = observer;
 }
 
-std::function<HIDKeyboardDriver::ObserverType> HIDKeyboardDriver::default_observer;
+void HIDKeyboardDriver::NotifyKeyEvent(uint8_t modifier, uint8_t keycode, bool pressed) {
+  InputRecord record{};
+  record.buttons = modifier;
+  record.keycode = keycode;
+  record.released = !pressed;
+  PublishInput(InputQueueID::kKeyboard, record);
 
-void HIDKeyboardDriver::NotifyKeyPush(uint8_t modifier, uint8_t keycode) {
   for (int i = 0; i < num_observers_; ++i) {
-    observers_[i](modifier, keycode);
+    observers_[i](modifier, keycode, pressed);
   }
 }
 } // namespace usb
@@ -7,7 +7,9 @@
 #pragma once
 
 #include "usb/classdriver/hid.hpp"
+#include "usb/classdriver/hid_report.hpp"
 
+#include <array>
 #include <functional>
 
 namespace usb {
@@ -20,14 +22,34 @@ public:
 
   Error OnDataReceived() override;
 
-  using ObserverType = void(uint8_t modifier, uint8_t keycode);
-  void SubscribeKeyPush(std::function<ObserverType> observer);
-  static std::function<ObserverType> default_observer;
+  /** @brief キーが押された（pressed），または離されたときに呼ばれる．
+   *
+   * modifier はイベント後のモディファイアキーの状態．モディファイアキー自身の変化も
+   * キーコード 0xe0 - 0xe7 のイベントとして通知される．
+   */
+  using ObserverType = void(uint8_t modifier, uint8_t keycode, bool pressed);
+  void SubscribeKeyEvent(std::function<ObserverType> observer);
+
+  /** @brief 1 ビット 1 キーコードで表した，押されているキーの集合 */
+  using KeyBitmap = std::array<uint64_t, 4>;
+
+protected:
+  bool WantsReportProtocol() const override { return true; }
+  bool OnReportDescriptorReceived(const uint8_t *desc, int len) override;
 
 private:
   std::array<std::function<ObserverType>, 4> observers_;
   int num_observers_ = 0;
 
-  void NotifyKeyPush(uint8_t modifier, uint8_t keycode);
+  /** N キーロールオーバーのため Report プロトコルで受信している場合のレポートの形式 */
+  hid::KeyboardLayout layout_{};
+  bool use_report_protocol_{false};
+  /** 前のレポートで押されていたキー */
+  KeyBitmap pressed_keys_{};
+
+  /** @brief レポートから押されているキーの集合を作る．ロールオーバーエラーなら false． */
+  bool DecodeBootReport(const uint8_t *report, KeyBitmap &keys) const;
+  bool DecodeReport(const uint8_t *report, KeyBitmap &keys) const;
+  void NotifyKeyEvent(uint8_t modifier, uint8_t keycode, bool pressed);
 };
 } // namespace usb
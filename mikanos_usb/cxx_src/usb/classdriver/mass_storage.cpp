@@ -0,0 +1,416 @@
+#include "usb/classdriver/mass_storage.hpp"
+
+#include "logger.hpp"
+#include "usb/classdriver/scsi.hpp"
+#include "usb/device.hpp"
+#include "usb/memory.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+using namespace usb::scsi;
+
+/** READ CAPACITY に失敗した（UNIT ATTENTION 等）場合に再試行する回数 */
+const int kMaxRetries = 5;
+
+/** CSW の bCSWStatus */
+const uint8_t kStatusPhaseError = 2;
+/** Bulk-Only Mass Storage Reset（クラス固有要求） */
+const int kBulkOnlyMassStorageReset = 0xff;
+/** ENDPOINT_HALT（標準の機能選択子） */
+const int kEndpointHalt = 0;
+/** Stall Error の完了コード */
+const int kStallError = 6;
+} // namespace
+
+namespace usb {
+MassStorageDriver::MassStorageDriver(Device *dev, int interface_index)
+    : BlockStorageDriver{dev}, interface_index_{interface_index} {}
+
+MassStorageDriver::~MassStorageDriver() { FreeMem(read_ahead_buf_); }
+
+void *MassStorageDriver::operator new(size_t size) {
+  return AllocMem(sizeof(MassStorageDriver), 64, 0);
+}
+
+void MassStorageDriver::operator delete(void *ptr) noexcept { FreeMem(ptr); }
+
+Error MassStorageDriver::Initialize() { return MAKE_ERROR(Error::kSuccess); }
+
+Error MassStorageDriver::SetEndpoint(const EndpointConfig &config) {
+  if (config.ep_type == EndpointType::kBulk && config.ep_id.IsIn()) {
+    ep_bulk_in_ = config.ep_id;
+  } else if (config.ep_type == EndpointType::kBulk && !config.ep_id.IsIn()) {
+    ep_bulk_out_ = config.ep_id;
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error MassStorageDriver::OnEndpointsConfigured() {
+  Log(kDebug, "MassStorageDriver: bulk in %d, bulk out %d, interface %d\n",
+      ep_bulk_in_.Address(), ep_bulk_out_.Address(), interface_index_);
+
+  phase_ = Phase::kInquiry;
+  const uint8_t cb[6] = {scsi::kInquiry, 0, 0, 0, kInquiryLength, 0};
+  return SubmitCommand(cb, sizeof(cb), response_.data(), kInquiryLength, true);
+}
+
+Error MassStorageDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                                            const void *buf, int len) {
+  switch (stage_) {
+  case Stage::kClearingHalt:
+    stage_ = Stage::kStatus;
+    return ParentDevice()->BulkIn(ep_bulk_in_, &csw_, sizeof(csw_));
+  case Stage::kResetting:
+    stage_ = Stage::kClearingInHalt;
+    return ClearEndpointHalt(ep_bulk_in_);
+  case Stage::kClearingInHalt:
+    stage_ = Stage::kClearingOutHalt;
+    return ClearEndpointHalt(ep_bulk_out_);
+  case Stage::kClearingOutHalt:
+    stage_ = Stage::kIdle;
+    return OnCommandCompleted(kStatusPhaseError, 0);
+  default:
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+}
+
+Error MassStorageDriver::OnControlFailed(EndpointID ep_id, int completion_code) {
+  Log(kError, "MassStorageDriver: recovery request failed: completion code %d\n",
+      completion_code);
+  switch (stage_) {
+  case Stage::kClearingHalt:
+    return StartResetRecovery();
+  case Stage::kResetting:
+  case Stage::kClearingInHalt:
+  case Stage::kClearingOutHalt:
+    // 回復できなかった．実行中のコマンドだけは失敗として返す．
+    stage_ = Stage::kIdle;
+    return OnCommandCompleted(kStatusPhaseError, 0);
+  default:
+    return MAKE_ERROR(Error::kTransferFailed);
+  }
+}
+
+Error MassStorageDriver::OnInterruptCompleted(EndpointID ep_id, const void *buf, int len) {
+  return MAKE_ERROR(Error::kNotImplemented);
+}
+
+Error MassStorageDriver::OnBulkCompleted(EndpointID ep_id, const void *buf, int len) {
+  switch (stage_) {
+  case Stage::kCommand:
+    if (data_len_ > 0) {
+      stage_ = Stage::kData;
+      return data_in_ ? ParentDevice()->BulkIn(ep_bulk_in_, data_buf_, data_len_)
+                      : ParentDevice()->BulkOut(ep_bulk_out_, data_buf_, data_len_);
+    }
+    stage_ = Stage::kStatus;
+    return ParentDevice()->BulkIn(ep_bulk_in_, &csw_, sizeof(csw_));
+  case Stage::kData:
+    stage_ = Stage::kStatus;
+    return ParentDevice()->BulkIn(ep_bulk_in_, &csw_, sizeof(csw_));
+  case Stage::kStatus:
+    if (len != sizeof(csw_) || csw_.signature != CommandStatusWrapper::kSignature ||
+        csw_.tag != cbw_.tag) {
+      Log(kError, "MassStorageDriver: invalid CSW (len %d, signature %08x, tag %u)\n", len,
+          csw_.signature, csw_.tag);
+      return StartResetRecovery();
+    }
+    if (csw_.status == kStatusPhaseError) {
+      Log(kError, "MassStorageDriver: phase error (tag %u)\n", csw_.tag);
+      return StartResetRecovery();
+    }
+    stage_ = Stage::kIdle;
+    return OnCommandCompleted(csw_.status, csw_.data_residue);
+  default:
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+}
+
+Error MassStorageDriver::OnBulkFailed(EndpointID ep_id, const void *buf, int completion_code) {
+  Log(kWarn, "MassStorageDriver: bulk transfer on ep addr %d failed in stage %d: code %d\n",
+      ep_id.Address(), static_cast<int>(stage_), completion_code);
+  switch (stage_) {
+  case Stage::kData:
+    if (completion_code == kStallError) {
+      // デバイスがデータステージを打ち切った．Halt を解除すれば CSW を返してくれる．
+      stage_ = Stage::kClearingHalt;
+      return ClearEndpointHalt(ep_id);
+    }
+    return StartResetRecovery();
+  case Stage::kStatus:
+    if (completion_code == kStallError && !status_retried_) {
+      status_retried_ = true;
+      stage_ = Stage::kClearingHalt;
+      return ClearEndpointHalt(ep_bulk_in_);
+    }
+    return StartResetRecovery();
+  case Stage::kCommand:
+    // CBW を受け付けない（Stall）デバイスは Reset Recovery で元に戻す
+    return StartResetRecovery();
+  default:
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+}
+
+Error MassStorageDriver::ClearEndpointHalt(EndpointID ep_id) {
+  SetupData setup_data{};
+  setup_data.request_type.bits.direction = request_type::kOut;
+  setup_data.request_type.bits.type = request_type::kStandard;
+  setup_data.request_type.bits.recipient = request_type::kEndpoint;
+  setup_data.request = request::kClearFeature;
+  setup_data.value = kEndpointHalt;
+  // wIndex はエンドポイントアドレス（bit 7 が方向）
+  setup_data.index = ep_id.Number() | (ep_id.IsIn() ? 0x80 : 0x00);
+  setup_data.length = 0;
+  return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this);
+}
+
+Error MassStorageDriver::StartResetRecovery() {
+  Log(kWarn, "MassStorageDriver: reset recovery (tag %u)\n", cbw_.tag);
+  SetupData setup_data{};
+  setup_data.request_type.bits.direction = request_type::kOut;
+  setup_data.request_type.bits.type = request_type::kClass;
+  setup_data.request_type.bits.recipient = request_type::kInterface;
+  setup_data.request = kBulkOnlyMassStorageReset;
+  setup_data.value = 0;
+  setup_data.index = interface_index_;
+  setup_data.length = 0;
+
+  stage_ = Stage::kResetting;
+  if (auto err =
+          ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this)) {
+    stage_ = Stage::kIdle;
+    if (auto complete_err = OnCommandCompleted(kStatusPhaseError, 0)) {
+      Log(kWarn, "MassStorageDriver: failed to complete command: %s\n", complete_err.Name());
+    }
+    return err;
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error MassStorageDriver::Read(uint64_t lba, uint32_t num_blocks, void *buf,
+                              CompletionCallback callback, void *context) {
+  if (!IsReady()) {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  if (!InRange(lba, num_blocks)) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+
+  // 書き込みが列にあれば，先読みした内容はその書き込みの前のものかもしれない．
+  // 書き込みを追い越さないよう，列に並ばせる．
+  if (num_queued_writes_ == 0 && ReadFromCache(lba, num_blocks, buf)) {
+    callback(context, Error::kSuccess);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  BlockRequest request{};
+  request.write = false;
+  request.lba = lba;
+  request.num_blocks = num_blocks;
+  request.buf = reinterpret_cast<uint8_t *>(buf);
+  request.callback = callback;
+  request.context = context;
+  // 小さい読み込みは後続の読み込みの分まで先読みバッファにまとめて読む
+  request.via_read_ahead = read_ahead_buf_ != nullptr &&
+                           static_cast<uint64_t>(num_blocks) * block_size_ < kReadAheadBytes;
+  return Enqueue(request);
+}
+
+Error MassStorageDriver::Write(uint64_t lba, uint32_t num_blocks, const void *buf,
+                               CompletionCallback callback, void *context) {
+  if (!IsReady()) {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  if (!InRange(lba, num_blocks)) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+
+  BlockRequest request{};
+  request.write = true;
+  request.lba = lba;
+  request.num_blocks = num_blocks;
+  request.buf = reinterpret_cast<uint8_t *>(const_cast<void *>(buf));
+  request.callback = callback;
+  request.context = context;
+  if (num_requests_ == requests_.size()) {
+    return MAKE_ERROR(Error::kRingFull);
+  }
+  // 以降の読み込みが書き込み前の内容を返さないようにする
+  cache_blocks_ = 0;
+  ++num_queued_writes_;
+  return Enqueue(request);
+}
+
+Error MassStorageDriver::SubmitCommand(const uint8_t *cb, uint8_t cb_length, void *buf,
+                                       uint32_t len, bool dir_in) {
+  cbw_ = CommandBlockWrapper{};
+  cbw_.signature = CommandBlockWrapper::kSignature;
+  cbw_.tag = next_tag_++;
+  cbw_.data_transfer_length = len;
+  cbw_.flags = dir_in ? 0x80 : 0x00;
+  cbw_.lun = 0;
+  cbw_.cb_length = cb_length;
+  memcpy(cbw_.cb, cb, cb_length);
+
+  data_buf_ = buf;
+  data_len_ = len;
+  data_in_ = dir_in;
+  status_retried_ = false;
+
+  stage_ = Stage::kCommand;
+  if (auto err = ParentDevice()->BulkOut(ep_bulk_out_, &cbw_, sizeof(cbw_))) {
+    stage_ = Stage::kIdle;
+    return err;
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error MassStorageDriver::OnCommandCompleted(uint8_t status, uint32_t residue) {
+  switch (phase_) {
+  case Phase::kInquiry: {
+    // INQUIRY の結果は使わない（失敗しても容量の取得を試みる）
+    phase_ = Phase::kReadCapacity;
+    const uint8_t cb[10] = {scsi::kReadCapacity10};
+    return SubmitCommand(cb, sizeof(cb), response_.data(), kReadCapacity10Length, true);
+  }
+  case Phase::kReadCapacity:
+    if (status != 0) {
+      if (++retry_count_ > kMaxRetries) {
+        Log(kError, "MassStorageDriver: READ CAPACITY failed (status %d)\n", status);
+        return MAKE_ERROR(Error::kTransferFailed);
+      }
+      // UNIT ATTENTION などを REQUEST SENSE で読み捨ててから再試行する
+      const uint8_t cb[6] = {scsi::kRequestSense, 0, 0, 0, kRequestSenseLength, 0};
+      // REQUEST SENSE が完了したら，INQUIRY の完了時と同じく READ CAPACITY を発行する
+      phase_ = Phase::kInquiry;
+      return SubmitCommand(cb, sizeof(cb), response_.data(), kRequestSenseLength, true);
+    }
+
+    num_blocks_ = static_cast<uint64_t>(ReadBE32(&response_[0])) + 1;
+    block_size_ = ReadBE32(&response_[4]);
+    if (block_size_ == 0) {
+      return MAKE_ERROR(Error::kInvalidDescriptor);
+    }
+    if (block_size_ <= kReadAheadBytes) {
+      read_ahead_buf_ = reinterpret_cast<uint8_t *>(AllocMem(kReadAheadBytes, 64, 0));
+    }
+    phase_ = Phase::kReady;
+    Log(kInfo, "MassStorageDriver: %lu blocks of %u bytes\n", num_blocks_, block_size_);
+
+    NotifyReady();
+    if (num_requests_ > 0 && stage_ == Stage::kIdle) {
+      return StartRequest();
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  case Phase::kReady:
+    break;
+  default:
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+
+  if (num_requests_ == 0) {
+    return MAKE_ERROR(Error::kNoWaiter);
+  }
+  if (status != 0) {
+    Log(kError, "MassStorageDriver: command failed (status %d, residue %u)\n", status, residue);
+    return CompleteRequest(Error::kTransferFailed);
+  }
+
+  auto &request = requests_[request_head_];
+  const uint32_t transferred_blocks = (data_len_ - std::min(residue, data_len_)) / block_size_;
+  if (request.write) {
+    // 書き込み前に先読みした内容が残っているかもしれない
+    cache_blocks_ = 0;
+  }
+
+  if (request.via_read_ahead) {
+    cache_lba_ = request.lba;
+    cache_blocks_ = transferred_blocks;
+    const bool ok = ReadFromCache(request.lba, request.num_blocks, request.buf);
+    if (num_queued_writes_ > 0) {
+      // 後ろに並んでいる書き込みで古くなる内容なので，この要求に渡すだけにする
+      cache_blocks_ = 0;
+    }
+    return CompleteRequest(ok ? Error::kSuccess : Error::kTransferFailed);
+  }
+
+  if (transferred_blocks == 0) {
+    return CompleteRequest(Error::kTransferFailed);
+  }
+  request.done_blocks += transferred_blocks;
+  if (request.done_blocks < request.num_blocks) {
+    return StartRequest();
+  }
+  return CompleteRequest(Error::kSuccess);
+}
+
+Error MassStorageDriver::Enqueue(const BlockRequest &request) {
+  if (num_requests_ == requests_.size()) {
+    return MAKE_ERROR(Error::kRingFull);
+  }
+  requests_[(request_head_ + num_requests_) % requests_.size()] = request;
+  ++num_requests_;
+
+  if (stage_ == Stage::kIdle) {
+    return StartRequest();
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error MassStorageDriver::StartRequest() {
+  const auto &request = requests_[request_head_];
+
+  uint64_t lba;
+  uint32_t num_blocks;
+  uint8_t *buf;
+  if (request.via_read_ahead) {
+    lba = request.lba;
+    num_blocks = std::min<uint64_t>(kReadAheadBytes / block_size_, num_blocks_ - lba);
+    buf = read_ahead_buf_;
+  } else {
+    const uint32_t max_blocks = std::max<uint32_t>(kMaxTransferBytes / block_size_, 1);
+    lba = request.lba + request.done_blocks;
+    num_blocks = std::min(request.num_blocks - request.done_blocks, max_blocks);
+    buf = request.buf + static_cast<size_t>(request.done_blocks) * block_size_;
+  }
+
+  uint8_t cb[16] = {};
+  const uint8_t cb_length = MakeReadWriteCommand(cb, request.write, lba, num_blocks);
+
+  if (auto err = SubmitCommand(cb, cb_length, buf, num_blocks * block_size_, !request.write)) {
+    Log(kError, "MassStorageDriver: failed to submit command: %s at %s:%d\n", err.Name(),
+        err.File(), err.Line());
+    return CompleteRequest(err.Cause());
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error MassStorageDriver::CompleteRequest(Error::Code code) {
+  const auto request = requests_[request_head_];
+  request_head_ = (request_head_ + 1) % requests_.size();
+  --num_requests_;
+  if (request.write) {
+    --num_queued_writes_;
+  }
+
+  // callback の中から次の要求が発行されることもある
+  request.callback(request.context, code);
+
+  if (num_requests_ > 0 && stage_ == Stage::kIdle) {
+    return StartRequest();
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+bool MassStorageDriver::ReadFromCache(uint64_t lba, uint32_t num_blocks, void *buf) const {
+  if (cache_blocks_ == 0 || lba < cache_lba_ || cache_lba_ + cache_blocks_ < lba + num_blocks) {
+    return false;
+  }
+  memcpy(buf, read_ahead_buf_ + (lba - cache_lba_) * block_size_,
+         static_cast<size_t>(num_blocks) * block_size_);
+  return true;
+}
+} // namespace usb
@@ -0,0 +1,149 @@
+/**
+ * @file usb/classdriver/mass_storage.hpp
+ *
+ * USB Mass Storage (Bulk-Only Transport, SCSI transparent command set) class driver.
+ */
+
+#pragma once
+
+#include "usb/classdriver/block_storage.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace usb {
+class MassStorageDriver : public BlockStorageDriver {
+public:
+  /** @brief 1 つの SCSI コマンドで転送する最大バイト数 */
+  const static uint32_t kMaxTransferBytes = 128 * 1024;
+  /** @brief 先読みバッファの大きさ．これより小さい読み込みは先読みバッファを経由する． */
+  const static uint32_t kReadAheadBytes = 16 * 1024;
+  /** @brief 同時に受け付けられるブロック I/O 要求の数 */
+  const static size_t kMaxPendingRequests = 8;
+
+  MassStorageDriver(Device *dev, int interface_index);
+  ~MassStorageDriver() override;
+
+  void *operator new(size_t size);
+  void operator delete(void *ptr) noexcept;
+
+  Error Initialize() override;
+  Error SetEndpoint(const EndpointConfig &config) override;
+  Error OnEndpointsConfigured() override;
+  Error OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf,
+                           int len) override;
+  Error OnInterruptCompleted(EndpointID ep_id, const void *buf, int len) override;
+  Error OnBulkCompleted(EndpointID ep_id, const void *buf, int len) override;
+  Error OnControlFailed(EndpointID ep_id, int completion_code) override;
+  /** @brief Bulk-Only Transport のエラー回復を行う．
+   *
+   * データステージの Stall は Halt を解除してから CSW を読む．CSW の Stall は 1 度だけ
+   * 読み直す．それ以外の失敗と Phase Error は Reset Recovery（Bulk-Only Mass Storage Reset
+   * と両エンドポイントの Halt の解除）を行い，実行中の要求を失敗させる．
+   */
+  Error OnBulkFailed(EndpointID ep_id, const void *buf, int completion_code) override;
+
+  bool IsReady() const override { return phase_ == Phase::kReady; }
+  /** @brief 先読みバッファに載っていれば，この関数の中で callback が呼ばれる． */
+  Error Read(uint64_t lba, uint32_t num_blocks, void *buf, CompletionCallback callback,
+             void *context) override;
+  Error Write(uint64_t lba, uint32_t num_blocks, const void *buf, CompletionCallback callback,
+              void *context) override;
+
+  /** Command Block Wrapper */
+  struct CommandBlockWrapper {
+    static const uint32_t kSignature = 0x43425355;
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t data_transfer_length;
+    uint8_t flags;
+    uint8_t lun;
+    uint8_t cb_length;
+    uint8_t cb[16];
+  } __attribute__((packed));
+
+  /** Command Status Wrapper */
+  struct CommandStatusWrapper {
+    static const uint32_t kSignature = 0x53425355;
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t data_residue;
+    uint8_t status;
+  } __attribute__((packed));
+
+private:
+  /** デバイスの初期化段階 */
+  enum class Phase { kNotConfigured, kInquiry, kReadCapacity, kReady };
+  /** 1 つの SCSI コマンドの Bulk-Only Transport 上での進行段階 */
+  enum class Stage {
+    kIdle,
+    kCommand,
+    kData,
+    kStatus,
+    /** Stall したエンドポイントの Halt を解除してから CSW を読む */
+    kClearingHalt,
+    /** Reset Recovery: Bulk-Only Mass Storage Reset，Bulk IN と Bulk OUT の Halt の解除 */
+    kResetting,
+    kClearingInHalt,
+    kClearingOutHalt,
+  };
+
+  struct BlockRequest {
+    bool write;
+    uint64_t lba;
+    uint32_t num_blocks;
+    uint8_t *buf;
+    CompletionCallback callback;
+    void *context;
+    /** 転送済みのブロック数 */
+    uint32_t done_blocks;
+    /** buf の代わりに先読みバッファへ読み込み，完了後にコピーする */
+    bool via_read_ahead;
+  };
+
+  const int interface_index_;
+  EndpointID ep_bulk_in_;
+  EndpointID ep_bulk_out_;
+
+  Phase phase_{Phase::kNotConfigured};
+  Stage stage_{Stage::kIdle};
+  int retry_count_{0};
+  /** 実行中のコマンドで CSW の読み直しを済ませたか */
+  bool status_retried_{false};
+
+  // ホストコントローラが直接読み書きする領域．ドライバごとメモリプールから確保される．
+  alignas(64) CommandBlockWrapper cbw_{};
+  alignas(64) CommandStatusWrapper csw_{};
+  alignas(64) std::array<uint8_t, 36> response_{};
+  uint32_t next_tag_{1};
+  /** 実行中のコマンドのデータステージ */
+  void *data_buf_{nullptr};
+  uint32_t data_len_{0};
+  bool data_in_{false};
+
+  /** 先読みバッファ．cache_blocks_ == 0 なら無効． */
+  uint8_t *read_ahead_buf_{nullptr};
+  uint64_t cache_lba_{0};
+  uint32_t cache_blocks_{0};
+
+  /** 受け付けたブロック I/O 要求の FIFO．先頭が実行中の要求． */
+  std::array<BlockRequest, kMaxPendingRequests> requests_{};
+  size_t request_head_{0};
+  size_t num_requests_{0};
+  /** requests_ のうち書き込みの数．0 でなければ先読みバッファを使わない． */
+  size_t num_queued_writes_{0};
+
+  Error SubmitCommand(const uint8_t *cb, uint8_t cb_length, void *buf, uint32_t len, bool dir_in);
+  Error OnCommandCompleted(uint8_t status, uint32_t residue);
+  /** @brief ep_id の Halt を Clear Feature(ENDPOINT_HALT) で解除する． */
+  Error ClearEndpointHalt(EndpointID ep_id);
+  /** @brief Reset Recovery を始める．終わると実行中のコマンドを Phase Error として完了させる． */
+  Error StartResetRecovery();
+
+  Error Enqueue(const BlockRequest &request);
+  Error StartRequest();
+  Error CompleteRequest(Error::Code code);
+  bool ReadFromCache(uint64_t lba, uint32_t num_blocks, void *buf) const;
+};
+} // namespace usb
@@ -2,20 +2,88 @@
 
 #include "logger.hpp"
 #include "usb/device.hpp"
+#include "usb/input_queue.hpp"
 #include "usb/memory.hpp"
 
 #include <algorithm>
+#include <limits>
 
 namespace usb {
 HIDMouseDriver::HIDMouseDriver(Device *dev, int interface_index)
     : HIDBaseDriver{dev, interface_index, 3} {}
 
+namespace {
+template <typename T> T Saturate(int32_t value) {
+  return static_cast<T>(std::clamp<int32_t>(value, std::numeric_limits<T>::min(),
+                                            std::numeric_limits<T>::max()));
+}
+} // namespace
+
+bool HIDMouseDriver::OnReportDescriptorReceived(const uint8_t *desc, int len) {
+  if (auto err = hid::ParseMouseReportDescriptor(desc, len, layout_)) {
+    Log(kInfo, "mouse: report descriptor not usable (%s), using boot protocol\n", err.Name());
+    return false;
+  }
+  if (!SetInPacketSize(layout_.report_bytes)) {
+    Log(kInfo, "mouse: report (%d bytes) does not fit in a packet, using boot protocol\n",
+        layout_.report_bytes);
+    SetInPacketSize(3);
+    return false;
+  }
+  use_report_protocol_ = true;
+  return true;
+}
+
 Error HIDMouseDriver::OnDataReceived() {
-  uint8_t buttons = Buffer()[0];
-  int8_t displacement_x = Buffer()[1];
-  int8_t displacement_y = Buffer()[2];
-  NotifyMouseMove(buttons, displacement_x, displacement_y);
-  Log(kTrace, "%02x,(%3d,%3d)\n", buttons, displacement_x, displacement_y);
+  const uint8_t *report = Buffer();
+  uint8_t buttons = 0;
+  int32_t displacement_x = 0, displacement_y = 0, wheel = 0;
+
+  if (use_report_protocol_) {
+    if (layout_.report_id != 0 && report[0] != layout_.report_id) {
+      return MAKE_ERROR(Error::kSuccess); // 関心のないレポート
+    }
+    for (int i = 0; i < layout_.num_fields; ++i) {
+      const auto &field = layout_.fields[i];
+      const int32_t value = hid::ReportLayout::Extract(report, field);
+      switch (field.kind) {
+      case hid::FieldKind::kButtons:
+        buttons = value;
+        break;
+      case hid::FieldKind::kX:
+        displacement_x = value;
+        break;
+      case hid::FieldKind::kY:
+        displacement_y = value;
+        break;
+      case hid::FieldKind::kWheel:
+        wheel = value;
+        break;
+      }
+    }
+  } else {
+    buttons = report[0];
+    displacement_x = static_cast<int8_t>(report[1]);
+    displacement_y = static_cast<int8_t>(report[2]);
+  }
+
+  Log(kTrace, "%02x,(%3d,%3d),%d\n", buttons, displacement_x, displacement_y, wheel);
+  if (MouseCoalescingEnabled()) {
+    if (buttons == buttons_) {
+      // コンシューマが次に読み出すまで移動量をためておく
+      AccumulateMotion(MotionDelta{displacement_x, displacement_y, wheel});
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    // ボタンの変化より前の移動が，変化の後に反映されないようにまとめて送る
+    const auto pending = TakeMotion();
+    displacement_x += pending.x;
+    displacement_y += pending.y;
+    wheel += pending.wheel;
+  }
+  buttons_ = buttons;
+
+  NotifyMouseMove(buttons, Saturate<int16_t>(displacement_x), Saturate<int16_t>(displacement_y),
+                  Saturate<int8_t>(wheel));
   return MAKE_ERROR(Error::kSuccess);
 }
 
@@ -27,12 +95,17 @@ void HIDMouseDriver::SubscribeMouseMove(std::function<ObserverType> observer) {
   observers_[num_observers_++] = observer;
 }
 
-std::function<HIDMouseDriver::ObserverType> HIDMouseDriver::default_observer;
+void HIDMouseDriver::NotifyMouseMove(uint8_t buttons, int16_t displacement_x,
+                                     int16_t displacement_y, int8_t wheel) {
+  InputRecord record{};
+  record.buttons = buttons;
+  record.displacement_x = displacement_x;
+  record.displacement_y = displacement_y;
+  record.wheel = wheel;
+  PublishInput(InputQueueID::kMouse, record);
 
-void HIDMouseDriver::NotifyMouseMove(uint8_t buttons, int8_t displacement_x,
-                                     int8_t displacement_y) {
   for (int i = 0; i < num_observers_; ++i) {
-    observers_[i](buttons, displacement_x, displacement_y);
+    observers_[i](buttons, displacement_x, displacement_y, wheel);
   }
 }
 } // namespace usb
@@ -7,6 +7,7 @@
 #pragma once
 
 #include "usb/classdriver/hid.hpp"
+#include "usb/classdriver/hid_report.hpp"
 
 #include <functional>
 
@@ -20,14 +21,28 @@ public:
 
   Error OnDataReceived() override;
 
-  using ObserverType = void(uint8_t buttons, int8_t displacement_x, int8_t displacement_y);
+  /** @brief 移動量の合体モード（MouseCoalescingEnabled()）では，ボタンの状態が変わったときだけ
+   * 呼ばれる．displacement にはそれまでにたまった移動量も含まれる．
+   */
+  using ObserverType = void(uint8_t buttons, int16_t displacement_x, int16_t displacement_y,
+                            int8_t wheel);
   void SubscribeMouseMove(std::function<ObserverType> observer);
-  static std::function<ObserverType> default_observer;
+
+protected:
+  bool WantsReportProtocol() const override { return true; }
+  bool OnReportDescriptorReceived(const uint8_t *desc, int len) override;
 
 private:
   std::array<std::function<ObserverType>, 4> observers_;
   int num_observers_ = 0;
 
-  void NotifyMouseMove(uint8_t buttons, int8_t displacement_x, int8_t displacement_y);
+  /** Report プロトコルで受信している場合のレポートの形式 */
+  hid::ReportLayout layout_{};
+  bool use_report_protocol_{false};
+  /** 最後に通知したボタンの状態 */
+  uint8_t buttons_{0};
+
+  void NotifyMouseMove(uint8_t buttons, int16_t displacement_x, int16_t displacement_y,
+                       int8_t wheel);
 };
 } // namespace usb
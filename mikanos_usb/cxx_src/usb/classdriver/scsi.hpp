@@ -0,0 +1,59 @@
+/**
+ * @file usb/classdriver/scsi.hpp
+ *
+ * マスストレージのクラスドライバが共通に使う SCSI コマンドの定義．
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace usb::scsi {
+const uint8_t kRequestSense = 0x03;
+const uint8_t kInquiry = 0x12;
+const uint8_t kReadCapacity10 = 0x25;
+const uint8_t kRead10 = 0x28;
+const uint8_t kWrite10 = 0x2a;
+const uint8_t kRead16 = 0x88;
+const uint8_t kWrite16 = 0x8a;
+
+/** @brief SCSI ステータス */
+const uint8_t kGood = 0x00;
+const uint8_t kCheckCondition = 0x02;
+
+const size_t kInquiryLength = 36;
+const size_t kRequestSenseLength = 18;
+const size_t kReadCapacity10Length = 8;
+
+inline uint32_t ReadBE32(const uint8_t *p) {
+  return static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16 |
+         static_cast<uint32_t>(p[2]) << 8 | static_cast<uint32_t>(p[3]);
+}
+
+inline void WriteBE(uint8_t *p, uint64_t value, int num_bytes) {
+  for (int i = num_bytes - 1; i >= 0; --i) {
+    p[i] = value & 0xffu;
+    value >>= 8;
+  }
+}
+
+/** @brief lba から num_blocks ブロックを読み書きする READ/WRITE (10) か (16) を cb に組み立てる．
+ *
+ * cb は 16 バイト以上あり，0 で初期化されていなければならない．
+ *
+ * @return コマンドブロックの長さ．
+ */
+inline uint8_t MakeReadWriteCommand(uint8_t *cb, bool write, uint64_t lba, uint32_t num_blocks) {
+  if (lba + num_blocks <= 0xffffffffu) {
+    cb[0] = write ? kWrite10 : kRead10;
+    WriteBE(&cb[2], lba, 4);
+    WriteBE(&cb[7], num_blocks, 2);
+    return 10;
+  }
+  cb[0] = write ? kWrite16 : kRead16;
+  WriteBE(&cb[2], lba, 8);
+  WriteBE(&cb[10], num_blocks, 4);
+  return 16;
+}
+} // namespace usb::scsi
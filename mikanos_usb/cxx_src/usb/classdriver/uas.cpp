@@ -0,0 +1,373 @@
+#include "usb/classdriver/uas.hpp"
+
+#include "logger.hpp"
+#include "usb/classdriver/scsi.hpp"
+#include "usb/device.hpp"
+#include "usb/memory.hpp"
+#include "usb/setupdata.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+using namespace usb::scsi;
+
+// Pipe Usage Descriptor の Pipe ID
+const int kCommandPipeID = 1;
+const int kStatusPipeID = 2;
+const int kDataInPipeID = 3;
+const int kDataOutPipeID = 4;
+
+/** READ CAPACITY に失敗した（UNIT ATTENTION 等）場合に再試行する回数 */
+const int kMaxRetries = 5;
+
+/** Response IU を受け取ったコマンドのステータスとして扱う値 */
+const uint8_t kResponseStatus = 0xff;
+} // namespace
+
+namespace usb {
+UASDriver::UASDriver(Device *dev, int interface_index, uint8_t alternate_setting)
+    : BlockStorageDriver{dev}, interface_index_{interface_index},
+      alternate_setting_{alternate_setting} {}
+
+void *UASDriver::operator new(size_t size) { return AllocMem(sizeof(UASDriver), 64, 0); }
+
+void UASDriver::operator delete(void *ptr) noexcept { FreeMem(ptr); }
+
+Error UASDriver::Initialize() { return MAKE_ERROR(Error::kSuccess); }
+
+Error UASDriver::SetEndpoint(const EndpointConfig &config) {
+  if (config.ep_type != EndpointType::kBulk) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  switch (config.pipe_id) {
+  case kCommandPipeID:
+    ep_command_ = config.ep_id;
+    break;
+  case kStatusPipeID:
+    ep_status_ = config.ep_id;
+    break;
+  case kDataInPipeID:
+    ep_data_in_ = config.ep_id;
+    break;
+  case kDataOutPipeID:
+    ep_data_out_ = config.ep_id;
+    break;
+  default:
+    Log(kWarn, "UASDriver: unknown pipe id %d (ep addr %d)\n", config.pipe_id,
+        config.ep_id.Address());
+    break;
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error UASDriver::OnEndpointsConfigured() {
+  auto dev = ParentDevice();
+  const int num_streams = std::min({dev->NumStreams(ep_status_), dev->NumStreams(ep_data_in_),
+                                    dev->NumStreams(ep_data_out_)});
+  num_tags_ = std::min<size_t>(kMaxTags, std::max(num_streams, 0));
+  Log(kDebug,
+      "UASDriver: command %d, status %d, data in %d, data out %d, interface %d, %lu tags\n",
+      ep_command_.Address(), ep_status_.Address(), ep_data_in_.Address(), ep_data_out_.Address(),
+      interface_index_, num_tags_);
+  if (num_tags_ == 0) {
+    // ストリームを使わない USB 2.0 の UAS（Read/Write Ready IU）には対応しない
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  // UAS はデフォルトではない代替設定にあるので，エンドポイントを構成した後で切り替える
+  SetupData setup_data{};
+  setup_data.request_type.bits.direction = request_type::kOut;
+  setup_data.request_type.bits.type = request_type::kStandard;
+  setup_data.request_type.bits.recipient = request_type::kInterface;
+  setup_data.request = request::kSetInterface;
+  setup_data.value = alternate_setting_;
+  setup_data.index = interface_index_;
+  setup_data.length = 0;
+  phase_ = Phase::kSetInterface;
+  return dev->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this);
+}
+
+Error UASDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf,
+                                    int len) {
+  if (phase_ != Phase::kSetInterface || setup_data.request != request::kSetInterface) {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  phase_ = Phase::kInquiry;
+  const uint8_t cb[6] = {kInquiry, 0, 0, 0, kInquiryLength, 0};
+  return SubmitInitCommand(cb, sizeof(cb), kInquiryLength);
+}
+
+Error UASDriver::OnInterruptCompleted(EndpointID ep_id, const void *buf, int len) {
+  return MAKE_ERROR(Error::kNotImplemented);
+}
+
+Error UASDriver::OnBulkCompleted(EndpointID ep_id, const void *buf, int len) {
+  if (ep_id.Address() == ep_command_.Address()) {
+    // Command IU を送っただけでは何もしない．ステータスで完了を知る．
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  for (size_t tag = 0; tag < num_tags_; ++tag) {
+    auto &cmd = commands_[tag];
+    if (!cmd.busy) {
+      continue;
+    }
+    if (ep_id.Address() == ep_status_.Address() && buf == &sense_ius_[tag]) {
+      cmd.status_done = true;
+      if (!cmd.data_done) {
+        // CHECK CONDITION などで，デバイスはデータステージを行わずに Sense IU を返した．
+        // データの TD は完了しないので取り消し，受け取ったデータは無いものとする．
+        CancelStream(tag, cmd.data_in ? ep_data_in_ : ep_data_out_);
+        cmd.data_done = true;
+      }
+    } else if (buf == cmd.data_buf && !cmd.data_done) {
+      cmd.data_done = true;
+      cmd.data_actual = len;
+    } else {
+      continue;
+    }
+    if (cmd.status_done && cmd.data_done) {
+      return FinishCommand(tag);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  return MAKE_ERROR(Error::kNoWaiter);
+}
+
+Error UASDriver::Read(uint64_t lba, uint32_t num_blocks, void *buf, CompletionCallback callback,
+                      void *context) {
+  if (!IsReady()) {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  if (!InRange(lba, num_blocks)) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+
+  BlockRequest request{};
+  request.write = false;
+  request.lba = lba;
+  request.num_blocks = num_blocks;
+  request.buf = reinterpret_cast<uint8_t *>(buf);
+  request.callback = callback;
+  request.context = context;
+  return Enqueue(request);
+}
+
+Error UASDriver::Write(uint64_t lba, uint32_t num_blocks, const void *buf,
+                       CompletionCallback callback, void *context) {
+  if (!IsReady()) {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  if (!InRange(lba, num_blocks)) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+
+  BlockRequest request{};
+  request.write = true;
+  request.lba = lba;
+  request.num_blocks = num_blocks;
+  request.buf = reinterpret_cast<uint8_t *>(const_cast<void *>(buf));
+  request.callback = callback;
+  request.context = context;
+  return Enqueue(request);
+}
+
+Error UASDriver::SubmitCommand(size_t tag, const uint8_t *cb, uint8_t cb_length, void *buf,
+                               uint32_t len, bool dir_in) {
+  auto &cmd = commands_[tag];
+  cmd.busy = true;
+  cmd.data_buf = buf;
+  cmd.data_len = len;
+  cmd.data_in = dir_in;
+  cmd.data_actual = 0;
+  cmd.data_done = len == 0;
+  cmd.status_done = false;
+
+  auto &iu = command_ius_[tag];
+  iu = CommandIU{};
+  iu.iu_id = CommandIU::kID;
+  WriteBE(iu.tag, tag + 1, 2);
+  memcpy(iu.cdb, cb, cb_length);
+  sense_ius_[tag] = SenseIU{};
+
+  // デバイスがステータスやデータを返す前に，そのストリームの受け取り先を用意しておく
+  auto dev = ParentDevice();
+  const uint16_t stream_id = tag + 1;
+  SubmissionBatch batch{*dev};
+  if (auto err = dev->BulkStreamIn(ep_status_, stream_id, &sense_ius_[tag], sizeof(SenseIU))) {
+    cmd.busy = false;
+    return err;
+  }
+  // 以降で失敗したら，積んだステータス（とデータ）の転送を取り消してタグを空ける
+  const auto ep_data = dir_in ? ep_data_in_ : ep_data_out_;
+  if (len > 0) {
+    auto err = dir_in ? dev->BulkStreamIn(ep_data_in_, stream_id, buf, len)
+                      : dev->BulkStreamOut(ep_data_out_, stream_id, buf, len);
+    if (err) {
+      CancelStream(tag, ep_status_);
+      cmd.busy = false;
+      return err;
+    }
+  }
+  if (auto err = dev->BulkOut(ep_command_, &iu, sizeof(iu))) {
+    CancelStream(tag, ep_status_);
+    if (len > 0) {
+      CancelStream(tag, ep_data);
+    }
+    cmd.busy = false;
+    return err;
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void UASDriver::CancelStream(size_t tag, EndpointID ep_id) {
+  if (auto err = ParentDevice()->CancelBulkStream(ep_id, tag + 1)) {
+    Log(kWarn, "UASDriver: failed to cancel stream %lu on ep addr %d: %s\n", tag + 1,
+        ep_id.Address(), err.Name());
+    commands_[tag].disabled = true;
+  }
+}
+
+Error UASDriver::FinishCommand(size_t tag) {
+  auto &cmd = commands_[tag];
+  cmd.busy = false;
+
+  const auto &sense = sense_ius_[tag];
+  uint8_t status = sense.status;
+  if (sense.iu_id != SenseIU::kID) {
+    Log(kError, "UASDriver: unexpected IU %02x for tag %lu\n", sense.iu_id, tag + 1);
+    status = kResponseStatus;
+  }
+
+  if (cmd.request == kNoRequest) {
+    return OnInitCommandCompleted(status);
+  }
+
+  auto &request = requests_[cmd.request];
+  --request.num_inflight;
+  const uint32_t transferred_blocks = std::max(cmd.data_actual, 0) / block_size_;
+  if (status != kGood || transferred_blocks != cmd.num_blocks) {
+    Log(kError, "UASDriver: command failed (status %d, %d of %u bytes)\n", status,
+        cmd.data_actual, cmd.data_len);
+    request.error = Error::kTransferFailed;
+  }
+  request.done_blocks += transferred_blocks;
+
+  CompleteRequests();
+  return StartRequests();
+}
+
+Error UASDriver::SubmitInitCommand(const uint8_t *cb, uint8_t cb_length, uint32_t len) {
+  commands_[0].request = kNoRequest;
+  return SubmitCommand(0, cb, cb_length, response_.data(), len, true);
+}
+
+Error UASDriver::OnInitCommandCompleted(uint8_t status) {
+  switch (phase_) {
+  case Phase::kInquiry: {
+    // INQUIRY の結果は使わない（失敗しても容量の取得を試みる）
+    phase_ = Phase::kReadCapacity;
+    const uint8_t cb[10] = {kReadCapacity10};
+    return SubmitInitCommand(cb, sizeof(cb), kReadCapacity10Length);
+  }
+  case Phase::kReadCapacity:
+    if (status != kGood) {
+      if (++retry_count_ > kMaxRetries) {
+        Log(kError, "UASDriver: READ CAPACITY failed (status %d)\n", status);
+        return MAKE_ERROR(Error::kTransferFailed);
+      }
+      // UAS では CHECK CONDITION のセンスデータが Sense IU で届くので，そのまま再試行する
+      const uint8_t cb[10] = {kReadCapacity10};
+      return SubmitInitCommand(cb, sizeof(cb), kReadCapacity10Length);
+    }
+
+    num_blocks_ = static_cast<uint64_t>(ReadBE32(&response_[0])) + 1;
+    block_size_ = ReadBE32(&response_[4]);
+    if (block_size_ == 0) {
+      return MAKE_ERROR(Error::kInvalidDescriptor);
+    }
+    phase_ = Phase::kReady;
+    Log(kInfo, "UASDriver: %lu blocks of %u bytes\n", num_blocks_, block_size_);
+
+    NotifyReady();
+    return StartRequests();
+  default:
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+}
+
+Error UASDriver::Enqueue(const BlockRequest &request) {
+  if (num_requests_ == requests_.size()) {
+    return MAKE_ERROR(Error::kRingFull);
+  }
+  auto &entry = requests_[(request_head_ + num_requests_) % requests_.size()];
+  entry = request;
+  entry.error = Error::kSuccess;
+  ++num_requests_;
+  return StartRequests();
+}
+
+Error UASDriver::StartRequests() {
+  if (!IsReady()) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  const uint32_t max_blocks = std::max<uint32_t>(kMaxTransferBytes / block_size_, 1);
+  // 複数のタグのコマンドを積み終えてからドアベルを鳴らす
+  SubmissionBatch batch{*ParentDevice()};
+  size_t tag = 0;
+  for (size_t i = 0; i < num_requests_; ++i) {
+    const size_t index = (request_head_ + i) % requests_.size();
+    auto &request = requests_[index];
+    while (request.error == Error::kSuccess && request.issued_blocks < request.num_blocks) {
+      while (tag < num_tags_ && (commands_[tag].busy || commands_[tag].disabled)) {
+        ++tag;
+      }
+      if (tag == num_tags_) {
+        return MAKE_ERROR(Error::kSuccess);
+      }
+
+      const uint64_t lba = request.lba + request.issued_blocks;
+      const uint32_t num_blocks = std::min(request.num_blocks - request.issued_blocks, max_blocks);
+      uint8_t *buf = request.buf + static_cast<size_t>(request.issued_blocks) * block_size_;
+      uint8_t cb[16] = {};
+      const uint8_t cb_length = MakeReadWriteCommand(cb, request.write, lba, num_blocks);
+
+      commands_[tag].request = index;
+      commands_[tag].num_blocks = num_blocks;
+      if (auto err = SubmitCommand(tag, cb, cb_length, buf, num_blocks * block_size_,
+                                   !request.write)) {
+        Log(kError, "UASDriver: failed to submit command: %s at %s:%d\n", err.Name(), err.File(),
+            err.Line());
+        request.error = err.Cause();
+        break;
+      }
+      request.issued_blocks += num_blocks;
+      ++request.num_inflight;
+    }
+  }
+  CompleteRequests();
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void UASDriver::CompleteRequests() {
+  for (size_t i = 0; i < num_requests_; ++i) {
+    auto &request = requests_[(request_head_ + i) % requests_.size()];
+    if (request.completed || request.num_inflight > 0) {
+      continue;
+    }
+    if (request.error == Error::kSuccess && request.done_blocks < request.num_blocks) {
+      continue;
+    }
+    request.completed = true;
+    // callback の中から次の要求が発行されることもある
+    request.callback(request.context, request.error);
+  }
+
+  while (num_requests_ > 0 && requests_[request_head_].completed) {
+    request_head_ = (request_head_ + 1) % requests_.size();
+    --num_requests_;
+  }
+}
+} // namespace usb
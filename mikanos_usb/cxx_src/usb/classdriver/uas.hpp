@@ -0,0 +1,155 @@
+/**
+ * @file usb/classdriver/uas.hpp
+ *
+ * USB Attached SCSI (UAS) class driver.
+ *
+ * コマンド，ステータス，データ IN，データ OUT の 4 本のパイプを使い，
+ * タグごとに別のバルクストリームを割り当てて複数の SCSI コマンドを同時に実行する．
+ */
+
+#pragma once
+
+#include "usb/classdriver/block_storage.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace usb {
+class UASDriver : public BlockStorageDriver {
+public:
+  /** @brief 同時に実行する SCSI コマンドの最大数．タグ t はストリーム t を使う． */
+  const static size_t kMaxTags = 8;
+  /** @brief 1 つの SCSI コマンドで転送する最大バイト数 */
+  const static uint32_t kMaxTransferBytes = 128 * 1024;
+  /** @brief 同時に受け付けられるブロック I/O 要求の数 */
+  const static size_t kMaxPendingRequests = 8;
+
+  UASDriver(Device *dev, int interface_index, uint8_t alternate_setting);
+
+  void *operator new(size_t size);
+  void operator delete(void *ptr) noexcept;
+
+  Error Initialize() override;
+  Error SetEndpoint(const EndpointConfig &config) override;
+  Error OnEndpointsConfigured() override;
+  Error OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf,
+                           int len) override;
+  Error OnInterruptCompleted(EndpointID ep_id, const void *buf, int len) override;
+  Error OnBulkCompleted(EndpointID ep_id, const void *buf, int len) override;
+
+  bool IsReady() const override { return phase_ == Phase::kReady; }
+  /** @brief 大きな要求は kMaxTransferBytes ごとに分け，空いているタグで並行して転送する． */
+  Error Read(uint64_t lba, uint32_t num_blocks, void *buf, CompletionCallback callback,
+             void *context) override;
+  Error Write(uint64_t lba, uint32_t num_blocks, const void *buf, CompletionCallback callback,
+              void *context) override;
+
+  /** Command IU */
+  struct CommandIU {
+    static const uint8_t kID = 0x01;
+    uint8_t iu_id;
+    uint8_t reserved0;
+    uint8_t tag[2]; // ビッグエンディアン
+    uint8_t task_attribute;
+    uint8_t reserved1;
+    uint8_t additional_cdb_length;
+    uint8_t reserved2;
+    uint8_t lun[8];
+    uint8_t cdb[16];
+  } __attribute__((packed));
+
+  /** Sense IU．Response IU もこの領域で受け取り，iu_id で見分ける． */
+  struct SenseIU {
+    static const uint8_t kID = 0x03;
+    static const uint8_t kResponseID = 0x04;
+    uint8_t iu_id;
+    uint8_t reserved0;
+    uint8_t tag[2];
+    uint8_t status_qualifier[2];
+    uint8_t status;
+    uint8_t reserved1[7];
+    uint8_t sense_length[2];
+    uint8_t sense_data[18];
+  } __attribute__((packed));
+
+private:
+  /** デバイスの初期化段階 */
+  enum class Phase { kNotConfigured, kSetInterface, kInquiry, kReadCapacity, kReady };
+
+  struct BlockRequest {
+    bool write;
+    uint64_t lba;
+    uint32_t num_blocks;
+    uint8_t *buf;
+    CompletionCallback callback;
+    void *context;
+    /** コマンドを発行済みのブロック数 */
+    uint32_t issued_blocks;
+    /** 転送を終えたブロック数 */
+    uint32_t done_blocks;
+    /** 実行中のコマンドの数 */
+    int num_inflight;
+    Error::Code error;
+    /** callback を呼び終えた．FIFO の先頭に来たら取り除く． */
+    bool completed;
+  };
+
+  /** 1 つのタグで実行中の SCSI コマンド */
+  struct Command {
+    bool busy;
+    /** 対応するブロック I/O 要求の requests_ での位置．初期化中のコマンドなら kNoRequest． */
+    size_t request;
+    uint32_t num_blocks;
+    void *data_buf;
+    uint32_t data_len;
+    bool data_in;
+    int data_actual;
+    bool data_done;
+    bool status_done;
+    /** 積んだ転送を取り消せなかった．ストリームに古い TD が残るので，このタグは以後使わない． */
+    bool disabled;
+  };
+  const static size_t kNoRequest = ~static_cast<size_t>(0);
+
+  const int interface_index_;
+  const uint8_t alternate_setting_;
+  EndpointID ep_command_;
+  EndpointID ep_status_;
+  EndpointID ep_data_in_;
+  EndpointID ep_data_out_;
+  /** 使えるタグの数 */
+  size_t num_tags_{0};
+
+  Phase phase_{Phase::kNotConfigured};
+  int retry_count_{0};
+
+  // ホストコントローラが直接読み書きする領域．ドライバごとメモリプールから確保される．
+  alignas(64) std::array<CommandIU, kMaxTags> command_ius_{};
+  alignas(64) std::array<SenseIU, kMaxTags> sense_ius_{};
+  alignas(64) std::array<uint8_t, 36> response_{};
+  std::array<Command, kMaxTags> commands_{};
+
+  /** 受け付けたブロック I/O 要求の FIFO */
+  std::array<BlockRequest, kMaxPendingRequests> requests_{};
+  size_t request_head_{0};
+  size_t num_requests_{0};
+
+  /** @brief commands_[tag] で SCSI コマンドを発行する．タグ番号とストリーム ID は tag + 1． */
+  Error SubmitCommand(size_t tag, const uint8_t *cb, uint8_t cb_length, void *buf, uint32_t len,
+                      bool dir_in);
+  /** @brief ステータスとデータの両方がそろったコマンドを完了させる． */
+  Error FinishCommand(size_t tag);
+  /** @brief tag のストリームに積んだ転送を ep_id から取り消す．失敗したらタグを使えなくする． */
+  void CancelStream(size_t tag, EndpointID ep_id);
+  Error OnInitCommandCompleted(uint8_t status);
+
+  Error Enqueue(const BlockRequest &request);
+  /** @brief 空いているタグがある限り，未発行のブロックのコマンドを発行する． */
+  Error StartRequests();
+  /** @brief 転送を終えた要求の callback を呼び，FIFO の先頭から取り除く． */
+  void CompleteRequests();
+  /** @brief 初期化中のコマンドを，応答を response_ に受け取るように発行する． */
+  Error SubmitInitCommand(const uint8_t *cb, uint8_t cb_length, uint32_t len);
+};
+} // namespace usb
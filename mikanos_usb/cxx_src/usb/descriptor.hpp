@@ -7,6 +7,7 @@
 #pragma once
 
 #include <array>
+#include <cstddef>
 #include <cstdint>
 
 namespace usb {
@@ -82,6 +83,29 @@ struct EndpointDescriptor {
   uint8_t interval;         // offset 6
 } __attribute__((packed));
 
+struct SuperSpeedEndpointCompanionDescriptor {
+  static const uint8_t kType = 48;
+
+  uint8_t length;              // offset 0
+  uint8_t descriptor_type;     // offset 1
+  uint8_t max_burst;           // offset 2
+  uint8_t attributes;          // offset 3
+  uint16_t bytes_per_interval; // offset 4
+
+  /** バルクエンドポイントなら，ストリーム数の指数（bmAttributes の bit 4:0） */
+  int MaxStreams() const { return attributes & 0x1fu; }
+} __attribute__((packed));
+
+/** @brief UAS のエンドポイントの役割を表すクラス特有ディスクリプタ */
+struct PipeUsageDescriptor {
+  static const uint8_t kType = 0x24;
+
+  uint8_t length;          // offset 0
+  uint8_t descriptor_type; // offset 1
+  uint8_t pipe_id;         // offset 2
+  uint8_t reserved;        // offset 3
+} __attribute__((packed));
+
 struct HIDDescriptor {
   static const uint8_t kType = 33;
 
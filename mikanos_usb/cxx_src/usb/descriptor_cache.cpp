@@ -0,0 +1,58 @@
+#include "usb/descriptor_cache.hpp"
+
+namespace usb {
+namespace {
+const size_t kDescriptorCacheSize = 8;
+
+struct Entry {
+  bool valid;
+  /** 最後に使った順番．小さいものから捨てる． */
+  uint32_t last_used;
+  CachedConfiguration conf;
+};
+
+std::array<Entry, kDescriptorCacheSize> entries{};
+uint32_t use_count = 0;
+
+Entry *FindEntry(const DeviceIdentity &identity) {
+  for (auto &e : entries) {
+    if (e.valid && e.conf.identity == identity) {
+      return &e;
+    }
+  }
+  return nullptr;
+}
+} // namespace
+
+const CachedConfiguration *FindCachedConfiguration(const DeviceIdentity &identity) {
+  auto e = FindEntry(identity);
+  if (e == nullptr) {
+    return nullptr;
+  }
+  e->last_used = ++use_count;
+  return &e->conf;
+}
+
+void StoreCachedConfiguration(const CachedConfiguration &conf) {
+  auto e = FindEntry(conf.identity);
+  if (e == nullptr) {
+    e = &entries[0];
+    for (auto &candidate : entries) {
+      if (!candidate.valid) {
+        e = &candidate;
+        break;
+      }
+      if (static_cast<int32_t>(candidate.last_used - e->last_used) < 0) {
+        e = &candidate;
+      }
+    }
+  }
+  *e = Entry{true, ++use_count, conf};
+}
+
+void EvictCachedConfiguration(const DeviceIdentity &identity) {
+  if (auto e = FindEntry(identity)) {
+    e->valid = false;
+  }
+}
+} // namespace usb
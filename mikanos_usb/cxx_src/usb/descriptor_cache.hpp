@@ -0,0 +1,56 @@
+/**
+ * @file usb/descriptor_cache.hpp
+ *
+ * 一度列挙したデバイスの構成を覚えておき，再接続時の列挙を短縮するキャッシュ．
+ */
+
+#pragma once
+
+#include "usb/descriptor.hpp"
+#include "usb/endpoint.hpp"
+
+#include <array>
+#include <cstdint>
+
+namespace usb {
+enum class DeviceSpeed : uint8_t;
+
+/** @brief キャッシュのキー．デバイスディスクリプタの idVendor, idProduct, bcdDevice と接続速度．
+ *
+ * 同じデバイスでも接続速度によってエンドポイントの構成（最大パケットサイズや
+ * ストリームの有無，UAS を使えるか）が変わるので，速度もキーに含める．
+ */
+struct DeviceIdentity {
+  uint16_t vendor_id;
+  uint16_t product_id;
+  uint16_t device_release;
+  DeviceSpeed speed;
+
+  bool operator==(const DeviceIdentity &rhs) const {
+    return vendor_id == rhs.vendor_id && product_id == rhs.product_id &&
+           device_release == rhs.device_release && speed == rhs.speed;
+  }
+};
+
+/** @brief コンフィギュレーションディスクリプタを解析した結果 */
+struct CachedConfiguration {
+  DeviceIdentity identity;
+  /** SetConfiguration に渡す値 */
+  uint8_t config_value;
+  /** 対応するクラスドライバが無ければ false．その場合は以下のフィールドは使わない． */
+  bool has_class_driver;
+  /** クラスドライバを選ぶのに使ったインタフェースディスクリプタ */
+  InterfaceDescriptor if_desc;
+  int num_ep_configs;
+  std::array<EndpointConfig, 16> ep_configs;
+};
+
+/** @brief identity の構成がキャッシュにあれば返す．無ければ nullptr． */
+const CachedConfiguration *FindCachedConfiguration(const DeviceIdentity &identity);
+
+/** @brief conf をキャッシュに登録する．同じキーがあれば置き換え，満杯なら最も古いものを捨てる． */
+void StoreCachedConfiguration(const CachedConfiguration &conf);
+
+/** @brief identity の構成をキャッシュから取り除く． */
+void EvictCachedConfiguration(const DeviceIdentity &identity);
+} // namespace usb
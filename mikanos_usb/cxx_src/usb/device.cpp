@@ -1,13 +1,25 @@
 #include "usb/device.hpp"
 
 #include "logger.hpp"
+#include "usb/async_transfer.hpp"
 #include "usb/classdriver/base.hpp"
+#include "usb/classdriver/cdc_acm.hpp"
+#include "usb/classdriver/cdc_ecm.hpp"
+#include "usb/classdriver/hub.hpp"
 #include "usb/classdriver/keyboard.hpp"
+#include "usb/classdriver/mass_storage.hpp"
 #include "usb/classdriver/mouse.hpp"
+#include "usb/classdriver/uas.hpp"
 #include "usb/descriptor.hpp"
+#include "usb/memory.hpp"
 #include "usb/setupdata.hpp"
 
+#include <algorithm>
+
 namespace {
+/** @brief 取得するコンフィギュレーションディスクリプタの最大長 */
+const int kMaxConfigurationSize = 4096;
+
 class ConfigurationDescriptorReader {
 public:
   ConfigurationDescriptorReader(const uint8_t *desc_buf, int len)
@@ -21,6 +33,12 @@ public:
     return nullptr;
   }
 
+  /** @brief 次のディスクリプタを，読み進めずに返す． */
+  const uint8_t *Peek() const {
+    const auto p = p_ + p_[0];
+    return p < desc_buf_ + desc_buf_len_ ? p : nullptr;
+  }
+
   template <class T> const T *Next() {
     while (auto n = Next()) {
       if (auto d = usb::DescriptorDynamicCast<T>(n)) {
@@ -36,30 +54,65 @@ private:
   const uint8_t *p_;
 };
 
-usb::EndpointConfig MakeEPConfig(const usb::EndpointDescriptor &ep_desc) {
+usb::EndpointConfig MakeEPConfig(const usb::InterfaceDescriptor &if_desc,
+                                 const usb::EndpointDescriptor &ep_desc) {
   usb::EndpointConfig conf;
   conf.ep_id = usb::EndpointID{ep_desc.endpoint_address.bits.number,
                                ep_desc.endpoint_address.bits.dir_in == 1};
   conf.ep_type = static_cast<usb::EndpointType>(ep_desc.attributes.bits.transfer_type);
   conf.max_packet_size = ep_desc.max_packet_size;
   conf.interval = ep_desc.interval;
+  conf.max_burst = 0;
+  conf.max_streams = 0;
+  conf.pipe_id = 0;
+  conf.interface_number = if_desc.interface_number;
+  conf.alternate_setting = if_desc.alternate_setting;
   return conf;
 }
 
+bool IsBulkOnlyStorage(const usb::InterfaceDescriptor &if_desc) {
+  return if_desc.interface_class == 8 && if_desc.interface_sub_class == 6 &&
+         if_desc.interface_protocol == 0x50;
+}
+
+bool IsUASStorage(const usb::InterfaceDescriptor &if_desc) {
+  return if_desc.interface_class == 8 && if_desc.interface_sub_class == 6 &&
+         if_desc.interface_protocol == 0x62;
+}
+
+/** @brief コンフィギュレーションに UAS の代替設定を持つインタフェースがあるか */
+bool HasUASInterface(const uint8_t *buf, int len) {
+  ConfigurationDescriptorReader reader{buf, len};
+  while (auto if_desc = reader.Next<usb::InterfaceDescriptor>()) {
+    if (IsUASStorage(*if_desc)) {
+      return true;
+    }
+  }
+  return false;
+}
+
 usb::ClassDriver *NewClassDriver(usb::Device *dev, const usb::InterfaceDescriptor &if_desc) {
   if (if_desc.interface_class == 3 && if_desc.interface_sub_class == 1) { // HID boot interface
     if (if_desc.interface_protocol == 1) {                                // keyboard
-      auto keyboard_driver = new usb::HIDKeyboardDriver{dev, if_desc.interface_number};
-      if (usb::HIDKeyboardDriver::default_observer) {
-        keyboard_driver->SubscribeKeyPush(usb::HIDKeyboardDriver::default_observer);
-      }
-      return keyboard_driver;
+      return new usb::HIDKeyboardDriver{dev, if_desc.interface_number};
     } else if (if_desc.interface_protocol == 2) { // mouse
-      auto mouse_driver = new usb::HIDMouseDriver{dev, if_desc.interface_number};
-      if (usb::HIDMouseDriver::default_observer) {
-        mouse_driver->SubscribeMouseMove(usb::HIDMouseDriver::default_observer);
-      }
-      return mouse_driver;
+      return new usb::HIDMouseDriver{dev, if_desc.interface_number};
+    }
+  }
+  if (if_desc.interface_class == usb::HubDriver::kInterfaceClass) {
+    return new usb::HubDriver{dev, if_desc.interface_number};
+  }
+  if (IsBulkOnlyStorage(if_desc)) { // mass storage, SCSI transparent, bulk-only
+    return new usb::MassStorageDriver{dev, if_desc.interface_number};
+  }
+  if (IsUASStorage(if_desc)) { // mass storage, SCSI transparent, USB Attached SCSI
+    return new usb::UASDriver{dev, if_desc.interface_number, if_desc.alternate_setting};
+  }
+  if (if_desc.interface_class == usb::CDCDriver::kCommunicationsClass) {
+    if (if_desc.interface_sub_class == usb::CDCACMDriver::kSubClass) {
+      return new usb::CDCACMDriver{dev, if_desc.interface_number};
+    } else if (if_desc.interface_sub_class == usb::CDCECMDriver::kSubClass) {
+      return new usb::CDCECMDriver{dev, if_desc.interface_number};
     }
   }
   return nullptr;
@@ -93,21 +146,31 @@ void _Log(LogLevel level, const char *file, uint32_t line, bool cont_flag,
 } // namespace
 
 namespace usb {
-Device::~Device() {}
+Device::~Device() {
+  // 1 つのクラスドライバが複数のエンドポイントを受け持つので，重複を除いて破棄する
+  for (size_t i = 0; i < class_drivers_.size(); ++i) {
+    auto class_driver = class_drivers_[i];
+    if (class_driver == nullptr) {
+      continue;
+    }
+    for (size_t j = i; j < class_drivers_.size(); ++j) {
+      if (class_drivers_[j] == class_driver) {
+        class_drivers_[j] = nullptr;
+      }
+    }
+    delete class_driver;
+  }
+  CancelAsyncTransfers(this);
+  FreeInitData();
+}
 
 Error Device::ControlIn(EndpointID ep_id, SetupData setup_data, void *buf, int len,
                         ClassDriver *issuer) {
-  if (issuer) {
-    event_waiters_.Put(setup_data, issuer);
-  }
   return MAKE_ERROR(Error::kSuccess);
 }
 
 Error Device::ControlOut(EndpointID ep_id, SetupData setup_data, const void *buf, int len,
                          ClassDriver *issuer) {
-  if (issuer) {
-    event_waiters_.Put(setup_data, issuer);
-  }
   return MAKE_ERROR(Error::kSuccess);
 }
 
@@ -119,17 +182,100 @@ Error Device::InterruptOut(EndpointID ep_id, void *buf, int len) {
   return MAKE_ERROR(Error::kSuccess);
 }
 
+Error Device::BulkIn(EndpointID ep_id, const TransferSegment *segments, int num_segments) {
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error Device::BulkOut(EndpointID ep_id, const TransferSegment *segments, int num_segments) {
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error Device::BulkIn(EndpointID ep_id, void *buf, int len) {
+  const TransferSegment segment{buf, static_cast<size_t>(len)};
+  return BulkIn(ep_id, &segment, 1);
+}
+
+Error Device::BulkOut(EndpointID ep_id, const void *buf, int len) {
+  const TransferSegment segment{const_cast<void *>(buf), static_cast<size_t>(len)};
+  return BulkOut(ep_id, &segment, 1);
+}
+
+Error Device::BulkStreamIn(EndpointID ep_id, uint16_t stream_id, void *buf, int len) {
+  return MAKE_ERROR(Error::kNotImplemented);
+}
+
+Error Device::BulkStreamOut(EndpointID ep_id, uint16_t stream_id, const void *buf, int len) {
+  return MAKE_ERROR(Error::kNotImplemented);
+}
+
+Error Device::CancelBulkStream(EndpointID ep_id, uint16_t stream_id) {
+  return MAKE_ERROR(Error::kNotImplemented);
+}
+
+int Device::NumStreams(EndpointID ep_id) const { return 0; }
+
+bool Device::SupportsStreams() const { return false; }
+
+Error Device::IsochIn(EndpointID ep_id, IsochPacket *packets, int num_packets) {
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error Device::IsochOut(EndpointID ep_id, IsochPacket *packets, int num_packets) {
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void Device::BeginBatch() {}
+
+void Device::EndBatch() {}
+
+DeviceSpeed Device::Speed() const { return DeviceSpeed::kFull; }
+
+int Device::HubDepth() const { return 0; }
+
+Error Device::ConfigureHub(const HubConfig &config) { return MAKE_ERROR(Error::kNotImplemented); }
+
+Error Device::OnHubPortConnected(uint8_t port_num) { return MAKE_ERROR(Error::kNotImplemented); }
+
+Error Device::OnHubPortReset(uint8_t port_num, DeviceSpeed speed) {
+  return MAKE_ERROR(Error::kNotImplemented);
+}
+
+Error Device::OnHubPortDisconnected(uint8_t port_num) {
+  return MAKE_ERROR(Error::kNotImplemented);
+}
+
 Error Device::StartInitialize() {
   is_initialized_ = false;
   initialize_phase_ = 1;
-  return GetDescriptor(*this, kDefaultControlPipeID, DeviceDescriptor::kType, 0, buf_.data(),
-                       buf_.size(), true);
+  if (init_ == nullptr) {
+    // ディスクリプタを受け取るので，ホストコントローラから読み書きできる領域に置く
+    init_ = AllocArray<InitData>(1, 64, 4096);
+    if (init_ == nullptr) {
+      return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
+  }
+  *init_ = InitData{};
+  return GetDescriptor(*this, kDefaultControlPipeID, DeviceDescriptor::kType, 0,
+                       init_->buf.data(), init_->buf.size(), true);
+}
+
+EndpointConfig *Device::EndpointConfigs() {
+  return init_ != nullptr ? init_->ep_configs.data() : nullptr;
 }
 
+int Device::NumEndpointConfigs() { return init_ != nullptr ? init_->num_ep_configs : 0; }
+
 Error Device::OnEndpointsConfigured() {
+  const auto identity = init_ ? init_->identity : DeviceIdentity{};
+  // 以降は初期化用のデータを使わない
+  FreeInitData();
   for (auto class_driver : class_drivers_) {
     if (class_driver != nullptr) {
       if (auto err = class_driver->OnEndpointsConfigured()) {
+        // キャッシュした構成が原因かもしれない．次の接続ではディスクリプタを読み直す．
+        Log(kDebug, "evicting cached configuration of %04x:%04x: %s\n", identity.vendor_id,
+            identity.product_id, err.Name());
+        EvictCachedConfiguration(identity);
         return err;
       }
     }
@@ -137,15 +283,32 @@ Error Device::OnEndpointsConfigured() {
   return MAKE_ERROR(Error::kSuccess);
 }
 
-Error Device::OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf, int len) {
+bool Device::PrefersThroughput() const {
+  bool found = false;
+  for (auto class_driver : class_drivers_) {
+    if (class_driver != nullptr) {
+      if (!class_driver->PrefersThroughput()) {
+        return false;
+      }
+      found = true;
+    }
+  }
+  return found;
+}
+
+Error Device::OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf, int len,
+                                 ClassDriver *issuer) {
   Log(kTrace, "Device::OnControlCompleted: buf 0x%08lx, len %d, dir %d\n",
       reinterpret_cast<uintptr_t>(buf), len, setup_data.request_type.bits.direction);
   if (is_initialized_) {
-    if (auto w = event_waiters_.Get(setup_data)) {
-      return w.value()->OnControlCompleted(ep_id, setup_data, buf, len);
+    if (issuer) {
+      return issuer->OnControlCompleted(ep_id, setup_data, buf, len);
     }
     return MAKE_ERROR(Error::kNoWaiter);
   }
+  if (init_ == nullptr) {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
 
   const uint8_t *buf8 = reinterpret_cast<const uint8_t *>(buf);
   if (initialize_phase_ == 1) {
@@ -178,14 +341,79 @@ Error Device::OnInterruptCompleted(EndpointID ep_id, const void *buf, int len) {
   return MAKE_ERROR(Error::kNoWaiter);
 }
 
+Error Device::OnBulkCompleted(EndpointID ep_id, const void *buf, int len) {
+  Log(kTrace, "Device::OnBulkCompleted: ep addr %d, len %d\n", ep_id.Address(), len);
+  if (auto w = class_drivers_[ep_id.Number()]) {
+    return w->OnBulkCompleted(ep_id, buf, len);
+  }
+  return MAKE_ERROR(Error::kNoWaiter);
+}
+
+Error Device::OnBulkFailed(EndpointID ep_id, const void *buf, int completion_code) {
+  Log(kDebug, "Device::OnBulkFailed: ep addr %d, completion code %d\n", ep_id.Address(),
+      completion_code);
+  if (auto w = class_drivers_[ep_id.Number()]) {
+    return w->OnBulkFailed(ep_id, buf, completion_code);
+  }
+  return MAKE_ERROR(Error::kNoWaiter);
+}
+
+Error Device::OnIsochCompleted(EndpointID ep_id, IsochPacket *packets, int num_packets) {
+  Log(kTrace, "Device::OnIsochCompleted: ep addr %d, %d packets\n", ep_id.Address(), num_packets);
+  if (auto w = class_drivers_[ep_id.Number()]) {
+    return w->OnIsochCompleted(ep_id, packets, num_packets);
+  }
+  return MAKE_ERROR(Error::kNoWaiter);
+}
+
 Error Device::InitializePhase1(const uint8_t *buf, int len) {
   const auto device_desc = DescriptorDynamicCast<DeviceDescriptor>(buf);
-  num_configurations_ = device_desc->num_configurations;
-  config_index_ = 0;
+  init_->num_configurations = device_desc->num_configurations;
+  init_->config_index = 0;
+  init_->identity = DeviceIdentity{device_desc->vendor_id, device_desc->product_id,
+                                   device_desc->device_release, Speed()};
+
+  if (auto cached = FindCachedConfiguration(init_->identity)) {
+    Log(kDebug, "configuration cache hit: %04x:%04x\n", init_->identity.vendor_id,
+        init_->identity.product_id);
+    return ApplyCachedConfiguration(*cached);
+  }
+
   initialize_phase_ = 2;
-  Log(kTrace, "issuing GetDesc(Config): index=%d)\n", config_index_);
-  return GetDescriptor(*this, kDefaultControlPipeID, ConfigurationDescriptor::kType, config_index_,
-                       buf_.data(), buf_.size(), true);
+  Log(kTrace, "issuing GetDesc(Config): index=%d)\n", init_->config_index);
+  return GetDescriptor(*this, kDefaultControlPipeID, ConfigurationDescriptor::kType,
+                       init_->config_index, init_->buf.data(), init_->buf.size(), true);
+}
+
+Error Device::ApplyCachedConfiguration(const CachedConfiguration &conf) {
+  if (!conf.has_class_driver) {
+    FreeInitData();
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  auto class_driver = NewClassDriver(this, conf.if_desc);
+  if (class_driver == nullptr) {
+    // 作れないはずのドライバがキャッシュされていた．ディスクリプタを読み直す．
+    EvictCachedConfiguration(conf.identity);
+    initialize_phase_ = 2;
+    return GetDescriptor(*this, kDefaultControlPipeID, ConfigurationDescriptor::kType,
+                         init_->config_index, init_->buf.data(), init_->buf.size(), true);
+  }
+  if (conf.if_desc.interface_class == HubDriver::kInterfaceClass) {
+    hub_driver_ = static_cast<class HubDriver *>(class_driver);
+  }
+  init_->config_value = conf.config_value;
+  init_->driver_if_desc = conf.if_desc;
+
+  init_->num_ep_configs = conf.num_ep_configs;
+  for (int i = 0; i < init_->num_ep_configs; ++i) {
+    init_->ep_configs[i] = conf.ep_configs[i];
+    class_drivers_[conf.ep_configs[i].ep_id.Number()] = class_driver;
+  }
+
+  initialize_phase_ = 3;
+  Log(kTrace, "issuing SetConfiguration: conf_val=%d\n", conf.config_value);
+  return SetConfiguration(*this, kDefaultControlPipeID, conf.config_value, true);
 }
 
 Error Device::InitializePhase2(const uint8_t *buf, int len) {
@@ -193,11 +421,86 @@ Error Device::InitializePhase2(const uint8_t *buf, int len) {
   if (conf_desc == nullptr) {
     return MAKE_ERROR(Error::kInvalidDescriptor);
   }
+
+  // 1 ページを超えるものは切り詰める（そこまで大きなディスクリプタを持つデバイスは稀）
+  const int total_length = std::min<int>(conf_desc->total_length, kMaxConfigurationSize);
+  if (total_length > len && init_->config_buf == nullptr) {
+    // buf に入り切らなかったので，全体が入るバッファで取得し直す
+    init_->config_buf = AllocArray<uint8_t>(total_length, 64, 4096);
+    if (init_->config_buf == nullptr) {
+      return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
+    Log(kTrace, "issuing GetDesc(Config): index=%d, len=%d)\n", init_->config_index,
+        total_length);
+    return GetDescriptor(*this, kDefaultControlPipeID, ConfigurationDescriptor::kType,
+                         init_->config_index, init_->config_buf, total_length, true);
+  }
+
+  auto err = ParseConfiguration(buf, len < total_length ? len : total_length);
+  if (init_ != nullptr) {
+    FreeMem(init_->config_buf);
+    init_->config_buf = nullptr;
+  }
+  return err;
+}
+
+Error Device::ParseConfiguration(const uint8_t *buf, int len) {
+  auto conf_desc = reinterpret_cast<const ConfigurationDescriptor *>(buf);
   ConfigurationDescriptorReader config_reader{buf, len};
+  auto &init = *init_;
+
+  // UAS は複数のコマンドを同時に実行できるので，ストリームを使えるなら Bulk-Only より優先する．
+  // 両対応のデバイスは Bulk-Only を代替設定 0，UAS を代替設定 1 に置いている．
+  const bool use_uas = SupportsStreams() && HasUASInterface(buf, len);
+
+  // if_desc のエンドポイントの構成を init.ep_configs に追加し，driver に割り当てる．
+  // エンドポイントディスクリプタの後に続く Companion や Pipe Usage も読むため，
+  // 次のインタフェースディスクリプタの手前まで読み進める．
+  auto read_endpoint_configs = [&](const InterfaceDescriptor &if_desc, ClassDriver *driver) {
+    int num_endpoints = 0;
+    while (auto desc = config_reader.Peek()) {
+      if (DescriptorDynamicCast<InterfaceDescriptor>(desc)) {
+        break;
+      }
+      config_reader.Next();
+      EndpointConfig *last_conf =
+          num_endpoints > 0 ? &init.ep_configs[init.num_ep_configs - 1] : nullptr;
+      if (auto ep_desc = DescriptorDynamicCast<EndpointDescriptor>(desc)) {
+        if (num_endpoints == if_desc.num_endpoints ||
+            init.num_ep_configs == static_cast<int>(init.ep_configs.size())) {
+          break;
+        }
+        auto conf = MakeEPConfig(if_desc, *ep_desc);
+        Log(kTrace, conf);
+
+        init.ep_configs[init.num_ep_configs] = conf;
+        ++init.num_ep_configs;
+        ++num_endpoints;
+        class_drivers_[conf.ep_id.Number()] = driver;
+      } else if (auto companion = DescriptorDynamicCast<SuperSpeedEndpointCompanionDescriptor>(
+                     desc)) {
+        if (last_conf) {
+          last_conf->max_burst = companion->max_burst;
+          if (last_conf->ep_type == EndpointType::kBulk) {
+            last_conf->max_streams = companion->MaxStreams();
+          }
+        }
+      } else if (auto pipe_usage = DescriptorDynamicCast<PipeUsageDescriptor>(desc)) {
+        if (last_conf) {
+          last_conf->pipe_id = pipe_usage->pipe_id;
+        }
+      } else if (auto hid_desc = DescriptorDynamicCast<HIDDescriptor>(desc)) {
+        Log(kTrace, *hid_desc);
+      }
+    }
+  };
 
   ClassDriver *class_driver = nullptr;
   while (auto if_desc = config_reader.Next<InterfaceDescriptor>()) {
     Log(kTrace, *if_desc);
+    if ((use_uas && IsBulkOnlyStorage(*if_desc)) || (!use_uas && IsUASStorage(*if_desc))) {
+      continue;
+    }
 
     class_driver = NewClassDriver(this, *if_desc);
     if (class_driver == nullptr) {
@@ -205,42 +508,76 @@ Error Device::InitializePhase2(const uint8_t *buf, int len) {
       continue;
     }
 
-    num_ep_configs_ = 0;
-
-    while (num_ep_configs_ < if_desc->num_endpoints) {
-      auto desc = config_reader.Next();
-      if (auto ep_desc = DescriptorDynamicCast<EndpointDescriptor>(desc)) {
-        auto conf = MakeEPConfig(*ep_desc);
-        Log(kTrace, conf);
-
-        ep_configs_[num_ep_configs_] = conf;
-        ++num_ep_configs_;
-        class_drivers_[conf.ep_id.Number()] = class_driver;
-      } else if (auto hid_desc = DescriptorDynamicCast<HIDDescriptor>(desc)) {
-        Log(kTrace, *hid_desc);
+    if (if_desc->interface_class == HubDriver::kInterfaceClass) {
+      hub_driver_ = static_cast<class HubDriver *>(class_driver);
+    }
+    init.driver_if_desc = *if_desc;
+    init.num_ep_configs = 0;
+    read_endpoint_configs(*if_desc, class_driver);
+
+    if (if_desc->interface_class == CDCDriver::kCommunicationsClass) {
+      // CDC は通信インタフェースとデータインタフェースの組で 1 つの機能になるので，
+      // 続くデータインタフェースのエンドポイントも同じドライバに割り当てる．
+      // ECM のデータインタフェースは代替設定 0 にエンドポイントを持たない．
+      while (auto data_if_desc = config_reader.Next<InterfaceDescriptor>()) {
+        if (data_if_desc->interface_class != CDCDriver::kDataClass) {
+          break;
+        }
+        if (data_if_desc->num_endpoints > 0) {
+          read_endpoint_configs(*data_if_desc, class_driver);
+          break;
+        }
       }
     }
-
     break;
   }
 
+  init.config_value = conf_desc->configuration_value;
   if (!class_driver) {
+    // 次に接続されたときにディスクリプタを読まずに済むよう，非対応であることも覚えておく
+    CachedConfiguration conf{};
+    conf.identity = init.identity;
+    conf.config_value = init.config_value;
+    conf.has_class_driver = false;
+    StoreCachedConfiguration(conf);
+    FreeInitData();
     return MAKE_ERROR(Error::kSuccess);
   }
   initialize_phase_ = 3;
-  Log(kTrace, "issuing SetConfiguration: conf_val=%d\n", conf_desc->configuration_value);
-  return SetConfiguration(*this, kDefaultControlPipeID, conf_desc->configuration_value, true);
+  Log(kTrace, "issuing SetConfiguration: conf_val=%d\n", init.config_value);
+  return SetConfiguration(*this, kDefaultControlPipeID, init.config_value, true);
 }
 
 Error Device::InitializePhase3(uint8_t config_value) {
-  for (int i = 0; i < num_ep_configs_; ++i) {
-    class_drivers_[ep_configs_[i].ep_id.Number()]->SetEndpoint(ep_configs_[i]);
+  const auto &init = *init_;
+  for (int i = 0; i < init.num_ep_configs; ++i) {
+    class_drivers_[init.ep_configs[i].ep_id.Number()]->SetEndpoint(init.ep_configs[i]);
+  }
+
+  CachedConfiguration conf{};
+  conf.identity = init.identity;
+  conf.config_value = init.config_value;
+  conf.has_class_driver = true;
+  conf.if_desc = init.driver_if_desc;
+  conf.num_ep_configs = init.num_ep_configs;
+  for (int i = 0; i < init.num_ep_configs; ++i) {
+    conf.ep_configs[i] = init.ep_configs[i];
   }
+  StoreCachedConfiguration(conf);
+
   initialize_phase_ = 4;
   is_initialized_ = true;
   return MAKE_ERROR(Error::kSuccess);
 }
 
+void Device::FreeInitData() {
+  if (init_ != nullptr) {
+    FreeMem(init_->config_buf);
+    FreeMem(init_);
+    init_ = nullptr;
+  }
+}
+
 Error GetDescriptor(Device &dev, EndpointID ep_id, uint8_t desc_type, uint8_t desc_index, void *buf,
                     int len, bool debug) {
   SetupData setup_data{};
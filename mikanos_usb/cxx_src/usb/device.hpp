@@ -7,17 +7,56 @@
 #pragma once
 
 #include "error.hpp"
-#include "usb/arraymap.hpp"
+#include "usb/descriptor_cache.hpp"
 #include "usb/endpoint.hpp"
 #include "usb/setupdata.hpp"
 
 #include <array>
+#include <cstddef>
 
 namespace usb {
 class ClassDriver;
+class HubDriver;
+
+/** @brief デバイスの通信速度 */
+enum class DeviceSpeed : uint8_t { kFull, kLow, kHigh, kSuper };
+
+/** @brief ハブクラスドライバがハブディスクリプタから読み取った，ホストコントローラに伝える情報 */
+struct HubConfig {
+  /** ダウンストリームポートの数 */
+  uint8_t num_ports;
+  /** TT Think Time（High Speed ハブのみ）．0 - 3 で，(n + 1) * 8 FS bit time を表す． */
+  uint8_t think_time;
+  /** Multi TT を有効にしているなら true */
+  bool multi_tt;
+};
+
+/** @brief 転送に用いるバッファの 1 区間．
+ *
+ * ホストコントローラが直接読み書きするため，buf は物理アドレスと一致
+ * していなければならない（アイデンティティマップされた領域を前提とする）．
+ */
+struct TransferSegment {
+  void *buf;
+  size_t len;
+};
+
+/** @brief アイソクロナス転送で 1 サービス間隔に送受信するパケット．
+ *
+ * buf と length は発行時に呼び出し側が設定する．buf は 64 KiB 境界を跨いではならない．
+ * actual_length と completion_code は完了時に書き込まれる．
+ */
+struct IsochPacket {
+  void *buf;
+  uint32_t length;
+  uint32_t actual_length;
+  /** xHCI の Completion Code．1（Success）か 13（Short Packet）なら受け渡しできている． */
+  uint8_t completion_code;
+};
 
 class Device {
 public:
+  /** @brief クラスドライバを破棄する． */
   virtual ~Device();
   virtual Error ControlIn(EndpointID ep_id, SetupData setup_data, void *buf, int len,
                           ClassDriver *issuer);
@@ -25,18 +64,92 @@ public:
                            ClassDriver *issuer);
   virtual Error InterruptIn(EndpointID ep_id, void *buf, int len);
   virtual Error InterruptOut(EndpointID ep_id, void *buf, int len);
+  /** @brief segments の各区間をつなげた領域へのバルク転送（IN）を開始する．
+   *
+   * 転送全体で 1 回だけ OnBulkCompleted が呼ばれる．
+   * バッファは転送が完了するまで呼び出し側が保持しなければならない．
+   */
+  virtual Error BulkIn(EndpointID ep_id, const TransferSegment *segments, int num_segments);
+  /** @brief segments の各区間をつなげた領域からのバルク転送（OUT）を開始する． */
+  virtual Error BulkOut(EndpointID ep_id, const TransferSegment *segments, int num_segments);
+  Error BulkIn(EndpointID ep_id, void *buf, int len);
+  Error BulkOut(EndpointID ep_id, const void *buf, int len);
+  /** @brief ストリームを使うバルクエンドポイントの stream_id 番のストリームで受信する．
+   *
+   * 完了は OnBulkCompleted で通知される．どのストリームの完了かは buf で見分ける．
+   */
+  virtual Error BulkStreamIn(EndpointID ep_id, uint16_t stream_id, void *buf, int len);
+  /** @brief ストリームを使うバルクエンドポイントの stream_id 番のストリームで送信する． */
+  virtual Error BulkStreamOut(EndpointID ep_id, uint16_t stream_id, const void *buf, int len);
+  /** @brief stream_id 番のストリームに積んだまま終わらない転送を全て取り消す．
+   *
+   * 取り消した転送の完了は通知されない．成功した時点でバッファと stream_id を
+   * 次の転送に使ってよい．
+   */
+  virtual Error CancelBulkStream(EndpointID ep_id, uint16_t stream_id);
+  /** @brief ep_id で使えるストリームの数．ストリーム ID は 1 から NumStreams() まで．使えなければ 0． */
+  virtual int NumStreams(EndpointID ep_id) const;
+  /** @brief ホストコントローラとデバイスがバルクストリームを扱えるか */
+  virtual bool SupportsStreams() const;
+  /** @brief packets の各パケットを連続するサービス間隔で受信するアイソクロナス転送を開始する．
+   *
+   * 前に発行した転送がまだ終わっていなければ，その直後のサービス間隔から続ける．
+   * 全パケットの転送が終わると OnIsochCompleted が 1 回だけ呼ばれ，パケットごとの結果は
+   * packets に書き込まれている．packets は完了まで呼び出し側が保持しなければならない．
+   */
+  virtual Error IsochIn(EndpointID ep_id, IsochPacket *packets, int num_packets);
+  /** @brief packets の各パケットを連続するサービス間隔で送信するアイソクロナス転送を開始する． */
+  virtual Error IsochOut(EndpointID ep_id, IsochPacket *packets, int num_packets);
+  /** @brief 以降に発行する転送をまとめ，EndBatch までホストコントローラに知らせない．
+   *
+   * 入れ子にでき，最も外側の EndBatch で転送を積んだエンドポイントごとに 1 回だけ
+   * ドアベルを鳴らす．通常は SubmissionBatch を使う．
+   */
+  virtual void BeginBatch();
+  virtual void EndBatch();
 
   Error StartInitialize();
   bool IsInitialized() { return is_initialized_; }
-  EndpointConfig *EndpointConfigs() { return ep_configs_.data(); }
-  int NumEndpointConfigs() { return num_ep_configs_; }
+  /** @brief 設定するエンドポイントの一覧．エンドポイントの設定が終わると nullptr になる． */
+  EndpointConfig *EndpointConfigs();
+  int NumEndpointConfigs();
   Error OnEndpointsConfigured();
+  /** @brief クラスドライバが 1 つ以上あり，その全てが ClassDriver::PrefersThroughput なら true． */
+  bool PrefersThroughput() const;
 
-  uint8_t *Buffer() { return buf_.data(); }
+  /** @brief このデバイスがハブなら，そのハブクラスドライバ．ハブでなければ nullptr． */
+  class HubDriver *HubDriver() const { return hub_driver_; }
+
+  // 以下はハブクラスドライバから呼ばれる．ポート番号は 1 から始まる．
+  virtual DeviceSpeed Speed() const;
+  /** @brief このデバイスとルートハブの間にあるハブの数 */
+  virtual int HubDepth() const;
+  /** @brief このデバイスをハブとしてホストコントローラに登録する． */
+  virtual Error ConfigureHub(const HubConfig &config);
+  /** @brief ダウンストリームポートへの接続を通知する．
+   *
+   * ホストコントローラはアドレスを割り当てる順番が来たら HubDriver::ResetPort を呼ぶ．
+   */
+  virtual Error OnHubPortConnected(uint8_t port_num);
+  /** @brief HubDriver::ResetPort によるリセットが完了し，ポートが有効になったことを通知する． */
+  virtual Error OnHubPortReset(uint8_t port_num, DeviceSpeed speed);
+  /** @brief ダウンストリームポートからの切断（またはリセットの失敗）を通知する． */
+  virtual Error OnHubPortDisconnected(uint8_t port_num);
 
 protected:
-  Error OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf, int len);
+  /** @brief コントロール転送の完了を通知する．
+   *
+   * issuer は ControlIn/ControlOut に渡された発行元．初期化後は issuer に完了を伝える．
+   */
+  Error OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf, int len,
+                           ClassDriver *issuer);
   Error OnInterruptCompleted(EndpointID ep_id, const void *buf, int len);
+  /** @brief バルク転送の完了を通知する．buf は先頭区間，len は全区間で転送できたバイト数． */
+  Error OnBulkCompleted(EndpointID ep_id, const void *buf, int len);
+  /** @brief バルク転送の失敗を通知する．buf は先頭区間． */
+  Error OnBulkFailed(EndpointID ep_id, const void *buf, int completion_code);
+  /** @brief アイソクロナス転送の完了を通知する．結果は各パケットに書き込まれている． */
+  Error OnIsochCompleted(EndpointID ep_id, IsochPacket *packets, int num_packets);
 
 private:
   /** @brief エンドポイントに割り当て済みのクラスドライバ．
@@ -45,12 +158,27 @@ private:
    * 添字 0 はどのクラスドライバからも使われないため，常に未使用．
    */
   std::array<ClassDriver *, 16> class_drivers_{};
+  class HubDriver *hub_driver_{nullptr};
 
-  std::array<uint8_t, 256> buf_{};
-
-  // following fields are used during initialization
-  uint8_t num_configurations_;
-  uint8_t config_index_;
+  /** @brief 初期化中だけ使うデータ．
+   *
+   * 初期化が終わったデバイスでは不要なので Device 本体には持たず，StartInitialize で
+   * メモリプールから確保し，エンドポイントの設定が終わったら解放する．
+   */
+  struct InitData {
+    std::array<uint8_t, 256> buf;
+    std::array<EndpointConfig, 16> ep_configs;
+    int num_ep_configs;
+    uint8_t num_configurations;
+    uint8_t config_index;
+    /** 構成のキャッシュのキーと，SetConfiguration が完了したら登録する内容 */
+    uint8_t config_value;
+    DeviceIdentity identity;
+    InterfaceDescriptor driver_if_desc;
+    /** buf に収まらないコンフィギュレーションディスクリプタを受け取るバッファ */
+    uint8_t *config_buf;
+  };
+  InitData *init_{nullptr};
 
   Error OnDeviceDescriptorReceived(const uint8_t *buf, int len);
   Error OnConfigurationDescriptorReceived(const uint8_t *buf, int len);
@@ -58,17 +186,27 @@ private:
 
   bool is_initialized_ = false;
   int initialize_phase_ = 0;
-  std::array<EndpointConfig, 16> ep_configs_;
-  int num_ep_configs_;
   Error InitializePhase1(const uint8_t *buf, int len);
   Error InitializePhase2(const uint8_t *buf, int len);
+  /** @brief コンフィギュレーションディスクリプタ全体を解析してクラスドライバを選ぶ． */
+  Error ParseConfiguration(const uint8_t *buf, int len);
   Error InitializePhase3(uint8_t config_value);
+  /** @brief キャッシュにあった構成でクラスドライバを作り，SetConfiguration を発行する． */
+  Error ApplyCachedConfiguration(const CachedConfiguration &conf);
   Error InitializePhase4();
+  void FreeInitData();
+};
 
-  /** OnControlCompleted の中で要求の発行元を特定するためのマップ構造．
-   * ControlOut または ControlIn を発行したときに発行元が登録される．
-   */
-  ArrayMap<SetupData, ClassDriver *, 4> event_waiters_{};
+/** @brief 生存期間中に dev へ発行した転送をまとめてホストコントローラに知らせる． */
+class SubmissionBatch {
+public:
+  explicit SubmissionBatch(Device &dev) : dev_{dev} { dev_.BeginBatch(); }
+  SubmissionBatch(const SubmissionBatch &) = delete;
+  SubmissionBatch &operator=(const SubmissionBatch &) = delete;
+  ~SubmissionBatch() { dev_.EndBatch(); }
+
+private:
+  Device &dev_;
 };
 
 Error GetDescriptor(Device &dev, EndpointID ep_id, uint8_t desc_type, uint8_t desc_index, void *buf,
@@ -61,5 +61,18 @@ struct EndpointConfig {
 
   /** このエンドポイントの制御周期（125*2^(interval-1) マイクロ秒） */
   int interval;
+
+  /** SuperSpeed Endpoint Companion の bMaxBurst（バースト 1 回あたりのパケット数 - 1） */
+  int max_burst;
+
+  /** バルクエンドポイントが扱えるストリーム数の指数（最大 2^max_streams 個）．0 ならストリームを使わない */
+  int max_streams;
+
+  /** UAS の Pipe Usage ディスクリプタに記載されたパイプの役割（1〜4）．無ければ 0 */
+  int pipe_id;
+
+  /** このエンドポイントを持つインタフェースの番号と代替設定 */
+  int interface_number;
+  int alternate_setting;
 };
 } // namespace usb
@@ -0,0 +1,115 @@
+#include "usb/input_queue.hpp"
+
+#include "usb/latency_trace.hpp"
+
+#include <algorithm>
+
+namespace {
+std::array<usb::InputQueue, static_cast<size_t>(usb::InputQueueID::kNumQueues)> queues{};
+usb::InputQueueNotifierType queue_notifier = nullptr;
+
+usb::PendingMotion pending_motion{};
+std::atomic<bool> mouse_coalescing{false};
+
+const uint64_t kMotionValid = 1;
+const int kMotionSeqShift = 1, kMotionSeqBits = 15;
+const uint64_t kMotionSeqMask = ((uint64_t{1} << kMotionSeqBits) - 1) << kMotionSeqShift;
+const int kMotionWheelShift = 16, kMotionWheelBits = 8;
+const int kMotionXShift = 24, kMotionXBits = 20;
+const int kMotionYShift = 44, kMotionYBits = 20;
+
+int32_t Unpack(uint64_t packed, int shift, int bits) {
+  const uint32_t value = (packed >> shift) & ((uint64_t{1} << bits) - 1);
+  const uint32_t sign = 1u << (bits - 1);
+  return static_cast<int32_t>((value ^ sign) - sign);
+}
+
+uint64_t Pack(int64_t value, int shift, int bits) {
+  const int64_t limit = int64_t{1} << (bits - 1);
+  const int64_t saturated = std::clamp(value, -limit, limit - 1);
+  return (static_cast<uint64_t>(saturated) & ((uint64_t{1} << bits) - 1)) << shift;
+}
+
+usb::MotionDelta UnpackMotion(uint64_t packed) {
+  if ((packed & kMotionValid) == 0) {
+    return usb::MotionDelta{0, 0, 0};
+  }
+  return usb::MotionDelta{Unpack(packed, kMotionXShift, kMotionXBits),
+                          Unpack(packed, kMotionYShift, kMotionYBits),
+                          Unpack(packed, kMotionWheelShift, kMotionWheelBits)};
+}
+} // namespace
+
+namespace usb {
+InputQueue *GetInputQueue(InputQueueID id) {
+  if (id >= InputQueueID::kNumQueues) {
+    return nullptr;
+  }
+  return &queues[static_cast<size_t>(id)];
+}
+
+void SetInputQueueNotifier(InputQueueNotifierType notifier) { queue_notifier = notifier; }
+
+bool PublishInput(InputQueueID id, const InputRecord &record) {
+  auto &queue = queues[static_cast<size_t>(id)];
+
+  const auto head = queue.head.load(std::memory_order_relaxed);
+  const auto tail = queue.tail.load(std::memory_order_acquire);
+  if (head - tail == InputQueue::kCapacity) {
+    queue.dropped.store(queue.dropped.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_relaxed);
+    return false;
+  }
+
+  queue.records[head & (InputQueue::kCapacity - 1)] = record;
+  TraceInputPublished(static_cast<uint32_t>(id), head);
+  queue.head.store(head + 1, std::memory_order_release);
+
+  // コンシューマは空のキューを見てから待ちに入るので，空でなくなったときだけ起こせば良い．
+  // 書き込みの間にコンシューマが追いついた場合も取りこぼさないよう，tail は読み直す．
+  // （コンシューマ側も待ちに入る前にフェンスを置いて head を読み直す）
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (queue.tail.load(std::memory_order_relaxed) == head && queue_notifier) {
+    queue_notifier(static_cast<uint32_t>(id));
+  }
+  return true;
+}
+
+PendingMotion *GetPendingMotion() { return &pending_motion; }
+
+void SetMouseCoalescing(bool enabled) {
+  mouse_coalescing.store(enabled, std::memory_order_relaxed);
+}
+
+bool MouseCoalescingEnabled() { return mouse_coalescing.load(std::memory_order_relaxed); }
+
+void AccumulateMotion(const MotionDelta &delta) {
+  const auto &queue = queues[static_cast<size_t>(InputQueueID::kMouse)];
+
+  // コンシューマは exchange で取り出すだけなので，CAS が失敗するのは取り出された時だけ
+  uint64_t old = pending_motion.packed.load(std::memory_order_relaxed);
+  uint64_t desired;
+  do {
+    const auto sum = UnpackMotion(old);
+    // たまり始めた時点より後のレコードは，この移動量より後の入力になる
+    const uint64_t seq = (old & kMotionValid)
+                             ? old & kMotionSeqMask
+                             : (uint64_t{queue.head.load(std::memory_order_relaxed)}
+                                << kMotionSeqShift) &
+                                   kMotionSeqMask;
+    desired = kMotionValid | seq |
+              Pack(int64_t{sum.wheel} + delta.wheel, kMotionWheelShift, kMotionWheelBits) |
+              Pack(int64_t{sum.x} + delta.x, kMotionXShift, kMotionXBits) |
+              Pack(int64_t{sum.y} + delta.y, kMotionYShift, kMotionYBits);
+  } while (!pending_motion.packed.compare_exchange_weak(old, desired, std::memory_order_release,
+                                                        std::memory_order_relaxed));
+
+  if ((old & kMotionValid) == 0 && queue_notifier) {
+    queue_notifier(static_cast<uint32_t>(InputQueueID::kMouse));
+  }
+}
+
+MotionDelta TakeMotion() {
+  return UnpackMotion(pending_motion.packed.exchange(0, std::memory_order_acquire));
+}
+} // namespace usb
@@ -0,0 +1,103 @@
+/**
+ * @file usb/input_queue.hpp
+ *
+ * HID ドライバから Rust 側へ入力を渡すための lock-free な SPSC キュー．
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+namespace usb {
+/** @brief キューで受け渡す固定長の入力レコード */
+struct InputRecord {
+  /** マウスのボタン，またはキーボードのモディファイアキー */
+  uint8_t buttons;
+  /** キーボードのキーコード */
+  uint8_t keycode;
+  /** マウスのホイールの回転量 */
+  int8_t wheel;
+  /** キーボードのキーが離されたなら 1，押されたなら 0 */
+  uint8_t released;
+  int16_t displacement_x;
+  int16_t displacement_y;
+};
+static_assert(sizeof(InputRecord) == 8);
+
+enum class InputQueueID : uint32_t {
+  kMouse,
+  kKeyboard,
+  kNumQueues, // この列挙子は常に最後に配置する
+};
+
+/** @brief 単一プロデューサ（C++ の HID ドライバ）・単一コンシューマ（Rust）のリングバッファ．
+ *
+ * メモリレイアウトは Rust 側の mikanos_usb::input::InputQueue と一致させている．
+ * プロデューサとコンシューマが書き換える変数はそれぞれ別のキャッシュラインに置く．
+ */
+struct InputQueue {
+  /** 要素数．インデックスの計算をマスクで済ませるため 2 のべき乗にする． */
+  static const uint32_t kCapacity = 256;
+
+  /** 次に書き込む位置（プロデューサのみが書き換える） */
+  alignas(64) std::atomic<uint32_t> head;
+  /** キューが満杯で捨てたレコードの数（プロデューサのみが書き換える） */
+  std::atomic<uint32_t> dropped;
+  /** 次に読み出す位置（コンシューマのみが書き換える） */
+  alignas(64) std::atomic<uint32_t> tail;
+  alignas(64) std::array<InputRecord, kCapacity> records;
+};
+static_assert(sizeof(InputQueue) == 128 + sizeof(InputRecord) * InputQueue::kCapacity);
+
+/** @brief キューが空でなくなったときに呼ばれる関数． */
+using InputQueueNotifierType = void (*)(uint32_t queue_id);
+
+InputQueue *GetInputQueue(InputQueueID id);
+void SetInputQueueNotifier(InputQueueNotifierType notifier);
+
+/** @brief レコードをキューに追加する．
+ *
+ * キューが空から空でない状態に変わったときだけ通知関数を呼ぶ．
+ * 満杯ならレコードを捨てて false を返す．
+ */
+bool PublishInput(InputQueueID id, const InputRecord &record);
+
+/** @brief コンシューマが読み出すまでにたまったマウスの移動量（移動量の合体モード用）．
+ *
+ * 1 つの 64 ビット値に詰めて読み書きするので，移動量の和と，それがマウスのキューの
+ * どのレコードより後の移動なのかが常にそろって見える．値 0 は「たまっていない」を表す．
+ *
+ * - ビット 0: 1 ならたまっている
+ * - ビット 1 - 15: たまり始めたときのキューの head の下位 15 ビット．
+ *   コンシューマはこれより前のレコードを処理してから移動量を反映する．
+ * - ビット 16 - 23: ホイール（符号付き 8 ビット）
+ * - ビット 24 - 43: X（符号付き 20 ビット）
+ * - ビット 44 - 63: Y（符号付き 20 ビット）
+ *
+ * メモリレイアウトとビット配置は Rust 側の mikanos_usb::input::PendingMotion と一致させている．
+ */
+struct PendingMotion {
+  alignas(64) std::atomic<uint64_t> packed;
+};
+
+/** @brief 合体した移動量 */
+struct MotionDelta {
+  int32_t x, y, wheel;
+};
+
+PendingMotion *GetPendingMotion();
+/** @brief マウスの移動量の合体モードを切り替える．コンシューマが対応している場合にだけ有効にする． */
+void SetMouseCoalescing(bool enabled);
+bool MouseCoalescingEnabled();
+
+/** @brief 移動量を PendingMotion に足し込む．
+ *
+ * たまっていない状態からたまった状態に変わったときだけマウスのキューの通知関数を呼ぶ．
+ * 各成分は PendingMotion のビット幅で飽和する．
+ */
+void AccumulateMotion(const MotionDelta &delta);
+/** @brief たまっている移動量を取り出して 0 にする（プロデューサ側）． */
+MotionDelta TakeMotion();
+} // namespace usb
@@ -0,0 +1,177 @@
+#include "usb/latency_trace.hpp"
+
+#include "usb/input_queue.hpp"
+
+namespace usb {
+#ifndef MIKANOS_USB_LATENCY_TRACE
+
+void _TraceDoorbell(uint8_t slot_id, uint8_t dci, uint64_t tsc) {}
+void _TraceEventArrival(uint8_t slot_id, uint8_t dci, uint64_t tsc) {}
+void _TraceMark(TraceStage stage, uint64_t tsc) {}
+void _TraceInputPublished(uint32_t queue_id, uint32_t seq, uint64_t tsc) {}
+void _TraceInputConsumed(uint32_t queue_id, uint32_t seq, uint64_t tsc) {}
+void _TraceDuration(TraceStage stage, uint64_t begin_tsc, uint64_t end_tsc, uint8_t slot_id,
+                    uint8_t dci) {}
+void _TraceEnumerationStart(uint8_t slot_id, uint64_t begin_tsc) {}
+void _TraceEnumerationDone(uint8_t slot_id, uint64_t tsc) {}
+bool GetLatencyHistogram(TraceStage stage, LatencyHistogram &out) { return false; }
+size_t ReadTraceRecords(TraceRecord *buf, size_t max_records) { return 0; }
+void ResetLatencyTrace() {}
+
+#else // MIKANOS_USB_LATENCY_TRACE
+
+namespace {
+const size_t kNumStages = static_cast<size_t>(TraceStage::kNumStages);
+/** ドアベルの時刻を記録するスロットの数．これ以上のスロット ID は計測しない． */
+const size_t kMaxTracedSlots = 32;
+/** 要素数．インデックスの計算をマスクで済ませるため 2 のべき乗にする． */
+const size_t kTraceBufferSize = 1024;
+
+std::array<LatencyHistogram, kNumStages> histograms{};
+
+std::array<TraceRecord, kTraceBufferSize> trace_buffer{};
+/** 次に書き込む位置と次に読み出す位置．どちらも単調に増加する． */
+size_t trace_head = 0;
+size_t trace_tail = 0;
+
+/** スロット・DCI ごとの直前のドアベルの時刻．0 なら未記録． */
+std::array<std::array<uint64_t, 32>, kMaxTracedSlots> doorbell_tsc{};
+
+/** スロットごとの，接続を検出した時刻．0 なら列挙中ではない． */
+std::array<uint64_t, kMaxTracedSlots> enumeration_tsc{};
+
+/** 処理中の転送イベントが最後に通過した段階 */
+struct Chain {
+  bool active;
+  TraceStage stage;
+  uint64_t tsc;
+  uint8_t slot_id;
+  uint8_t dci;
+} chain{};
+
+/** 入力キューの各エントリを追加した時刻 */
+std::array<std::array<uint64_t, InputQueue::kCapacity>,
+           static_cast<size_t>(InputQueueID::kNumQueues)>
+    publish_tsc{};
+
+int BucketOf(uint64_t cycles) {
+  const int bucket = cycles <= 1 ? 0 : 63 - __builtin_clzll(cycles);
+  return bucket < LatencyHistogram::kNumBuckets ? bucket : LatencyHistogram::kNumBuckets - 1;
+}
+
+void Record(TraceStage stage, uint64_t tsc, uint64_t latency, bool has_latency, uint8_t slot_id,
+            uint8_t dci) {
+  if (has_latency) {
+    auto &h = histograms[static_cast<size_t>(stage)];
+    ++h.count;
+    h.total_cycles += latency;
+    h.max_cycles = latency > h.max_cycles ? latency : h.max_cycles;
+    ++h.buckets[BucketOf(latency)];
+  } else {
+    ++histograms[static_cast<size_t>(stage)].count;
+  }
+
+  trace_buffer[trace_head % kTraceBufferSize] = TraceRecord{
+      tsc, latency > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(latency), stage, slot_id,
+      dci, 0};
+  ++trace_head;
+  if (trace_head - trace_tail > kTraceBufferSize) {
+    ++trace_tail;
+  }
+}
+} // namespace
+
+void _TraceDoorbell(uint8_t slot_id, uint8_t dci, uint64_t tsc) {
+  if (slot_id < kMaxTracedSlots && dci < 32) {
+    doorbell_tsc[slot_id][dci] = tsc;
+  }
+  Record(TraceStage::kDoorbell, tsc, 0, false, slot_id, dci);
+}
+
+void _TraceEventArrival(uint8_t slot_id, uint8_t dci, uint64_t tsc) {
+  uint64_t last_doorbell = 0;
+  if (slot_id < kMaxTracedSlots && dci < 32) {
+    last_doorbell = doorbell_tsc[slot_id][dci];
+  }
+  const bool has_latency = last_doorbell != 0 && last_doorbell <= tsc;
+  Record(TraceStage::kEventArrival, tsc, has_latency ? tsc - last_doorbell : 0, has_latency,
+         slot_id, dci);
+  chain = Chain{true, TraceStage::kEventArrival, tsc, slot_id, dci};
+}
+
+void _TraceMark(TraceStage stage, uint64_t tsc) {
+  if (!chain.active || stage <= chain.stage) {
+    // イベントの処理の外から呼ばれた
+    return;
+  }
+  Record(stage, tsc, tsc - chain.tsc, true, chain.slot_id, chain.dci);
+  chain.stage = stage;
+  chain.tsc = tsc;
+}
+
+void _TraceInputPublished(uint32_t queue_id, uint32_t seq, uint64_t tsc) {
+  if (queue_id < publish_tsc.size()) {
+    publish_tsc[queue_id][seq % InputQueue::kCapacity] = tsc;
+  }
+  // 入力キューに渡したらこのイベントの処理は終わり
+  chain.active = false;
+}
+
+void _TraceInputConsumed(uint32_t queue_id, uint32_t seq, uint64_t tsc) {
+  if (queue_id >= publish_tsc.size()) {
+    return;
+  }
+  auto &published = publish_tsc[queue_id][seq % InputQueue::kCapacity];
+  if (published == 0 || published > tsc) {
+    return;
+  }
+  Record(TraceStage::kObserverReturn, tsc, tsc - published, true, 0, 0);
+  published = 0;
+}
+
+void _TraceDuration(TraceStage stage, uint64_t begin_tsc, uint64_t end_tsc, uint8_t slot_id,
+                    uint8_t dci) {
+  if (begin_tsc == 0 || begin_tsc > end_tsc) {
+    return;
+  }
+  Record(stage, end_tsc, end_tsc - begin_tsc, true, slot_id, dci);
+}
+
+void _TraceEnumerationStart(uint8_t slot_id, uint64_t begin_tsc) {
+  if (slot_id < kMaxTracedSlots) {
+    enumeration_tsc[slot_id] = begin_tsc;
+  }
+}
+
+void _TraceEnumerationDone(uint8_t slot_id, uint64_t tsc) {
+  if (slot_id >= kMaxTracedSlots) {
+    return;
+  }
+  _TraceDuration(TraceStage::kEnumeration, enumeration_tsc[slot_id], tsc, slot_id, 0);
+  enumeration_tsc[slot_id] = 0;
+}
+
+bool GetLatencyHistogram(TraceStage stage, LatencyHistogram &out) {
+  if (stage >= TraceStage::kNumStages) {
+    return false;
+  }
+  out = histograms[static_cast<size_t>(stage)];
+  return true;
+}
+
+size_t ReadTraceRecords(TraceRecord *buf, size_t max_records) {
+  size_t n = 0;
+  while (n < max_records && trace_tail != trace_head) {
+    buf[n++] = trace_buffer[trace_tail % kTraceBufferSize];
+    ++trace_tail;
+  }
+  return n;
+}
+
+void ResetLatencyTrace() {
+  histograms = {};
+  trace_head = trace_tail = 0;
+}
+
+#endif // MIKANOS_USB_LATENCY_TRACE
+} // namespace usb
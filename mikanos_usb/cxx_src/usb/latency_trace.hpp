@@ -0,0 +1,163 @@
+/**
+ * @file usb/latency_trace.hpp
+ *
+ * 転送の開始から Rust 側での入力処理までの遅延と，ホットパスの処理時間を TSC で計測する仕組み．
+ *
+ * MIKANOS_USB_LATENCY_TRACE を定義してビルドしたときだけ記録する．
+ * 定義しなければ各計測点は空のインライン関数になる．
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace usb {
+#ifdef MIKANOS_USB_LATENCY_TRACE
+constexpr bool kLatencyTraceEnabled = true;
+#else
+constexpr bool kLatencyTraceEnabled = false;
+#endif
+
+/** @brief 計測点．各段階の遅延は 1 つ前の段階からの経過時間として集計する． */
+enum class TraceStage : uint8_t {
+  /** エンドポイントのドアベルを鳴らした（遅延は集計しない） */
+  kDoorbell,
+  /** 転送イベントをイベントリングから取り出した（同じエンドポイントの直前のドアベルから） */
+  kEventArrival,
+  /** Device::OnTransferEventReceived に入った */
+  kTransferEvent,
+  /** クラスドライバの OnDataReceived を呼び出す直前 */
+  kDataReceived,
+  /** Rust 側が入力レコードを処理し終えた（入力キューへの追加から） */
+  kObserverReturn,
+
+  // 以下は 1 つの処理にかかった時間を TraceBegin/TraceEnd で計測する
+
+  /** 1 つのイベントの処理（DispatchEvent）にかかった時間 */
+  kEventDispatch,
+  /** Ring::Push で 1 つの TRB を書き込むのにかかった時間（TSC の読み出し 1 回分を含む） */
+  kRingPush,
+  /** 接続の検出から，エンドポイントを構成してクラスドライバに渡すまでの時間 */
+  kEnumeration,
+  kNumStages, // この列挙子は常に最後に配置する
+};
+
+/** @brief 1 つの段階の遅延（TSC のサイクル数）の分布 */
+struct LatencyHistogram {
+  /** buckets[i] は [2^i, 2^(i+1)) サイクルの遅延の数（buckets[0] は 0 と 1 を含む） */
+  static const int kNumBuckets = 32;
+
+  uint64_t count;
+  uint64_t total_cycles;
+  uint64_t max_cycles;
+  std::array<uint32_t, kNumBuckets> buckets;
+};
+
+/** @brief トレースバッファの 1 レコード */
+struct TraceRecord {
+  uint64_t tsc;
+  /** 1 つ前の段階からの遅延か処理時間（サイクル数，32 ビットで飽和する） */
+  uint32_t latency_cycles;
+  TraceStage stage;
+  uint8_t slot_id;
+  uint8_t dci;
+  uint8_t reserved;
+};
+static_assert(sizeof(TraceRecord) == 16);
+
+inline uint64_t ReadTSC() {
+  uint32_t lo, hi;
+  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return static_cast<uint64_t>(hi) << 32 | lo;
+}
+
+void _TraceDoorbell(uint8_t slot_id, uint8_t dci, uint64_t tsc);
+void _TraceEventArrival(uint8_t slot_id, uint8_t dci, uint64_t tsc);
+void _TraceMark(TraceStage stage, uint64_t tsc);
+void _TraceInputPublished(uint32_t queue_id, uint32_t seq, uint64_t tsc);
+void _TraceInputConsumed(uint32_t queue_id, uint32_t seq, uint64_t tsc);
+void _TraceDuration(TraceStage stage, uint64_t begin_tsc, uint64_t end_tsc, uint8_t slot_id,
+                    uint8_t dci);
+void _TraceEnumerationStart(uint8_t slot_id, uint64_t begin_tsc);
+void _TraceEnumerationDone(uint8_t slot_id, uint64_t tsc);
+
+inline void TraceDoorbell(uint8_t slot_id, uint8_t dci) {
+  if constexpr (kLatencyTraceEnabled) {
+    _TraceDoorbell(slot_id, dci, ReadTSC());
+  }
+}
+
+/** @brief 転送イベントの処理を始める．以降の TraceMark はこのイベントの続きとして扱う． */
+inline void TraceEventArrival(uint8_t slot_id, uint8_t dci) {
+  if constexpr (kLatencyTraceEnabled) {
+    _TraceEventArrival(slot_id, dci, ReadTSC());
+  }
+}
+
+/** @brief 処理中の転送イベントが stage に達したことを記録する． */
+inline void TraceMark(TraceStage stage) {
+  if constexpr (kLatencyTraceEnabled) {
+    _TraceMark(stage, ReadTSC());
+  }
+}
+
+/** @brief 入力キューの seq 番目に追加したレコードの時刻を記録する． */
+inline void TraceInputPublished(uint32_t queue_id, uint32_t seq) {
+  if constexpr (kLatencyTraceEnabled) {
+    _TraceInputPublished(queue_id, seq, ReadTSC());
+  }
+}
+
+/** @brief 入力キューの seq 番目のレコードが処理し終わった（Rust 側から呼ばれる）． */
+inline void TraceInputConsumed(uint32_t queue_id, uint32_t seq) {
+  if constexpr (kLatencyTraceEnabled) {
+    _TraceInputConsumed(queue_id, seq, ReadTSC());
+  }
+}
+
+/** @brief 処理時間の計測を始める．計測が無効なら 0 を返す． */
+inline uint64_t TraceBegin() {
+  if constexpr (kLatencyTraceEnabled) {
+    return ReadTSC();
+  }
+  return 0;
+}
+
+/** @brief TraceBegin が返した時刻からの経過時間を stage の処理時間として記録する． */
+inline void TraceEnd(TraceStage stage, uint64_t begin_tsc, uint8_t slot_id = 0,
+                     uint8_t dci = 0) {
+  if constexpr (kLatencyTraceEnabled) {
+    _TraceDuration(stage, begin_tsc, ReadTSC(), slot_id, dci);
+  }
+}
+
+/** @brief TraceBegin で得た接続の検出時刻を，割り当てたスロットに結び付ける． */
+inline void TraceEnumerationStart(uint8_t slot_id, uint64_t begin_tsc) {
+  if constexpr (kLatencyTraceEnabled) {
+    _TraceEnumerationStart(slot_id, begin_tsc);
+  }
+}
+
+/** @brief スロットの構成が終わった．kEnumeration の処理時間として記録する． */
+inline void TraceEnumerationDone(uint8_t slot_id) {
+  if constexpr (kLatencyTraceEnabled) {
+    _TraceEnumerationDone(slot_id, ReadTSC());
+  }
+}
+
+/** @brief stage の遅延の分布を out にコピーする．計測が無効なら false を返す． */
+bool GetLatencyHistogram(TraceStage stage, LatencyHistogram &out);
+
+/** @brief トレースバッファから古い順に高々 max_records 個のレコードを取り出す．
+ *
+ * バッファが溢れた場合は古いレコードから上書きされる．
+ *
+ * @return 取り出したレコードの数
+ */
+size_t ReadTraceRecords(TraceRecord *buf, size_t max_records);
+
+/** @brief 分布とトレースバッファを空にする． */
+void ResetLatencyTrace();
+} // namespace usb
@@ -1,6 +1,12 @@
 #include "usb/memory.hpp"
 
+#include "cxx_support.h"
+#include "usb/spinlock.hpp"
+
+#include <algorithm>
+#include <array>
 #include <cstdint>
+#include <cstring>
 
 namespace {
 template <class T> T Ceil(T value, unsigned int alignment) {
@@ -10,37 +16,441 @@ template <class T> T Ceil(T value, unsigned int alignment) {
 template <class T, class U> T MaskBits(T value, U mask) {
   return value & ~static_cast<T>(mask - 1);
 }
+
+/* メモリプールはページ（4 KiB）単位で管理する．
+ *
+ * 2 KiB 以下の要求は 2 のべき乗サイズのブロック（64 B - 2 KiB）に切り上げ，
+ * 同じサイズのブロックを 1 ページに敷き詰めたスラブから割り当てる．
+ * ブロックはサイズの倍数のアドレスに配置されるため，alignment がブロック
+ * サイズ以下なら自動的に満たされ，boundary（2 のべき乗）がブロックサイズ以上
+ * なら境界を跨ぐこともない．
+ * それより大きい要求は連続したページを first-fit で割り当てる．
+ *
+ * プールは物理的に連続した複数の領域からなる．最初の領域は SetMemoryPool で与えられ，
+ * 空きが足りなくなるとカーネルから領域を追加でもらう（sabios_alloc_dma_frames）．
+ * 追加した領域は全て空になったら返す．ページ番号は全領域で通し番号にする．
+ *
+ * プールは全てのホストコントローラで共有し，コントローラのロックの外（非同期転送の
+ * 結果を受け取った側）からも解放されるので，pool_lock で守る．
+ * カーネルのメモリ管理はページテーブルとフレームのロックを取り，カーネル側はそれらを
+ * 保持したまま SetMemoryPool を呼ぶことがある．ロックの順序が逆にならないよう，
+ * sabios_alloc_dma_frames と sabios_free_dma_frames は pool_lock を離してから呼ぶ．
+ */
+const size_t kPageSize = 4096;
+const unsigned int kMinBlockShift = 6;  // 64 B: TRB リングやコンテキストの最小アライメント
+const unsigned int kMaxBlockShift = 11; // 2 KiB
+const size_t kNumSizeClasses = kMaxBlockShift - kMinBlockShift + 1;
+const size_t kMaxPoolPages = 4096;
+const size_t kMaxRegions = 16;
+/** 一度に追加する領域のページ数の最小値 */
+const size_t kMinGrowPages = 16;
+const uint16_t kNil = 0xffff;
+
+enum class PageKind : uint8_t {
+  kFree,
+  kSlab,      // size_class のブロックに分割されたページ
+  kLargeHead, // 複数ページにわたる割り当ての先頭ページ
+  kLargeTail, // 複数ページにわたる割り当ての 2 ページ目以降
+};
+
+struct PageInfo {
+  PageKind kind;
+  uint8_t size_class;
+  /** kSlab: 使用中のブロック数．kLargeHead: 割り当てたページ数． */
+  uint16_t count;
+  /** kSlab: ページ内の空きブロックリストの先頭（ブロック番号）．無ければ kNil． */
+  uint16_t free_block;
+  /** kSlab: 空きブロックを持つスラブページのリスト（size_class ごと） */
+  uint16_t prev, next;
+};
+
+struct Region {
+  /** 先頭アドレス．0 なら使われていない． */
+  uintptr_t base;
+  /** 先頭ページのページ番号 */
+  uint16_t first_page;
+  /** 予約しているページ番号の数．領域を返した後も同じ番号を次の領域に使い回す． */
+  uint16_t capacity;
+  uint16_t num_pages;
+  /** 空きでないページの数 */
+  uint16_t used_pages;
+};
+
+std::array<PageInfo, kMaxPoolPages> pages{};
+std::array<uint8_t, kMaxPoolPages> page_regions{};
+std::array<uint16_t, kNumSizeClasses> partial_slabs{};
+std::array<Region, kMaxRegions> regions{};
+/** 予約済みのページ番号の数 */
+size_t num_reserved_pages = 0;
+/** 全領域の空きページの数 */
+size_t num_free_pages = 0;
+usb::SpinLock pool_lock;
+
+uintptr_t PageAddr(size_t page) {
+  const auto &region = regions[page_regions[page]];
+  return region.base + (page - region.first_page) * kPageSize;
+}
+
+/** @brief addr を含むページのページ番号．プール外なら kNil． */
+uint16_t PageOf(uintptr_t addr) {
+  for (const auto &region : regions) {
+    if (region.base != 0 && region.base <= addr &&
+        addr < region.base + region.num_pages * kPageSize) {
+      return region.first_page + (addr - region.base) / kPageSize;
+    }
+  }
+  return kNil;
+}
+
+unsigned int BlockShift(size_t size_class) { return kMinBlockShift + size_class; }
+
+/** 空き領域の先頭 2 バイトに次の空きブロック番号を格納する． */
+uint16_t &NextFreeBlock(uintptr_t block_addr) { return *reinterpret_cast<uint16_t *>(block_addr); }
+
+void PushPartial(size_t size_class, uint16_t page) {
+  pages[page].prev = kNil;
+  pages[page].next = partial_slabs[size_class];
+  if (partial_slabs[size_class] != kNil) {
+    pages[partial_slabs[size_class]].prev = page;
+  }
+  partial_slabs[size_class] = page;
+}
+
+void RemovePartial(size_t size_class, uint16_t page) {
+  auto &info = pages[page];
+  if (info.prev != kNil) {
+    pages[info.prev].next = info.next;
+  } else {
+    partial_slabs[size_class] = info.next;
+  }
+  if (info.next != kNil) {
+    pages[info.next].prev = info.prev;
+  }
+  info.prev = info.next = kNil;
+}
+
+bool CrossesBoundary(uintptr_t addr, size_t size, unsigned int boundary) {
+  return boundary > 0 && size <= boundary && addr / boundary != (addr + size - 1) / boundary;
+}
+
+/** @brief [base, base + num_pages * kPageSize) を新しい領域として追加する．
+ *
+ * @return 追加できたら true
+ */
+bool AddRegion(uintptr_t base, size_t num_pages) {
+  if (base == 0 || num_pages == 0) {
+    return false;
+  }
+  // 返した領域のページ番号を使い回せるならそうする
+  Region *slot = nullptr;
+  for (auto &region : regions) {
+    if (region.base == 0 && region.capacity >= num_pages &&
+        (slot == nullptr || region.capacity < slot->capacity)) {
+      slot = &region;
+    }
+  }
+  if (slot == nullptr) {
+    if (num_pages > kMaxPoolPages - num_reserved_pages) {
+      return false;
+    }
+    for (auto &region : regions) {
+      if (region.base == 0 && region.capacity == 0) {
+        slot = &region;
+        break;
+      }
+    }
+    if (slot == nullptr) {
+      return false;
+    }
+    slot->first_page = num_reserved_pages;
+    slot->capacity = num_pages;
+    num_reserved_pages += num_pages;
+  }
+
+  slot->base = base;
+  slot->num_pages = num_pages;
+  slot->used_pages = 0;
+  for (size_t i = slot->first_page; i < slot->first_page + num_pages; ++i) {
+    pages[i] = PageInfo{};
+    page_regions[i] = slot - regions.begin();
+  }
+  num_free_pages += num_pages;
+  return true;
+}
+
+/** @brief num_pages 個のページを連続して割り当てるために追加する領域のページ数． */
+size_t GrowPages(size_t num_pages, unsigned int alignment, unsigned int boundary) {
+  // 追加した領域の先頭はページ境界にしか揃っていないので，制約を満たせるだけ余分にもらう
+  size_t extra = 0;
+  if (alignment > kPageSize) {
+    extra += alignment / kPageSize - 1;
+  }
+  if (boundary > kPageSize && num_pages * kPageSize <= boundary) {
+    extra += num_pages - 1;
+  }
+  return std::max(num_pages + extra, kMinGrowPages);
+}
+
+/** @brief カーネルから grow_pages ページの領域をもらってプールに追加する．
+ *
+ * pool_lock を保持せずに呼ぶ．
+ */
+bool GrowPool(size_t grow_pages) {
+  const uintptr_t base = sabios_alloc_dma_frames(grow_pages);
+  if (base == 0) {
+    return false;
+  }
+  bool added;
+  {
+    usb::LockGuard lock{pool_lock};
+    added = AddRegion(base, grow_pages);
+  }
+  if (!added) {
+    sabios_free_dma_frames(base, grow_pages);
+  }
+  return added;
+}
+
+/** プールから外した，カーネルに返す領域．base が 0 なら返すものは無い． */
+struct ReleasedRegion {
+  uintptr_t base;
+  size_t num_pages;
+};
+
+/** @brief 空ページを返した後に呼ぶ．追加した領域が全て空になったらプールから外す．
+ *
+ * @return カーネルに返す領域．pool_lock を離してから sabios_free_dma_frames に渡す．
+ */
+ReleasedRegion OnPagesFreed(uint16_t page, size_t num_pages) {
+  const auto index = page_regions[page];
+  auto &region = regions[index];
+  region.used_pages -= num_pages;
+  num_free_pages += num_pages;
+
+  // 最初の領域は返さない．割り当てと解放を繰り返す度に領域を出し入れしないよう，
+  // 他の領域に十分な空きがあるときだけ返す．
+  if (index == 0 || region.used_pages != 0 ||
+      num_free_pages - region.num_pages < kMinGrowPages) {
+    return {};
+  }
+  const ReleasedRegion released{region.base, region.num_pages};
+  num_free_pages -= region.num_pages;
+  region.base = 0;
+  region.num_pages = 0;
+  return released;
+}
+
+/** @brief region の中で連続した num_pages 個の空きページを探して割り当てる．
+ *
+ * @return 先頭ページ番号．確保できなかった場合は kNil．
+ */
+uint16_t AllocPagesIn(Region &region, size_t num_pages, unsigned int alignment,
+                      unsigned int boundary) {
+  const size_t size = num_pages * kPageSize;
+  size_t start = 0;
+  while (start + num_pages <= region.num_pages) {
+    const auto addr = region.base + start * kPageSize;
+    if (alignment > kPageSize && addr % alignment != 0) {
+      start = (Ceil(addr, alignment) - region.base) / kPageSize;
+      continue;
+    }
+    if (CrossesBoundary(addr, size, boundary)) {
+      start = (Ceil(addr + 1, boundary) - region.base) / kPageSize;
+      continue;
+    }
+
+    const size_t first = region.first_page + start;
+    size_t used = first;
+    while (used < first + num_pages && pages[used].kind == PageKind::kFree) {
+      ++used;
+    }
+    if (used == first + num_pages) {
+      pages[first].kind = PageKind::kLargeHead;
+      pages[first].count = num_pages;
+      for (size_t i = first + 1; i < first + num_pages; ++i) {
+        pages[i].kind = PageKind::kLargeTail;
+      }
+      region.used_pages += num_pages;
+      num_free_pages -= num_pages;
+      return first;
+    }
+    start = used - region.first_page + 1;
+  }
+  return kNil;
+}
+
+/** @brief 連続した num_pages 個の空きページを探して割り当てる．
+ *
+ * プールは拡張しない．
+ *
+ * @return 先頭ページ番号．確保できなかった場合は kNil．
+ */
+uint16_t AllocPages(size_t num_pages, unsigned int alignment, unsigned int boundary) {
+  if (num_pages > num_free_pages) {
+    return kNil;
+  }
+  for (auto &region : regions) {
+    if (region.base == 0 || static_cast<size_t>(region.num_pages - region.used_pages) < num_pages) {
+      continue;
+    }
+    const auto page = AllocPagesIn(region, num_pages, alignment, boundary);
+    if (page != kNil) {
+      return page;
+    }
+  }
+  return kNil;
+}
+
+ReleasedRegion FreePages(uint16_t page) {
+  const size_t num_pages = pages[page].count;
+  for (size_t i = page; i < page + num_pages; ++i) {
+    pages[i] = PageInfo{};
+  }
+  return OnPagesFreed(page, num_pages);
+}
+void *AllocBlock(size_t size_class) {
+  const auto shift = BlockShift(size_class);
+  uint16_t page = partial_slabs[size_class];
+  if (page == kNil) {
+    page = AllocPages(1, 0, 0);
+    if (page == kNil) {
+      return nullptr;
+    }
+
+    auto &info = pages[page];
+    info.kind = PageKind::kSlab;
+    info.size_class = size_class;
+    info.count = 0;
+    info.free_block = 0;
+    const uint16_t num_blocks = kPageSize >> shift;
+    for (uint16_t i = 0; i < num_blocks; ++i) {
+      NextFreeBlock(PageAddr(page) + (i << shift)) = i + 1 < num_blocks ? i + 1 : kNil;
+    }
+    PushPartial(size_class, page);
+  }
+
+  auto &info = pages[page];
+  const auto block_addr = PageAddr(page) + (info.free_block << shift);
+  info.free_block = NextFreeBlock(block_addr);
+  ++info.count;
+  if (info.free_block == kNil) {
+    RemovePartial(size_class, page);
+  }
+  return reinterpret_cast<void *>(block_addr);
+}
+
+ReleasedRegion FreeBlock(uint16_t page, uintptr_t block_addr) {
+  auto &info = pages[page];
+  const auto shift = BlockShift(info.size_class);
+  const bool was_full = info.free_block == kNil;
+
+  NextFreeBlock(block_addr) = info.free_block;
+  info.free_block = (block_addr - PageAddr(page)) >> shift;
+  --info.count;
+
+  if (info.count == 0) {
+    // 空になったスラブページはプールへ返し，他のサイズで再利用できるようにする
+    if (!was_full) {
+      RemovePartial(info.size_class, page);
+    }
+    info = PageInfo{};
+    return OnPagesFreed(page, 1);
+  }
+  if (was_full) {
+    PushPartial(info.size_class, page);
+  }
+  return {};
+}
 } // namespace
 
 namespace usb {
-size_t memory_pool_size = 0;
-uintptr_t pool_base_ptr = 0;
-uintptr_t alloc_ptr = 0;
-
 void SetMemoryPool(uintptr_t pool_ptr, size_t pool_size) {
-  pool_base_ptr = alloc_ptr = pool_ptr;
-  memory_pool_size = pool_size;
+  const auto pool_base = Ceil(pool_ptr, kPageSize);
+  const auto pool_end = MaskBits(pool_ptr + pool_size, kPageSize);
+  const size_t num_pages = pool_end > pool_base ? (pool_end - pool_base) / kPageSize : 0;
+
+  LockGuard lock{pool_lock};
+  pages.fill(PageInfo{});
+  partial_slabs.fill(kNil);
+  regions.fill(Region{});
+  num_reserved_pages = 0;
+  num_free_pages = 0;
+  // 最初の領域は必ず regions[0] に入る
+  AddRegion(pool_base, std::min(num_pages, kMaxPoolPages));
 }
 
 void *AllocMem(size_t size, unsigned int alignment, unsigned int boundary) {
-  if (alignment > 0) {
-    alloc_ptr = Ceil(alloc_ptr, alignment);
+  if (size == 0) {
+    size = 1;
   }
-  if (boundary > 0) {
-    auto next_boundary = Ceil(alloc_ptr, boundary);
-    if (next_boundary < alloc_ptr + size) {
-      alloc_ptr = next_boundary;
-    }
+
+  size_t block_size = size_t{1} << kMinBlockShift;
+  while (block_size < size || block_size < alignment) {
+    block_size <<= 1;
+  }
+
+  const bool is_block = block_size <= (size_t{1} << kMaxBlockShift);
+  size_t size_class = 0;
+  while (is_block && (size_t{1} << BlockShift(size_class)) < block_size) {
+    ++size_class;
   }
+  // ブロックは新しいスラブページから切り出せれば良い
+  const size_t grow_pages = is_block ? GrowPages(1, 0, 0)
+                                     : GrowPages(Ceil(size, kPageSize) / kPageSize, alignment,
+                                                 boundary);
 
-  if (pool_base_ptr + memory_pool_size < alloc_ptr + size) {
-    return nullptr;
+  void *p = nullptr;
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    // 空きが足りなければ pool_lock を離した状態でプールを拡張してからやり直す
+    if (attempt > 0 && !GrowPool(grow_pages)) {
+      break;
+    }
+
+    LockGuard lock{pool_lock};
+    if (is_block) {
+      p = AllocBlock(size_class);
+    } else {
+      const auto page = AllocPages(Ceil(size, kPageSize) / kPageSize, alignment, boundary);
+      if (page != kNil) {
+        p = reinterpret_cast<void *>(PageAddr(page));
+      }
+    }
+    if (p != nullptr) {
+      break;
+    }
   }
 
-  auto p = alloc_ptr;
-  alloc_ptr += size;
-  return reinterpret_cast<void *>(p);
+  if (p != nullptr) {
+    memset(p, 0, size);
+  }
+  return p;
 }
 
-void FreeMem(void *p) {}
+void FreeMem(void *p) {
+  const auto addr = reinterpret_cast<uintptr_t>(p);
+  ReleasedRegion released{};
+  {
+    LockGuard lock{pool_lock};
+    const uint16_t page = PageOf(addr);
+    if (page == kNil) {
+      return;
+    }
+
+    switch (pages[page].kind) {
+    case PageKind::kSlab:
+      released = FreeBlock(page, addr);
+      break;
+    case PageKind::kLargeHead:
+      released = FreePages(page);
+      break;
+    default:
+      // 割り当てていない領域の解放要求は無視する
+      break;
+    }
+  }
+
+  if (released.base != 0) {
+    sabios_free_dma_frames(released.base, released.num_pages);
+  }
+}
 } // namespace usb
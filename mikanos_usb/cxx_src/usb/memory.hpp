@@ -17,6 +17,7 @@ void SetMemoryPool(uintptr_t pool_ptr, size_t pool_size);
  * 先頭アドレスが alignment に揃ったメモリ領域を確保する．
  * size <= boundary ならメモリ領域が boundary を跨がないことを保証する．
  * boundary は典型的にはページ境界を跨がないように 4096 を指定する．
+ * 確保したメモリ領域は 0 で初期化される．
  *
  * @param size        確保するメモリ領域のサイズ（バイト単位）
  * @param alignment   メモリ領域のアライメント制約．0 なら制約しない．
@@ -29,7 +30,10 @@ template <class T> T *AllocArray(size_t num_obj, unsigned int alignment, unsigne
   return reinterpret_cast<T *>(AllocMem(sizeof(T) * num_obj, alignment, boundary));
 }
 
-/** @brief 指定されたメモリ領域を解放する．本当に解放することは保証されない． */
+/** @brief AllocMem で確保したメモリ領域を解放し，以降の割り当てで再利用できるようにする．
+ *
+ * p が nullptr またはメモリプール外のアドレスの場合は何もしない．
+ */
 void FreeMem(void *p);
 
 /** @brief 標準コンテナ用のメモリアロケータ */
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+
 namespace usb {
 namespace request_type {
 // bmRequestType recipient
@@ -47,6 +49,9 @@ const int kSetIsochDelay = 49;
 // HID class specific report values
 const int kGetReport = 1;
 const int kSetProtocol = 11;
+
+// Hub class specific values
+const int kSetHubDepth = 12;
 } // namespace request
 
 namespace descriptor_type {
@@ -62,6 +67,9 @@ const int kInterfaceAssociation = 11;
 const int kBOS = 15;
 const int kDeviceCapability = 16;
 const int kHID = 33;
+const int kReport = 34;
+const int kHub = 41;
+const int kSuperspeedHub = 42;
 const int kSuperspeedUSBEndpointCompanion = 48;
 const int kSuperspeedPlusIsochronousEndpointCompanion = 49;
 } // namespace descriptor_type
@@ -0,0 +1,40 @@
+/**
+ * @file usb/spinlock.hpp
+ *
+ * カーネルのどのコアからでも触れる共有データを守るスピンロック．
+ */
+
+#pragma once
+
+#include <atomic>
+
+namespace usb {
+class SpinLock {
+public:
+  void Lock() {
+    while (locked_.exchange(true, std::memory_order_acquire)) {
+      // 解放されるまでは読むだけにして，キャッシュラインを奪い合わない
+      while (locked_.load(std::memory_order_relaxed)) {
+        __builtin_ia32_pause();
+      }
+    }
+  }
+
+  void Unlock() { locked_.store(false, std::memory_order_release); }
+
+private:
+  std::atomic<bool> locked_{false};
+};
+
+/** @brief スコープを抜けるまで lock を保持する． */
+class LockGuard {
+public:
+  explicit LockGuard(SpinLock &lock) : lock_{lock} { lock_.Lock(); }
+  ~LockGuard() { lock_.Unlock(); }
+  LockGuard(const LockGuard &) = delete;
+  LockGuard &operator=(const LockGuard &) = delete;
+
+private:
+  SpinLock &lock_;
+};
+} // namespace usb
@@ -2,6 +2,8 @@
 
 #include "usb/endpoint.hpp"
 
+#include <cstdint>
+
 namespace usb::xhci {
 class Ring;
 union TRB;
@@ -33,6 +35,8 @@ union SlotContext {
   } __attribute__((packed)) bits;
 } __attribute__((packed));
 
+union StreamContext;
+
 union EndpointContext {
   uint32_t dwords[8];
   struct {
@@ -65,6 +69,32 @@ union EndpointContext {
   void SetTransferRingBuffer(TRB *buffer) {
     bits.tr_dequeue_pointer = reinterpret_cast<uint64_t>(buffer) >> 4;
   }
+
+  /** @brief ストリームを使うエンドポイントで，TR Dequeue Pointer に Stream Context Array を指させる． */
+  void SetStreamContextArray(StreamContext *contexts) {
+    bits.tr_dequeue_pointer = reinterpret_cast<uint64_t>(contexts) >> 4;
+  }
+} __attribute__((packed));
+
+/** @brief Stream Context Array の 1 要素．ストリーム 1 本分の Transfer Ring を指す． */
+union StreamContext {
+  static const unsigned int kPrimaryTransferRing = 1;
+
+  uint32_t dwords[4];
+  struct {
+    uint64_t dequeue_cycle_state : 1;
+    uint64_t stream_context_type : 3;
+    uint64_t tr_dequeue_pointer : 60;
+
+    uint32_t stopped_edtla : 24;
+    uint32_t : 8;
+
+    uint32_t : 32;
+  } __attribute__((packed)) bits;
+
+  void SetTransferRingBuffer(TRB *buffer) {
+    bits.tr_dequeue_pointer = reinterpret_cast<uint64_t>(buffer) >> 4;
+  }
 } __attribute__((packed));
 
 struct DeviceContextIndex {
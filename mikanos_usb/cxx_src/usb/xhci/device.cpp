@@ -1,8 +1,17 @@
 #include "usb/xhci/device.hpp"
 
 #include "logger.hpp"
+#include "usb/classdriver/base.hpp"
+#include "usb/latency_trace.hpp"
 #include "usb/memory.hpp"
 #include "usb/xhci/ring.hpp"
+#include "usb/xhci/speed.hpp"
+#include "usb/xhci/xhci.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <new>
 
 namespace {
 using namespace usb::xhci;
@@ -27,6 +36,51 @@ DataStageTRB MakeDataStageTRB(const void *buf, int len, bool dir_in) {
   return data;
 }
 
+/** @brief TRB 1 つで転送できる最大長．データバッファは 64 KiB 境界を跨いではならない． */
+const uintptr_t kMaxTRBTransferLength = 64 * 1024;
+
+/** @brief addr から始まる len バイトの区間を 64 KiB 境界で分割したときの先頭片の長さ */
+size_t FirstChunkLength(uintptr_t addr, size_t len) {
+  const auto to_boundary = kMaxTRBTransferLength - (addr % kMaxTRBTransferLength);
+  return len < to_boundary ? len : to_boundary;
+}
+
+/** @brief MFINDEX は 14 ビットで一周する */
+const uint16_t kMicroframeMask = (1u << 14) - 1;
+/** @brief IST に加えて空けておくマイクロフレーム数．発行からドアベルまでの遅れを吸収する． */
+const uint16_t kIsochLeadMicroframes = 8;
+
+bool IsIsochEndpoint(const EndpointContext &ep_ctx) {
+  return ep_ctx.bits.ep_type == 1 || ep_ctx.bits.ep_type == 5;
+}
+
+/** @brief segments を 64 KiB 境界で分割したときの TRB の数 */
+size_t CountTRBs(const usb::TransferSegment *segments, int num_segments) {
+  size_t num_trbs = 0;
+  for (int i = 0; i < num_segments; ++i) {
+    auto addr = reinterpret_cast<uintptr_t>(segments[i].buf);
+    auto rest = segments[i].len;
+    while (rest > 0) {
+      const auto chunk = FirstChunkLength(addr, rest);
+      addr += chunk;
+      rest -= chunk;
+      ++num_trbs;
+    }
+  }
+  return num_trbs;
+}
+
+/** @brief エンドポイントを Halted にする完了コード（Babble, Transaction Error, Stall, Split Error） */
+bool HaltsEndpoint(int completion_code) {
+  return completion_code == 3 || completion_code == 4 || completion_code == 6 ||
+         completion_code == 36;
+}
+
+/** @brief Stop Endpoint で止めた TD の完了コード（Stopped, Length Invalid, Short Packet） */
+bool IsStoppedCode(int completion_code) {
+  return completion_code == 26 || completion_code == 27 || completion_code == 28;
+}
+
 void _Log(LogLevel level, const char *file, uint32_t line, bool cont_flag,
           const DataStageTRB &trb) {
   _Log(level, file, line, false, "DataStageTRB: len %d, buf 0x%08lx, dir %d, attr 0x%02x\n",
@@ -68,7 +122,15 @@ void _Log(LogLevel level, const char *file, uint32_t line, bool cont_flag,
 } // namespace
 
 namespace usb::xhci {
-Device::Device(uint8_t slot_id, DoorbellRegister *dbreg) : slot_id_{slot_id}, dbreg_{dbreg} {}
+Device::Device(Controller *xhc, uint8_t slot_id, DoorbellRegister *dbreg,
+               uint16_t interrupter_target)
+    : xhc_{xhc}, dbreg_{dbreg}, slot_id_{slot_id}, interrupter_target_{interrupter_target} {}
+
+Device::~Device() {
+  for (size_t i = 0; i < transfer_rings_.size(); ++i) {
+    FreeEndpoint(i);
+  }
+}
 
 Error Device::Initialize() {
   state_ = State::kBlank;
@@ -81,16 +143,175 @@ Error Device::Initialize() {
 
 void Device::SelectForSlotAssignment() { state_ = State::kSlotAssigning; }
 
+void Device::FreeEndpoint(int index) {
+  if (auto tr = transfer_rings_[index]) {
+    tr->~Ring();
+    FreeMem(tr);
+  }
+  FreeMem(transfer_requests_[index]);
+  FreeMem(endpoint_stats_[index]);
+  transfer_rings_[index] = nullptr;
+  transfer_requests_[index] = nullptr;
+  endpoint_stats_[index] = nullptr;
+
+  if (auto streams = stream_sets_[index]) {
+    for (size_t id = 1; id < streams->num_contexts; ++id) {
+      if (auto tr = streams->rings[id]) {
+        tr->~Ring();
+        FreeMem(tr);
+      }
+      FreeMem(streams->requests[id]);
+    }
+    FreeMem(streams->contexts);
+    FreeMem(streams);
+    stream_sets_[index] = nullptr;
+  }
+}
+
 Ring *Device::AllocTransferRing(DeviceContextIndex index, size_t buf_size) {
   int i = index.value - 1;
+  FreeEndpoint(i);
+
   auto tr = AllocArray<Ring>(1, 64, 4096);
+  bool ring_ok = false;
   if (tr) {
-    tr->Initialize(buf_size);
+    new (tr) Ring;
+    ring_ok = !tr->Initialize(buf_size);
+  }
+  auto requests = AllocArray<TransferRequest>(buf_size, 64, 0);
+  if (requests) {
+    std::fill_n(requests, buf_size, TransferRequest{});
+  }
+  auto stats = AllocArray<EndpointStats>(1, 64, 0);
+  if (stats) {
+    *stats = EndpointStats{};
+  }
+  if (!ring_ok || !requests || !stats) {
+    if (tr) {
+      tr->~Ring();
+      FreeMem(tr);
+      tr = nullptr;
+    }
+    FreeMem(requests);
+    FreeMem(stats);
+    requests = nullptr;
+    stats = nullptr;
   }
   transfer_rings_[i] = tr;
+  transfer_requests_[i] = requests;
+  endpoint_stats_[i] = stats;
   return tr;
 }
 
+StreamContext *Device::AllocStreams(DeviceContextIndex index, size_t num_contexts,
+                                    size_t ring_size) {
+  const int i = index.value - 1;
+  FreeEndpoint(i);
+  if (num_contexts < 2 || num_contexts > kMaxStreamContexts) {
+    return nullptr;
+  }
+
+  // ストリームを使うエンドポイントは transfer_rings_ を使わず，ストリームごとのリングを使う
+  auto stats = AllocArray<EndpointStats>(1, 64, 0);
+  auto streams = AllocArray<StreamSet>(1, 64, 0);
+  auto contexts = AllocArray<StreamContext>(num_contexts, 64, 0);
+  if (!stats || !streams || !contexts) {
+    FreeMem(stats);
+    FreeMem(streams);
+    FreeMem(contexts);
+    return nullptr;
+  }
+  *stats = EndpointStats{};
+  *streams = StreamSet{};
+  memset(contexts, 0, num_contexts * sizeof(StreamContext));
+  streams->contexts = contexts;
+  streams->num_contexts = num_contexts;
+  endpoint_stats_[i] = stats;
+  stream_sets_[i] = streams;
+
+  for (size_t id = 1; id < num_contexts; ++id) {
+    auto tr = AllocArray<Ring>(1, 64, 4096);
+    auto requests = AllocArray<TransferRequest>(ring_size, 64, 0);
+    if (tr) {
+      new (tr) Ring;
+    }
+    streams->rings[id] = tr;
+    streams->requests[id] = requests;
+    if (tr == nullptr || requests == nullptr || tr->Initialize(ring_size)) {
+      FreeEndpoint(i);
+      return nullptr;
+    }
+    std::fill_n(requests, ring_size, TransferRequest{});
+
+    auto &ctx = streams->contexts[id];
+    ctx.SetTransferRingBuffer(tr->Buffer());
+    ctx.bits.dequeue_cycle_state = 1;
+    ctx.bits.stream_context_type = StreamContext::kPrimaryTransferRing;
+  }
+  return streams->contexts;
+}
+
+Ring *Device::TransferRingAt(DeviceContextIndex dci, uint16_t stream_id) const {
+  if (dci.value < 1 || 31 < dci.value) {
+    return nullptr;
+  }
+  if (auto streams = stream_sets_[dci.value - 1]) {
+    return 0 < stream_id && stream_id < streams->num_contexts ? streams->rings[stream_id]
+                                                               : nullptr;
+  }
+  return stream_id == 0 ? transfer_rings_[dci.value - 1] : nullptr;
+}
+
+Ring *Device::TransferRingOf(DeviceContextIndex dci, const TRB *trb) const {
+  if (dci.value < 1 || 31 < dci.value) {
+    return nullptr;
+  }
+  if (auto streams = stream_sets_[dci.value - 1]) {
+    // Transfer Event はストリーム ID を含まないので，TRB の位置からリングを探す
+    for (size_t id = 1; id < streams->num_contexts; ++id) {
+      if (streams->rings[id]->IndexOf(trb) >= 0) {
+        return streams->rings[id];
+      }
+    }
+    return nullptr;
+  }
+  return transfer_rings_[dci.value - 1];
+}
+
+uint16_t Device::StreamIDOf(DeviceContextIndex dci, const Ring *tr) const {
+  if (auto streams = stream_sets_[dci.value - 1]) {
+    for (size_t id = 1; id < streams->num_contexts; ++id) {
+      if (streams->rings[id] == tr) {
+        return id;
+      }
+    }
+  }
+  return 0;
+}
+
+TransferRequest *Device::RequestAt(DeviceContextIndex dci, const TRB *trb) {
+  if (dci.value < 1 || 31 < dci.value) {
+    return nullptr;
+  }
+  Ring *tr = transfer_rings_[dci.value - 1];
+  TransferRequest *requests = transfer_requests_[dci.value - 1];
+  if (auto streams = stream_sets_[dci.value - 1]) {
+    tr = nullptr;
+    for (size_t id = 1; id < streams->num_contexts; ++id) {
+      if (streams->rings[id]->IndexOf(trb) >= 0) {
+        tr = streams->rings[id];
+        requests = streams->requests[id];
+        break;
+      }
+    }
+  }
+  if (tr == nullptr || requests == nullptr) {
+    return nullptr;
+  }
+  const int index = tr->IndexOf(trb);
+  return index < 0 ? nullptr : &requests[index];
+}
+
 Error Device::ControlIn(EndpointID ep_id, SetupData setup_data, void *buf, int len,
                         ClassDriver *issuer) {
   if (auto err = usb::Device::ControlIn(ep_id, setup_data, buf, len, issuer)) {
@@ -111,18 +332,26 @@ Error Device::ControlIn(EndpointID ep_id, SetupData setup_data, void *buf, int l
   if (tr == nullptr) {
     return MAKE_ERROR(Error::kTransferRingNotSet);
   }
+  // Setup, Data, Status の 3 TRB をまとめて積めなければ何も積まない
+  if (tr->FreeSlots() < (buf ? 3 : 2)) {
+    return MAKE_ERROR(Error::kRingFull);
+  }
 
   auto status = StatusStageTRB{};
+  status.bits.interrupter_target = interrupter_target_;
 
+  tr->BeginTD();
   if (buf) {
     auto setup_trb_position = TRBDynamicCast<SetupStageTRB>(
         tr->Push(MakeSetupStageTRB(setup_data, SetupStageTRB::kInDataStage)));
     auto data = MakeDataStageTRB(buf, len, true);
+    data.bits.interrupter_target = interrupter_target_;
     data.bits.interrupt_on_completion = true;
     auto data_trb_position = tr->Push(data);
     tr->Push(status);
 
-    setup_stage_map_.Put(data_trb_position, setup_trb_position);
+    *RequestAt(dci, data_trb_position) =
+        TransferRequest{TransferRequest::Type::kControl, issuer, setup_trb_position, nullptr};
   } else {
     auto setup_trb_position = TRBDynamicCast<SetupStageTRB>(
         tr->Push(MakeSetupStageTRB(setup_data, SetupStageTRB::kNoDataStage)));
@@ -130,10 +359,12 @@ Error Device::ControlIn(EndpointID ep_id, SetupData setup_data, void *buf, int l
     status.bits.interrupt_on_completion = true;
     auto status_trb_position = tr->Push(status);
 
-    setup_stage_map_.Put(status_trb_position, setup_trb_position);
+    *RequestAt(dci, status_trb_position) =
+        TransferRequest{TransferRequest::Type::kControl, issuer, setup_trb_position, nullptr};
   }
+  tr->CommitTD();
 
-  dbreg_->Ring(dci.value);
+  RingDoorbell(dci);
 
   return MAKE_ERROR(Error::kSuccess);
 }
@@ -158,29 +389,39 @@ Error Device::ControlOut(EndpointID ep_id, SetupData setup_data, const void *buf
   if (tr == nullptr) {
     return MAKE_ERROR(Error::kTransferRingNotSet);
   }
+  // Setup, Data, Status の 3 TRB をまとめて積めなければ何も積まない
+  if (tr->FreeSlots() < (buf ? 3 : 2)) {
+    return MAKE_ERROR(Error::kRingFull);
+  }
 
   auto status = StatusStageTRB{};
+  status.bits.interrupter_target = interrupter_target_;
   status.bits.direction = true;
 
+  tr->BeginTD();
   if (buf) {
     auto setup_trb_position = TRBDynamicCast<SetupStageTRB>(
         tr->Push(MakeSetupStageTRB(setup_data, SetupStageTRB::kOutDataStage)));
     auto data = MakeDataStageTRB(buf, len, false);
+    data.bits.interrupter_target = interrupter_target_;
     data.bits.interrupt_on_completion = true;
     auto data_trb_position = tr->Push(data);
     tr->Push(status);
 
-    setup_stage_map_.Put(data_trb_position, setup_trb_position);
+    *RequestAt(dci, data_trb_position) =
+        TransferRequest{TransferRequest::Type::kControl, issuer, setup_trb_position, nullptr};
   } else {
     auto setup_trb_position = TRBDynamicCast<SetupStageTRB>(
         tr->Push(MakeSetupStageTRB(setup_data, SetupStageTRB::kNoDataStage)));
     status.bits.interrupt_on_completion = true;
     auto status_trb_position = tr->Push(status);
 
-    setup_stage_map_.Put(status_trb_position, setup_trb_position);
+    *RequestAt(dci, status_trb_position) =
+        TransferRequest{TransferRequest::Type::kControl, issuer, setup_trb_position, nullptr};
   }
+  tr->CommitTD();
 
-  dbreg_->Ring(dci.value);
+  RingDoorbell(dci);
 
   return MAKE_ERROR(Error::kSuccess);
 }
@@ -197,15 +438,19 @@ Error Device::InterruptIn(EndpointID ep_id, void *buf, int len) {
   if (tr == nullptr) {
     return MAKE_ERROR(Error::kTransferRingNotSet);
   }
+  if (tr->FreeSlots() < 1) {
+    return MAKE_ERROR(Error::kRingFull);
+  }
 
   NormalTRB normal{};
   normal.SetPointer(buf);
   normal.bits.trb_transfer_length = len;
   normal.bits.interrupt_on_short_packet = true;
   normal.bits.interrupt_on_completion = true;
+  normal.bits.interrupter_target = interrupter_target_;
 
   tr->Push(normal);
-  dbreg_->Ring(dci.value);
+  RingDoorbell(dci);
   return MAKE_ERROR(Error::kSuccess);
 }
 
@@ -219,24 +464,430 @@ Error Device::InterruptOut(EndpointID ep_id, void *buf, int len) {
   return MAKE_ERROR(Error::kNotImplemented);
 }
 
+Error Device::BulkIn(EndpointID ep_id, const TransferSegment *segments, int num_segments) {
+  if (auto err = usb::Device::BulkIn(ep_id, segments, num_segments)) {
+    return err;
+  }
+  return PushBulkTransfer(ep_id, 0, segments, num_segments);
+}
+
+Error Device::BulkOut(EndpointID ep_id, const TransferSegment *segments, int num_segments) {
+  if (auto err = usb::Device::BulkOut(ep_id, segments, num_segments)) {
+    return err;
+  }
+  return PushBulkTransfer(ep_id, 0, segments, num_segments);
+}
+
+Error Device::BulkStreamIn(EndpointID ep_id, uint16_t stream_id, void *buf, int len) {
+  const TransferSegment segment{buf, static_cast<size_t>(len)};
+  return PushBulkTransfer(ep_id, stream_id, &segment, 1);
+}
+
+Error Device::BulkStreamOut(EndpointID ep_id, uint16_t stream_id, const void *buf, int len) {
+  const TransferSegment segment{const_cast<void *>(buf), static_cast<size_t>(len)};
+  return PushBulkTransfer(ep_id, stream_id, &segment, 1);
+}
+
+Error Device::CancelBulkStream(EndpointID ep_id, uint16_t stream_id) {
+  const DeviceContextIndex dci{ep_id};
+  Ring *tr = TransferRingAt(dci, stream_id);
+  if (tr == nullptr) {
+    return MAKE_ERROR(Error::kTransferRingNotSet);
+  }
+  if (tr->NumInFlight() == 0) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  if (auto err = CancelTransfers(*xhc_, *this, dci, stream_id, tr->WritePosition(),
+                                 tr->ProducerCycleState())) {
+    return err;
+  }
+
+  // 取り消した TD の完了は通知しない．Stopped のイベントは OnTransferEventReceived が捨てる．
+  auto streams = stream_sets_[dci.value - 1];
+  TransferRequest *requests =
+      streams ? streams->requests[stream_id] : transfer_requests_[dci.value - 1];
+  for (size_t i = 0; i < tr->Capacity(); ++i) {
+    requests[i].type = TransferRequest::Type::kNone;
+  }
+  tr->DiscardInFlight();
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+int Device::NumStreams(EndpointID ep_id) const {
+  const DeviceContextIndex dci{ep_id};
+  if (dci.value < 1 || 31 < dci.value) {
+    return 0;
+  }
+  auto streams = stream_sets_[dci.value - 1];
+  return streams ? streams->num_contexts - 1 : 0;
+}
+
+bool Device::SupportsStreams() const {
+  return Speed() == DeviceSpeed::kSuper && xhc_->MaxStreamContexts() >= 4;
+}
+
+Error Device::PushBulkTransfer(EndpointID ep_id, uint16_t stream_id,
+                               const TransferSegment *segments, int num_segments) {
+  Log(kTrace, "Device::PushBulkTransfer: ep addr %d, stream %d, %d segments\n", ep_id.Address(),
+      stream_id, num_segments);
+  if (ep_id.Number() < 1 || 15 < ep_id.Number()) {
+    return MAKE_ERROR(Error::kInvalidEndpointNumber);
+  }
+
+  const DeviceContextIndex dci{ep_id};
+  Ring *tr = TransferRingAt(dci, stream_id);
+  if (tr == nullptr) {
+    return MAKE_ERROR(Error::kTransferRingNotSet);
+  }
+
+  if (segments == nullptr || num_segments < 1) {
+    return MAKE_ERROR(Error::kBufferTooSmall);
+  }
+
+  const auto num_trbs = CountTRBs(segments, num_segments);
+  // 転送の途中でリングが尽きないよう，EventDataTRB を含めた全体を事前に確保する
+  if (tr->FreeSlots() < std::max<size_t>(num_trbs, 1) + 1) {
+    return MAKE_ERROR(Error::kRingFull);
+  }
+
+  // 全体の完了は EventDataTRB の Transfer Event（転送長は合計）で 1 回だけ受け取る．
+  // Short Packet が起きた場合も，xHC は TD 末尾の EventDataTRB まで進んでから通知する．
+  // EventDataTRB が置かれる位置を先に求めて Event Data に自身のアドレスを埋め込んでおき，
+  // 完了時にリングの消費位置の更新と要求の検索ができるようにする．
+  const size_t head = tr->WritePosition() - tr->Buffer();
+  TRB *const event_data_position =
+      tr->Buffer() + (head + std::max<size_t>(num_trbs, 1)) % tr->Capacity();
+  *RequestAt(dci, event_data_position) =
+      TransferRequest{TransferRequest::Type::kBulk, nullptr, nullptr, segments[0].buf};
+
+  const int max_packet_size = ctx_.ep_contexts[dci.value - 1].bits.max_packet_size;
+  size_t remaining = 0;
+  for (int i = 0; i < num_segments; ++i) {
+    remaining += segments[i].len;
+  }
+
+  tr->BeginTD();
+  for (int i = 0; i < num_segments; ++i) {
+    auto addr = reinterpret_cast<uintptr_t>(segments[i].buf);
+    auto rest = segments[i].len;
+    while (rest > 0) {
+      const auto chunk = FirstChunkLength(addr, rest);
+      remaining -= chunk;
+
+      NormalTRB normal{};
+      normal.SetPointer(reinterpret_cast<const void *>(addr));
+      normal.bits.trb_transfer_length = chunk;
+      // TD Size: この TRB より後に残っているパケット数（最大 31）
+      const size_t packets_left =
+          max_packet_size > 0 ? (remaining + max_packet_size - 1) / max_packet_size : 0;
+      normal.bits.td_size = packets_left < 31 ? packets_left : 31;
+      normal.bits.interrupter_target = interrupter_target_;
+      normal.bits.chain_bit = true;
+      tr->Push(normal);
+
+      addr += chunk;
+      rest -= chunk;
+    }
+  }
+
+  if (num_trbs == 0) {
+    // 長さ 0 の転送（ZLP）
+    NormalTRB normal{};
+    normal.bits.interrupter_target = interrupter_target_;
+    normal.bits.chain_bit = true;
+    tr->Push(normal);
+  }
+
+  EventDataTRB event_data{};
+  event_data.SetEventData(event_data_position);
+  event_data.bits.interrupter_target = interrupter_target_;
+  event_data.bits.interrupt_on_completion = true;
+  tr->Push(event_data);
+  tr->CommitTD();
+
+  RingDoorbell(dci, stream_id);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error Device::IsochIn(EndpointID ep_id, IsochPacket *packets, int num_packets) {
+  if (auto err = usb::Device::IsochIn(ep_id, packets, num_packets)) {
+    return err;
+  }
+  return PushIsochTransfer(ep_id, packets, num_packets);
+}
+
+Error Device::IsochOut(EndpointID ep_id, IsochPacket *packets, int num_packets) {
+  if (auto err = usb::Device::IsochOut(ep_id, packets, num_packets)) {
+    return err;
+  }
+  return PushIsochTransfer(ep_id, packets, num_packets);
+}
+
+uint16_t Device::NextIsochMicroframe(DeviceContextIndex dci, const Ring &tr) {
+  const uint32_t bit = 1u << (dci.value - 1);
+  const uint16_t earliest = (xhc_->MicroframeIndex() + xhc_->IsochSchedulingThreshold() +
+                             kIsochLeadMicroframes) &
+                            kMicroframeMask;
+  if ((isoch_scheduled_ & bit) != 0 && tr.NumInFlight() > 0) {
+    const uint16_t next = isoch_next_uframe_[dci.value - 1];
+    // next が earliest より後（半周以内）なら，積んである TD の直後に続けられる
+    if (((next - earliest) & kMicroframeMask) < (kMicroframeMask + 1) / 2) {
+      return next;
+    }
+    Log(kDebug, "isoch transfer on slot %d dci %d fell behind, rescheduling\n", slot_id_,
+        dci.value);
+  }
+  return earliest;
+}
+
+Error Device::PushIsochTransfer(EndpointID ep_id, IsochPacket *packets, int num_packets) {
+  Log(kTrace, "Device::PushIsochTransfer: ep addr %d, %d packets\n", ep_id.Address(),
+      num_packets);
+  if (ep_id.Number() < 1 || 15 < ep_id.Number()) {
+    return MAKE_ERROR(Error::kInvalidEndpointNumber);
+  }
+
+  const DeviceContextIndex dci{ep_id};
+  Ring *tr = transfer_rings_[dci.value - 1];
+  const auto &ep_ctx = ctx_.ep_contexts[dci.value - 1];
+  if (tr == nullptr || !IsIsochEndpoint(ep_ctx)) {
+    return MAKE_ERROR(Error::kTransferRingNotSet);
+  }
+  if (packets == nullptr || num_packets < 1 || num_packets > UINT16_MAX) {
+    return MAKE_ERROR(Error::kBufferTooSmall);
+  }
+  for (int i = 0; i < num_packets; ++i) {
+    // 1 パケットを 1 TRB で送るので，64 KiB 境界を跨ぐバッファは扱わない
+    const auto addr = reinterpret_cast<uintptr_t>(packets[i].buf);
+    if (FirstChunkLength(addr, packets[i].length) < packets[i].length) {
+      return MAKE_ERROR(Error::kBufferTooSmall);
+    }
+  }
+  if (tr->FreeSlots() < static_cast<size_t>(num_packets)) {
+    return MAKE_ERROR(Error::kRingFull);
+  }
+
+  const uint32_t max_packet_size = ep_ctx.bits.max_packet_size;
+  const uint32_t burst_size = ep_ctx.bits.max_burst_size + 1;
+  // Interval はサービス間隔（2^Interval マイクロフレーム）の指数
+  const uint16_t interval = 1u << std::min<int>(ep_ctx.bits.interval, 13);
+  uint16_t uframe = NextIsochMicroframe(dci, *tr);
+
+  tr->BeginTD();
+  for (int i = 0; i < num_packets; ++i) {
+    auto &packet = packets[i];
+    packet.actual_length = 0;
+    packet.completion_code = 0;
+
+    // TD を構成するパケット数から，バースト数（TBC）と最後のバーストのパケット数（TLBPC）を求める
+    const uint32_t td_packets =
+        max_packet_size > 0 && packet.length > 0
+            ? (packet.length + max_packet_size - 1) / max_packet_size
+            : 1;
+    const uint32_t last_burst_packets = td_packets % burst_size;
+
+    IsochTRB isoch{};
+    isoch.SetPointer(packet.buf);
+    isoch.bits.trb_transfer_length = packet.length;
+    isoch.bits.interrupter_target = interrupter_target_;
+    isoch.bits.transfer_burst_count = (td_packets - 1) / burst_size;
+    isoch.bits.transfer_last_burst_packet_count =
+        last_burst_packets == 0 ? burst_size - 1 : last_burst_packets - 1;
+    isoch.bits.frame_id = (uframe >> 3) & 0x7ffu;
+    isoch.bits.interrupt_on_completion = true;
+    isoch.bits.block_event_interrupt = i + 1 < num_packets;
+    auto position = tr->Push(isoch);
+
+    auto request = RequestAt(dci, position);
+    *request = TransferRequest{TransferRequest::Type::kIsoch, nullptr, nullptr, nullptr};
+    request->packets = packets;
+    request->packet_index = i;
+    request->num_packets = num_packets;
+    uframe = (uframe + interval) & kMicroframeMask;
+  }
+  tr->CommitTD();
+
+  isoch_next_uframe_[dci.value - 1] = uframe;
+  isoch_scheduled_ |= 1u << (dci.value - 1);
+
+  RingDoorbell(dci);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void Device::RestartEndpoint(DeviceContextIndex dci, uint16_t stream_id) {
+  auto streams = stream_sets_[dci.value - 1];
+  if (streams == nullptr) {
+    RingDoorbell(dci, stream_id);
+    return;
+  }
+  // Stop Endpoint はエンドポイントの全てのストリームを止める
+  for (size_t id = 1; id < streams->num_contexts; ++id) {
+    if (id == stream_id || streams->rings[id]->NumInFlight() > 0) {
+      RingDoorbell(dci, id);
+    }
+  }
+}
+
+void Device::RingDoorbell(DeviceContextIndex dci, uint16_t stream_id) {
+  TraceDoorbell(slot_id_, dci.value);
+  auto tr = TransferRingAt(dci, stream_id);
+  if (auto stats = endpoint_stats_[dci.value - 1]; stats && tr) {
+    const uint32_t in_flight = tr->NumInFlight();
+    stats->peak_in_flight = std::max(stats->peak_in_flight, in_flight);
+    if (stats->last_completion_tsc != 0) {
+      const uint64_t gap = ReadTSC() - stats->last_completion_tsc;
+      stats->last_completion_tsc = 0;
+      ++stats->rearms;
+      stats->total_rearm_gap_cycles += gap;
+      stats->max_rearm_gap_cycles = std::max(stats->max_rearm_gap_cycles, gap);
+    }
+  }
+  if (batch_depth_ > 0) {
+    if (stream_id == 0) {
+      pending_doorbells_ |= 1u << dci.value;
+      return;
+    }
+    // ストリームのドアベルは（dci, stream ID）ごとに覚える．覚えきれなければすぐに鳴らす．
+    if (num_pending_stream_doorbells_ < pending_stream_doorbells_.size()) {
+      const uint32_t target = static_cast<uint32_t>(stream_id) << 8 | dci.value;
+      auto begin = pending_stream_doorbells_.begin();
+      auto end = begin + num_pending_stream_doorbells_;
+      if (std::find(begin, end, target) == end) {
+        pending_stream_doorbells_[num_pending_stream_doorbells_++] = target;
+      }
+      return;
+    }
+  }
+  dbreg_->Ring(dci.value, stream_id);
+}
+
+void Device::BeginBatch() { ++batch_depth_; }
+
+void Device::EndBatch() {
+  if (batch_depth_ == 0 || --batch_depth_ > 0 ||
+      (pending_doorbells_ == 0 && num_pending_stream_doorbells_ == 0)) {
+    return;
+  }
+  // 積んだ TRB が全て見えるようになってからドアベルを鳴らす．まとめた分のフェンスは 1 回で済む．
+  std::atomic_thread_fence(std::memory_order_release);
+  for (uint32_t pending = pending_doorbells_; pending != 0; pending &= pending - 1) {
+    dbreg_->Ring(__builtin_ctz(pending));
+  }
+  pending_doorbells_ = 0;
+  for (size_t i = 0; i < num_pending_stream_doorbells_; ++i) {
+    const uint32_t target = pending_stream_doorbells_[i];
+    dbreg_->Ring(target & 0xffu, target >> 8);
+  }
+  num_pending_stream_doorbells_ = 0;
+}
+
+void Device::RecordCompletion(DeviceContextIndex dci, int completion_code, int transferred_bytes) {
+  if (dci.value < 1 || 31 < dci.value) {
+    return;
+  }
+  auto stats = endpoint_stats_[dci.value - 1];
+  if (stats == nullptr) {
+    return;
+  }
+  if (completion_code == 1 /* Success */ || completion_code == 13 /* Short Packet */) {
+    ++stats->transfers;
+    stats->bytes += transferred_bytes;
+    if (completion_code == 13) {
+      ++stats->short_packets;
+    }
+  } else {
+    ++stats->errors;
+    ++stats->errors_by_code[std::min(completion_code, kNumStatsCompletionCodes)];
+  }
+  stats->last_completion_tsc = ReadTSC();
+}
+
 Error Device::OnTransferEventReceived(const TransferEventTRB &trb) {
+  TraceMark(TraceStage::kTransferEvent);
   const auto residual_length = trb.bits.trb_transfer_length;
 
+  if (IsStoppedCode(trb.bits.completion_code)) {
+    // Stop Endpoint で止めた位置の通知．TD は終わっておらず，再開すると続きから処理されるか，
+    // Set TR Dequeue Pointer で取り消されている．リングの消費位置も要求もそのままにする．
+    Log(kTrace, trb);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  // EventDataTRB には自身のアドレスを埋め込んでいるので，Event Data の場合も
+  // TRB Pointer はリング上の位置を指す
+  const DeviceContextIndex dci{trb.EndpointID()};
+  if (1 <= dci.value && dci.value <= 31) {
+    if (auto tr = TransferRingOf(dci, trb.Pointer())) {
+      tr->MarkConsumed(trb.Pointer());
+    }
+  }
+
+  // 失敗した要求も記録から外す
+  TransferRequest request{};
+  if (auto entry = RequestAt(dci, trb.Pointer())) {
+    request = *entry;
+    entry->type = TransferRequest::Type::kNone;
+  }
+
+  TRB *issuer_trb = trb.Pointer();
+  int transferred_bytes = 0;
+  if (trb.bits.event_data) {
+    // Event Data の Transfer Event では転送長は残りではなく，TD 全体で転送したバイト数
+    transferred_bytes = trb.bits.trb_transfer_length;
+  } else if (auto normal_trb = TRBDynamicCast<NormalTRB>(issuer_trb)) {
+    transferred_bytes = normal_trb->bits.trb_transfer_length - residual_length;
+  } else if (auto data_stage_trb = TRBDynamicCast<DataStageTRB>(issuer_trb)) {
+    transferred_bytes = data_stage_trb->bits.trb_transfer_length - residual_length;
+  } else if (auto isoch_trb = TRBDynamicCast<IsochTRB>(issuer_trb)) {
+    transferred_bytes = isoch_trb->bits.trb_transfer_length - residual_length;
+  }
+  RecordCompletion(dci, trb.bits.completion_code, transferred_bytes);
+
+  if (request.type == TransferRequest::Type::kIsoch) {
+    // 失敗（Missed Service など）もパケットごとの結果として呼び出し側に渡す
+    auto &packet = request.packets[request.packet_index];
+    packet.actual_length = std::max(transferred_bytes, 0);
+    packet.completion_code = trb.bits.completion_code;
+    if (request.packet_index + 1 < request.num_packets) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    return this->OnIsochCompleted(trb.EndpointID(), request.packets, request.num_packets);
+  }
+  if (request.type == TransferRequest::Type::kNone && 1 <= dci.value && dci.value <= 31 &&
+      IsIsochEndpoint(ctx_.ep_contexts[dci.value - 1])) {
+    // Ring Underrun/Overrun や TD を特定しない Missed Service は，TD の結果には現れない
+    Log(kDebug, "isoch event without TD on slot %d dci %d: completion code %d\n", slot_id_,
+        dci.value, trb.bits.completion_code);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
   if (trb.bits.completion_code != 1 /* Success */ &&
       trb.bits.completion_code != 13 /* Short Packet */) {
     Log(kTrace, trb);
+    // 初期化後のコントロール転送なら，失敗を発行元に伝える
+    if (request.type == TransferRequest::Type::kControl && request.issuer && IsInitialized()) {
+      return request.issuer->OnControlFailed(trb.EndpointID(), trb.bits.completion_code);
+    }
+    // 割り込み転送の NormalTRB は連鎖させないので，chain bit があればバルク転送の TD
+    if (auto normal_trb = TRBDynamicCast<NormalTRB>(issuer_trb);
+        normal_trb && normal_trb->bits.chain_bit) {
+      return OnBulkTDFailed(trb);
+    }
     return MAKE_ERROR(Error::kTransferFailed);
   }
   Log(kTrace, trb);
 
-  TRB *issuer_trb = trb.Pointer();
+  if (trb.bits.event_data) {
+    if (request.type != TransferRequest::Type::kBulk) {
+      return MAKE_ERROR(Error::kNoWaiter);
+    }
+    return this->OnBulkCompleted(trb.EndpointID(), request.buf, transferred_bytes);
+  }
   if (auto normal_trb = TRBDynamicCast<NormalTRB>(issuer_trb)) {
-    const auto transfer_length = normal_trb->bits.trb_transfer_length - residual_length;
-    return this->OnInterruptCompleted(trb.EndpointID(), normal_trb->Pointer(), transfer_length);
+    return this->OnInterruptCompleted(trb.EndpointID(), normal_trb->Pointer(), transferred_bytes);
   }
 
-  auto opt_setup_stage_trb = setup_stage_map_.Get(issuer_trb);
-  if (!opt_setup_stage_trb) {
+  if (request.type != TransferRequest::Type::kControl) {
     Log(kTrace, "No Corresponding Setup Stage for issuer %s\n",
         kTRBTypeToName[issuer_trb->bits.trb_type]);
     if (auto data_trb = TRBDynamicCast<DataStageTRB>(issuer_trb)) {
@@ -244,9 +895,8 @@ Error Device::OnTransferEventReceived(const TransferEventTRB &trb) {
     }
     return MAKE_ERROR(Error::kNoCorrespondingSetupStage);
   }
-  setup_stage_map_.Delete(issuer_trb);
 
-  auto setup_stage_trb = opt_setup_stage_trb.value();
+  auto setup_stage_trb = request.setup_stage;
   SetupData setup_data{};
   setup_data.request_type.data = setup_stage_trb->bits.request_type;
   setup_data.request = setup_stage_trb->bits.request;
@@ -255,15 +905,64 @@ Error Device::OnTransferEventReceived(const TransferEventTRB &trb) {
   setup_data.length = setup_stage_trb->bits.length;
 
   void *data_stage_buffer{nullptr};
-  int transfer_length{0};
   if (auto data_stage_trb = TRBDynamicCast<DataStageTRB>(issuer_trb)) {
     data_stage_buffer = data_stage_trb->Pointer();
-    transfer_length = data_stage_trb->bits.trb_transfer_length - residual_length;
   } else if (auto status_stage_trb = TRBDynamicCast<StatusStageTRB>(issuer_trb)) {
     // pass
   } else {
     return MAKE_ERROR(Error::kNotImplemented);
   }
-  return this->OnControlCompleted(trb.EndpointID(), setup_data, data_stage_buffer, transfer_length);
+  return this->OnControlCompleted(trb.EndpointID(), setup_data, data_stage_buffer,
+                                  transferred_bytes, request.issuer);
+}
+
+Error Device::OnBulkTDFailed(const TransferEventTRB &trb) {
+  const DeviceContextIndex dci{trb.EndpointID()};
+  const int completion_code = trb.bits.completion_code;
+  Ring *tr = TransferRingOf(dci, trb.Pointer());
+  if (tr == nullptr) {
+    return MAKE_ERROR(Error::kTransferRingNotSet);
+  }
+  // 完了通知を受け取るはずだった TD 末尾の EventDataTRB の要求を外す
+  TRB *const last = tr->LastOfTD(trb.Pointer());
+  TransferRequest request{};
+  if (auto entry = RequestAt(dci, last)) {
+    request = *entry;
+    entry->type = TransferRequest::Type::kNone;
+  }
+  tr->MarkConsumed(last);
+
+  if (HaltsEndpoint(completion_code)) {
+    bool cycle;
+    TRB *const next = tr->NextOf(last, &cycle);
+    if (auto err = RecoverHaltedEndpoint(*xhc_, *this, dci, StreamIDOf(dci, tr), next, cycle)) {
+      Log(kWarn, "failed to recover slot %d dci %d: %s\n", slot_id_, dci.value, err.Name());
+    }
+  }
+
+  if (request.type != TransferRequest::Type::kBulk) {
+    return MAKE_ERROR(Error::kNoWaiter);
+  }
+  return this->OnBulkFailed(trb.EndpointID(), request.buf, completion_code);
+}
+
+DeviceSpeed Device::Speed() const { return ToDeviceSpeed(ctx_.slot_context.bits.speed); }
+
+int Device::HubDepth() const { return RouteDepth(ctx_.slot_context.bits.route_string); }
+
+Error Device::ConfigureHub(const HubConfig &config) {
+  return xhci::ConfigureHub(*xhc_, *this, config);
+}
+
+Error Device::OnHubPortConnected(uint8_t port_num) {
+  return xhci::OnHubPortConnected(*xhc_, *this, port_num);
+}
+
+Error Device::OnHubPortReset(uint8_t port_num, DeviceSpeed speed) {
+  return xhci::OnHubPortReset(*xhc_, *this, port_num, speed);
+}
+
+Error Device::OnHubPortDisconnected(uint8_t port_num) {
+  return xhci::OnHubPortDisconnected(*xhc_, *this, port_num);
 }
 } // namespace usb::xhci
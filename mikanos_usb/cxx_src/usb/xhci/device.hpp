@@ -7,16 +7,62 @@
 #pragma once
 
 #include "error.hpp"
-#include "usb/arraymap.hpp"
 #include "usb/device.hpp"
 #include "usb/xhci/context.hpp"
 #include "usb/xhci/registers.hpp"
+#include "usb/xhci/stats.hpp"
 #include "usb/xhci/trb.hpp"
 
 #include <cstddef>
 #include <cstdint>
 
 namespace usb::xhci {
+class Controller;
+
+/** @brief ルートストリングの段数（ルートハブの下に接続できるハブの段数）の上限 */
+const int kMaxRouteDepth = 5;
+
+/** @brief ルートストリングが何段のハブを経由しているか */
+inline int RouteDepth(uint32_t route_string) {
+  int depth = 0;
+  while (depth < kMaxRouteDepth && (route_string >> (4 * depth)) & 0xfu) {
+    ++depth;
+  }
+  return depth;
+}
+
+/** @brief Transfer Ring 上で完了通知を受け取る TRB に対応付けて記録する，発行中の要求 */
+struct TransferRequest {
+  enum class Type : uint8_t { kNone, kControl, kBulk, kIsoch };
+
+  Type type;
+  /** kControl: 要求の発行元 */
+  ClassDriver *issuer;
+  /** kControl: 対応する SetupStageTRB */
+  const SetupStageTRB *setup_stage;
+  /** kBulk: 転送の先頭区間 */
+  const void *buf;
+  /** kIsoch: 発行時に渡されたパケットの配列 */
+  IsochPacket *packets = nullptr;
+  /** kIsoch: この TD が受け持つパケットの添字と，packets の要素数 */
+  uint16_t packet_index = 0;
+  uint16_t num_packets = 0;
+};
+
+/** @brief 1 つのエンドポイントで使う Stream Context Array の要素数の上限（ストリーム 0 は予約） */
+const size_t kMaxStreamContexts = 16;
+
+/** @brief ストリームを使うエンドポイントの Stream Context Array と，ストリームごとの Transfer Ring */
+struct StreamSet {
+  /** ホストコントローラが読む Stream Context Array（要素数 num_contexts） */
+  StreamContext *contexts;
+  size_t num_contexts;
+  /** index = stream ID．0 は使わない */
+  std::array<Ring *, kMaxStreamContexts> rings;
+  /** rings と同じ添字で引ける，各リングの要求の表 */
+  std::array<TransferRequest *, kMaxStreamContexts> requests;
+};
+
 class Device : public usb::Device {
 public:
   enum class State { kInvalid, kBlank, kSlotAssigning, kSlotAssigned };
@@ -24,7 +70,10 @@ public:
   using OnTransferredCallbackType = void(Device *dev, DeviceContextIndex dci, int completion_code,
                                          int trb_transfer_length, TRB *issue_trb);
 
-  Device(uint8_t slot_id, DoorbellRegister *dbreg);
+  Device(Controller *xhc, uint8_t slot_id, DoorbellRegister *dbreg,
+         uint16_t interrupter_target = 0);
+  /** @brief Transfer Ring と，それに付随する要求の表と統計を解放する． */
+  ~Device() override;
 
   Error Initialize();
 
@@ -35,9 +84,17 @@ public:
 
   State State() const { return state_; }
   uint8_t SlotID() const { return slot_id_; }
+  /** @brief このデバイスの転送イベントを受け取るインタラプタの番号 */
+  uint16_t InterrupterTarget() const { return interrupter_target_; }
 
   void SelectForSlotAssignment();
   Ring *AllocTransferRing(DeviceContextIndex index, size_t buf_size);
+  /** @brief index のエンドポイントの Stream Context Array と，ストリーム 1〜num_contexts-1
+   * の Transfer Ring（各 ring_size 個の TRB）を割り当てる．
+   *
+   * @return Endpoint Context の TR Dequeue Pointer に設定する Stream Context Array．失敗したら nullptr．
+   */
+  StreamContext *AllocStreams(DeviceContextIndex index, size_t num_contexts, size_t ring_size);
 
   Error ControlIn(EndpointID ep_id, SetupData setup_data, void *buf, int len,
                   ClassDriver *issuer) override;
@@ -45,23 +102,113 @@ public:
                    ClassDriver *issuer) override;
   Error InterruptIn(EndpointID ep_id, void *buf, int len) override;
   Error InterruptOut(EndpointID ep_id, void *buf, int len) override;
+  Error BulkIn(EndpointID ep_id, const TransferSegment *segments, int num_segments) override;
+  Error BulkOut(EndpointID ep_id, const TransferSegment *segments, int num_segments) override;
+  using usb::Device::BulkIn;
+  using usb::Device::BulkOut;
+  Error BulkStreamIn(EndpointID ep_id, uint16_t stream_id, void *buf, int len) override;
+  Error BulkStreamOut(EndpointID ep_id, uint16_t stream_id, const void *buf, int len) override;
+  /** @brief Stop Endpoint と Set TR Dequeue Pointer（ストリーム ID つき）で TD を取り消す． */
+  Error CancelBulkStream(EndpointID ep_id, uint16_t stream_id) override;
+  int NumStreams(EndpointID ep_id) const override;
+  bool SupportsStreams() const override;
+  Error IsochIn(EndpointID ep_id, IsochPacket *packets, int num_packets) override;
+  Error IsochOut(EndpointID ep_id, IsochPacket *packets, int num_packets) override;
+  void BeginBatch() override;
+  void EndBatch() override;
 
   Error OnTransferEventReceived(const TransferEventTRB &trb);
+  /** @brief 止めたエンドポイントのドアベルを鳴らし，積んである転送を再開させる．
+   *
+   * ストリームを使うエンドポイントでは，stream_id と転送の残っている全てのストリームを再開させる．
+   */
+  void RestartEndpoint(DeviceContextIndex dci, uint16_t stream_id);
+
+  DeviceSpeed Speed() const override;
+  int HubDepth() const override;
+  Error ConfigureHub(const HubConfig &config) override;
+  Error OnHubPortConnected(uint8_t port_num) override;
+  Error OnHubPortReset(uint8_t port_num, DeviceSpeed speed) override;
+  Error OnHubPortDisconnected(uint8_t port_num) override;
+
+  /** @brief dci のエンドポイントの統計．Transfer Ring が無ければ nullptr． */
+  const EndpointStats *EndpointStatsAt(DeviceContextIndex dci) const {
+    return 1 <= dci.value && dci.value <= 31 ? endpoint_stats_[dci.value - 1] : nullptr;
+  }
 
 private:
+  // 完了通知の処理で毎回参照するフィールドを先頭のキャッシュラインにまとめる．
+  // 初期化時しか使わないコンテキストは末尾に置く．
+  alignas(64) Controller *const xhc_;
+  DoorbellRegister *const dbreg_;
+  const uint8_t slot_id_;
+  const uint16_t interrupter_target_;
+  enum State state_;
+
+  std::array<Ring *, 31> transfer_rings_{}; // index = dci - 1
+  /** 各 Transfer Ring のエントリと同じ添字で引ける要求の表（index = dci - 1）．
+   *
+   * 完了通知を受け取る TRB（DataStage/StatusStage/EventData）の位置に要求を記録する．
+   * エントリはリングが一周して再利用されるまで他の要求に使われないので，
+   * 登録が溢れることはなく，完了時の検索も定数時間で済む．
+   */
+  std::array<TransferRequest *, 31> transfer_requests_{};
+  /** 各エンドポイントの統計（index = dci - 1）．Transfer Ring と同時に確保する． */
+  std::array<EndpointStats *, 31> endpoint_stats_{};
+  /** ストリームを使うエンドポイントの Transfer Ring（index = dci - 1）．transfer_rings_ の代わりに使う． */
+  std::array<StreamSet *, 31> stream_sets_{};
+  /** BeginBatch の入れ子の深さ．0 でなければドアベルを鳴らさずに pending_doorbells_ に記録する． */
+  uint8_t batch_depth_ = 0;
+  /** まとめている間に転送を積んだエンドポイント（ビット番号 = dci） */
+  uint32_t pending_doorbells_ = 0;
+  /** まとめている間に転送を積んだストリーム（stream ID << 8 | dci） */
+  std::array<uint32_t, 8> pending_stream_doorbells_{};
+  size_t num_pending_stream_doorbells_ = 0;
+  /** 次のアイソクロナス TD を置くマイクロフレーム（index = dci - 1）．isoch_scheduled_ のビットが立っていれば有効． */
+  std::array<uint16_t, 31> isoch_next_uframe_{};
+  uint32_t isoch_scheduled_ = 0;
+
   alignas(64) struct DeviceContext ctx_;
   alignas(64) struct InputContext input_ctx_;
 
-  const uint8_t slot_id_;
-  DoorbellRegister *const dbreg_;
+  /** @brief dci の Transfer Ring 上の trb に対応する要求の記録場所．trb が範囲外なら nullptr． */
+  TransferRequest *RequestAt(DeviceContextIndex dci, const TRB *trb);
+  /** @brief dci の stream_id 番のストリームの Transfer Ring．ストリームを使わないなら stream_id は 0． */
+  Ring *TransferRingAt(DeviceContextIndex dci, uint16_t stream_id) const;
+  /** @brief trb を含む dci の Transfer Ring（ストリームを使うならそのストリームのリング） */
+  Ring *TransferRingOf(DeviceContextIndex dci, const TRB *trb) const;
+  /** @brief tr が dci の何番のストリームのリングか．ストリームを使わないなら 0． */
+  uint16_t StreamIDOf(DeviceContextIndex dci, const Ring *tr) const;
+  /** @brief バルク転送の TD が途中の NormalTRB で失敗したときの後始末．
+   *
+   * TD の最後の EventDataTRB に記録した要求を外し，エンドポイントが Halted なら
+   * Reset Endpoint と Set TR Dequeue Pointer で TD の次から再開させてから，
+   * クラスドライバに失敗を通知する．
+   */
+  Error OnBulkTDFailed(const TransferEventTRB &trb);
+  /** @brief index（= dci - 1）のエンドポイントのリング，要求の表，統計，ストリームを解放する． */
+  void FreeEndpoint(int index);
 
-  enum State state_;
-  std::array<Ring *, 31> transfer_rings_; // index = dci - 1
+  void RingDoorbell(DeviceContextIndex dci, uint16_t stream_id = 0);
+  void RecordCompletion(DeviceContextIndex dci, int completion_code, int transferred_bytes);
 
-  /** コントロール転送が完了した際に DataStageTRB や StatusStageTRB
-   * から対応する SetupStageTRB を検索するためのマップ．
+  /** @brief segments を 64 KiB 境界で分割した NormalTRB の連鎖と，完了通知用の
+   * EventDataTRB を Transfer Ring に積む．
+   */
+  Error PushBulkTransfer(EndpointID ep_id, uint16_t stream_id, const TransferSegment *segments,
+                         int num_segments);
+
+  /** @brief 1 パケットを 1 つの IsochTRB（TD）として，連続するサービス間隔に積む．
+   *
+   * 全ての TD で完了イベントを生成させ，割り込みは最後の TD だけで起こす（BEI）．
+   * これによりパケットごとの結果を 1 回の割り込みでまとめて受け取る．
+   */
+  Error PushIsochTransfer(EndpointID ep_id, IsochPacket *packets, int num_packets);
+  /** @brief dci に次のアイソクロナス TD を置くマイクロフレームを決める．
+   *
+   * 積んである TD に続けられるならその直後，遅れていれば MFINDEX + IST より先にする．
    */
-  ArrayMap<const void *, const SetupStageTRB *, 16> setup_stage_map_{};
+  uint16_t NextIsochMicroframe(DeviceContextIndex dci, const Ring &tr);
 
   // usb::Device* usb_device_;
 };
@@ -2,7 +2,12 @@
 
 #include "usb/memory.hpp"
 
+#include <algorithm>
+
 namespace usb::xhci {
+// AllocDevice で 1 ページに収まるように確保する
+static_assert(sizeof(Device) <= 4096);
+
 Error DeviceManager::Initialize(size_t max_slots) {
   max_slots_ = max_slots;
 
@@ -17,10 +22,22 @@ Error DeviceManager::Initialize(size_t max_slots) {
     return MAKE_ERROR(Error::kNoEnoughMemory);
   }
 
+  links_ = AllocArray<Link>(max_slots_ + 1, 0, 0);
+  child_slots_ = AllocArray<uint8_t>((max_slots_ + 1) * kChildrenPerHub, 0, 0);
+  if (links_ == nullptr || child_slots_ == nullptr) {
+    FreeMem(devices_);
+    FreeMem(device_context_pointers_);
+    FreeMem(links_);
+    FreeMem(child_slots_);
+    return MAKE_ERROR(Error::kNoEnoughMemory);
+  }
+
   for (size_t i = 0; i <= max_slots_; ++i) {
     devices_[i] = nullptr;
     device_context_pointers_[i] = nullptr;
+    links_[i] = Link{0, 0};
   }
+  std::fill_n(child_slots_, (max_slots_ + 1) * kChildrenPerHub, 0);
 
   return MAKE_ERROR(Error::kSuccess);
 }
@@ -28,15 +45,25 @@ Error DeviceManager::Initialize(size_t max_slots) {
 DeviceContext **DeviceManager::DeviceContexts() const { return device_context_pointers_; }
 
 Device *DeviceManager::FindByPort(uint8_t port_num, uint32_t route_string) const {
-  for (size_t i = 1; i <= max_slots_; ++i) {
-    auto dev = devices_[i];
-    if (dev == nullptr)
-      continue;
-    if (dev->DeviceContext()->slot_context.bits.root_hub_port_num == port_num) {
-      return dev;
+  uint8_t slot_id = root_port_slots_[port_num];
+  for (int depth = 0; depth < kMaxRouteDepth && slot_id != 0; ++depth) {
+    const auto hub_port = (route_string >> (4 * depth)) & 0xfu;
+    if (hub_port == 0) {
+      break;
     }
+    slot_id = child_slots_[slot_id * kChildrenPerHub + hub_port];
   }
-  return nullptr;
+  return FindBySlot(slot_id);
+}
+
+Device *DeviceManager::FindByAttachPoint(uint8_t hub_slot, uint8_t port_num) const {
+  if (hub_slot == 0) {
+    return FindBySlot(root_port_slots_[port_num]);
+  }
+  if (hub_slot > max_slots_ || port_num >= kChildrenPerHub) {
+    return nullptr;
+  }
+  return FindBySlot(child_slots_[hub_slot * kChildrenPerHub + port_num]);
 }
 
 Device *DeviceManager::FindByState(enum Device::State state) const {
@@ -67,7 +94,8 @@ WithError<Device*> DeviceManager::Get(uint8_t device_id) const {
 }
 */
 
-Error DeviceManager::AllocDevice(uint8_t slot_id, DoorbellRegister *dbreg) {
+Error DeviceManager::AllocDevice(Controller *xhc, uint8_t slot_id, DoorbellRegister *dbreg,
+                                 uint16_t interrupter_target) {
   if (slot_id > max_slots_) {
     return MAKE_ERROR(Error::kInvalidSlotID);
   }
@@ -77,7 +105,10 @@ Error DeviceManager::AllocDevice(uint8_t slot_id, DoorbellRegister *dbreg) {
   }
 
   devices_[slot_id] = AllocArray<Device>(1, 64, 4096);
-  new (devices_[slot_id]) Device(slot_id, dbreg);
+  if (devices_[slot_id] == nullptr) {
+    return MAKE_ERROR(Error::kNoEnoughMemory);
+  }
+  new (devices_[slot_id]) Device(xhc, slot_id, dbreg, interrupter_target);
   return MAKE_ERROR(Error::kSuccess);
 }
 
@@ -91,8 +122,40 @@ Error DeviceManager::LoadDCBAA(uint8_t slot_id) {
   return MAKE_ERROR(Error::kSuccess);
 }
 
+Error DeviceManager::Attach(uint8_t slot_id, uint8_t hub_slot, uint8_t port_num) {
+  if (slot_id == 0 || slot_id > max_slots_ || hub_slot > max_slots_) {
+    return MAKE_ERROR(Error::kInvalidSlotID);
+  }
+  if (hub_slot == 0) {
+    root_port_slots_[port_num] = slot_id;
+  } else if (port_num < kChildrenPerHub) {
+    child_slots_[hub_slot * kChildrenPerHub + port_num] = slot_id;
+  } else {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  links_[slot_id] = Link{hub_slot, port_num};
+  return MAKE_ERROR(Error::kSuccess);
+}
+
 Error DeviceManager::Remove(uint8_t slot_id) {
+  if (slot_id == 0 || slot_id > max_slots_) {
+    return MAKE_ERROR(Error::kInvalidSlotID);
+  }
+  const auto link = links_[slot_id];
+  if (link.hub_slot == 0) {
+    if (root_port_slots_[link.port_num] == slot_id) {
+      root_port_slots_[link.port_num] = 0;
+    }
+  } else if (auto &child = child_slots_[link.hub_slot * kChildrenPerHub + link.port_num];
+             child == slot_id) {
+    child = 0;
+  }
+  links_[slot_id] = Link{0, 0};
+
   device_context_pointers_[slot_id] = nullptr;
+  if (auto dev = devices_[slot_id]) {
+    dev->~Device();
+  }
   FreeMem(devices_[slot_id]);
   devices_[slot_id] = nullptr;
   return MAKE_ERROR(Error::kSuccess);
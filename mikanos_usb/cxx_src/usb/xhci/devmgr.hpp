@@ -10,21 +10,44 @@
 #include "usb/xhci/context.hpp"
 #include "usb/xhci/device.hpp"
 
+#include <array>
 #include <cstddef>
 #include <cstdint>
 
 namespace usb::xhci {
+class Controller;
+
 class DeviceManager {
 
 public:
   Error Initialize(size_t max_slots);
   DeviceContext **DeviceContexts() const;
+  /** @brief 管理できるスロット ID の最大値（CONFIG の Max Slots Enabled に設定する値） */
+  size_t MaxSlots() const { return max_slots_; }
+  /** @brief ルートハブのポート番号とルートストリングでデバイスを探す．
+   *
+   * 接続木をルートストリングの段数（高々 kMaxRouteDepth）だけ辿るので，
+   * デバイスの数によらず定数時間で済む．
+   */
   Device *FindByPort(uint8_t port_num, uint32_t route_string) const;
+  /** @brief hub_slot のハブ（0 ならルートハブ）の port_num 番ポートに接続されたデバイスを探す． */
+  Device *FindByAttachPoint(uint8_t hub_slot, uint8_t port_num) const;
   Device *FindByState(enum Device::State state) const;
   Device *FindBySlot(uint8_t slot_id) const;
   // WithError<Device*> Get(uint8_t device_id) const;
-  Error AllocDevice(uint8_t slot_id, DoorbellRegister *dbreg);
+  Error AllocDevice(Controller *xhc, uint8_t slot_id, DoorbellRegister *dbreg,
+                    uint16_t interrupter_target = 0);
   Error LoadDCBAA(uint8_t slot_id);
+  /** @brief slot_id のデバイスを接続木に登録する．
+   *
+   * @param hub_slot  接続先のハブのスロット ID．0 ならルートハブ．
+   * @param port_num  接続先のポート番号．
+   */
+  Error Attach(uint8_t slot_id, uint8_t hub_slot, uint8_t port_num);
+  /** @brief slot_id のデバイスを接続木から外して破棄し，そのメモリを全て解放する．
+   *
+   * ホストコントローラがスロットを参照しなくなった後（Disable Slot の完了後）に呼ぶこと．
+   */
   Error Remove(uint8_t slot_id);
 
 private:
@@ -35,5 +58,21 @@ private:
 
   // The number of elements is max_slots_ + 1.
   Device **devices_;
+
+  /** ハブ 1 つあたりの子の表の大きさ．ルートストリングの 1 段（4 ビット）で表せる数． */
+  static const size_t kChildrenPerHub = 16;
+  /** 各デバイスの接続先（index = slot ID） */
+  struct Link {
+    uint8_t hub_slot;
+    uint8_t port_num;
+  };
+  // The number of elements is max_slots_ + 1.
+  Link *links_;
+  /** ハブのポートに接続されたデバイスのスロット ID．
+   * 要素数は (max_slots_ + 1) * kChildrenPerHub で，hub_slot * kChildrenPerHub + port_num で引く．
+   */
+  uint8_t *child_slots_;
+  /** ルートハブの各ポートに接続されたデバイスのスロット ID（index = port number） */
+  std::array<uint8_t, 256> root_port_slots_{};
 };
 } // namespace usb::xhci
@@ -0,0 +1,76 @@
+#include "usb/xhci/event_trace.hpp"
+
+#include "usb/latency_trace.hpp"
+#include "usb/xhci/xhci.hpp"
+
+namespace usb::xhci {
+#ifndef MIKANOS_USB_EVENT_TRACE
+
+void _RecordEvent(Controller &xhc, uint16_t interrupter, const TRB &event_trb) {}
+bool SetEventTraceEnabled(bool enabled) { return false; }
+size_t ReadEventTrace(EventTraceRecord *buf, size_t max_records) { return 0; }
+uint64_t EventTraceDropped() { return 0; }
+void ResetEventTrace() {}
+
+#else // MIKANOS_USB_EVENT_TRACE
+
+namespace {
+/** 要素数．インデックスの計算をマスクで済ませるため 2 のべき乗にする． */
+const size_t kEventTraceSize = 2048;
+
+std::array<EventTraceRecord, kEventTraceSize> records{};
+/** 次に書き込む位置と次に読み出す位置．どちらも単調に増加する． */
+size_t head = 0;
+size_t tail = 0;
+uint64_t dropped = 0;
+bool enabled = false;
+} // namespace
+
+void _RecordEvent(Controller &xhc, uint16_t interrupter, const TRB &event_trb) {
+  if (!enabled) {
+    return;
+  }
+
+  auto &record = records[head % kEventTraceSize];
+  record.tsc = ReadTSC();
+  record.trb = event_trb.data;
+  record.portsc = 0;
+  if (auto trb = TRBDynamicCast<const PortStatusChangeEventTRB>(&event_trb)) {
+    const uint8_t port_id = trb->bits.port_id;
+    if (1 <= port_id && port_id <= xhc.MaxPorts()) {
+      record.portsc = xhc.PortAt(port_id).Status();
+    }
+  }
+  record.interrupter = interrupter;
+  record.reserved = 0;
+
+  ++head;
+  if (head - tail > kEventTraceSize) {
+    ++tail;
+    ++dropped;
+  }
+}
+
+bool SetEventTraceEnabled(bool enable) {
+  enabled = enable;
+  return true;
+}
+
+size_t ReadEventTrace(EventTraceRecord *buf, size_t max_records) {
+  size_t n = 0;
+  while (n < max_records && tail != head) {
+    buf[n++] = records[tail % kEventTraceSize];
+    ++tail;
+  }
+  return n;
+}
+
+uint64_t EventTraceDropped() { return dropped; }
+
+void ResetEventTrace() {
+  head = tail = 0;
+  dropped = 0;
+}
+
+#endif // MIKANOS_USB_EVENT_TRACE
+} // namespace usb::xhci
@@ -0,0 +1,69 @@
+/**
+ * @file usb/xhci/event_trace.hpp
+ *
+ * イベントリングから取り出したイベントを，届いた順にそのまま記録する仕組み．
+ *
+ * 特定のデバイスの組み合わせでだけ起きる問題を調べるため，イベント TRB と，
+ * ハンドラが読むレジスタ（Port Status Change Event なら PORTSC）と時刻を残す．
+ * MIKANOS_USB_EVENT_TRACE を定義してビルドしたときだけ記録でき，
+ * 記録は SetEventTraceEnabled で有効にしてから始まる．
+ */
+
+#pragma once
+
+#include "usb/xhci/trb.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace usb::xhci {
+class Controller;
+
+#ifdef MIKANOS_USB_EVENT_TRACE
+constexpr bool kEventTraceEnabled = true;
+#else
+constexpr bool kEventTraceEnabled = false;
+#endif
+
+/** @brief 記録した 1 つのイベント */
+struct EventTraceRecord {
+  /** イベントを取り出した時刻（TSC） */
+  uint64_t tsc;
+  /** イベント TRB の内容．サイクルビットも取り出したときのまま残す． */
+  std::array<uint32_t, 4> trb;
+  /** Port Status Change Event なら，ハンドラが処理する前の PORTSC．それ以外は 0． */
+  uint32_t portsc;
+  /** イベントが届いたインタラプタ */
+  uint16_t interrupter;
+  uint16_t reserved;
+};
+static_assert(sizeof(EventTraceRecord) == 32);
+
+void _RecordEvent(Controller &xhc, uint16_t interrupter, const TRB &event_trb);
+
+/** @brief 処理する直前のイベントを記録する． */
+inline void RecordEvent(Controller &xhc, uint16_t interrupter, const TRB &event_trb) {
+  if constexpr (kEventTraceEnabled) {
+    _RecordEvent(xhc, interrupter, event_trb);
+  }
+}
+
+/** @brief 記録を始める（true）か止める（false）．記録できないビルドなら false を返す． */
+bool SetEventTraceEnabled(bool enabled);
+
+/** @brief 記録したイベントを古い順に高々 max_records 個取り出す．
+ *
+ * 取り出される前にバッファが溢れた場合は古いイベントから上書きされ，
+ * 上書きされた数は EventTraceDropped で分かる．
+ *
+ * @return 取り出したレコードの数
+ */
+size_t ReadEventTrace(EventTraceRecord *buf, size_t max_records);
+
+/** @brief 取り出される前に上書きされたイベントの数 */
+uint64_t EventTraceDropped();
+
+/** @brief 記録したイベントと上書きされた数を捨てる． */
+void ResetEventTrace();
+} // namespace usb::xhci
@@ -18,13 +18,13 @@ bool Port::IsPortResetChanged() const { return port_reg_set_.PORTSC.Read().bits.
 
 int Port::Speed() const { return port_reg_set_.PORTSC.Read().bits.port_speed; }
 
+uint32_t Port::Status() const { return port_reg_set_.PORTSC.Read().data[0]; }
+
 Error Port::Reset() {
   auto portsc = port_reg_set_.PORTSC.Read();
   portsc.data[0] &= 0x0e00c3e0u;
   portsc.data[0] |= 0x00020010u; // Write 1 to PR and CSC
   port_reg_set_.PORTSC.Write(portsc);
-  while (port_reg_set_.PORTSC.Read().bits.port_reset)
-    ;
   return MAKE_ERROR(Error::kSuccess);
 }
 
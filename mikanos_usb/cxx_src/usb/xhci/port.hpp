@@ -35,6 +35,9 @@ public:
   bool IsConnectStatusChanged() const;
   bool IsPortResetChanged() const;
   int Speed() const;
+  /** @brief PORTSC の値をそのまま読む． */
+  uint32_t Status() const;
+  /** @brief ポートのリセットを始める．完了は Port Status Change Event（PRC）で通知される． */
   Error Reset();
   Device *Initialize();
 
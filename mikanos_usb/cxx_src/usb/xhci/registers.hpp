@@ -8,6 +8,9 @@
 
 #include "register.hpp"
 
+#include <cstddef>
+#include <iterator>
+
 namespace usb::xhci {
 union HCSPARAMS1_Bitmap {
   uint32_t data[1];
@@ -316,6 +319,14 @@ union ERDP_Bitmap {
   void SetPointer(uint64_t value) { bits.event_ring_dequeue_pointer = value >> 4; }
 } __attribute__((packed));
 
+union MFINDEX_Bitmap {
+  uint32_t data[1];
+  struct {
+    uint32_t microframe_index : 14;
+    uint32_t : 18;
+  } __attribute__((packed)) bits;
+} __attribute__((packed));
+
 struct InterrupterRegisterSet {
   MemMapRegister<IMAN_Bitmap> IMAN;
   MemMapRegister<IMOD_Bitmap> IMOD;
@@ -366,6 +377,12 @@ public:
 
   class Iterator {
   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = ValueType;
+    using difference_type = std::ptrdiff_t;
+    using pointer = ValueType *;
+    using reference = ValueType &;
+
     Iterator(ValueType *reg) : reg_{reg} {}
     auto operator->() const { return reg_; }
     auto &operator*() const { return *reg_; }
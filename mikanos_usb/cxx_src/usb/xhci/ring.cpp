@@ -1,7 +1,17 @@
 #include "usb/xhci/ring.hpp"
 
+#include "usb/latency_trace.hpp"
 #include "usb/memory.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+namespace {
+/** @brief 転送 TRB の dword 3 にある chain bit */
+const uint32_t kChainBitMask = 1u << 4;
+} // namespace
+
 namespace usb::xhci {
 Ring::~Ring() {
   if (buf_ != nullptr) {
@@ -16,6 +26,9 @@ Error Ring::Initialize(size_t buf_size) {
 
   cycle_bit_ = true;
   write_index_ = 0;
+  dequeue_index_ = 0;
+  in_td_ = false;
+  td_head_ = nullptr;
   buf_size_ = buf_size;
 
   buf_ = AllocArray<TRB>(buf_size_, 64, 64 * 1024);
@@ -24,89 +37,234 @@ Error Ring::Initialize(size_t buf_size) {
   }
   memset(buf_, 0, buf_size_ * sizeof(TRB));
 
+  // Link TRB の指す先は変わらないので，周回のたびに書き込むのは dword 3 だけで済む
+  LinkTRB link{buf_};
+  link.bits.toggle_cycle = true;
+  buf_[buf_size_ - 1].data = link.data;
+  buf_[buf_size_ - 1].data[3] = ControlWithCycle(link.data[3], !cycle_bit_);
+
   return MAKE_ERROR(Error::kSuccess);
 }
 
-void Ring::CopyToLast(const std::array<uint32_t, 4> &data) {
-  for (int i = 0; i < 3; ++i) {
-    // data[0..2] must be written prior to data[3].
-    buf_[write_index_].data[i] = data[i];
+size_t Ring::NumInFlight() const {
+  const auto capacity = Capacity();
+  if (capacity == 0) {
+    return 0;
+  }
+  return (write_index_ + capacity - dequeue_index_) % capacity;
+}
+
+size_t Ring::FreeSlots() const {
+  const auto capacity = Capacity();
+  if (capacity == 0) {
+    return 0;
+  }
+  return capacity - 1 - NumInFlight();
+}
+
+void Ring::MarkConsumed(const TRB *trb) {
+  if (const int index = IndexOf(trb); index >= 0) {
+    dequeue_index_ = (index + 1) % Capacity();
+  }
+}
+
+TRB *Ring::LastOfTD(const TRB *trb) const {
+  int index = IndexOf(trb);
+  if (index < 0) {
+    return nullptr;
   }
-  buf_[write_index_].data[3] = (data[3] & 0xfffffffeu) | static_cast<uint32_t>(cycle_bit_);
+  // Link TRB の chain bit は直前の TRB と同じなので，通常の TRB だけを見ればよい
+  for (size_t i = 0; i + 1 < Capacity(); ++i) {
+    if ((buf_[index].data[3] & kChainBitMask) == 0) {
+      break;
+    }
+    index = (index + 1) % Capacity();
+  }
+  return &buf_[index];
+}
+
+TRB *Ring::NextOf(const TRB *trb, bool *cycle) const {
+  const int index = IndexOf(trb);
+  if (index < 0) {
+    return nullptr;
+  }
+  *cycle = trb->data[3] & 1u;
+  if (static_cast<size_t>(index) + 1 == Capacity()) {
+    // Link TRB（toggle cycle つき）を越えて先頭に戻る
+    *cycle = !*cycle;
+    return &buf_[0];
+  }
+  return &buf_[index + 1];
+}
+
+void Ring::CopyToLast(const std::array<uint32_t, 4> &data, bool cycle_bit) {
+  // カーネルは SSE のレジスタを退避しないので 128 ビットのストアは使えない．
+  // dword 0〜1 を 1 回の 64 ビットストア，dword 2 を 32 ビットストアで書く．
+  auto dst = reinterpret_cast<volatile uint32_t *>(buf_[write_index_].data.data());
+  *reinterpret_cast<volatile uint64_t *>(dst) = static_cast<uint64_t>(data[1]) << 32 | data[0];
+  dst[2] = data[2];
+  // data[0..2] must be written prior to data[3].
+  // x86 ではストア同士の順序は保たれるので，コンパイラによる並べ替えを止めれば十分．
+  std::atomic_signal_fence(std::memory_order_release);
+  dst[3] = ControlWithCycle(data[3], cycle_bit);
 }
 
 TRB *Ring::Push(const std::array<uint32_t, 4> &data) {
+  const auto trace_begin = TraceBegin();
   auto trb_ptr = &buf_[write_index_];
-  CopyToLast(data);
+  if (in_td_ && td_head_ == nullptr) {
+    // TD の先頭は CommitTD() までホストコントローラの物にしない
+    td_head_ = trb_ptr;
+    td_head_control_ = ControlWithCycle(data[3], cycle_bit_);
+    CopyToLast(data, !cycle_bit_);
+  } else {
+    CopyToLast(data, cycle_bit_);
+  }
 
   ++write_index_;
   if (write_index_ == buf_size_ - 1) {
+    // TD の途中で一周するなら，Link TRB にも chain bit を立てて TD を次の周回へつなげる．
+    // TD の最後の TRB（chain bit が無い）の直後や TD の外では chain bit を落とす．
     LinkTRB link{buf_};
     link.bits.toggle_cycle = true;
-    CopyToLast(link.data);
+    link.bits.chain_bit = in_td_ && (data[3] & kChainBitMask) != 0;
+    std::atomic_signal_fence(std::memory_order_release);
+    auto link_control = reinterpret_cast<volatile uint32_t *>(&buf_[write_index_].data[3]);
+    *link_control = ControlWithCycle(link.data[3], cycle_bit_);
 
     write_index_ = 0;
     cycle_bit_ = !cycle_bit_;
   }
 
+  TraceEnd(TraceStage::kRingPush, trace_begin);
   return trb_ptr;
 }
 
-Error EventRing::Initialize(size_t buf_size, InterrupterRegisterSet *interrupter) {
-  if (buf_ != nullptr) {
-    FreeMem(buf_);
+TRB *Ring::PushN(const TRB *trbs, size_t num_trbs) {
+  BeginTD();
+  auto head = WritePosition();
+  for (size_t i = 0; i < num_trbs; ++i) {
+    Push(trbs[i].data);
   }
+  CommitTD();
+  return head;
+}
+
+void Ring::BeginTD() {
+  in_td_ = true;
+  td_head_ = nullptr;
+}
+
+void Ring::CommitTD() {
+  if (td_head_ != nullptr) {
+    // TD の残りの TRB を全て書き終えてから先頭を引き渡す
+    std::atomic_signal_fence(std::memory_order_release);
+    *reinterpret_cast<volatile uint32_t *>(&td_head_->data[3]) = td_head_control_;
+  }
+  in_td_ = false;
+  td_head_ = nullptr;
+}
+
+void EventRing::FreeSegments() {
+  if (erst_ == nullptr) {
+    return;
+  }
+  for (size_t i = 0; i < num_segments_; ++i) {
+    FreeMem(SegmentBegin(i));
+  }
+  FreeMem(erst_);
+  erst_ = nullptr;
+  num_segments_ = 0;
+}
+
+Error EventRing::Initialize(size_t num_trbs, InterrupterRegisterSet *interrupter,
+                            size_t max_segments, Access64 access64) {
+  FreeSegments();
 
   cycle_bit_ = true;
-  buf_size_ = buf_size;
   interrupter_ = interrupter;
+  access64_ = access64;
 
-  buf_ = AllocArray<TRB>(buf_size_, 64, 64 * 1024);
-  if (buf_ == nullptr) {
-    return MAKE_ERROR(Error::kNoEnoughMemory);
+  if (max_segments == 0) {
+    max_segments = 1;
   }
-  memset(buf_, 0, buf_size_ * sizeof(TRB));
+  num_segments_ = (num_trbs + kMaxSegmentSize - 1) / kMaxSegmentSize;
+  if (num_segments_ == 0) {
+    num_segments_ = 1;
+  } else if (num_segments_ > max_segments) {
+    num_segments_ = max_segments;
+  }
+  segment_size_ = (num_trbs + num_segments_ - 1) / num_segments_;
+  segment_size_ = (segment_size_ + kMinSegmentSize - 1) / kMinSegmentSize * kMinSegmentSize;
+  // セグメントは 64 KiB 境界を跨いではいけない
+  segment_size_ = std::min(segment_size_, 64 * 1024 / sizeof(TRB));
 
-  erst_ = AllocArray<EventRingSegmentTableEntry>(1, 64, 64 * 1024);
+  erst_ = AllocArray<EventRingSegmentTableEntry>(num_segments_, 64, 64 * 1024);
   if (erst_ == nullptr) {
-    FreeMem(buf_);
+    num_segments_ = 0;
     return MAKE_ERROR(Error::kNoEnoughMemory);
   }
-  memset(erst_, 0, 1 * sizeof(EventRingSegmentTableEntry));
+  memset(erst_, 0, num_segments_ * sizeof(EventRingSegmentTableEntry));
 
-  erst_[0].bits.ring_segment_base_address = reinterpret_cast<uint64_t>(buf_);
-  erst_[0].bits.ring_segment_size = buf_size_;
+  for (size_t i = 0; i < num_segments_; ++i) {
+    auto segment = AllocArray<TRB>(segment_size_, 64, 64 * 1024);
+    if (segment == nullptr) {
+      num_segments_ = i;
+      FreeSegments();
+      return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
+    memset(segment, 0, segment_size_ * sizeof(TRB));
+
+    erst_[i].bits.ring_segment_base_address = reinterpret_cast<uint64_t>(segment);
+    erst_[i].bits.ring_segment_size = segment_size_;
+  }
 
   ERSTSZ_Bitmap erstsz = interrupter_->ERSTSZ.Read();
-  erstsz.SetSize(1);
+  erstsz.SetSize(num_segments_);
   interrupter_->ERSTSZ.Write(erstsz);
 
-  WriteDequeuePointer(&buf_[0]);
+  segment_index_ = 0;
+  dequeue_ = SegmentBegin(0);
+  segment_end_ = dequeue_ + segment_size_;
+  WriteDequeuePointer(dequeue_);
 
-  ERSTBA_Bitmap erstba = interrupter_->ERSTBA.Read();
+  ERSTBA_Bitmap erstba = interrupter_->ERSTBA.Read(access64_);
   erstba.SetPointer(reinterpret_cast<uint64_t>(erst_));
-  interrupter_->ERSTBA.Write(erstba);
+  interrupter_->ERSTBA.Write(erstba, access64_);
 
   return MAKE_ERROR(Error::kSuccess);
 }
 
 void EventRing::WriteDequeuePointer(TRB *p) {
-  auto erdp = interrupter_->ERDP.Read();
+  // ERDP の全フィールドをここで決めるので，現在値を読む必要はない
+  ERDP_Bitmap erdp{};
   erdp.SetPointer(reinterpret_cast<uint64_t>(p));
-  interrupter_->ERDP.Write(erdp);
+  erdp.bits.dequeue_erst_segment_index = segment_index_ & 0x7u;
+  erdp.bits.event_handler_busy = true; // RW1C
+  interrupter_->ERDP.Write(erdp, access64_);
 }
 
-void EventRing::Pop() {
-  auto p = ReadDequeuePointer() + 1;
+void EventRing::SetInterruptEnabled(bool enabled) {
+  interrupter_->IMAN.Update([enabled](auto &iman) {
+    iman.bits.interrupt_pending = true; // RW1C
+    iman.bits.interrupt_enable = enabled;
+  });
+}
 
-  TRB *segment_begin = reinterpret_cast<TRB *>(erst_[0].bits.ring_segment_base_address);
-  TRB *segment_end = segment_begin + erst_[0].bits.ring_segment_size;
+void EventRing::Pop() {
+  auto p = dequeue_ + 1;
 
-  if (p == segment_end) {
-    p = segment_begin;
-    cycle_bit_ = !cycle_bit_;
+  if (p == segment_end_) {
+    ++segment_index_;
+    if (segment_index_ == num_segments_) {
+      // 最後のセグメントの末尾に達したら先頭に戻り，cycle bit を反転させる
+      segment_index_ = 0;
+      cycle_bit_ = !cycle_bit_;
+    }
+    p = SegmentBegin(segment_index_);
+    segment_end_ = p + segment_size_;
   }
 
-  WriteDequeuePointer(p);
+  dequeue_ = p;
 }
 } // namespace usb::xhci
@@ -27,12 +27,81 @@ public:
   Error Initialize(size_t buf_size);
 
   /** @brief TRB に cycle bit を設定した上でリング末尾に追加する．
+   *
+   * 呼び出し側は事前に FreeSlots() で空きがあることを確認しなければならない．
    *
    * @return 追加された（リング上の）TRB を指すポインタ．
    */
   template <typename TRBType> TRB *Push(const TRBType &trb) { return Push(trb.data); }
 
+  /** @brief trbs の num_trbs 個の TRB を 1 つの TD としてリング末尾に追加する．
+   *
+   * BeginTD() と CommitTD() で挟んで Push するのと同じ．
+   * 呼び出し側は事前に FreeSlots() で空きがあることを確認しなければならない．
+   *
+   * @return 追加された先頭の TRB を指すポインタ．
+   */
+  TRB *PushN(const TRB *trbs, size_t num_trbs);
+
+  /** @brief 以降に Push する TRB を，CommitTD() までホストコントローラから隠す．
+   *
+   * 先頭の TRB は cycle bit を反転させた状態で書き込み，CommitTD() で正しい
+   * cycle bit を書き込む．ホストコントローラは先頭の TRB で止まるので，
+   * 複数の TRB からなる TD は書き終わってから一度に見えるようになる．
+   * TD がリング末尾をまたぐ場合は，Link TRB の chain bit で TD をつなげる．
+   */
+  void BeginTD();
+  /** @brief BeginTD() 以降に Push した TRB をホストコントローラに引き渡す． */
+  void CommitTD();
+
   TRB *Buffer() const { return buf_; }
+  /** @brief 次に Push される TRB が置かれる位置 */
+  TRB *WritePosition() const { return &buf_[write_index_]; }
+  /** @brief Link TRB を除いた，TRB を格納できるエントリ数 */
+  size_t Capacity() const { return buf_size_ > 0 ? buf_size_ - 1 : 0; }
+  /** @brief Push 済みでホストコントローラの処理完了が確認できていない TRB の数 */
+  size_t NumInFlight() const;
+  /** @brief 上書きせずに Push できる TRB の数．
+   *
+   * 満杯と空を区別するため，エントリを 1 つ空けておく．
+   */
+  size_t FreeSlots() const;
+
+  /** @brief ホストコントローラが trb までを処理し終えたことを記録する．
+   *
+   * Transfer Event や Command Completion Event の TRB Pointer を渡す．
+   * trb がこのリング上の TRB でなければ何もしない．
+   */
+  void MarkConsumed(const TRB *trb);
+
+  /** @brief trb がリング上の何番目のエントリかを返す．リング上の TRB でなければ -1． */
+  int IndexOf(const TRB *trb) const {
+    if (trb < buf_ || buf_ + Capacity() <= trb) {
+      return -1;
+    }
+    return trb - buf_;
+  }
+
+  /** @brief 次に Push される TRB に書き込む cycle bit（プロデューサ・サイクル・ステート） */
+  bool ProducerCycleState() const { return cycle_bit_; }
+  /** @brief Push 済みの TRB をすべて処理済みとして扱う．
+   *
+   * 止めたエンドポイントの TR Dequeue Pointer を WritePosition() まで進め，
+   * 積んであった TD を取り消したときに使う．
+   */
+  void DiscardInFlight() { dequeue_index_ = write_index_; }
+
+  /** @brief trb から chain bit をたどり，trb を含む TD の最後の TRB を返す．
+   *
+   * trb がリング上の TRB でなければ nullptr．
+   */
+  TRB *LastOfTD(const TRB *trb) const;
+  /** @brief trb の次にホストコントローラが処理する TRB を返す．Link TRB は飛ばす．
+   *
+   * 戻り値の位置のサイクル・ステート（TRB に書かれる cycle bit）を *cycle に書き込む．
+   * trb がリング上の TRB でなければ nullptr．
+   */
+  TRB *NextOf(const TRB *trb, bool *cycle) const;
 
 private:
   TRB *buf_ = nullptr;
@@ -42,12 +111,27 @@ private:
   bool cycle_bit_;
   /** @brief リング上で次に書き込む位置 */
   size_t write_index_;
+  /** @brief ホストコントローラが次に処理する（と分かっている）位置 */
+  size_t dequeue_index_ = 0;
+
+  /** @brief BeginTD() から CommitTD() までの間なら true */
+  bool in_td_ = false;
+  /** @brief TD の先頭の TRB．まだ何も Push していなければ nullptr */
+  TRB *td_head_ = nullptr;
+  /** @brief CommitTD() で TD の先頭の TRB に書き込む，正しい cycle bit を含む dword 3 */
+  uint32_t td_head_control_ = 0;
+
+  /** @brief data[3] に cycle bit を設定した値 */
+  uint32_t ControlWithCycle(uint32_t control, bool cycle_bit) const {
+    return (control & 0xfffffffeu) | static_cast<uint32_t>(cycle_bit);
+  }
 
   /** @brief TRB に cycle bit を設定した上でリング末尾に書き込む．
    *
+   * dword 0〜2 を書いてから cycle bit を含む dword 3 を書く．
    * write_index_ は変化させない．
    */
-  void CopyToLast(const std::array<uint32_t, 4> &data);
+  void CopyToLast(const std::array<uint32_t, 4> &data, bool cycle_bit);
 
   /** @brief TRB に cycle bit を設定した上でリング末尾に追加する．
    *
@@ -74,26 +158,76 @@ union EventRingSegmentTableEntry {
 
 class EventRing {
 public:
-  Error Initialize(size_t buf_size, InterrupterRegisterSet *interrupter);
+  /** @brief 1 セグメントあたりの TRB 数の上限（4 KiB）． */
+  static const size_t kMaxSegmentSize = 256;
+  /** @brief 1 セグメントあたりの TRB 数の下限（xHCI 仕様による）． */
+  static const size_t kMinSegmentSize = 16;
+
+  /** @brief イベントリングのメモリ領域を割り当て，インタラプタに登録する．
+   *
+   * 少なくとも num_trbs 個のイベントを保持できるよう，kMaxSegmentSize 個ずつの
+   * セグメントに分割して割り当てる．セグメント数が max_segments を超える場合は
+   * 各セグメントを大きくする．
+   *
+   * @param num_trbs      イベントリング全体で保持するイベント（TRB）の数．
+   * @param interrupter   このイベントリングを登録するインタラプタ．
+   * @param max_segments  ERST のエントリ数の上限（ERST Max）．
+   * @param access64      ERSTBA と ERDP へのアクセス方法．
+   */
+  Error Initialize(size_t num_trbs, InterrupterRegisterSet *interrupter, size_t max_segments = 1,
+                   Access64 access64 = Access64::kNative);
 
   TRB *ReadDequeuePointer() const {
-    return reinterpret_cast<TRB *>(interrupter_->ERDP.Read().Pointer());
+    return reinterpret_cast<TRB *>(interrupter_->ERDP.Read(access64_).Pointer());
   }
 
+  /** @brief ERDP に p を書き込み，同時に Event Handler Busy ビットをクリアする． */
   void WriteDequeuePointer(TRB *p);
 
-  bool HasFront() const { return Front()->bits.cycle_bit == cycle_bit_; }
+  bool HasFront() const {
+    // TRB はホストコントローラが書き換えるため，cycle bit は毎回メモリから読み直す
+    const auto control = reinterpret_cast<const volatile uint32_t *>(&dequeue_->data[3]);
+    return (*control & 1u) == cycle_bit_;
+  }
 
-  TRB *Front() const { return ReadDequeuePointer(); }
+  TRB *Front() const { return dequeue_; }
 
+  /** @brief 先頭のイベントを取り除く．
+   *
+   * デキューポインタはソフトウェア側のシャドウだけを進め，ERDP には書き込まない．
+   * 処理し終えたら FlushDequeuePointer() でホストコントローラに通知すること．
+   */
   void Pop();
 
+  /** @brief シャドウのデキューポインタを ERDP に書き戻す． */
+  void FlushDequeuePointer() { WriteDequeuePointer(dequeue_); }
+
+  /** @brief イベントリング全体で保持できるイベントの数 */
+  size_t Capacity() const { return num_segments_ * segment_size_; }
+
+  /** @brief インタラプタの IMAN.IE を設定し，保留中の割り込み（IMAN.IP）をクリアする． */
+  void SetInterruptEnabled(bool enabled);
+
 private:
-  TRB *buf_;
-  size_t buf_size_;
+  /** @brief 次に読むイベントの位置（ERDP のシャドウ） */
+  TRB *dequeue_ = nullptr;
+  /** @brief dequeue_ を含むセグメントの末尾（の次） */
+  TRB *segment_end_ = nullptr;
+  /** @brief dequeue_ を含むセグメントの ERST 上の番号 */
+  size_t segment_index_ = 0;
+
+  size_t num_segments_ = 0;
+  size_t segment_size_ = 0;
 
   bool cycle_bit_;
-  EventRingSegmentTableEntry *erst_;
-  InterrupterRegisterSet *interrupter_;
+  EventRingSegmentTableEntry *erst_ = nullptr;
+  InterrupterRegisterSet *interrupter_ = nullptr;
+  Access64 access64_ = Access64::kNative;
+
+  TRB *SegmentBegin(size_t index) const {
+    return reinterpret_cast<TRB *>(erst_[index].bits.ring_segment_base_address);
+  }
+
+  void FreeSegments();
 };
 } // namespace usb::xhci
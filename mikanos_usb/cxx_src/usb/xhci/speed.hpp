@@ -6,10 +6,39 @@
 
 #pragma once
 
+#include "usb/device.hpp"
+
 namespace usb::xhci {
 const int kFullSpeed = 1;
 const int kLowSpeed = 2;
 const int kHighSpeed = 3;
 const int kSuperSpeed = 4;
 const int kSuperSpeedPlus = 5;
+
+inline int ToProtocolSpeedID(DeviceSpeed speed) {
+  switch (speed) {
+  case DeviceSpeed::kLow:
+    return kLowSpeed;
+  case DeviceSpeed::kHigh:
+    return kHighSpeed;
+  case DeviceSpeed::kSuper:
+    return kSuperSpeed;
+  default:
+    return kFullSpeed;
+  }
+}
+
+inline DeviceSpeed ToDeviceSpeed(int speed_id) {
+  switch (speed_id) {
+  case kLowSpeed:
+    return DeviceSpeed::kLow;
+  case kHighSpeed:
+    return DeviceSpeed::kHigh;
+  case kSuperSpeed:
+  case kSuperSpeedPlus:
+    return DeviceSpeed::kSuper;
+  default:
+    return DeviceSpeed::kFull;
+  }
+}
 } // namespace usb::xhci
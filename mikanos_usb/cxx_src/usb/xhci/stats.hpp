@@ -0,0 +1,62 @@
+/**
+ * @file usb/xhci/stats.hpp
+ *
+ * ホストコントローラとエンドポイントの統計カウンタ．
+ *
+ * 構造体のレイアウトは Rust 側の mikanos_usb::xhci::{ControllerStats, EndpointStats} と一致させている．
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+namespace usb::xhci {
+/** @brief 統計を取る完了コードの数．これ以上のコードはまとめて最後の要素に数える． */
+const int kNumStatsCompletionCodes = 37;
+
+struct EndpointStats {
+  /** 成功（Short Packet を含む）した転送の完了通知の数 */
+  uint64_t transfers;
+  /** 転送したバイト数 */
+  uint64_t bytes;
+  uint64_t short_packets;
+  /** 失敗した転送の完了通知の数 */
+  uint64_t errors;
+  /** errors_by_code[c] は完了コード c で失敗した数 */
+  std::array<uint32_t, kNumStatsCompletionCodes + 1> errors_by_code;
+  /** Transfer Ring 上で同時に処理待ちだった TRB の数の最大値 */
+  uint32_t peak_in_flight;
+  uint32_t reserved;
+  /** 完了通知を処理してから次の転送を積むまでの間隔（TSC のサイクル数） */
+  uint64_t rearms;
+  uint64_t total_rearm_gap_cycles;
+  uint64_t max_rearm_gap_cycles;
+  /** 直前の完了通知の時刻．次の転送を積んだら 0 に戻す． */
+  uint64_t last_completion_tsc;
+};
+
+struct ControllerStats {
+  /** 処理したイベントの数 */
+  uint64_t events;
+  /** 処理に失敗したイベントの数 */
+  uint64_t event_errors;
+  /** 1 つ以上のイベントを処理した ProcessEvents の呼び出し回数 */
+  uint64_t drain_batches;
+  /** 1 回の ProcessEvents で処理したイベントの数の最大値 */
+  uint64_t max_events_per_batch;
+  /** 割り込みを受けてイベントを処理しに来た回数（まとめて処理された割り込みは 1 回と数える） */
+  uint64_t interrupts;
+  /** 完了したコマンドの数 */
+  uint64_t commands;
+  /** コマンドを積んでから完了通知を処理するまでの時間（TSC のサイクル数） */
+  uint64_t total_command_cycles;
+  uint64_t max_command_cycles;
+  /** 制限時間内に完了せず，Command Ring を中断させた回数 */
+  uint64_t command_timeouts;
+  /** 割り込みを止めてポーリングに切り替えた回数 */
+  uint64_t polling_entries;
+  /** ポーリングでイベントを処理しに来た回数 */
+  uint64_t polls;
+};
+} // namespace usb::xhci
@@ -177,6 +177,63 @@ union LinkTRB {
   void SetPointer(const TRB *p) { bits.ring_segment_pointer = reinterpret_cast<uint64_t>(p) >> 4; }
 };
 
+union IsochTRB {
+  static const unsigned int Type = 5;
+  std::array<uint32_t, 4> data{};
+  struct {
+    uint64_t data_buffer_pointer;
+
+    uint32_t trb_transfer_length : 17;
+    uint32_t td_size : 5;
+    uint32_t interrupter_target : 10;
+
+    uint32_t cycle_bit : 1;
+    uint32_t evaluate_next_trb : 1;
+    uint32_t interrupt_on_short_packet : 1;
+    uint32_t no_snoop : 1;
+    uint32_t chain_bit : 1;
+    uint32_t interrupt_on_completion : 1;
+    uint32_t immediate_data : 1;
+    uint32_t transfer_burst_count : 2;
+    uint32_t block_event_interrupt : 1;
+    uint32_t trb_type : 6;
+    uint32_t transfer_last_burst_packet_count : 4;
+    uint32_t frame_id : 11;
+    uint32_t start_isoch_asap : 1;
+  } __attribute__((packed)) bits;
+
+  IsochTRB() { bits.trb_type = Type; }
+
+  void *Pointer() const { return reinterpret_cast<void *>(bits.data_buffer_pointer); }
+
+  void SetPointer(const void *p) { bits.data_buffer_pointer = reinterpret_cast<uint64_t>(p); }
+};
+
+union EventDataTRB {
+  static const unsigned int Type = 7;
+  std::array<uint32_t, 4> data{};
+  struct {
+    uint64_t event_data;
+
+    uint32_t : 22;
+    uint32_t interrupter_target : 10;
+
+    uint32_t cycle_bit : 1;
+    uint32_t evaluate_next_trb : 1;
+    uint32_t : 2;
+    uint32_t chain_bit : 1;
+    uint32_t interrupt_on_completion : 1;
+    uint32_t : 3;
+    uint32_t block_event_interrupt : 1;
+    uint32_t trb_type : 6;
+    uint32_t : 16;
+  } __attribute__((packed)) bits;
+
+  EventDataTRB() { bits.trb_type = Type; }
+
+  void SetEventData(const void *p) { bits.event_data = reinterpret_cast<uint64_t>(p); }
+};
+
 union NoOpTRB {
   static const unsigned int Type = 8;
   std::array<uint32_t, 4> data{};
@@ -219,6 +276,29 @@ union EnableSlotCommandTRB {
   EnableSlotCommandTRB() { bits.trb_type = Type; }
 };
 
+union DisableSlotCommandTRB {
+  static const unsigned int Type = 10;
+  std::array<uint32_t, 4> data{};
+  struct {
+    uint32_t : 32;
+
+    uint32_t : 32;
+
+    uint32_t : 32;
+
+    uint32_t cycle_bit : 1;
+    uint32_t : 9;
+    uint32_t trb_type : 6;
+    uint32_t : 8;
+    uint32_t slot_id : 8;
+  } __attribute__((packed)) bits;
+
+  DisableSlotCommandTRB(uint8_t slot_id) {
+    bits.trb_type = Type;
+    bits.slot_id = slot_id;
+  }
+};
+
 union AddressDeviceCommandTRB {
   static const unsigned int Type = 11;
   std::array<uint32_t, 4> data{};
@@ -283,6 +363,65 @@ union ConfigureEndpointCommandTRB {
   }
 };
 
+union EvaluateContextCommandTRB {
+  static const unsigned int Type = 13;
+  std::array<uint32_t, 4> data{};
+  struct {
+    uint64_t : 4;
+    uint64_t input_context_pointer : 60;
+
+    uint32_t : 32;
+
+    uint32_t cycle_bit : 1;
+    uint32_t : 9;
+    uint32_t trb_type : 6;
+    uint32_t : 8;
+    uint32_t slot_id : 8;
+  } __attribute__((packed)) bits;
+
+  EvaluateContextCommandTRB(const InputContext *input_context, uint8_t slot_id) {
+    bits.trb_type = Type;
+    bits.slot_id = slot_id;
+    SetPointer(input_context);
+  }
+
+  InputContext *Pointer() const {
+    return reinterpret_cast<InputContext *>(bits.input_context_pointer << 4);
+  }
+
+  void SetPointer(const InputContext *p) {
+    bits.input_context_pointer = reinterpret_cast<uint64_t>(p) >> 4;
+  }
+};
+
+union ResetEndpointCommandTRB {
+  static const unsigned int Type = 14;
+  std::array<uint32_t, 4> data{};
+  struct {
+    uint32_t : 32;
+
+    uint32_t : 32;
+
+    uint32_t : 32;
+
+    uint32_t cycle_bit : 1;
+    uint32_t : 8;
+    uint32_t transfer_state_preserve : 1;
+    uint32_t trb_type : 6;
+    uint32_t endpoint_id : 5;
+    uint32_t : 3;
+    uint32_t slot_id : 8;
+  } __attribute__((packed)) bits;
+
+  ResetEndpointCommandTRB(EndpointID endpoint_id, uint8_t slot_id) {
+    bits.trb_type = Type;
+    bits.endpoint_id = endpoint_id.Address();
+    bits.slot_id = slot_id;
+  }
+
+  EndpointID EndpointID() const { return usb::EndpointID{bits.endpoint_id}; }
+};
+
 union StopEndpointCommandTRB {
   static const unsigned int Type = 15;
   std::array<uint32_t, 4> data{};
@@ -311,6 +450,40 @@ union StopEndpointCommandTRB {
   EndpointID EndpointID() const { return usb::EndpointID{bits.endpoint_id}; }
 };
 
+union SetTRDequeuePointerCommandTRB {
+  static const unsigned int Type = 16;
+  std::array<uint32_t, 4> data{};
+  struct {
+    uint64_t dequeue_cycle_state : 1;
+    uint64_t stream_context_type : 3;
+    uint64_t new_tr_dequeue_pointer : 60;
+
+    uint32_t : 16;
+    uint32_t stream_id : 16;
+
+    uint32_t cycle_bit : 1;
+    uint32_t : 9;
+    uint32_t trb_type : 6;
+    uint32_t endpoint_id : 5;
+    uint32_t : 3;
+    uint32_t slot_id : 8;
+  } __attribute__((packed)) bits;
+
+  SetTRDequeuePointerCommandTRB(EndpointID endpoint_id, uint8_t slot_id, uint16_t stream_id,
+                                const TRB *dequeue, bool dequeue_cycle_state) {
+    bits.trb_type = Type;
+    bits.endpoint_id = endpoint_id.Address();
+    bits.slot_id = slot_id;
+    bits.stream_id = stream_id;
+    // ストリームを使うなら SCT = 1（Primary Transfer Ring）
+    bits.stream_context_type = stream_id != 0 ? 1 : 0;
+    bits.dequeue_cycle_state = dequeue_cycle_state;
+    bits.new_tr_dequeue_pointer = reinterpret_cast<uint64_t>(dequeue) >> 4;
+  }
+
+  EndpointID EndpointID() const { return usb::EndpointID{bits.endpoint_id}; }
+};
+
 union NoOpCommandTRB {
   static const unsigned int Type = 23;
   std::array<uint32_t, 4> data{};
@@ -402,6 +575,88 @@ union PortStatusChangeEventTRB {
   PortStatusChangeEventTRB() { bits.trb_type = Type; }
 };
 
+union BandwidthRequestEventTRB {
+  static const unsigned int Type = 35;
+  std::array<uint32_t, 4> data{};
+  struct {
+    uint32_t : 32;
+
+    uint32_t : 32;
+
+    uint32_t : 24;
+    uint32_t completion_code : 8;
+
+    uint32_t cycle_bit : 1;
+    uint32_t : 9;
+    uint32_t trb_type : 6;
+    uint32_t : 8;
+    uint32_t slot_id : 8;
+  } __attribute__((packed)) bits;
+
+  BandwidthRequestEventTRB() { bits.trb_type = Type; }
+};
+
+union HostControllerEventTRB {
+  static const unsigned int Type = 37;
+  std::array<uint32_t, 4> data{};
+  struct {
+    uint32_t : 32;
+
+    uint32_t : 32;
+
+    uint32_t : 24;
+    uint32_t completion_code : 8;
+
+    uint32_t cycle_bit : 1;
+    uint32_t : 9;
+    uint32_t trb_type : 6;
+    uint32_t : 16;
+  } __attribute__((packed)) bits;
+
+  HostControllerEventTRB() { bits.trb_type = Type; }
+};
+
+union DeviceNotificationEventTRB {
+  static const unsigned int Type = 38;
+  std::array<uint32_t, 4> data{};
+  struct {
+    uint64_t : 4;
+    uint64_t notification_type : 4;
+    uint64_t notification_data : 56;
+
+    uint32_t : 24;
+    uint32_t completion_code : 8;
+
+    uint32_t cycle_bit : 1;
+    uint32_t : 9;
+    uint32_t trb_type : 6;
+    uint32_t : 8;
+    uint32_t slot_id : 8;
+  } __attribute__((packed)) bits;
+
+  DeviceNotificationEventTRB() { bits.trb_type = Type; }
+};
+
+union MFINDEXWrapEventTRB {
+  static const unsigned int Type = 39;
+  std::array<uint32_t, 4> data{};
+  struct {
+    uint32_t : 32;
+
+    uint32_t : 32;
+
+    uint32_t : 24;
+    uint32_t completion_code : 8;
+
+    uint32_t cycle_bit : 1;
+    uint32_t : 9;
+    uint32_t trb_type : 6;
+    uint32_t : 16;
+  } __attribute__((packed)) bits;
+
+  MFINDEXWrapEventTRB() { bits.trb_type = Type; }
+};
+
 /** @brief TRBDynamicCast casts a trb pointer to other type of TRB.
  *
  * @param trb  source pointer
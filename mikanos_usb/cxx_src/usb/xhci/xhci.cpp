@@ -1,52 +1,222 @@
 #include "usb/xhci/xhci.hpp"
 
 #include "logger.hpp"
+#include "usb/classdriver/hub.hpp"
 #include "usb/descriptor.hpp"
 #include "usb/device.hpp"
+#include "usb/latency_trace.hpp"
+#include "usb/memory.hpp"
 #include "usb/setupdata.hpp"
+#include "usb/xhci/event_trace.hpp"
 #include "usb/xhci/speed.hpp"
 
+#include <algorithm>
+#include <cstring>
+#include <new>
+
 namespace {
 using namespace usb::xhci;
 
-Error RegisterCommandRing(Ring *ring, MemMapRegister<CRCR_Bitmap> *crcr) {
-  CRCR_Bitmap value = crcr->Read();
+Error RegisterCommandRing(Ring *ring, MemMapRegister<CRCR_Bitmap> *crcr, Access64 access64) {
+  CRCR_Bitmap value = crcr->Read(access64);
   value.bits.ring_cycle_state = true;
   value.bits.command_stop = false;
   value.bits.command_abort = false;
   value.SetPointer(reinterpret_cast<uint64_t>(ring->Buffer()));
-  crcr->Write(value);
+  crcr->Write(value, access64);
   return MAKE_ERROR(Error::kSuccess);
 }
 
+/** @brief デフォルトコントロールパイプの Transfer Ring の大きさ（TRB 数） */
+const size_t kControlTransferRingSize = 32;
+
+/** @brief ストリームごとの Transfer Ring の大きさ（TRB 数） */
+const size_t kStreamTransferRingSize = 32;
+
+/** @brief バルクエンドポイントに割り当てる Stream Context Array の要素数．ストリームを使わないなら 0．
+ *
+ * max_streams はエンドポイントが扱えるストリーム数の指数．ストリーム 0 は予約されているので
+ * 要素数はストリーム数 + 1 以上の 2 のべき乗（最小 4）にする．
+ */
+size_t StreamContextArraySize(int max_streams, size_t hc_max_contexts) {
+  if (max_streams <= 0) {
+    return 0;
+  }
+  const size_t limit = std::min(usb::xhci::kMaxStreamContexts, hc_max_contexts);
+  const size_t wanted = (size_t{1} << std::min(max_streams, 15)) + 1;
+  size_t size = 4;
+  while (size < wanted && size < limit) {
+    size <<= 1;
+  }
+  return size <= limit ? size : 0;
+}
+
+/** @brief エンドポイントの種別と最大パケットサイズから Transfer Ring の大きさを決める．
+ *
+ * 同時に積む TRB が少ない割り込み転送は小さく，スループットが要求される
+ * バルク・アイソクロナス転送は大きな（パケットサイズが大きいほど大きな）リングにする．
+ * いずれも 2 のべき乗にして，メモリプールのブロックやページにちょうど収まるようにする．
+ */
+size_t TransferRingSize(usb::EndpointType type, int max_packet_size) {
+  switch (type) {
+  case usb::EndpointType::kControl:
+    return kControlTransferRingSize;
+  case usb::EndpointType::kInterrupt:
+    return 16;
+  case usb::EndpointType::kBulk:
+  case usb::EndpointType::kIsochronous:
+    return max_packet_size >= 1024 ? 256 : 128;
+  }
+  return kControlTransferRingSize;
+}
+
 enum class ConfigPhase {
   kNotConnected,
+  kEnablingSlot,
   kWaitingAddressed,
   kResettingPort,
-  kEnablingSlot,
   kAddressingDevice,
   kInitializingDevice,
   kConfiguringEndpoints,
+  kConfiguringHub,
   kConfigured,
+  /** 切断された．Disable Slot を発行できるようになるのを待っている（スロットごとの状態） */
+  kDetaching,
+  /** Disable Slot の完了を待っている．完了したらデバイスを破棄する（スロットごとの状態） */
+  kDisablingSlot,
 };
-/* root hub port はリセット処理をしてからアドレスを割り当てるまでは
- * 他の処理を挟まず，そのポートについての処理だけをしなければならない．
+/* ポート（root hub port とハブのダウンストリームポート）はリセット処理をしてから
+ * アドレスを割り当てるまでは他の処理を挟まず，そのポートについての処理だけをしなければならない．
+ * スロットの割り当て（kEnablingSlot）は接続を検出した時点で各ポートが並行して行い，
  * kWaitingAddressed はリセット（kResettingPort）からアドレス割り当て
  * （kAddressingDevice）までの一連の処理の実行を待っている状態．
+ * アドレスを割り当てた後の処理（ディスクリプタの取得以降）はスロットごとに並行して進める．
  */
 
-std::array<volatile ConfigPhase, 256> port_config_phase{}; // index: port number
+/** @brief デバイスを接続するポート．hub_slot が 0 なら root hub のポート． */
+struct AttachPoint {
+  uint8_t hub_slot;
+  uint8_t port_num;
+};
 
-/** kResettingPort から kAddressingDevice までの処理を実行中のポート番号．
- * 0 ならその状態のポートがないことを示す．
- */
-uint8_t addressing_port{0};
+/** @brief 接続を検出してからアドレスを割り当てるまでの，1 つのポートの処理 */
+struct Enumeration {
+  AttachPoint point;
+  /** kNotConnected なら未使用 */
+  ConfigPhase phase;
+  /** ハブのポートなら，リセット後にハブから通知された速度（Protocol Speed ID） */
+  uint8_t speed;
+  /** kWaitingAddressed 以降で有効 */
+  uint8_t slot_id;
+  /** スロットの割り当て中かアドレスの割り当て中に切断された */
+  bool cancelled;
+  /** kWaitingAddressed になった順番．小さいものからリセットする． */
+  uint32_t order;
+  /** kResettingPort になった時刻（ミリ秒） */
+  uint64_t reset_started_ms;
+  /** 接続を検出した時刻（TSC）．列挙時間の計測が無効なら 0． */
+  uint64_t trace_tsc;
+};
+
+/** ポートのリセットの完了を待つ時間（ミリ秒）．USB 2.0 のリセットは 10 - 20 ms で終わる． */
+const uint64_t kPortResetTimeoutMs = 500;
+
+const size_t kMaxEnumerations = 16;
+} // namespace
+
+namespace usb::xhci {
+/** @brief ホストコントローラごとの，ポートとスロットの列挙の状態 */
+struct EnumerationState {
+  std::array<volatile ConfigPhase, 256> port_config_phase{}; // index: port number
+  std::array<volatile ConfigPhase, 256> slot_config_phase{}; // index: slot ID
+  std::array<Enumeration, kMaxEnumerations> enumerations{};
+
+  /** kResettingPort から kAddressingDevice までの処理を実行中のポート．nullptr なら無し． */
+  Enumeration *addressing = nullptr;
+
+  /** 次に kWaitingAddressed になる処理の order */
+  uint32_t next_order = 0;
+};
+} // namespace usb::xhci
+
+namespace {
 
-void InitializeSlotContext(SlotContext &ctx, Port &port) {
-  ctx.bits.route_string = 0;
-  ctx.bits.root_hub_port_num = port.Number();
+/** @brief 処理が発行したコマンドに付けるタグ．0 はどの処理にも対応しない． */
+uint16_t TagOf(const EnumerationState &st, const Enumeration &e) {
+  return &e - st.enumerations.data() + 1;
+}
+
+Enumeration *EnumerationFromTag(EnumerationState &st, uint16_t tag) {
+  if (tag == 0 || tag > st.enumerations.size()) {
+    return nullptr;
+  }
+  auto &e = st.enumerations[tag - 1];
+  return e.phase == ConfigPhase::kNotConnected ? nullptr : &e;
+}
+
+Enumeration *FindEnumeration(EnumerationState &st, uint8_t hub_slot, uint8_t port_num) {
+  for (auto &e : st.enumerations) {
+    if (e.phase != ConfigPhase::kNotConnected && e.point.hub_slot == hub_slot &&
+        e.point.port_num == port_num) {
+      return &e;
+    }
+  }
+  return nullptr;
+}
+
+void SetPhase(EnumerationState &st, Enumeration &e, ConfigPhase phase) {
+  e.phase = phase;
+  if (e.point.hub_slot == 0) {
+    st.port_config_phase[e.point.port_num] = phase;
+  }
+}
+
+/** @brief 処理を終えて enumerations のエントリを空ける．root hub のポートの状態は残す． */
+void ReleaseEnumeration(EnumerationState &st, Enumeration &e) {
+  if (st.addressing == &e) {
+    st.addressing = nullptr;
+  }
+  e.phase = ConfigPhase::kNotConnected;
+}
+
+Error InitializeSlotContext(Controller &xhc, SlotContext &ctx, const Enumeration &e) {
+  const auto point = e.point;
+  ctx = SlotContext{};
   ctx.bits.context_entries = 1;
-  ctx.bits.speed = port.Speed();
+
+  if (point.hub_slot == 0) {
+    auto port = xhc.PortAt(point.port_num);
+    ctx.bits.route_string = 0;
+    ctx.bits.root_hub_port_num = port.Number();
+    ctx.bits.speed = port.Speed();
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  auto hub = xhc.DeviceManager()->FindBySlot(point.hub_slot);
+  if (hub == nullptr) {
+    return MAKE_ERROR(Error::kInvalidSlotID);
+  }
+  const auto &hub_ctx = hub->DeviceContext()->slot_context;
+  const int depth = RouteDepth(hub_ctx.bits.route_string);
+  if (depth >= kMaxRouteDepth) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  ctx.bits.route_string = hub_ctx.bits.route_string | (point.port_num & 0xfu) << (4 * depth);
+  ctx.bits.root_hub_port_num = hub_ctx.bits.root_hub_port_num;
+  ctx.bits.speed = e.speed;
+
+  // LS/FS のデバイスには，最も近い上流の High Speed ハブの TT を使わせる
+  if (e.speed == kFullSpeed || e.speed == kLowSpeed) {
+    if (hub_ctx.bits.speed == kHighSpeed) {
+      ctx.bits.tt_hub_slot_id = point.hub_slot;
+      ctx.bits.tt_port_num = point.port_num;
+    } else {
+      ctx.bits.tt_hub_slot_id = hub_ctx.bits.tt_hub_slot_id;
+      ctx.bits.tt_port_num = hub_ctx.bits.tt_port_num;
+    }
+    ctx.bits.mtt = hub_ctx.bits.mtt;
+  }
+  return MAKE_ERROR(Error::kSuccess);
 }
 
 unsigned int DetermineMaxPacketSizeForControlPipe(unsigned int slot_speed) {
@@ -82,54 +252,168 @@ void InitializeEP0Context(EndpointContext &ctx, Ring *transfer_ring, unsigned in
   ctx.bits.error_count = 3;
 }
 
-Error ResetPort(Controller &xhc, Port &port) {
-  const bool is_connected = port.IsConnected();
-  Log(kTrace, "ResetPort: port.IsConnected() = %s\n", is_connected ? "true" : "false");
+// コマンドの完了を受け取る関数．context は発行元の処理のタグかスロット ID．
+Error OnEnableSlotCompleted(Controller &xhc, const CommandCompletionEventTRB &trb, uintptr_t tag);
+Error OnAddressDeviceCompleted(Controller &xhc, const CommandCompletionEventTRB &trb,
+                               uintptr_t tag);
+Error OnDetachDisableSlotCompleted(Controller &xhc, const CommandCompletionEventTRB &trb,
+                                   uintptr_t slot_id);
+Error OnConfigureEndpointCompleted(Controller &xhc, const CommandCompletionEventTRB &trb,
+                                   uintptr_t);
+
+/** @brief ポートへの接続を受け付け，スロットを割り当てる．
+ *
+ * スロットの割り当てはバスの状態に影響しないので，他のポートの処理と並行して行う．
+ */
+Error StartEnumeration(Controller &xhc, AttachPoint point) {
+  auto &st = xhc.Enumerations();
+  auto e = std::find_if(st.enumerations.begin(), st.enumerations.end(),
+                        [](auto &e) { return e.phase == ConfigPhase::kNotConnected; });
+  if (e == st.enumerations.end()) {
+    return MAKE_ERROR(Error::kTooManyEnumerations);
+  }
+  if (xhc.FreeCommandSlots() < 1) {
+    return MAKE_ERROR(Error::kRingFull);
+  }
+
+  *e = Enumeration{point, ConfigPhase::kNotConnected, 0, 0, false, 0, 0, usb::TraceBegin()};
+  SetPhase(st, *e, ConfigPhase::kEnablingSlot);
+  EnableSlotCommandTRB cmd{};
+  xhc.IssueCommand(cmd, OnEnableSlotCompleted, TagOf(st, *e));
+  return MAKE_ERROR(Error::kSuccess);
+}
 
-  if (!is_connected) {
-    return MAKE_ERROR(Error::kSuccess);
+/** @brief 割り当てたスロットを，アドレスを設定する前に解放する．
+ *
+ * デバイスを作る前なので，完了を待って後始末する必要はない．
+ */
+Error DisableSlot(Controller &xhc, uint8_t slot_id) {
+  if (xhc.FreeCommandSlots() < 1) {
+    return MAKE_ERROR(Error::kRingFull);
   }
+  DisableSlotCommandTRB cmd{slot_id};
+  xhc.IssueCommand(cmd);
+  return MAKE_ERROR(Error::kSuccess);
+}
 
-  if (addressing_port != 0) {
-    port_config_phase[port.Number()] = ConfigPhase::kWaitingAddressed;
-  } else {
-    const auto port_phase = port_config_phase[port.Number()];
-    if (port_phase != ConfigPhase::kNotConnected && port_phase != ConfigPhase::kWaitingAddressed) {
-      return MAKE_ERROR(Error::kInvalidPhase);
-    }
-    addressing_port = port.Number();
-    port_config_phase[port.Number()] = ConfigPhase::kResettingPort;
-    port.Reset();
+/** @brief e の処理を打ち切り，スロットを割り当て済みなら解放する． */
+Error CancelEnumeration(Controller &xhc, Enumeration &e) {
+  auto &st = xhc.Enumerations();
+  const bool has_slot = e.phase == ConfigPhase::kWaitingAddressed ||
+                        e.phase == ConfigPhase::kResettingPort;
+  const auto slot_id = e.slot_id;
+  SetPhase(st, e, ConfigPhase::kNotConnected);
+  ReleaseEnumeration(st, e);
+  if (has_slot) {
+    return DisableSlot(xhc, slot_id);
   }
   return MAKE_ERROR(Error::kSuccess);
 }
 
-Error EnableSlot(Controller &xhc, Port &port) {
-  const bool is_enabled = port.IsEnabled();
-  const bool reset_completed = port.IsPortResetChanged();
-  Log(kTrace, "EnableSlot: port.IsEnabled() = %s, port.IsPortResetChanged() = %s\n",
-      is_enabled ? "true" : "false", reset_completed ? "true" : "false");
+Error ResetEnumeratingPort(Controller &xhc, Enumeration &e) {
+  auto &st = xhc.Enumerations();
+  SetPhase(st, e, ConfigPhase::kResettingPort);
+  e.reset_started_ms = xhc.NowMs();
+
+  if (e.point.hub_slot == 0) {
+    auto port = xhc.PortAt(e.point.port_num);
+    Log(kTrace, "ResetPort: port.IsConnected() = %s\n", port.IsConnected() ? "true" : "false");
+    if (!port.IsConnected()) {
+      // 次の接続で Port Status Change Event が発生するよう，変化ビットを落としておく
+      port.ClearConnectStatusChanged();
+      return MAKE_ERROR(Error::kUnknownDevice);
+    }
+    return port.Reset();
+  }
 
-  if (is_enabled && reset_completed) {
-    port.ClearPortResetChange();
+  auto hub = xhc.DeviceManager()->FindBySlot(e.point.hub_slot);
+  if (hub == nullptr || hub->HubDriver() == nullptr) {
+    // 待っている間にハブが外された
+    return MAKE_ERROR(Error::kInvalidSlotID);
+  }
+  return hub->HubDriver()->ResetPort(e.point.port_num);
+}
 
-    port_config_phase[port.Number()] = ConfigPhase::kEnablingSlot;
+/** @brief リセットを待っているポートがあれば，次のポートの処理を始める． */
+Error StartNextAddressing(Controller &xhc) {
+  auto &st = xhc.Enumerations();
+  while (st.addressing == nullptr) {
+    Enumeration *next = nullptr;
+    for (auto &e : st.enumerations) {
+      if (e.phase == ConfigPhase::kWaitingAddressed &&
+          (next == nullptr || static_cast<int32_t>(e.order - next->order) < 0)) {
+        next = &e;
+      }
+    }
+    if (next == nullptr) {
+      break;
+    }
 
-    EnableSlotCommandTRB cmd{};
-    xhc.CommandRing()->Push(cmd);
-    xhc.DoorbellRegisterAt(0)->Ring(0);
+    auto &e = *next;
+    st.addressing = &e;
+    if (auto err = ResetEnumeratingPort(xhc, e)) {
+      Log(kWarn, "failed to reset port %d of hub slot %d: %s\n", e.point.port_num,
+          e.point.hub_slot, err.Name());
+      if (auto cancel_err = CancelEnumeration(xhc, e)) {
+        return cancel_err;
+      }
+    }
   }
   return MAKE_ERROR(Error::kSuccess);
 }
 
-Error AddressDevice(Controller &xhc, uint8_t port_id, uint8_t slot_id) {
-  Log(kTrace, "AddressDevice: port_id = %d, slot_id = %d\n", port_id, slot_id);
+Error OnSlotEnabled(Controller &xhc, Enumeration &e, uint8_t slot_id) {
+  auto &st = xhc.Enumerations();
+  if (e.cancelled) {
+    ReleaseEnumeration(st, e);
+    return DisableSlot(xhc, slot_id);
+  }
+
+  e.slot_id = slot_id;
+  e.order = st.next_order++;
+  usb::TraceEnumerationStart(slot_id, e.trace_tsc);
+  SetPhase(st, e, ConfigPhase::kWaitingAddressed);
+  return StartNextAddressing(xhc);
+}
+
+Error AddressDevice(Controller &xhc, Enumeration &e) {
+  auto &st = xhc.Enumerations();
+  const auto slot_id = e.slot_id;
+  Log(kTrace, "AddressDevice: hub_slot = %d, port_num = %d, slot_id = %d\n", e.point.hub_slot,
+      e.point.port_num, slot_id);
+
+  // 失敗したら作りかけのデバイスを破棄してスロットを解放し，次のポートの処理に進む．
+  // そうしないと st.addressing が e を指したままになり，以降のポートを列挙できなくなる．
+  bool allocated = false;
+  auto fail = [&](Error err) {
+    Log(kWarn, "failed to address device on port %d of hub slot %d: %s\n", e.point.port_num,
+        e.point.hub_slot, err.Name());
+    if (allocated) {
+      // Address Device を発行する前なので，ホストコントローラはまだスロットを参照していない
+      xhc.DeviceManager()->Remove(slot_id);
+    }
+    if (auto cancel_err = CancelEnumeration(xhc, e)) {
+      Log(kWarn, "failed to disable slot %d: %s\n", slot_id, cancel_err.Name());
+    }
+    if (auto next_err = StartNextAddressing(xhc)) {
+      Log(kWarn, "failed to start next addressing: %s\n", next_err.Name());
+    }
+    return err;
+  };
+
+  if (xhc.FreeCommandSlots() < 1) {
+    return fail(MAKE_ERROR(Error::kRingFull));
+  }
 
-  xhc.DeviceManager()->AllocDevice(slot_id, xhc.DoorbellRegisterAt(slot_id));
+  if (auto err = xhc.DeviceManager()->AllocDevice(&xhc, slot_id, xhc.DoorbellRegisterAt(slot_id),
+                                                  xhc.InterrupterForSlot(slot_id))) {
+    return fail(err);
+  }
+  allocated = true;
 
   Device *dev = xhc.DeviceManager()->FindBySlot(slot_id);
   if (dev == nullptr) {
-    return MAKE_ERROR(Error::kInvalidSlotID);
+    return fail(MAKE_ERROR(Error::kInvalidSlotID));
   }
 
   memset(&dev->InputContext()->input_control_context, 0, sizeof(InputControlContext));
@@ -138,68 +422,372 @@ Error AddressDevice(Controller &xhc, uint8_t port_id, uint8_t slot_id) {
   auto slot_ctx = dev->InputContext()->EnableSlotContext();
   auto ep0_ctx = dev->InputContext()->EnableEndpoint(ep0_dci);
 
-  auto port = xhc.PortAt(port_id);
-  InitializeSlotContext(*slot_ctx, port);
+  if (auto err = InitializeSlotContext(xhc, *slot_ctx, e)) {
+    return fail(err);
+  }
+  slot_ctx->bits.interrupter_target = dev->InterrupterTarget();
 
-  InitializeEP0Context(*ep0_ctx, dev->AllocTransferRing(ep0_dci, 32),
+  auto ep0_ring = dev->AllocTransferRing(ep0_dci, kControlTransferRingSize);
+  if (ep0_ring == nullptr) {
+    return fail(MAKE_ERROR(Error::kNoEnoughMemory));
+  }
+  InitializeEP0Context(*ep0_ctx, ep0_ring,
                        DetermineMaxPacketSizeForControlPipe(slot_ctx->bits.speed));
 
   xhc.DeviceManager()->LoadDCBAA(slot_id);
+  if (auto err = xhc.DeviceManager()->Attach(slot_id, e.point.hub_slot, e.point.port_num)) {
+    return fail(err);
+  }
 
-  port_config_phase[port_id] = ConfigPhase::kAddressingDevice;
+  SetPhase(st, e, ConfigPhase::kAddressingDevice);
 
   AddressDeviceCommandTRB addr_dev_cmd{dev->InputContext(), slot_id};
-  xhc.CommandRing()->Push(addr_dev_cmd);
-  xhc.DoorbellRegisterAt(0)->Ring(0);
+  xhc.IssueCommand(addr_dev_cmd, OnAddressDeviceCompleted, TagOf(st, e));
 
   return MAKE_ERROR(Error::kSuccess);
 }
 
-Error InitializeDevice(Controller &xhc, uint8_t port_id, uint8_t slot_id) {
-  Log(kTrace, "InitializeDevice: port_id = %d, slot_id = %d\n", port_id, slot_id);
+/** @brief slot_id のスロットを解放する Disable Slot を発行する．受け付けられなければ後で再試行する． */
+Error IssueDetachDisableSlot(Controller &xhc, uint8_t slot_id) {
+  auto &st = xhc.Enumerations();
+  if (xhc.FreeCommandSlots() < 1) {
+    // CheckTimeouts で再試行する
+    st.slot_config_phase[slot_id] = ConfigPhase::kDetaching;
+    return MAKE_ERROR(Error::kRingFull);
+  }
+  st.slot_config_phase[slot_id] = ConfigPhase::kDisablingSlot;
+  DisableSlotCommandTRB cmd{slot_id};
+  xhc.IssueCommand(cmd, OnDetachDisableSlotCompleted, slot_id);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error DetachDevice(Controller &xhc, uint8_t slot_id);
+
+/** @brief 接続先のポートが切断された e の処理を打ち切る． */
+Error AbortEnumeration(Controller &xhc, Enumeration &e) {
+  switch (e.phase) {
+  case ConfigPhase::kEnablingSlot:
+  case ConfigPhase::kAddressingDevice:
+    // コマンドの完了を待ってからスロットを解放する
+    e.cancelled = true;
+    return MAKE_ERROR(Error::kSuccess);
+  case ConfigPhase::kWaitingAddressed:
+    return CancelEnumeration(xhc, e);
+  case ConfigPhase::kResettingPort:
+    if (auto err = CancelEnumeration(xhc, e)) {
+      return err;
+    }
+    return StartNextAddressing(xhc);
+  default:
+    return MAKE_ERROR(Error::kSuccess);
+  }
+}
+
+/** @brief hub_slot のハブ（0 ならルートハブ）の port_num 番ポートの切断を処理する．
+ *
+ * 列挙の途中ならそれを打ち切り，アドレスを割り当て済みならデバイスを切り離す．
+ */
+Error DisconnectPort(Controller &xhc, uint8_t hub_slot, uint8_t port_num) {
+  auto &st = xhc.Enumerations();
+  if (auto e = FindEnumeration(st, hub_slot, port_num)) {
+    return AbortEnumeration(xhc, *e);
+  }
+  if (hub_slot == 0) {
+    st.port_config_phase[port_num] = ConfigPhase::kNotConnected;
+  }
+  if (auto dev = xhc.DeviceManager()->FindByAttachPoint(hub_slot, port_num)) {
+    return DetachDevice(xhc, dev->SlotID());
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+/** @brief slot_id のデバイス（ハブならその先のデバイスも）を切り離す．
+ *
+ * 以降はこのスロットのイベントを無視し，Disable Slot の完了後に
+ * Transfer Ring，コンテキスト，クラスドライバを解放する．
+ */
+Error DetachDevice(Controller &xhc, uint8_t slot_id) {
+  auto &st = xhc.Enumerations();
+  auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
+  if (dev == nullptr) {
+    return MAKE_ERROR(Error::kInvalidSlotID);
+  }
+  const auto phase = st.slot_config_phase[slot_id];
+  if (phase == ConfigPhase::kDetaching || phase == ConfigPhase::kDisablingSlot) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  Log(kDebug, "detaching slot %d\n", slot_id);
+  st.slot_config_phase[slot_id] = ConfigPhase::kDetaching;
+
+  if (dev->HubDriver() != nullptr) {
+    // ハブの先のポートは切断されたものとして扱う（ポート番号は 1 - 15）
+    for (uint8_t port_num = 1; port_num <= usb::HubDriver::kMaxPorts; ++port_num) {
+      if (auto err = DisconnectPort(xhc, slot_id, port_num)) {
+        Log(kWarn, "failed to disconnect port %d of hub slot %d: %s\n", port_num, slot_id,
+            err.Name());
+      }
+    }
+  }
+  return IssueDetachDisableSlot(xhc, slot_id);
+}
+
+/** @brief 切り離し中のスロットのイベントなら true．そのようなイベントは捨てる． */
+bool IsDetaching(const EnumerationState &st, uint8_t slot_id) {
+  const auto phase = st.slot_config_phase[slot_id];
+  return phase == ConfigPhase::kDetaching || phase == ConfigPhase::kDisablingSlot;
+}
+
+Error OnRootPortReset(Controller &xhc, Port &port) {
+  auto &st = xhc.Enumerations();
+  const bool is_enabled = port.IsEnabled();
+  const bool reset_completed = port.IsPortResetChanged();
+  Log(kTrace, "OnRootPortReset: port.IsEnabled() = %s, port.IsPortResetChanged() = %s\n",
+      is_enabled ? "true" : "false", reset_completed ? "true" : "false");
+
+  if (st.addressing == nullptr || st.addressing->point.hub_slot != 0 ||
+      st.addressing->point.port_num != port.Number()) {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  if (!port.IsConnected()) {
+    // リセット中に外された
+    port.ClearConnectStatusChanged();
+    if (auto err = CancelEnumeration(xhc, *st.addressing)) {
+      return err;
+    }
+    return StartNextAddressing(xhc);
+  }
+  if (is_enabled && reset_completed) {
+    port.ClearPortResetChange();
+    return AddressDevice(xhc, *st.addressing);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error InitializeDevice(Controller &xhc, uint8_t slot_id) {
+  auto &st = xhc.Enumerations();
+  Log(kTrace, "InitializeDevice: slot_id = %d\n", slot_id);
 
   auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
   if (dev == nullptr) {
     return MAKE_ERROR(Error::kInvalidSlotID);
   }
 
-  port_config_phase[port_id] = ConfigPhase::kInitializingDevice;
+  st.slot_config_phase[slot_id] = ConfigPhase::kInitializingDevice;
   dev->StartInitialize();
 
   return MAKE_ERROR(Error::kSuccess);
 }
 
-Error CompleteConfiguration(Controller &xhc, uint8_t port_id, uint8_t slot_id) {
-  Log(kTrace, "CompleteConfiguration: port_id = %d, slot_id = %d\n", port_id, slot_id);
+Error CompleteConfiguration(Controller &xhc, uint8_t slot_id) {
+  auto &st = xhc.Enumerations();
+  Log(kTrace, "CompleteConfiguration: slot_id = %d\n", slot_id);
 
   auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
   if (dev == nullptr) {
     return MAKE_ERROR(Error::kInvalidSlotID);
   }
 
-  dev->OnEndpointsConfigured();
+  // ハブのクラスドライバは OnEndpointsConfigured の中から ConfigureHub を呼ぶことがある
+  st.slot_config_phase[slot_id] = ConfigPhase::kConfigured;
+  // クラスドライバが最初の転送を積む前に，完了を受け取るインタラプタの IMOD を決めておく
+  xhc.SetSlotWorkload(slot_id, dev->PrefersThroughput() ? Controller::SlotWorkload::kThroughput
+                                                        : Controller::SlotWorkload::kLowLatency);
+  auto err = dev->OnEndpointsConfigured();
+  usb::TraceEnumerationDone(slot_id);
+  return err;
+}
+
+/** @brief Command Completion Event の完了コード */
+const unsigned int kCommandSuccess = 1;
+const unsigned int kCommandAborted = 25;
+
+Error OnEnableSlotCompleted(Controller &xhc, const CommandCompletionEventTRB &trb,
+                            uintptr_t tag) {
+  auto &st = xhc.Enumerations();
+  auto e = EnumerationFromTag(st, tag);
+  if (e == nullptr || e->phase != ConfigPhase::kEnablingSlot) {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  if (trb.bits.completion_code != kCommandSuccess) {
+    // No Slots Available など．再接続されるまでこのポートは使わない．
+    Log(kWarn, "failed to enable slot for port %d of hub slot %d: %s\n", e->point.port_num,
+        e->point.hub_slot, kTRBCompletionCodeToName[trb.bits.completion_code]);
+    ReleaseEnumeration(st, *e);
+    return MAKE_ERROR(Error::kTransferFailed);
+  }
+
+  return OnSlotEnabled(xhc, *e, trb.bits.slot_id);
+}
+
+Error OnAddressDeviceCompleted(Controller &xhc, const CommandCompletionEventTRB &trb,
+                               uintptr_t tag) {
+  auto &st = xhc.Enumerations();
+  const auto slot_id = trb.bits.slot_id;
+  auto e = EnumerationFromTag(st, tag);
+  if (e == nullptr || e != st.addressing || e->slot_id != slot_id) {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  if (e->phase != ConfigPhase::kAddressingDevice) {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+
+  const bool failed = trb.bits.completion_code != kCommandSuccess;
+  if (failed) {
+    // USB Transaction Error や，時間切れによる Command Aborted など
+    Log(kWarn, "failed to address device on port %d of hub slot %d: %s\n", e->point.port_num,
+        e->point.hub_slot, kTRBCompletionCodeToName[trb.bits.completion_code]);
+  }
+  const bool cancelled = e->cancelled || failed;
+  // root hub のポートはデバイスが外されるまで使用中になる
+  SetPhase(st, *e, cancelled ? ConfigPhase::kNotConnected : ConfigPhase::kConfigured);
+  ReleaseEnumeration(st, *e);
+  if (auto err = StartNextAddressing(xhc)) {
+    return err;
+  }
+
+  if (cancelled) {
+    return DetachDevice(xhc, slot_id);
+  }
+  return InitializeDevice(xhc, slot_id);
+}
 
-  port_config_phase[port_id] = ConfigPhase::kConfigured;
+Error OnDetachDisableSlotCompleted(Controller &xhc, const CommandCompletionEventTRB &trb,
+                                   uintptr_t slot_id) {
+  auto &st = xhc.Enumerations();
+  if (st.slot_config_phase[slot_id] != ConfigPhase::kDisablingSlot) {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  if (trb.bits.completion_code == kCommandAborted) {
+    // CheckTimeouts で再試行する
+    st.slot_config_phase[slot_id] = ConfigPhase::kDetaching;
+    return MAKE_ERROR(Error::kTimeout);
+  }
+  if (trb.bits.completion_code != kCommandSuccess) {
+    // Slot Not Enabled など．いずれにせよホストコントローラはスロットを使っていない．
+    Log(kWarn, "failed to disable slot %d: %s\n", static_cast<int>(slot_id),
+        kTRBCompletionCodeToName[trb.bits.completion_code]);
+  }
+  Log(kDebug, "slot %d disabled\n", static_cast<int>(slot_id));
+  st.slot_config_phase[slot_id] = ConfigPhase::kNotConnected;
+  xhc.SetSlotWorkload(slot_id, Controller::SlotWorkload::kNone);
+  return xhc.DeviceManager()->Remove(slot_id);
+}
+
+Error OnConfigureEndpointCompleted(Controller &xhc, const CommandCompletionEventTRB &trb,
+                                   uintptr_t) {
+  auto &st = xhc.Enumerations();
+  const auto slot_id = trb.bits.slot_id;
+  if (IsDetaching(st, slot_id)) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
+  if (dev == nullptr) {
+    return MAKE_ERROR(Error::kInvalidSlotID);
+  }
+
+  const auto phase = st.slot_config_phase[slot_id];
+  if (phase != ConfigPhase::kConfiguringHub && phase != ConfigPhase::kConfiguringEndpoints) {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  if (trb.bits.completion_code != kCommandSuccess) {
+    Log(kWarn, "failed to configure %s of slot %d: %s\n",
+        phase == ConfigPhase::kConfiguringHub ? "hub" : "endpoints", slot_id,
+        kTRBCompletionCodeToName[trb.bits.completion_code]);
+    if (phase == ConfigPhase::kConfiguringHub) {
+      st.slot_config_phase[slot_id] = ConfigPhase::kConfigured;
+    }
+    return MAKE_ERROR(Error::kTransferFailed);
+  }
+
+  if (phase == ConfigPhase::kConfiguringHub) {
+    st.slot_config_phase[slot_id] = ConfigPhase::kConfigured;
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  return CompleteConfiguration(xhc, slot_id);
+}
+
+/** @brief エンドポイントに対するコマンドの context（slot ID | dci << 8 | stream ID << 16） */
+uintptr_t EndpointCommandContext(uint8_t slot_id, DeviceContextIndex dci, uint16_t stream_id) {
+  return slot_id | static_cast<uintptr_t>(dci.value) << 8 | static_cast<uintptr_t>(stream_id) << 16;
+}
+
+Error OnRecoveryResetEndpointCompleted(Controller &xhc, const CommandCompletionEventTRB &trb,
+                                       uintptr_t context) {
+  if (trb.bits.completion_code != kCommandSuccess) {
+    // 続けて積んだ Set TR Dequeue Pointer も失敗し，エンドポイントは止まったままになる
+    Log(kWarn, "failed to reset endpoint (dci %d) of slot %d: %s\n",
+        static_cast<int>(context >> 8 & 0xffu), static_cast<int>(context & 0xffu),
+        kTRBCompletionCodeToName[trb.bits.completion_code]);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error OnCancelStopEndpointCompleted(Controller &xhc, const CommandCompletionEventTRB &trb,
+                                    uintptr_t context) {
+  if (trb.bits.completion_code != kCommandSuccess) {
+    // Halted や Stopped のエンドポイントは止める必要が無い（Context State Error）
+    Log(kDebug, "stop endpoint (dci %d) of slot %d: %s\n",
+        static_cast<int>(context >> 8 & 0xffu), static_cast<int>(context & 0xffu),
+        kTRBCompletionCodeToName[trb.bits.completion_code]);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+/** @brief Set TR Dequeue Pointer が完了したら，止めていたエンドポイントの転送を再開させる． */
+Error OnSetTRDequeueCompleted(Controller &xhc, const CommandCompletionEventTRB &trb,
+                              uintptr_t context) {
+  const uint8_t slot_id = context & 0xffu;
+  const DeviceContextIndex dci(context >> 8 & 0xffu);
+  const uint16_t stream_id = context >> 16;
+  if (trb.bits.completion_code != kCommandSuccess) {
+    Log(kWarn, "failed to move dequeue pointer of slot %d dci %d stream %d: %s\n", slot_id,
+        dci.value, stream_id, kTRBCompletionCodeToName[trb.bits.completion_code]);
+    return MAKE_ERROR(Error::kTransferFailed);
+  }
+  if (IsDetaching(xhc.Enumerations(), slot_id)) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
+  if (dev == nullptr) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  // 取り除いた TD の後ろに積まれていた転送を再開させる
+  dev->RestartEndpoint(dci, stream_id);
   return MAKE_ERROR(Error::kSuccess);
 }
 
 Error OnEvent(Controller &xhc, PortStatusChangeEventTRB &trb) {
+  auto &st = xhc.Enumerations();
   Log(kTrace, "PortStatusChangeEvent: port_id = %d\n", trb.bits.port_id);
   auto port_id = trb.bits.port_id;
   auto port = xhc.PortAt(port_id);
 
-  switch (port_config_phase[port_id]) {
+  switch (st.port_config_phase[port_id]) {
   case ConfigPhase::kNotConnected:
-    return ResetPort(xhc, port);
+    return ConfigurePort(xhc, port);
+  case ConfigPhase::kEnablingSlot:
+  case ConfigPhase::kWaitingAddressed:
+    // リセットの順番を待っている間の状態変化．リセット後に改めて状態を読む．
+    return MAKE_ERROR(Error::kSuccess);
   case ConfigPhase::kResettingPort:
-    return EnableSlot(xhc, port);
+    return OnRootPortReset(xhc, port);
   default:
-    return MAKE_ERROR(Error::kInvalidPhase);
+    // アドレスの割り当て以降．切断以外の状態変化は扱わない．
+    if (!port.IsConnected()) {
+      Log(kDebug, "device disconnected from port %d\n", port_id);
+      port.ClearConnectStatusChanged();
+      return DisconnectPort(xhc, 0, port_id);
+    }
+    return MAKE_ERROR(Error::kSuccess);
   }
 }
 
 Error OnEvent(Controller &xhc, TransferEventTRB &trb) {
+  auto &st = xhc.Enumerations();
   const uint8_t slot_id = trb.bits.slot_id;
+  if (IsDetaching(st, slot_id)) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
   auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
   if (dev == nullptr) {
     return MAKE_ERROR(Error::kInvalidSlotID);
@@ -208,93 +796,142 @@ Error OnEvent(Controller &xhc, TransferEventTRB &trb) {
     return err;
   }
 
-  const auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
-  if (dev->IsInitialized() && port_config_phase[port_id] == ConfigPhase::kInitializingDevice) {
+  if (dev->IsInitialized() && st.slot_config_phase[slot_id] == ConfigPhase::kInitializingDevice) {
     return ConfigureEndpoints(xhc, *dev);
   }
   return MAKE_ERROR(Error::kSuccess);
 }
 
 Error OnEvent(Controller &xhc, CommandCompletionEventTRB &trb) {
-  const auto issuer_type = trb.Pointer()->bits.trb_type;
-  const auto slot_id = trb.bits.slot_id;
-  Log(kTrace, "CommandCompletionEvent: slot_id = %d, issuer = %s\n", trb.bits.slot_id,
-      kTRBTypeToName[issuer_type]);
+  Log(kTrace, "CommandCompletionEvent: slot_id = %d, issuer = %s, %s\n", trb.bits.slot_id,
+      kTRBTypeToName[trb.Pointer()->bits.trb_type],
+      kTRBCompletionCodeToName[trb.bits.completion_code]);
+  return xhc.OnCommandCompleted(trb);
+}
 
-  if (issuer_type == EnableSlotCommandTRB::Type) {
-    if (port_config_phase[addressing_port] != ConfigPhase::kEnablingSlot) {
-      return MAKE_ERROR(Error::kInvalidPhase);
-    }
+Error OnEvent(Controller &xhc, BandwidthRequestEventTRB &trb) {
+  // 帯域の再割り当ては行わない（周期転送のスケジュールはホストコントローラに任せる）
+  Log(kDebug, "BandwidthRequestEvent: slot_id = %d\n", trb.bits.slot_id);
+  return MAKE_ERROR(Error::kSuccess);
+}
 
-    return AddressDevice(xhc, addressing_port, slot_id);
-  } else if (issuer_type == AddressDeviceCommandTRB::Type) {
-    auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
-    if (dev == nullptr) {
-      return MAKE_ERROR(Error::kInvalidSlotID);
-    }
+Error OnEvent(Controller &xhc, HostControllerEventTRB &trb) {
+  // Event Ring Full Error など，ホストコントローラ全体に関わる異常の通知
+  const auto code = trb.bits.completion_code;
+  Log(kWarn, "HostControllerEvent: %s\n",
+      code < kTRBCompletionCodeToName.size() ? kTRBCompletionCodeToName[code] : "Unknown");
+  return MAKE_ERROR(Error::kSuccess);
+}
 
-    auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
+Error OnEvent(Controller &xhc, DeviceNotificationEventTRB &trb) {
+  Log(kDebug, "DeviceNotificationEvent: slot_id = %d, type = %d, data = %014lx\n",
+      trb.bits.slot_id, trb.bits.notification_type,
+      static_cast<uint64_t>(trb.bits.notification_data));
+  return MAKE_ERROR(Error::kSuccess);
+}
 
-    if (port_id != addressing_port) {
-      return MAKE_ERROR(Error::kInvalidPhase);
-    }
-    if (port_config_phase[port_id] != ConfigPhase::kAddressingDevice) {
-      return MAKE_ERROR(Error::kInvalidPhase);
-    }
+Error OnEvent(Controller &xhc, MFINDEXWrapEventTRB &trb) {
+  // MFINDEX が一周した（2^14 マイクロフレーム = 2.048 秒ごと）
+  Log(kTrace, "MFINDEXWrapEvent\n");
+  return MAKE_ERROR(Error::kSuccess);
+}
 
-    addressing_port = 0;
-    for (int i = 0; i < port_config_phase.size(); ++i) {
-      if (port_config_phase[i] == ConfigPhase::kWaitingAddressed) {
-        auto port = xhc.PortAt(i);
-        if (auto err = ResetPort(xhc, port); err) {
-          return err;
-        }
-        break;
-      }
-    }
+template <class EventTRB> Error HandleEvent(Controller &xhc, TRB &trb) {
+  return OnEvent(xhc, reinterpret_cast<EventTRB &>(trb));
+}
 
-    return InitializeDevice(xhc, port_id, slot_id);
-  } else if (issuer_type == ConfigureEndpointCommandTRB::Type) {
-    auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
-    if (dev == nullptr) {
-      return MAKE_ERROR(Error::kInvalidSlotID);
-    }
+/** @brief trb_type（6 ビット）で引くイベントハンドラの表 */
+using EventHandlerTable = std::array<EventHandlerType *, 64>;
+
+constexpr EventHandlerTable MakeDefaultEventHandlers() {
+  EventHandlerTable table{};
+  table[TransferEventTRB::Type] = HandleEvent<TransferEventTRB>;
+  table[CommandCompletionEventTRB::Type] = HandleEvent<CommandCompletionEventTRB>;
+  table[PortStatusChangeEventTRB::Type] = HandleEvent<PortStatusChangeEventTRB>;
+  table[BandwidthRequestEventTRB::Type] = HandleEvent<BandwidthRequestEventTRB>;
+  table[HostControllerEventTRB::Type] = HandleEvent<HostControllerEventTRB>;
+  table[DeviceNotificationEventTRB::Type] = HandleEvent<DeviceNotificationEventTRB>;
+  table[MFINDEXWrapEventTRB::Type] = HandleEvent<MFINDEXWrapEventTRB>;
+  return table;
+}
 
-    auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
-    if (port_config_phase[port_id] != ConfigPhase::kConfiguringEndpoints) {
-      return MAKE_ERROR(Error::kInvalidPhase);
-    }
+// 定数初期化されるので，起動直後から（コンストラクタの実行を待たずに）使える
+EventHandlerTable event_handlers = MakeDefaultEventHandlers();
 
-    return CompleteConfiguration(xhc, port_id, slot_id);
+Error DispatchEvent(Controller &xhc, uint16_t interrupter, TRB *event_trb) {
+  RecordEvent(xhc, interrupter, *event_trb);
+  if constexpr (usb::kLatencyTraceEnabled) {
+    if (auto trb = TRBDynamicCast<TransferEventTRB>(event_trb)) {
+      usb::TraceEventArrival(trb->bits.slot_id, trb->bits.endpoint_id);
+    }
   }
-
-  return MAKE_ERROR(Error::kInvalidPhase);
+  if (auto handler = event_handlers[event_trb->bits.trb_type]) {
+    return handler(xhc, *event_trb);
+  }
+  return MAKE_ERROR(Error::kNotImplemented);
 }
 
-void RequestHCOwnership(uintptr_t mmio_base, HCCPARAMS1_Bitmap hccp) {
+/** @brief BIOS に xHC の所有権を要求する．
+ *
+ * 完了は待たない．
+ *
+ * @return 所有権の移行を確認するためのレジスタ．USB Legacy Support Capability が無いか，
+ *   既に OS が所有していれば nullptr．
+ */
+MemMapRegister<USBLEGSUP_Bitmap> *RequestHCOwnership(uintptr_t mmio_base,
+                                                     HCCPARAMS1_Bitmap hccp) {
   ExtendedRegisterList extregs{mmio_base, hccp};
 
   auto ext_usblegsup = std::find_if(extregs.begin(), extregs.end(),
                                     [](auto &reg) { return reg.Read().bits.capability_id == 1; });
 
   if (ext_usblegsup == extregs.end()) {
-    return;
+    return nullptr;
   }
 
   auto &reg = reinterpret_cast<MemMapRegister<USBLEGSUP_Bitmap> &>(*ext_usblegsup);
   auto r = reg.Read();
-  if (r.bits.hc_os_owned_semaphore) {
-    return;
+  if (r.bits.hc_os_owned_semaphore && !r.bits.hc_bios_owned_semaphore) {
+    return nullptr;
   }
 
   r.bits.hc_os_owned_semaphore = 1;
   Log(kTrace, "waiting until OS owns xHC...\n");
   reg.Write(r);
+  return &reg;
+}
 
-  do {
-    r = reg.Read();
-  } while (r.bits.hc_bios_owned_semaphore || !r.bits.hc_os_owned_semaphore);
-  Log(kTrace, "OS has owned xHC\n");
+/** @brief 起動処理の各段階の制限時間（ミリ秒） */
+uint64_t BringUpTimeoutMs(usb::xhci::Controller::BringUpPhase phase) {
+  using Phase = usb::xhci::Controller::BringUpPhase;
+  switch (phase) {
+  case Phase::kWaitingOwnership:
+    return 1000;
+  case Phase::kWaitingHalted:
+    return 100; // 仕様上は 16 ms 以内
+  case Phase::kWaitingReset:
+    return 1000;
+  case Phase::kWaitingRunning:
+    return 100;
+  default:
+    return 0;
+  }
+}
+
+const char *BringUpPhaseName(usb::xhci::Controller::BringUpPhase phase) {
+  using Phase = usb::xhci::Controller::BringUpPhase;
+  switch (phase) {
+  case Phase::kWaitingOwnership:
+    return "ownership";
+  case Phase::kWaitingHalted:
+    return "halt";
+  case Phase::kWaitingReset:
+    return "reset";
+  case Phase::kWaitingRunning:
+    return "run";
+  default:
+    return "?";
+  }
 }
 } // namespace
 
@@ -303,15 +940,105 @@ namespace usb::xhci {
 Controller::Controller(uintptr_t mmio_base)
     : mmio_base_{mmio_base}, cap_{reinterpret_cast<CapabilityRegisters *>(mmio_base)},
       op_{reinterpret_cast<OperationalRegisters *>(mmio_base + cap_->CAPLENGTH.Read())},
-      max_ports_{static_cast<uint8_t>(cap_->HCSPARAMS1.Read().bits.max_ports)} {}
-
-Error Controller::Initialize() {
-  if (auto err = devmgr_.Initialize(kDeviceSize)) {
+      max_ports_{static_cast<uint8_t>(cap_->HCSPARAMS1.Read().bits.max_ports)},
+      access64_{cap_->HCCPARAMS1.Read().bits.addressing_capability_64 ? Access64::kNative
+                                                                      : Access64::kSplit},
+      isoch_threshold_{[ist = cap_->HCSPARAMS2.Read().bits.isochronous_scheduling_threshold]() {
+        // bit 3 が立っていればフレーム単位，そうでなければマイクロフレーム単位
+        return static_cast<uint16_t>(ist & 0x8u ? (ist & 0x7u) * 8 : ist);
+      }()},
+      mfindex_{reinterpret_cast<MemMapRegister<MFINDEX_Bitmap> *>(mmio_base +
+                                                                 cap_->RTSOFF.Read().Offset())},
+      interrupters_{mmio_base + cap_->RTSOFF.Read().Offset() + 0x20u, 1024},
+      doorbells_{mmio_base + cap_->DBOFF.Read().Offset(), 256},
+      ports_{reinterpret_cast<uintptr_t>(op_) + 0x400u, max_ports_} {}
+
+Error Controller::Initialize(uint16_t num_interrupters, size_t event_ring_size) {
+  if (bring_up_phase_ != BringUpPhase::kNotStarted) {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  // スロットの表は 1 スロットあたり数十バイトしかないので，
+  // ホストコントローラが扱える数（高々 255）だけ用意する．
+  if (enum_state_ == nullptr) {
+    auto state = AllocArray<EnumerationState>(1, 64, 0);
+    if (state == nullptr) {
+      return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
+    enum_state_ = new (state) EnumerationState{};
+  }
+  if (auto err = devmgr_.Initialize(cap_->HCSPARAMS1.Read().bits.max_device_slots)) {
     return err;
   }
+  requested_interrupters_ = num_interrupters;
+  event_ring_size_ = event_ring_size;
+
+  usblegsup_ = RequestHCOwnership(mmio_base_, cap_->HCCPARAMS1.Read());
+  if (usblegsup_ != nullptr) {
+    EnterPhase(BringUpPhase::kWaitingOwnership);
+  } else {
+    Halt();
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error Controller::PollBringUp(uint64_t now_ms) {
+  now_ms_ = now_ms;
+  for (;;) {
+    bool done = false;
+    switch (bring_up_phase_) {
+    case BringUpPhase::kNotStarted:
+    case BringUpPhase::kFailed:
+      return MAKE_ERROR(Error::kInvalidPhase);
+    case BringUpPhase::kRunning:
+      return MAKE_ERROR(Error::kSuccess);
+    case BringUpPhase::kWaitingOwnership: {
+      const auto r = usblegsup_->Read();
+      done = !r.bits.hc_bios_owned_semaphore && r.bits.hc_os_owned_semaphore;
+      break;
+    }
+    case BringUpPhase::kWaitingHalted:
+      done = op_->USBSTS.Read().bits.host_controller_halted;
+      break;
+    case BringUpPhase::kWaitingReset:
+      done = !op_->USBCMD.Read().bits.host_controller_reset &&
+             !op_->USBSTS.Read().bits.controller_not_ready;
+      break;
+    case BringUpPhase::kWaitingRunning:
+      done = !op_->USBSTS.Read().bits.host_controller_halted;
+      break;
+    }
+
+    if (!done) {
+      // 制限時間は最初に待たされた時点から数える（Initialize の時点ではまだ時刻が分からない）
+      if (phase_deadline_ms_ == 0) {
+        phase_deadline_ms_ = now_ms + BringUpTimeoutMs(bring_up_phase_);
+        return MAKE_ERROR(Error::kSuccess);
+      }
+      if (now_ms < phase_deadline_ms_) {
+        return MAKE_ERROR(Error::kSuccess);
+      }
+      if (bring_up_phase_ != BringUpPhase::kWaitingOwnership) {
+        Log(kError, "xHC bring-up timed out (%s)\n", BringUpPhaseName(bring_up_phase_));
+        bring_up_phase_ = BringUpPhase::kFailed;
+        return MAKE_ERROR(Error::kTimeout);
+      }
+      // 所有権を手放さない BIOS もあるので，諦めてそのまま使う
+      Log(kWarn, "BIOS did not release xHC, taking it over\n");
+    }
+
+    if (auto err = AdvanceBringUp()) {
+      bring_up_phase_ = BringUpPhase::kFailed;
+      return err;
+    }
+  }
+}
 
-  RequestHCOwnership(mmio_base_, cap_->HCCPARAMS1.Read());
+void Controller::EnterPhase(BringUpPhase phase) {
+  bring_up_phase_ = phase;
+  phase_deadline_ms_ = 0;
+}
 
+void Controller::Halt() {
   auto usbcmd = op_->USBCMD.Read();
   usbcmd.bits.interrupter_enable = false;
   usbcmd.bits.host_system_error_enable = false;
@@ -320,24 +1047,45 @@ Error Controller::Initialize() {
   if (!op_->USBSTS.Read().bits.host_controller_halted) {
     usbcmd.bits.run_stop = false; // stop
   }
-
   op_->USBCMD.Write(usbcmd);
-  while (!op_->USBSTS.Read().bits.host_controller_halted)
-    ;
+  EnterPhase(BringUpPhase::kWaitingHalted);
+}
 
-  // Reset controller
-  usbcmd = op_->USBCMD.Read();
-  usbcmd.bits.host_controller_reset = true;
-  op_->USBCMD.Write(usbcmd);
-  while (op_->USBCMD.Read().bits.host_controller_reset)
-    ;
-  while (op_->USBSTS.Read().bits.controller_not_ready)
-    ;
+Error Controller::AdvanceBringUp() {
+  switch (bring_up_phase_) {
+  case BringUpPhase::kWaitingOwnership:
+    Log(kTrace, "OS has owned xHC\n");
+    Halt();
+    break;
+  case BringUpPhase::kWaitingHalted: {
+    // Reset controller
+    auto usbcmd = op_->USBCMD.Read();
+    usbcmd.bits.host_controller_reset = true;
+    op_->USBCMD.Write(usbcmd);
+    EnterPhase(BringUpPhase::kWaitingReset);
+    break;
+  }
+  case BringUpPhase::kWaitingReset:
+    if (auto err = SetUpRings()) {
+      return err;
+    }
+    Run();
+    break;
+  case BringUpPhase::kWaitingRunning:
+    Log(kTrace, "xHC is running\n");
+    EnterPhase(BringUpPhase::kRunning);
+    break;
+  default:
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
 
+Error Controller::SetUpRings() {
   Log(kTrace, "MaxSlots: %u\n", cap_->HCSPARAMS1.Read().bits.max_device_slots);
   // Set "Max Slots Enabled" field in CONFIG.
   auto config = op_->CONFIG.Read();
-  config.bits.max_device_slots_enabled = kDeviceSize;
+  config.bits.max_device_slots_enabled = devmgr_.MaxSlots();
   op_->CONFIG.Write(config);
 
   auto hcsparams2 = cap_->HCSPARAMS2.Read();
@@ -355,60 +1103,277 @@ Error Controller::Initialize() {
 
   DCBAAP_Bitmap dcbaap{};
   dcbaap.SetPointer(reinterpret_cast<uint64_t>(devmgr_.DeviceContexts()));
-  op_->DCBAAP.Write(dcbaap);
+  op_->DCBAAP.Write(dcbaap, access64_);
 
-  auto primary_interrupter = &InterrupterRegisterSets()[0];
-  if (auto err = cr_.Initialize(32)) {
+  if (auto err = cr_.Initialize(kCommandRingSize)) {
     return err;
   }
-  if (auto err = RegisterCommandRing(&cr_, &op_->CRCR)) {
+  if (auto err = RegisterCommandRing(&cr_, &op_->CRCR, access64_)) {
     return err;
   }
-  if (auto err = er_.Initialize(32, primary_interrupter)) {
-    return err;
+
+  const uint16_t max_interrupters = cap_->HCSPARAMS1.Read().bits.max_interrupters;
+  num_interrupters_ = std::min({requested_interrupters_, max_interrupters, kMaxInterrupters});
+  if (num_interrupters_ == 0) {
+    num_interrupters_ = 1;
   }
+  Log(kTrace, "MaxIntrs: %u, using %u interrupters\n", max_interrupters, num_interrupters_);
+
+  const size_t erst_max = std::min(size_t{1} << hcsparams2.bits.event_ring_segment_table_max,
+                                   kMaxEventRingSegments);
 
-  // Enable interrupt for the primary interrupter
-  auto iman = primary_interrupter->IMAN.Read();
-  iman.bits.interrupt_pending = true;
-  iman.bits.interrupt_enable = true;
-  primary_interrupter->IMAN.Write(iman);
+  for (uint16_t i = 0; i < num_interrupters_; ++i) {
+    auto interrupter = &interrupters_[i];
+    if (auto err = er_[i].Initialize(event_ring_size_, interrupter, erst_max, access64_)) {
+      return err;
+    }
+
+    SetInterruptModeration(i, kIMODIntervalLowLatency, 0);
+
+    // Enable interrupt for the interrupter
+    er_[i].SetInterruptEnabled(true);
+  }
 
   // Enable interrupt for the controller
-  usbcmd = op_->USBCMD.Read();
+  auto usbcmd = op_->USBCMD.Read();
   usbcmd.bits.interrupter_enable = true;
   op_->USBCMD.Write(usbcmd);
 
   return MAKE_ERROR(Error::kSuccess);
 }
 
-Error Controller::Run() {
+void Controller::IssueCommandTRB(const TRB &trb, CommandCallbackType *callback,
+                                 uintptr_t context, uint64_t timeout_ms) {
+  if (num_deferred_commands_ == 0 && cr_.FreeSlots() > 0) {
+    NoteCommandIssued(cr_.Push(trb), callback, context, timeout_ms);
+    DoorbellRegisterAt(0)->Ring(0);
+    return;
+  }
+  // 空きがあっても，待たせているコマンドを追い越さないよう後ろに並べる
+  if (num_deferred_commands_ == kMaxDeferredCommands) {
+    Log(kError, "too many commands deferred, dropping type %u\n", trb.bits.trb_type);
+    return;
+  }
+  deferred_commands_[(deferred_head_ + num_deferred_commands_) % kMaxDeferredCommands] =
+      DeferredCommand{trb, callback, context, timeout_ms};
+  ++num_deferred_commands_;
+}
+
+void Controller::IssueDeferredCommands() {
+  bool issued = false;
+  while (num_deferred_commands_ > 0 && cr_.FreeSlots() > 0) {
+    const auto &cmd = deferred_commands_[deferred_head_];
+    NoteCommandIssued(cr_.Push(cmd.trb), cmd.callback, cmd.context, cmd.timeout_ms);
+    deferred_head_ = (deferred_head_ + 1) % kMaxDeferredCommands;
+    --num_deferred_commands_;
+    issued = true;
+  }
+  if (issued) {
+    DoorbellRegisterAt(0)->Ring(0);
+  }
+}
+
+void Controller::NoteCommandIssued(const TRB *trb, CommandCallbackType *callback,
+                                   uintptr_t context, uint64_t timeout_ms) {
+  // Command Ring のエントリ数は kCommandRingSize なので，添字は必ず範囲内になる
+  const int index = cr_.IndexOf(trb);
+  if (index < 0) {
+    return;
+  }
+  auto &cmd = pending_commands_[index];
+  if (cmd.issue_tsc == 0) {
+    ++num_pending_commands_;
+  }
+  cmd = PendingCommand{callback, context, ReadTSC(), timeout_ms ? now_ms_ + timeout_ms : 0,
+                       timeout_ms};
+}
+
+Error Controller::OnCommandCompleted(const CommandCompletionEventTRB &trb) {
+  if (trb.bits.completion_code == 24 /* Command Ring Stopped */) {
+    // Command Abort による停止．TRB Pointer は次に実行するコマンドを指すので，
+    // 消費済みにはせず，残りのコマンドがあれば実行を再開させる．
+    aborting_commands_ = false;
+    if (num_pending_commands_ > 0) {
+      // 待たされていた分，残りのコマンドの制限時間は再開した時点から数え直す
+      for (auto &cmd : pending_commands_) {
+        if (cmd.issue_tsc != 0 && cmd.timeout_ms != 0) {
+          cmd.deadline_ms = now_ms_ + cmd.timeout_ms;
+        }
+      }
+      DoorbellRegisterAt(0)->Ring(0);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  cr_.MarkConsumed(trb.Pointer());
+  const int index = cr_.IndexOf(trb.Pointer());
+  if (index < 0 || pending_commands_[index].issue_tsc == 0) {
+    IssueDeferredCommands();
+    return MAKE_ERROR(Error::kNoWaiter);
+  }
+  const auto cmd = pending_commands_[index];
+  pending_commands_[index] = PendingCommand{};
+  --num_pending_commands_;
+  // callback が発行するコマンドより先に，待たせていたコマンドを積む
+  IssueDeferredCommands();
+
+  const uint64_t cycles = ReadTSC() - cmd.issue_tsc;
+  ++stats_.commands;
+  stats_.total_command_cycles += cycles;
+  stats_.max_command_cycles = std::max(stats_.max_command_cycles, cycles);
+
+  if (cmd.callback == nullptr) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  return cmd.callback(*this, trb, cmd.context);
+}
+
+void Controller::CheckCommandTimeouts() {
+  if (aborting_commands_ || num_pending_commands_ == 0) {
+    return;
+  }
+  for (const auto &cmd : pending_commands_) {
+    if (cmd.issue_tsc != 0 && cmd.deadline_ms != 0 && now_ms_ >= cmd.deadline_ms) {
+      // コマンドは積んだ順に実行されるので，中断されるのは実行中の（最も古い）コマンド．
+      // 後続のコマンドは Command Ring Stopped の後に実行を再開する．
+      Log(kWarn, "command did not complete in %lu ms, aborting\n", cmd.timeout_ms);
+      ++stats_.command_timeouts;
+      AbortCommandRing();
+      return;
+    }
+  }
+}
+
+void Controller::AbortCommandRing() {
+  // 実行中は CRCR のポインタへの書き込みは無視されるので，フラグだけを立てればよい
+  auto crcr = op_->CRCR.Read(access64_);
+  crcr.bits.command_abort = true;
+  op_->CRCR.Write(crcr, access64_);
+  aborting_commands_ = true;
+}
+
+void Controller::Run() {
   // Run the controller
   auto usbcmd = op_->USBCMD.Read();
   usbcmd.bits.run_stop = true;
   op_->USBCMD.Write(usbcmd);
   op_->USBCMD.Read();
+  EnterPhase(BringUpPhase::kWaitingRunning);
+}
 
-  while (op_->USBSTS.Read().bits.host_controller_halted)
-    ;
+void Controller::SetInterruptModeration(uint16_t interval, uint16_t counter) {
+  for (uint16_t i = 0; i < num_interrupters_; ++i) {
+    SetInterruptModeration(i, interval, counter);
+  }
+}
 
-  return MAKE_ERROR(Error::kSuccess);
+void Controller::SetInterruptModeration(uint16_t index, uint16_t interval, uint16_t counter) {
+  // IMOD の全フィールドを書き換えるので，現在値を読む必要はない
+  IMOD_Bitmap imod{};
+  imod.bits.interrupt_moderation_interval = interval;
+  imod.bits.interrupt_moderation_counter = counter;
+  interrupters_[index].IMOD.Write(imod);
+}
+
+void Controller::SetSlotWorkload(uint8_t slot_id, SlotWorkload workload) {
+  slot_workloads_[slot_id] = workload;
+  const uint16_t index = InterrupterForSlot(slot_id);
+  if (index == 0) {
+    return;
+  }
+
+  bool throughput = false;
+  for (size_t i = index; i < slot_workloads_.size(); i += num_interrupters_) {
+    if (slot_workloads_[i] == SlotWorkload::kLowLatency) {
+      throughput = false;
+      break;
+    }
+    if (slot_workloads_[i] == SlotWorkload::kThroughput) {
+      throughput = true;
+    }
+  }
+  Log(kDebug, "interrupter %u: %s moderation\n", index, throughput ? "throughput" : "low latency");
+  SetInterruptModeration(index, throughput ? kIMODIntervalThroughput : kIMODIntervalLowLatency, 0);
+}
+
+void Controller::SetPollingPolicy(const PollingPolicy &policy) {
+  polling_policy_ = policy;
+  if (!policy.enabled && polling_) {
+    polling_ = false;
+    SetEventInterruptsEnabled(true);
+  }
+}
+
+void Controller::SetEventInterruptsEnabled(bool enabled) {
+  for (uint16_t i = 0; i < num_interrupters_; ++i) {
+    er_[i].SetInterruptEnabled(enabled);
+  }
+}
+
+bool Controller::PollEvents(size_t max_events) {
+  if (polling_policy_.enabled && !polling_) {
+    // 割り込みを受けた．イベントリングが空になるまで割り込みを止めてポーリングで処理する．
+    SetEventInterruptsEnabled(false);
+    polling_ = true;
+    idle_polls_ = 0;
+    ++stats_.polling_entries;
+  }
+
+  size_t num_events = 0;
+  for (uint16_t i = 0; i < num_interrupters_; ++i) {
+    size_t n;
+    do {
+      n = ProcessEvents(*this, i, max_events);
+      num_events += n;
+      // ポーリング中は 1 回の呼び出しで処理する量を抑え，他のタスクに順番を回す
+    } while (!polling_ && n == max_events);
+  }
+  if (!polling_) {
+    return false;
+  }
+
+  ++stats_.polls;
+  idle_polls_ = num_events > 0 ? 0 : idle_polls_ + 1;
+  if (idle_polls_ < polling_policy_.idle_poll_budget) {
+    return true;
+  }
+
+  polling_ = false;
+  SetEventInterruptsEnabled(true);
+  // 割り込みを止めている間に届いたイベントは割り込みを起こさないので，ここで拾う
+  for (uint16_t i = 0; i < num_interrupters_; ++i) {
+    if (er_[i].HasFront()) {
+      SetEventInterruptsEnabled(false);
+      polling_ = true;
+      idle_polls_ = 0;
+      return true;
+    }
+  }
+  return false;
 }
 
-DoorbellRegister *Controller::DoorbellRegisterAt(uint8_t index) {
-  return &DoorbellRegisters()[index];
+EventHandlerType *SetEventHandler(uint8_t trb_type, EventHandlerType *handler) {
+  auto &slot = event_handlers[trb_type % event_handlers.size()];
+  auto previous = slot;
+  slot = handler;
+  return previous;
 }
 
 Error ConfigurePort(Controller &xhc, Port &port) {
-  if (port_config_phase[port.Number()] == ConfigPhase::kNotConnected) {
-    return ResetPort(xhc, port);
+  auto &st = xhc.Enumerations();
+  if (st.port_config_phase[port.Number()] == ConfigPhase::kNotConnected && port.IsConnected()) {
+    return StartEnumeration(xhc, AttachPoint{0, port.Number()});
   }
   return MAKE_ERROR(Error::kSuccess);
 }
 
 Error ConfigureEndpoints(Controller &xhc, Device &dev) {
+  auto &st = xhc.Enumerations();
   const auto configs = dev.EndpointConfigs();
   const auto len = dev.NumEndpointConfigs();
+  if (xhc.FreeCommandSlots() < 1) {
+    return MAKE_ERROR(Error::kRingFull);
+  }
 
   memset(&dev.InputContext()->input_control_context, 0, sizeof(InputControlContext));
   memcpy(&dev.InputContext()->slot_context, &dev.DeviceContext()->slot_context,
@@ -416,8 +1381,8 @@ Error ConfigureEndpoints(Controller &xhc, Device &dev) {
 
   auto slot_ctx = dev.InputContext()->EnableSlotContext();
   slot_ctx->bits.context_entries = 31;
-  const auto port_id{dev.DeviceContext()->slot_context.bits.root_hub_port_num};
-  const int port_speed{xhc.PortAt(port_id).Speed()};
+  // ハブの先のデバイスもあるので，ポートではなくスロットコンテキストの速度を使う
+  const int port_speed = dev.DeviceContext()->slot_context.bits.speed;
   if (port_speed == 0 || port_speed > kSuperSpeedPlus) {
     return MAKE_ERROR(Error::kUnknownXHCISpeedID);
   }
@@ -452,41 +1417,276 @@ Error ConfigureEndpoints(Controller &xhc, Device &dev) {
     ep_ctx->bits.max_packet_size = configs[i].max_packet_size;
     ep_ctx->bits.interval = convert_interval(configs[i].ep_type, configs[i].interval);
     ep_ctx->bits.average_trb_length = 1;
+    if (configs[i].ep_type == EndpointType::kIsochronous) {
+      // アイソクロナス転送は 1 TRB = 1 サービス間隔分のデータなので，帯域の見積もりに使われる
+      // Max ESIT Payload と Average TRB Length は最大パケットサイズにする
+      ep_ctx->bits.max_esit_payload_lo = configs[i].max_packet_size;
+      ep_ctx->bits.average_trb_length = configs[i].max_packet_size;
+    }
 
-    auto tr = dev.AllocTransferRing(ep_dci, 32);
-    ep_ctx->SetTransferRingBuffer(tr->Buffer());
+    ep_ctx->bits.max_burst_size = configs[i].max_burst;
+
+    const size_t num_stream_contexts =
+        configs[i].ep_type == EndpointType::kBulk && dev.SupportsStreams()
+            ? StreamContextArraySize(configs[i].max_streams, xhc.MaxStreamContexts())
+            : 0;
+    if (num_stream_contexts > 0) {
+      auto contexts = dev.AllocStreams(ep_dci, num_stream_contexts, kStreamTransferRingSize);
+      if (contexts == nullptr) {
+        return MAKE_ERROR(Error::kNoEnoughMemory);
+      }
+      // TR Dequeue Pointer は Stream Context Array を指し，DCS は使われない
+      ep_ctx->SetStreamContextArray(contexts);
+      ep_ctx->bits.dequeue_cycle_state = 0;
+      ep_ctx->bits.max_primary_streams = MostSignificantBit(num_stream_contexts) - 1;
+      ep_ctx->bits.linear_stream_array = 1;
+      Log(kDebug, "slot %d dci %d: %lu streams\n", dev.SlotID(), ep_dci.value,
+          num_stream_contexts - 1);
+    } else {
+      auto tr = dev.AllocTransferRing(
+          ep_dci, TransferRingSize(configs[i].ep_type, configs[i].max_packet_size));
+      if (tr == nullptr) {
+        return MAKE_ERROR(Error::kNoEnoughMemory);
+      }
+      ep_ctx->SetTransferRingBuffer(tr->Buffer());
+      ep_ctx->bits.dequeue_cycle_state = 1;
+      ep_ctx->bits.max_primary_streams = 0;
+      ep_ctx->bits.linear_stream_array = 0;
+    }
 
-    ep_ctx->bits.dequeue_cycle_state = 1;
-    ep_ctx->bits.max_primary_streams = 0;
     ep_ctx->bits.mult = 0;
     ep_ctx->bits.error_count = 3;
   }
 
-  port_config_phase[port_id] = ConfigPhase::kConfiguringEndpoints;
+  st.slot_config_phase[dev.SlotID()] = ConfigPhase::kConfiguringEndpoints;
 
   ConfigureEndpointCommandTRB cmd{dev.InputContext(), dev.SlotID()};
-  xhc.CommandRing()->Push(cmd);
-  xhc.DoorbellRegisterAt(0)->Ring(0);
+  xhc.IssueCommand(cmd, OnConfigureEndpointCompleted);
+
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error ConfigureHub(Controller &xhc, Device &hub, const usb::HubConfig &config) {
+  auto &st = xhc.Enumerations();
+  const auto slot_id = hub.SlotID();
+  if (st.slot_config_phase[slot_id] != ConfigPhase::kConfigured) {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  if (xhc.FreeCommandSlots() < 1) {
+    return MAKE_ERROR(Error::kRingFull);
+  }
+
+  // スロットコンテキストだけを更新する Configure Endpoint コマンド．
+  // 後続のデバイスの Address Device は Command Ring 上でこれより後になるので，
+  // ハブの情報が反映された後に処理される．
+  memset(&hub.InputContext()->input_control_context, 0, sizeof(InputControlContext));
+  memcpy(&hub.InputContext()->slot_context, &hub.DeviceContext()->slot_context,
+         sizeof(SlotContext));
+  auto slot_ctx = hub.InputContext()->EnableSlotContext();
+  slot_ctx->bits.hub = 1;
+  slot_ctx->bits.num_ports = config.num_ports;
+  slot_ctx->bits.mtt = config.multi_tt;
+  if (slot_ctx->bits.speed == kHighSpeed) {
+    slot_ctx->bits.ttt = config.think_time;
+  }
+
+  st.slot_config_phase[slot_id] = ConfigPhase::kConfiguringHub;
+
+  ConfigureEndpointCommandTRB cmd{hub.InputContext(), slot_id};
+  xhc.IssueCommand(cmd, OnConfigureEndpointCompleted);
+
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error EvaluateContext(Controller &xhc, Device &dev, Controller::CommandCallbackType *callback,
+                      uintptr_t context) {
+  if (xhc.FreeCommandSlots() < 1) {
+    return MAKE_ERROR(Error::kRingFull);
+  }
+  EvaluateContextCommandTRB cmd{dev.InputContext(), dev.SlotID()};
+  xhc.IssueCommand(cmd, callback, context);
+  return MAKE_ERROR(Error::kSuccess);
+}
 
+Error StopEndpoint(Controller &xhc, Device &dev, DeviceContextIndex dci,
+                   Controller::CommandCallbackType *callback, uintptr_t context) {
+  if (dci.value < 1 || 31 < dci.value) {
+    return MAKE_ERROR(Error::kInvalidEndpointNumber);
+  }
+  if (xhc.FreeCommandSlots() < 1) {
+    return MAKE_ERROR(Error::kRingFull);
+  }
+  StopEndpointCommandTRB cmd{EndpointID{dci.value}, dev.SlotID()};
+  xhc.IssueCommand(cmd, callback, context);
   return MAKE_ERROR(Error::kSuccess);
 }
 
+Error ResetEndpoint(Controller &xhc, Device &dev, DeviceContextIndex dci,
+                    Controller::CommandCallbackType *callback, uintptr_t context) {
+  if (dci.value < 1 || 31 < dci.value) {
+    return MAKE_ERROR(Error::kInvalidEndpointNumber);
+  }
+  if (xhc.FreeCommandSlots() < 1) {
+    return MAKE_ERROR(Error::kRingFull);
+  }
+  ResetEndpointCommandTRB cmd{EndpointID{dci.value}, dev.SlotID()};
+  xhc.IssueCommand(cmd, callback, context);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error SetTRDequeuePointer(Controller &xhc, Device &dev, DeviceContextIndex dci,
+                          uint16_t stream_id, const TRB *dequeue, bool cycle,
+                          Controller::CommandCallbackType *callback, uintptr_t context) {
+  if (dci.value < 1 || 31 < dci.value) {
+    return MAKE_ERROR(Error::kInvalidEndpointNumber);
+  }
+  if (xhc.FreeCommandSlots() < 1) {
+    return MAKE_ERROR(Error::kRingFull);
+  }
+  SetTRDequeuePointerCommandTRB cmd{EndpointID{dci.value}, dev.SlotID(), stream_id, dequeue,
+                                    cycle};
+  xhc.IssueCommand(cmd, callback, context);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error RecoverHaltedEndpoint(Controller &xhc, Device &dev, DeviceContextIndex dci,
+                            uint16_t stream_id, const TRB *dequeue, bool cycle) {
+  // 2 つのコマンドは積んだ順に処理されるので，Reset Endpoint の完了を待たずに積んでよい
+  if (xhc.FreeCommandSlots() < 2) {
+    return MAKE_ERROR(Error::kRingFull);
+  }
+  const auto context = EndpointCommandContext(dev.SlotID(), dci, stream_id);
+  if (auto err = ResetEndpoint(xhc, dev, dci, OnRecoveryResetEndpointCompleted, context)) {
+    return err;
+  }
+  return SetTRDequeuePointer(xhc, dev, dci, stream_id, dequeue, cycle,
+                             OnSetTRDequeueCompleted, context);
+}
+
+Error CancelTransfers(Controller &xhc, Device &dev, DeviceContextIndex dci, uint16_t stream_id,
+                      const TRB *dequeue, bool cycle) {
+  if (xhc.FreeCommandSlots() < 2) {
+    return MAKE_ERROR(Error::kRingFull);
+  }
+  const auto context = EndpointCommandContext(dev.SlotID(), dci, stream_id);
+  if (auto err = StopEndpoint(xhc, dev, dci, OnCancelStopEndpointCompleted, context)) {
+    return err;
+  }
+  return SetTRDequeuePointer(xhc, dev, dci, stream_id, dequeue, cycle, OnSetTRDequeueCompleted,
+                             context);
+}
+
+Error OnHubPortConnected(Controller &xhc, Device &hub, uint8_t port_num) {
+  auto &st = xhc.Enumerations();
+  Log(kDebug, "device connected to port %d of hub slot %d\n", port_num, hub.SlotID());
+  if (RouteDepth(hub.DeviceContext()->slot_context.bits.route_string) >= kMaxRouteDepth) {
+    Log(kWarn, "hubs are nested too deeply\n");
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  if (FindEnumeration(st, hub.SlotID(), port_num)) {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  return StartEnumeration(xhc, AttachPoint{hub.SlotID(), port_num});
+}
+
+Error OnHubPortReset(Controller &xhc, Device &hub, uint8_t port_num, usb::DeviceSpeed speed) {
+  auto &st = xhc.Enumerations();
+  Log(kTrace, "OnHubPortReset: hub slot %d, port %d\n", hub.SlotID(), port_num);
+  auto e = st.addressing;
+  if (e == nullptr || e->point.hub_slot != hub.SlotID() || e->point.port_num != port_num ||
+      e->phase != ConfigPhase::kResettingPort) {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  e->speed = ToProtocolSpeedID(speed);
+  return AddressDevice(xhc, *e);
+}
+
+Error OnHubPortDisconnected(Controller &xhc, Device &hub, uint8_t port_num) {
+  auto &st = xhc.Enumerations();
+  Log(kDebug, "device disconnected from port %d of hub slot %d\n", port_num, hub.SlotID());
+  if (IsDetaching(st, hub.SlotID())) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  return DisconnectPort(xhc, hub.SlotID(), port_num);
+}
+
 Error ProcessEvent(Controller &xhc) {
   if (!xhc.PrimaryEventRing()->HasFront()) {
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error err = MAKE_ERROR(Error::kNotImplemented);
-  auto event_trb = xhc.PrimaryEventRing()->Front();
-  if (auto trb = TRBDynamicCast<TransferEventTRB>(event_trb)) {
-    err = OnEvent(xhc, *trb);
-  } else if (auto trb = TRBDynamicCast<PortStatusChangeEventTRB>(event_trb)) {
-    err = OnEvent(xhc, *trb);
-  } else if (auto trb = TRBDynamicCast<CommandCompletionEventTRB>(event_trb)) {
-    err = OnEvent(xhc, *trb);
-  }
+  const auto trace_begin = TraceBegin();
+  auto err = DispatchEvent(xhc, 0, xhc.PrimaryEventRing()->Front());
+  TraceEnd(TraceStage::kEventDispatch, trace_begin);
   xhc.PrimaryEventRing()->Pop();
+  xhc.PrimaryEventRing()->FlushDequeuePointer();
+
+  auto &stats = xhc.Stats();
+  ++stats.events;
+  if (err) {
+    ++stats.event_errors;
+  }
 
   return err;
 }
+
+size_t ProcessEvents(Controller &xhc, size_t max_events) {
+  return ProcessEvents(xhc, 0, max_events);
+}
+
+size_t ProcessEvents(Controller &xhc, uint16_t interrupter, size_t max_events) {
+  if (interrupter >= xhc.NumInterrupters()) {
+    return 0;
+  }
+  auto er = xhc.EventRingAt(interrupter);
+
+  size_t num_events = 0;
+  while (num_events < max_events && er->HasFront()) {
+    const auto trace_begin = TraceBegin();
+    if (auto err = DispatchEvent(xhc, interrupter, er->Front())) {
+      Log(kError, "failed to process event: %s at %s:%d\n", err.Name(), err.File(), err.Line());
+      ++xhc.Stats().event_errors;
+    }
+    TraceEnd(TraceStage::kEventDispatch, trace_begin);
+    er->Pop();
+    ++num_events;
+  }
+
+  if (num_events > 0) {
+    er->FlushDequeuePointer();
+
+    auto &stats = xhc.Stats();
+    stats.events += num_events;
+    ++stats.drain_batches;
+    stats.max_events_per_batch = std::max<uint64_t>(stats.max_events_per_batch, num_events);
+  }
+  return num_events;
+}
+
+Error CheckTimeouts(Controller &xhc, uint64_t now_ms) {
+  auto &st = xhc.Enumerations();
+  xhc.SetNowMs(now_ms);
+  xhc.CheckCommandTimeouts();
+
+  // コマンドを受け付けられずに発行できなかった Disable Slot を再試行する
+  for (size_t slot_id = 1;
+       slot_id < st.slot_config_phase.size() && xhc.FreeCommandSlots() > 0; ++slot_id) {
+    if (st.slot_config_phase[slot_id] == ConfigPhase::kDetaching) {
+      IssueDetachDisableSlot(xhc, slot_id);
+    }
+  }
+
+  if (st.addressing == nullptr || st.addressing->phase != ConfigPhase::kResettingPort ||
+      now_ms - st.addressing->reset_started_ms < kPortResetTimeoutMs) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  auto &e = *st.addressing;
+  Log(kWarn, "port %d of hub slot %d did not finish reset in %lu ms\n", e.point.port_num,
+      e.point.hub_slot, kPortResetTimeoutMs);
+  if (auto err = CancelEnumeration(xhc, e)) {
+    return err;
+  }
+  return StartNextAddressing(xhc);
+}
 } // namespace usb::xhci
@@ -12,48 +12,361 @@
 #include "usb/xhci/port.hpp"
 #include "usb/xhci/registers.hpp"
 #include "usb/xhci/ring.hpp"
+#include "usb/xhci/stats.hpp"
+
+#include <array>
 
 namespace usb::xhci {
+/** @brief ポートとスロットの列挙の状態．定義は xhci.cpp にある． */
+struct EnumerationState;
+
+/** @brief 1 つのホストコントローラ．
+ *
+ * 列挙の状態を含め，ホストコントローラごとの状態は全てこのインスタンスが持つので，
+ * 複数のホストコントローラをそれぞれ独立に扱える．
+ */
 class Controller {
 public:
+  /** @brief IMOD の interval の既定値（単位は 250 ns）．
+   *
+   * kIMODIntervalLowLatency は HID のような遅延に敏感なデバイス向けで，
+   * kIMODIntervalThroughput はバルク転送主体のデバイス向けに割り込みをまとめる．
+   */
+  static const uint16_t kIMODIntervalLowLatency = 160; // 40 us
+  static const uint16_t kIMODIntervalThroughput = 4000; // 1 ms
+
+  /** @brief 同時に利用できるインタラプタ（イベントリング）の最大数． */
+  static const uint16_t kMaxInterrupters = 8;
+
   Controller(uintptr_t mmio_base);
-  Error Initialize();
-  Error Run();
+
+  /** @brief 各イベントリングが保持できるイベント数の既定値． */
+  static const size_t kDefaultEventRingSize = 256;
+  /** @brief 1 つのイベントリングが使うセグメント数の上限． */
+  static const size_t kMaxEventRingSegments = 16;
+
+  /** @brief 起動処理の段階．Initialize で kNotStarted を抜け，PollBringUp で進む． */
+  enum class BringUpPhase : uint8_t {
+    kNotStarted,
+    /** BIOS が所有権を手放すのを待っている */
+    kWaitingOwnership,
+    /** HCHalted が 1 になるのを待っている */
+    kWaitingHalted,
+    /** HCRST と CNR が 0 になるのを待っている */
+    kWaitingReset,
+    /** Run/Stop を 1 にした後，HCHalted が 0 になるのを待っている */
+    kWaitingRunning,
+    kRunning,
+    kFailed,
+  };
+
+  /** @brief ホストコントローラの初期化を始める．
+   *
+   * レジスタの変化は待たずに戻る．以降は PollBringUp を繰り返し呼び出して，
+   * 所有権の移行，停止，リセット，各リングの設定，起動の順に進める．
+   *
+   * @param num_interrupters  有効にするインタラプタの数．kMaxInterrupters と
+   *   HCSPARAMS1 の MaxIntrs の小さい方に切り詰められる．
+   *   各インタラプタはそれぞれ専用のイベントリングを持つ．
+   * @param event_ring_size  各イベントリングが保持できるイベントの数．
+   *   ERST Max の範囲で複数のセグメントに分割して割り当てる．
+   */
+  Error Initialize(uint16_t num_interrupters = 1, size_t event_ring_size = kDefaultEventRingSize);
+
+  /** @brief 起動処理を進められるところまで進める．
+   *
+   * 各段階には制限時間があり，超えると kTimeout を返して kFailed になる．
+   * ただし BIOS が所有権を手放さない場合は，警告を出してそのまま先に進む．
+   *
+   * @param now_ms  現在時刻（ミリ秒）．単調に増加していればよい．
+   * @return 起動中または起動済みなら kSuccess．
+   */
+  Error PollBringUp(uint64_t now_ms);
+  BringUpPhase Phase() const { return bring_up_phase_; }
+  bool IsRunning() const { return bring_up_phase_ == BringUpPhase::kRunning; }
+
+  /** @brief 最後に PollBringUp か CheckTimeouts で与えられた時刻（ミリ秒）． */
+  uint64_t NowMs() const { return now_ms_; }
+  void SetNowMs(uint64_t now_ms) { now_ms_ = now_ms; }
+
+  /** @brief 全インタラプタの割り込みモデレーションを設定する．
+   *
+   * @param interval  割り込みの最小間隔（250 ns 単位）．0 ならモデレーションしない．
+   * @param counter   次の割り込みまでの残り時間の初期値（250 ns 単位）．
+   */
+  void SetInterruptModeration(uint16_t interval, uint16_t counter);
+
+  /** @brief index 番目のインタラプタの割り込みモデレーションを設定する． */
+  void SetInterruptModeration(uint16_t index, uint16_t interval, uint16_t counter);
+
+  /** @brief スロットの転送の性質．インタラプタの IMOD を選ぶのに使う． */
+  enum class SlotWorkload : uint8_t {
+    kNone,
+    kLowLatency,
+    kThroughput,
+  };
+  /** @brief slot_id の性質を記録し，そのスロットが使うインタラプタの IMOD を選び直す．
+   *
+   * インタラプタを共有するスロットが全て kThroughput なら kIMODIntervalThroughput，
+   * そうでなければ kIMODIntervalLowLatency にする．コマンド完了とポート状態変化を
+   * 受け取るインタラプタ 0 は常に kIMODIntervalLowLatency のままにする．
+   */
+  void SetSlotWorkload(uint8_t slot_id, SlotWorkload workload);
+
   Ring *CommandRing() { return &cr_; }
-  EventRing *PrimaryEventRing() { return &er_; }
-  DoorbellRegister *DoorbellRegisterAt(uint8_t index);
-  Port PortAt(uint8_t port_num) { return Port{port_num, PortRegisterSets()[port_num - 1]}; }
+
+  /** @brief コマンドの完了を受け取る関数．
+   *
+   * trb は Command Completion Event．失敗や Command Aborted も含めて，
+   * 発行したコマンドごとに 1 回だけ呼ばれる．
+   *
+   * @param context  IssueCommand に渡した値
+   */
+  using CommandCallbackType = Error(Controller &xhc, const CommandCompletionEventTRB &trb,
+                                    uintptr_t context);
+
+  /** @brief コマンドの完了を待つ時間の既定値（ミリ秒） */
+  static const uint64_t kDefaultCommandTimeoutMs = 5000;
+
+  /** @brief Command Ring が一杯のときに IssueCommand が待たせておけるコマンドの数 */
+  static const size_t kMaxDeferredCommands = 16;
+
+  /** @brief command を Command Ring に積んでドアベルを鳴らす．
+   *
+   * Command Ring が一杯なら kMaxDeferredCommands 個まで待たせておき，先に積んだコマンドが
+   * 完了して空きができたところで積む．呼び出し側は事前に FreeCommandSlots() で
+   * 受け付けられることを確認しなければならない．
+   * コマンドは IssueCommand を呼んだ順に処理されるが，完了を待たずに次のコマンドを積んでよい．
+   *
+   * @param callback    完了時に呼ぶ関数．nullptr なら完了を無視する．
+   * @param context     callback に渡す値．発行元の識別に使う．
+   * @param timeout_ms  この時間内に完了しなければ CheckTimeouts が Command Ring を中断し，
+   *   コマンドは Command Aborted で完了する．0 なら時間を制限しない．
+   */
+  template <class CommandTRBType>
+  void IssueCommand(const CommandTRBType &command, CommandCallbackType *callback = nullptr,
+                    uintptr_t context = 0, uint64_t timeout_ms = kDefaultCommandTimeoutMs) {
+    IssueCommandTRB(TRB{command.data}, callback, context, timeout_ms);
+  }
+  /** @brief IssueCommand で受け付けられるコマンドの数 */
+  size_t FreeCommandSlots() const {
+    return cr_.FreeSlots() + (kMaxDeferredCommands - num_deferred_commands_);
+  }
+  /** @brief Command Completion Event を処理し，コマンドを発行したときの callback を呼ぶ．
+   *
+   * Command Ring Stopped の通知なら，残っているコマンドの処理を再開させる．
+   */
+  Error OnCommandCompleted(const CommandCompletionEventTRB &trb);
+  /** @brief 制限時間を過ぎたコマンドがあれば，CRCR の Command Abort で中断させる． */
+  void CheckCommandTimeouts();
+  /** @brief 完了を待っているコマンドの数 */
+  int NumPendingCommands() const { return num_pending_commands_; }
+
+  /** @brief イベントの受け取り方（割り込みのみか，割り込みとポーリングの併用か） */
+  struct PollingPolicy {
+    /** true なら割り込みを受けた後，イベントが途絶えるまで割り込みを止めてポーリングする */
+    bool enabled;
+    /** イベントの無いポーリングがこの回数続いたら割り込みを再び有効にする */
+    uint32_t idle_poll_budget;
+  };
+
+  /** @brief イベントの受け取り方を設定する．既定では割り込みだけを使う． */
+  void SetPollingPolicy(const PollingPolicy &policy);
+  const PollingPolicy &GetPollingPolicy() const { return polling_policy_; }
+  /** @brief 割り込みを止めてポーリングしている最中なら true */
+  bool IsPolling() const { return polling_; }
+
+  /** @brief 全イベントリングのイベントを処理する．割り込みを受けたときと，ポーリング中に呼ぶ．
+   *
+   * ポーリングが無効なら各イベントリングが空になるまで処理して false を返す．
+   * 有効なら最初の呼び出しで全インタラプタの割り込みを止め，以降は 1 回あたり
+   * 各イベントリングから高々 max_events 個ずつ処理する．イベントの無い呼び出しが
+   * idle_poll_budget 回続いたら割り込みを再び有効にして false を返す．
+   *
+   * @return まだポーリングを続けるなら true．false なら次の割り込みを待てばよい．
+   */
+  bool PollEvents(size_t max_events);
+
+  ControllerStats &Stats() { return stats_; }
+  /** @brief 割り込みを受けてイベントを処理しに来たことを統計に記録する． */
+  void NoteInterrupt() { ++stats_.interrupts; }
+
+  /** @brief インタラプタ 0 のイベントリング．コマンド完了とポート状態変化はここに届く． */
+  EventRing *PrimaryEventRing() { return &er_[0]; }
+  EventRing *EventRingAt(uint16_t index) { return &er_[index]; }
+  uint16_t NumInterrupters() const { return num_interrupters_; }
+
+  /** @brief スロットの転送イベントを受け取るインタラプタを決める． */
+  uint16_t InterrupterForSlot(uint8_t slot_id) const { return slot_id % num_interrupters_; }
+
+  DoorbellRegister *DoorbellRegisterAt(uint8_t index) { return &doorbells_[index]; }
+  Port PortAt(uint8_t port_num) { return Port{port_num, ports_[port_num - 1]}; }
   uint8_t MaxPorts() const { return max_ports_; }
+  /** @brief 現在のマイクロフレーム番号（MFINDEX，125 us ごとに増え 2^14 で一周する） */
+  uint16_t MicroframeIndex() const { return mfindex_->Read().bits.microframe_index; }
+  /** @brief アイソクロナス TD を MFINDEX より何マイクロフレーム先から積めるか（IST） */
+  uint16_t IsochSchedulingThreshold() const { return isoch_threshold_; }
+  /** @brief Primary Stream Context Array の要素数の上限（MaxPSASize）．ストリームを扱えなければ 0． */
+  size_t MaxStreamContexts() const {
+    const int max_psa_size = cap_->HCCPARAMS1.Read().bits.maximum_primary_stream_array_size;
+    return max_psa_size == 0 ? 0 : size_t{1} << (max_psa_size + 1);
+  }
   DeviceManager *DeviceManager() { return &devmgr_; }
+  /** @brief Initialize の後で有効 */
+  EnumerationState &Enumerations() { return *enum_state_; }
 
 private:
-  static const size_t kDeviceSize = 8;
+  static const size_t kCommandRingSize = 32;
 
   const uintptr_t mmio_base_;
   CapabilityRegisters *const cap_;
   OperationalRegisters *const op_;
   const uint8_t max_ports_;
+  /** 64 ビットのレジスタ（DCBAAP，CRCR，ERSTBA，ERDP）へのアクセス方法．HCCPARAMS1.AC64 で決まる． */
+  const Access64 access64_;
+  /** HCSPARAMS2.IST をマイクロフレーム単位に換算した値 */
+  const uint16_t isoch_threshold_;
+  // 以下のレジスタ配列の位置はキャパビリティレジスタから求まり変化しないので，構築時に 1 回だけ求める．
+  // 転送やコマンドのたびに DBOFF や RTSOFF を MMIO から読み直さずに済む．
+  MemMapRegister<MFINDEX_Bitmap> *const mfindex_;
+  InterrupterRegisterSetArray interrupters_;
+  DoorbellRegisterArray doorbells_;
+  PortRegisterSetArray ports_;
 
   class DeviceManager devmgr_;
+  EnumerationState *enum_state_{nullptr};
   Ring cr_;
-  EventRing er_;
+  std::array<EventRing, kMaxInterrupters> er_;
+  uint16_t num_interrupters_{1};
+  /** スロット ID で引く，各スロットの転送の性質 */
+  std::array<SlotWorkload, 256> slot_workloads_{};
 
-  InterrupterRegisterSetArray InterrupterRegisterSets() const {
-    return {mmio_base_ + cap_->RTSOFF.Read().Offset() + 0x20u, 1024};
-  }
+  BringUpPhase bring_up_phase_{BringUpPhase::kNotStarted};
+  /** 現在の段階の制限時間．0 なら次に待たされた時点で決める． */
+  uint64_t phase_deadline_ms_{0};
+  uint64_t now_ms_{0};
+  /** BIOS からの所有権の移行を待つためのレジスタ */
+  MemMapRegister<USBLEGSUP_Bitmap> *usblegsup_{nullptr};
+  /** Initialize で受け取り，リングを設定するときに使う */
+  uint16_t requested_interrupters_{1};
+  size_t event_ring_size_{kDefaultEventRingSize};
 
-  PortRegisterSetArray PortRegisterSets() const {
-    return {reinterpret_cast<uintptr_t>(op_) + 0x400u, max_ports_};
-  }
+  ControllerStats stats_{};
 
-  DoorbellRegisterArray DoorbellRegisters() const {
-    return {mmio_base_ + cap_->DBOFF.Read().Offset(), 256};
-  }
+  PollingPolicy polling_policy_{false, 0};
+  bool polling_{false};
+  /** ポーリング中にイベントが無かった呼び出しが続いた回数 */
+  uint32_t idle_polls_{0};
+  /** @brief Command Ring に積んだ，完了を待っているコマンド */
+  struct PendingCommand {
+    CommandCallbackType *callback;
+    uintptr_t context;
+    /** 積んだ時刻（TSC）．0 ならこのエントリのコマンドは完了を待っていない． */
+    uint64_t issue_tsc;
+    /** 制限時刻（ミリ秒）．0 なら制限しない． */
+    uint64_t deadline_ms;
+    uint64_t timeout_ms;
+  };
+  /** Command Ring と同じ添字で引ける，各エントリに積んだコマンドの記録．
+   *
+   * 完了通知の TRB Pointer から定数時間で引ける．Command Ring が一周するまで
+   * エントリは再利用されないので，記録が上書きされることはない．
+   */
+  std::array<PendingCommand, kCommandRingSize> pending_commands_{};
+  int num_pending_commands_{0};
+  /** CRCR の Command Abort を書き込み，Command Ring Stopped を待っている */
+  bool aborting_commands_{false};
+  /** @brief Command Ring に空きが無く，積むのを待っているコマンド */
+  struct DeferredCommand {
+    TRB trb;
+    CommandCallbackType *callback;
+    uintptr_t context;
+    uint64_t timeout_ms;
+  };
+  /** deferred_head_ から num_deferred_commands_ 個が IssueCommand を呼んだ順に並ぶ環状バッファ */
+  std::array<DeferredCommand, kMaxDeferredCommands> deferred_commands_{};
+  size_t deferred_head_{0};
+  size_t num_deferred_commands_{0};
+
+  void IssueCommandTRB(const TRB &trb, CommandCallbackType *callback, uintptr_t context,
+                       uint64_t timeout_ms);
+  /** @brief 待たせているコマンドを，Command Ring に空きがある分だけ積む． */
+  void IssueDeferredCommands();
+  void NoteCommandIssued(const TRB *trb, CommandCallbackType *callback, uintptr_t context,
+                         uint64_t timeout_ms);
+  void AbortCommandRing();
+  void SetEventInterruptsEnabled(bool enabled);
+
+  void EnterPhase(BringUpPhase phase);
+  /** @brief 現在の段階の待ち合わせが終わったので，次の段階の処理を始める． */
+  Error AdvanceBringUp();
+  void Halt();
+  /** @brief リセット後に DCBAAP，Command Ring，イベントリングを設定し，割り込みを有効にする． */
+  Error SetUpRings();
+  void Run();
 };
 
+/** @brief イベント TRB を処理する関数．trb の種類はハンドラの登録時に決まっている． */
+using EventHandlerType = Error(Controller &xhc, TRB &trb);
+
+/** @brief trb_type のイベントを処理するハンドラを登録する．
+ *
+ * 既定では Transfer, Command Completion, Port Status Change, Bandwidth Request,
+ * Host Controller, Device Notification, MFINDEX Wrap の各イベントにハンドラが登録されている．
+ * handler に nullptr を渡すとそのイベントは kNotImplemented として扱われる．
+ *
+ * @return それまで登録されていたハンドラ
+ */
+EventHandlerType *SetEventHandler(uint8_t trb_type, EventHandlerType *handler);
+
 Error ConfigurePort(Controller &xhc, Port &port);
 Error ConfigureEndpoints(Controller &xhc, Device &dev);
 
+/** @brief hub のスロットコンテキストにハブの情報（ポート数と TT の設定）を書き込む． */
+Error ConfigureHub(Controller &xhc, Device &hub, const usb::HubConfig &config);
+/** @brief hub のポートへの接続を受け付け，順番が来たらハブにポートのリセットを依頼する． */
+Error OnHubPortConnected(Controller &xhc, Device &hub, uint8_t port_num);
+/** @brief hub のポートのリセットが完了したので，スロットを割り当ててアドレスを設定する． */
+Error OnHubPortReset(Controller &xhc, Device &hub, uint8_t port_num, usb::DeviceSpeed speed);
+Error OnHubPortDisconnected(Controller &xhc, Device &hub, uint8_t port_num);
+
+// 以下は設定済みのデバイスに対するコマンド．完了すると callback が context とともに呼ばれる．
+// Command Ring に空きが無ければ kRingFull を返し，何も発行しない．
+
+/** @brief dev の入力コンテキスト（呼び出し側が Add Context フラグを設定したもの）で
+ * スロットコンテキストや EP0 のコンテキストを更新する Evaluate Context を発行する．
+ */
+Error EvaluateContext(Controller &xhc, Device &dev, Controller::CommandCallbackType *callback,
+                      uintptr_t context);
+/** @brief dev のエンドポイント dci の転送を止める Stop Endpoint を発行する． */
+Error StopEndpoint(Controller &xhc, Device &dev, DeviceContextIndex dci,
+                   Controller::CommandCallbackType *callback, uintptr_t context);
+/** @brief Halted になった dev のエンドポイント dci を Stopped に戻す Reset Endpoint を発行する． */
+Error ResetEndpoint(Controller &xhc, Device &dev, DeviceContextIndex dci,
+                    Controller::CommandCallbackType *callback, uintptr_t context);
+/** @brief dev のエンドポイント dci（ストリームを使うなら stream_id 番のストリーム）の
+ * TR Dequeue Pointer を dequeue に移す Set TR Dequeue Pointer を発行する．
+ *
+ * エンドポイントは Stopped でなければならない．cycle は dequeue の位置のサイクル・ステート．
+ */
+Error SetTRDequeuePointer(Controller &xhc, Device &dev, DeviceContextIndex dci,
+                          uint16_t stream_id, const TRB *dequeue, bool cycle,
+                          Controller::CommandCallbackType *callback, uintptr_t context);
+/** @brief Halted になった dev のエンドポイント dci を Reset Endpoint で Stopped に戻し，
+ * Set TR Dequeue Pointer で dequeue（失敗した TD の次）へ進めてから転送を再開させる．
+ *
+ * 2 つのコマンドを続けて積むので，Command Ring に 2 つの空きが無ければ kRingFull を返す．
+ */
+Error RecoverHaltedEndpoint(Controller &xhc, Device &dev, DeviceContextIndex dci,
+                            uint16_t stream_id, const TRB *dequeue, bool cycle);
+/** @brief dev のエンドポイント dci を Stop Endpoint で止め，Set TR Dequeue Pointer で
+ * stream_id 番のストリームを dequeue まで進めて，その間の TD を取り消してから再開させる．
+ *
+ * 2 つのコマンドを続けて積むので，Command Ring に 2 つの空きが無ければ kRingFull を返す．
+ */
+Error CancelTransfers(Controller &xhc, Device &dev, DeviceContextIndex dci, uint16_t stream_id,
+                      const TRB *dequeue, bool cycle);
+
 /** @brief イベントリングに登録されたイベントを高々1つ処理する．
  *
  * xhc のプライマリイベントリングの先頭のイベントを処理する．
@@ -62,4 +375,26 @@ Error ConfigureEndpoints(Controller &xhc, Device &dev);
  * @return イベントを正常に処理できたら Error::kSuccess
  */
 Error ProcessEvent(Controller &xhc);
+
+/** @brief イベントリングに登録されたイベントを高々 max_events 個まとめて処理する．
+ *
+ * イベントごとのエラーはログに記録して処理を続ける．
+ * ERDP への書き込みは最後に 1 回だけ行う．
+ *
+ * @return 処理したイベントの数．max_events 未満ならイベントリングは空になっている．
+ */
+size_t ProcessEvents(Controller &xhc, size_t max_events);
+
+/** @brief interrupter 番目のイベントリングのイベントを高々 max_events 個まとめて処理する． */
+size_t ProcessEvents(Controller &xhc, uint16_t interrupter, size_t max_events);
+
+/** @brief 時間内に終わらなかったポートのリセットを打ち切り，次のポートの処理に進む．
+ *
+ * 制限時間を過ぎたコマンドもここで中断させる．
+ * Command Ring が一杯で発行できなかった，切断されたデバイスの Disable Slot もここで発行する．
+ * 起動後は一定間隔で呼び出すこと．
+ *
+ * @param now_ms  現在時刻（ミリ秒）．PollBringUp に渡したものと同じ時計を使う．
+ */
+Error CheckTimeouts(Controller &xhc, uint64_t now_ms);
 } // namespace usb::xhci
@@ -0,0 +1,70 @@
+/**
+ * @file host/bench_enumeration.cpp
+ *
+ * キーボードをつないでから，クラスドライバが割り込み IN 転送を始めるまでの時間を測る．
+ *
+ * ディスクリプタのキャッシュに無い状態（cold）と，同じデバイスをつなぎ直してキャッシュが
+ * 効く状態（warm）を交互に測る．各回の後にデバイスを外し，スロットが解放されるのを待つ．
+ */
+
+#include "harness.hpp"
+#include "keyboard_model.hpp"
+#include "usb/descriptor_cache.hpp"
+#include "usb/device.hpp"
+
+#include <cstdio>
+
+namespace {
+const int kRounds = 200;
+
+bool Enumerate(sim::Harness &h, sim::Samples &samples, bool cold) {
+  if (cold) {
+    usb::EvictCachedConfiguration({sim::BootKeyboard::kVendorID,
+                                   sim::BootKeyboard::kDefaultProductID, 0x0100,
+                                   usb::DeviceSpeed::kFull});
+  }
+
+  sim::BootKeyboard keyboard;
+  const uint64_t start = sim::NowNs();
+  h.Model().Attach(1, &keyboard);
+  if (!h.PumpUntil([&keyboard] { return keyboard.Polled(); })) {
+    fprintf(stderr, "the keyboard was not configured\n");
+    return false;
+  }
+  samples.Add(sim::NowNs() - start);
+
+  if (keyboard.Configuration() != 1 || keyboard.Protocol() != 0) {
+    fprintf(stderr, "unexpected state: configuration %d, protocol %d\n", keyboard.Configuration(),
+            keyboard.Protocol());
+    return false;
+  }
+
+  h.Model().Detach(1);
+  if (!h.PumpUntil([&h] { return h.Model().NumEnabledSlots() == 0; })) {
+    fprintf(stderr, "the slot was not released\n");
+    return false;
+  }
+  return true;
+}
+} // namespace
+
+int main() {
+  sim::Harness h;
+  if (!h.BringUp()) {
+    return 1;
+  }
+
+  sim::Samples cold, warm;
+  for (int i = 0; i < kRounds; ++i) {
+    if (!Enumerate(h, cold, true) || !Enumerate(h, warm, false)) {
+      return 1;
+    }
+  }
+  cold.Print("enumeration (cold cache)");
+  warm.Print("enumeration (warm cache)");
+  printf("model: %llu commands, %llu transfer TRBs, %llu events\n",
+         static_cast<unsigned long long>(h.Model().Stats().commands),
+         static_cast<unsigned long long>(h.Model().Stats().transfer_trbs),
+         static_cast<unsigned long long>(h.Model().Stats().events));
+  return 0;
+}
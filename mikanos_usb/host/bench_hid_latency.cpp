@@ -0,0 +1,75 @@
+/**
+ * @file host/bench_hid_latency.cpp
+ *
+ * キーボードのレポートが入力キューの通知関数（カーネルでは Rust 側の受け手を起こす）に
+ * 届くまでの時間を測る．
+ *
+ * - event → observer：モデルが Transfer Event を書き込んだ直後から．ドライバの処理だけ．
+ * - report → observer：モデルがレポートを転送する Step() の前から．
+ *
+ * 毎回キューを空にしてから次のレポートを送るので，毎回通知関数が呼ばれる．
+ */
+
+#include "harness.hpp"
+#include "keyboard_model.hpp"
+#include "usb/input_queue.hpp"
+
+#include <cstdio>
+
+namespace {
+const int kRounds = 20000;
+const uint8_t kKeycode = 0x04;
+
+uint64_t notified_at = 0;
+
+void OnInput(uint32_t queue_id) {
+  if (queue_id == static_cast<uint32_t>(usb::InputQueueID::kKeyboard)) {
+    notified_at = sim::NowNs();
+  }
+}
+} // namespace
+
+int main() {
+  sim::Harness h;
+  sim::BootKeyboard keyboard;
+  h.Model().Attach(1, &keyboard);
+  if (!h.BringUp() || !h.PumpUntil([&keyboard] { return keyboard.Polled(); })) {
+    fprintf(stderr, "the keyboard was not configured\n");
+    return 1;
+  }
+
+  auto queue = usb::GetInputQueue(usb::InputQueueID::kKeyboard);
+  queue->tail.store(queue->head.load());
+  usb::SetInputQueueNotifier(OnInput);
+
+  sim::Samples from_event, from_report;
+  for (int i = 0; i < kRounds; ++i) {
+    const bool press = i % 2 == 0;
+    keyboard.QueueReport(0, {press ? kKeycode : uint8_t{0}});
+    notified_at = 0;
+
+    const uint64_t report_at = sim::NowNs();
+    h.Model().Step();
+    const uint64_t event_at = sim::NowNs();
+    usb::xhci::ProcessEvents(h.Controller(), 0, 64);
+
+    const uint32_t head = queue->head.load(std::memory_order_acquire);
+    const uint32_t tail = queue->tail.load();
+    if (notified_at == 0 || head - tail != 1) {
+      fprintf(stderr, "round %d: notified %d, %u records\n", i, notified_at != 0, head - tail);
+      return 1;
+    }
+    const auto &record = queue->records[tail % usb::InputQueue::kCapacity];
+    if (record.keycode != kKeycode || record.released != !press) {
+      fprintf(stderr, "round %d: keycode %u, released %u\n", i, record.keycode, record.released);
+      return 1;
+    }
+    queue->tail.store(head, std::memory_order_release);
+
+    from_event.Add(notified_at - event_at);
+    from_report.Add(notified_at - report_at);
+  }
+  from_event.Print("HID event -> observer");
+  from_report.Print("HID report -> observer");
+  return 0;
+}
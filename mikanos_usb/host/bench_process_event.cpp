@@ -0,0 +1,107 @@
+/**
+ * @file host/bench_process_event.cpp
+ *
+ * イベントリングからイベントを取り出して処理する速さを測る．
+ *
+ * - キーボードのレポート：Transfer Event を受けて HID ドライバがレポートを解釈し，
+ *   次の転送を積み直すまで．モデルの Step() は計測に含めない．
+ * - 未接続のポートの Port Status Change Event：ハンドラの仕事がほとんど無いので，
+ *   イベントの取り出しと振り分けにかかる時間がわかる．
+ */
+
+#include "harness.hpp"
+#include "keyboard_model.hpp"
+#include "usb/input_queue.hpp"
+
+#include <cstdio>
+
+namespace {
+const int kReportRounds = 5000;
+const int kDispatchRounds = 200;
+const uint8_t kIdlePort = 2;
+
+void DrainKeyboardQueue() {
+  auto queue = usb::GetInputQueue(usb::InputQueueID::kKeyboard);
+  queue->tail.store(queue->head.load(std::memory_order_acquire), std::memory_order_release);
+}
+
+bool BenchReports(sim::Harness &h, sim::BootKeyboard &keyboard) {
+  auto queue = usb::GetInputQueue(usb::InputQueueID::kKeyboard);
+  sim::Samples samples;
+  uint64_t num_events = 0;
+  for (int i = 0; i < kReportRounds; ++i) {
+    // 押す，離すを 2 回．どのレポートもキーの状態を変えるので 1 件ずつ入力になる．
+    keyboard.Tap(0x04);
+    keyboard.Tap(0x05);
+    const uint32_t head = queue->head.load();
+    const size_t posted = h.Model().Step();
+
+    const uint64_t start = sim::NowNs();
+    const size_t processed = usb::xhci::ProcessEvents(h.Controller(), 0, 64);
+    samples.Add(sim::NowNs() - start);
+
+    if (posted != 4 || processed != posted || queue->head.load() - head != 4) {
+      fprintf(stderr, "round %d: posted %zu, processed %zu, published %u\n", i, posted, processed,
+              queue->head.load() - head);
+      return false;
+    }
+    num_events += processed;
+    DrainKeyboardQueue();
+  }
+  samples.PrintPerOp("ProcessEvents (HID report)", 4);
+  printf("%-32s %llu events\n", "", static_cast<unsigned long long>(num_events));
+  return true;
+}
+
+bool BenchDispatch(sim::Harness &h) {
+  const size_t batch = h.Model().EventRingCapacity(0) - 1;
+  usb::xhci::PortStatusChangeEventTRB psc{};
+  psc.bits.port_id = kIdlePort;
+  psc.bits.completion_code = 1;
+
+  sim::Samples single, batched;
+  for (int i = 0; i < kDispatchRounds; ++i) {
+    for (size_t j = 0; j < batch; ++j) {
+      h.Model().PostEvent(0, usb::xhci::TRB{psc.data});
+    }
+    uint64_t start = sim::NowNs();
+    for (size_t j = 0; j < batch; ++j) {
+      if (auto err = usb::xhci::ProcessEvent(h.Controller())) {
+        fprintf(stderr, "ProcessEvent: %s\n", err.Name());
+        return false;
+      }
+    }
+    single.Add(sim::NowNs() - start);
+
+    for (size_t j = 0; j < batch; ++j) {
+      h.Model().PostEvent(0, usb::xhci::TRB{psc.data});
+    }
+    start = sim::NowNs();
+    const size_t processed = usb::xhci::ProcessEvents(h.Controller(), 0, batch);
+    batched.Add(sim::NowNs() - start);
+    if (processed != batch || h.Model().NumBacklogEvents() != 0) {
+      fprintf(stderr, "round %d: processed %zu of %zu events\n", i, processed, batch);
+      return false;
+    }
+  }
+  single.PrintPerOp("ProcessEvent (idle PSC)", batch);
+  batched.PrintPerOp("ProcessEvents (idle PSC)", batch);
+  return true;
+}
+} // namespace
+
+int main() {
+  sim::Harness h;
+  sim::BootKeyboard keyboard;
+  h.Model().Attach(1, &keyboard);
+  if (!h.BringUp() || !h.PumpUntil([&keyboard] { return keyboard.Polled(); })) {
+    fprintf(stderr, "the keyboard was not configured\n");
+    return 1;
+  }
+  DrainKeyboardQueue();
+
+  if (!BenchReports(h, keyboard) || !BenchDispatch(h)) {
+    return 1;
+  }
+  return 0;
+}
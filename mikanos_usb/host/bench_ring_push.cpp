@@ -0,0 +1,94 @@
+/**
+ * @file host/bench_ring_push.cpp
+ *
+ * Transfer Ring に TRB を積む Ring::Push と，複数の TRB を 1 つの TD として積む
+ * Ring::PushN の 1 回あたりの時間を測る．
+ *
+ * リングを満杯の手前まで積むごとに MarkConsumed で全て処理済みにするので，
+ * Link TRB をまたぐ周回も計測に含まれる．
+ */
+
+#include "harness.hpp"
+#include "usb/xhci/ring.hpp"
+#include "usb/xhci/trb.hpp"
+
+#include <cstdio>
+
+namespace {
+const size_t kRingSize = 256;
+const int kRounds = 4000;
+
+bool BenchPush(usb::xhci::Ring &ring) {
+  usb::xhci::NormalTRB trb{};
+  trb.bits.trb_transfer_length = 8;
+  trb.bits.interrupt_on_short_packet = true;
+  trb.bits.interrupt_on_completion = true;
+
+  const size_t batch = ring.FreeSlots();
+  sim::Samples samples;
+  for (int i = 0; i < kRounds; ++i) {
+    usb::xhci::TRB *last = nullptr;
+    const uint64_t start = sim::NowNs();
+    for (size_t j = 0; j < batch; ++j) {
+      last = ring.Push(trb);
+    }
+    samples.Add(sim::NowNs() - start);
+
+    if (ring.NumInFlight() != batch) {
+      fprintf(stderr, "round %d: %zu TRBs in flight, expected %zu\n", i, ring.NumInFlight(),
+              batch);
+      return false;
+    }
+    ring.MarkConsumed(last);
+  }
+  samples.PrintPerOp("Ring::Push (Normal TRB)", batch);
+  return true;
+}
+
+bool BenchPushN(usb::xhci::Ring &ring) {
+  // バルク転送の TD と同じく，chain でつないだ Normal TRB 2 つと Event Data TRB
+  usb::xhci::TRB td[3];
+  for (int i = 0; i < 2; ++i) {
+    usb::xhci::NormalTRB normal{};
+    normal.bits.trb_transfer_length = 512;
+    normal.bits.chain_bit = true;
+    td[i].data = normal.data;
+  }
+  usb::xhci::EventDataTRB event_data{};
+  event_data.bits.interrupt_on_completion = true;
+  td[2].data = event_data.data;
+
+  const size_t num_tds = ring.FreeSlots() / 3;
+  sim::Samples samples;
+  for (int i = 0; i < kRounds; ++i) {
+    usb::xhci::TRB *head = nullptr;
+    const uint64_t start = sim::NowNs();
+    for (size_t j = 0; j < num_tds; ++j) {
+      head = ring.PushN(td, 3);
+    }
+    samples.Add(sim::NowNs() - start);
+
+    if (ring.NumInFlight() != num_tds * 3) {
+      fprintf(stderr, "round %d: %zu TRBs in flight, expected %zu\n", i, ring.NumInFlight(),
+              num_tds * 3);
+      return false;
+    }
+    ring.MarkConsumed(ring.LastOfTD(head));
+  }
+  samples.PrintPerOp("Ring::PushN (3-TRB TD)", num_tds);
+  return true;
+}
+} // namespace
+
+int main() {
+  sim::SetUpHost();
+  usb::xhci::Ring ring;
+  if (auto err = ring.Initialize(kRingSize)) {
+    fprintf(stderr, "Ring::Initialize: %s\n", err.Name());
+    return 1;
+  }
+  if (!BenchPush(ring) || !BenchPushN(ring)) {
+    return 1;
+  }
+  return 0;
+}
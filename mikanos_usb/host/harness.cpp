@@ -0,0 +1,117 @@
+#include "harness.hpp"
+
+#include "logger.hpp"
+#include "usb/memory.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <sys/mman.h>
+
+namespace {
+const size_t kPoolSize = 4 * 1024 * 1024;
+
+void SetUpMemoryPool() {
+  // DCBAAP など 32 ビットのアドレスしか書けないレジスタがあるので，4 GiB 未満に割り当てる
+  void *pool = mmap(nullptr, kPoolSize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+  if (pool == MAP_FAILED) {
+    perror("mmap");
+    std::abort();
+  }
+  usb::SetMemoryPool(reinterpret_cast<uintptr_t>(pool), kPoolSize);
+}
+} // namespace
+
+namespace sim {
+uint64_t NowNs() {
+  const auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+void SetUpHost() {
+  static bool done = false;
+  if (done) {
+    return;
+  }
+  SetUpMemoryPool();
+  SetLogLevel(kWarn);
+  done = true;
+}
+
+Harness::Harness(uint16_t num_interrupters) : num_interrupters_{num_interrupters} {
+  SetUpHost();
+  auto xhc = usb::AllocArray<usb::xhci::Controller>(1, 64, 0);
+  if (xhc == nullptr) {
+    fprintf(stderr, "failed to allocate the controller\n");
+    std::abort();
+  }
+  xhc_ = new (xhc) usb::xhci::Controller{model_.MMIOBase()};
+}
+
+bool Harness::BringUp() {
+  if (auto err = xhc_->Initialize(num_interrupters_)) {
+    fprintf(stderr, "Initialize: %s\n", err.Name());
+    return false;
+  }
+  for (int i = 0; i < 1000 && !xhc_->IsRunning(); ++i) {
+    if (auto err = xhc_->PollBringUp(NowNs() / 1000000)) {
+      fprintf(stderr, "PollBringUp: %s\n", err.Name());
+      return false;
+    }
+    model_.Step();
+  }
+  if (!xhc_->IsRunning()) {
+    fprintf(stderr, "the controller did not start\n");
+    return false;
+  }
+
+  // cxx_xhci_controller_configure_connected_ports と同じく，接続済みのポートから始める
+  for (int i = 1; i <= xhc_->MaxPorts(); ++i) {
+    auto port = xhc_->PortAt(i);
+    if (port.IsConnected()) {
+      if (auto err = ConfigurePort(*xhc_, port)) {
+        fprintf(stderr, "ConfigurePort(%d): %s\n", i, err.Name());
+      }
+    }
+  }
+  return true;
+}
+
+size_t Harness::Pump() {
+  model_.Step();
+  size_t num_events = 0;
+  for (uint16_t i = 0; i < xhc_->NumInterrupters(); ++i) {
+    num_events += usb::xhci::ProcessEvents(*xhc_, i, 64);
+  }
+  return num_events;
+}
+
+void Samples::Print(const char *name) const {
+  PrintPerOp(name, 0);
+}
+
+void Samples::PrintPerOp(const char *name, uint64_t num_ops) const {
+  if (values_.empty()) {
+    printf("%-32s no samples\n", name);
+    return;
+  }
+  auto sorted = values_;
+  std::sort(sorted.begin(), sorted.end());
+  uint64_t sum = 0;
+  for (auto v : sorted) {
+    sum += v;
+  }
+  const double scale = num_ops == 0 ? 1000.0 : static_cast<double>(num_ops);
+  const char *unit = num_ops == 0 ? "us" : "ns/op";
+  const auto at = [&sorted](double q) {
+    return sorted[static_cast<size_t>(q * (sorted.size() - 1))];
+  };
+  printf("%-32s n=%-6zu min %8.3f  median %8.3f  mean %8.3f  p99 %8.3f  max %8.3f %s\n", name,
+         sorted.size(), sorted.front() / scale, at(0.5) / scale,
+         static_cast<double>(sum) / sorted.size() / scale, at(0.99) / scale, sorted.back() / scale,
+         unit);
+}
+} // namespace sim
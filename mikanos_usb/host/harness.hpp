@@ -0,0 +1,76 @@
+/**
+ * @file host/harness.hpp
+ *
+ * XhciModel の上で usb::xhci::Controller を動かし，ベンチマークや試験から使うための道具．
+ *
+ * USB スタックはメモリプールやクラスドライバの状態を大域変数に持つので，
+ * Harness は 1 プロセスに 1 つだけ作る．
+ */
+
+#pragma once
+
+#include "usb/xhci/xhci.hpp"
+#include "xhci_model.hpp"
+
+#include <cstdint>
+#include <vector>
+
+namespace sim {
+/** @brief steady_clock のナノ秒 */
+uint64_t NowNs();
+
+/** @brief USB スタックのメモリプールを用意し，ログのしきい値を kWarn にする．何度呼んでもよい．
+ *
+ * Harness は自分で呼ぶので，Harness を使わずにリングなどを直接試すときに使う．
+ */
+void SetUpHost();
+
+class Harness {
+public:
+  explicit Harness(uint16_t num_interrupters = 1);
+  Harness(const Harness &) = delete;
+  Harness &operator=(const Harness &) = delete;
+
+  XhciModel &Model() { return model_; }
+  usb::xhci::Controller &Controller() { return *xhc_; }
+
+  /** @brief ホストコントローラを動かし，接続済みのポートの初期化を始める．失敗したら false． */
+  bool BringUp();
+
+  /** @brief モデルを 1 段進め，全てのインタラプタのイベントを処理する．
+   *
+   * @return 処理したイベントの数
+   */
+  size_t Pump();
+
+  /** @brief pred() が真になるまで Pump() する．max_rounds 回で真にならなければ false． */
+  template <typename F> bool PumpUntil(F pred, int max_rounds = 10000) {
+    for (int i = 0; i < max_rounds; ++i) {
+      if (pred()) {
+        return true;
+      }
+      Pump();
+    }
+    return pred();
+  }
+
+private:
+  XhciModel model_;
+  usb::xhci::Controller *xhc_;
+  uint16_t num_interrupters_;
+};
+
+/** @brief 計測値を集めて分布を表示する． */
+class Samples {
+public:
+  void Add(uint64_t ns) { values_.push_back(ns); }
+  size_t Size() const { return values_.size(); }
+  /** @brief 最小値，中央値，平均，99 パーセンタイル，最大値をマイクロ秒で表示する． */
+  void Print(const char *name) const;
+  /** @brief 分布を 1 操作あたりの値として，num_ops で割ってナノ秒で表示する． */
+  void PrintPerOp(const char *name, uint64_t num_ops) const;
+
+private:
+  std::vector<uint64_t> values_;
+};
+} // namespace sim
@@ -0,0 +1,107 @@
+#include "keyboard_model.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+// HID 1.11 の付録 B.1 にある，ブートプロトコルのキーボードのレポートディスクリプタ
+const uint8_t kReportDescriptor[] = {
+    0x05, 0x01, 0x09, 0x06, 0xa1, 0x01, 0x05, 0x07, 0x19, 0xe0, 0x29, 0xe7, 0x15,
+    0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01, 0x75, 0x08,
+    0x81, 0x01, 0x95, 0x05, 0x75, 0x01, 0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x91,
+    0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x01, 0x95, 0x06, 0x75, 0x08, 0x15, 0x00,
+    0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65, 0x81, 0x00, 0xc0,
+};
+
+const uint8_t kConfigDescriptor[] = {
+    // Configuration
+    9, 2, 34, 0, 1, 1, 0, 0xa0, 50,
+    // Interface: HID, Boot Interface Subclass, Keyboard
+    9, 4, 0, 0, 1, 3, 1, 1, 0,
+    // HID
+    9, 0x21, 0x11, 0x01, 0, 1, 0x22, sizeof(kReportDescriptor), 0,
+    // Endpoint 1 IN, Interrupt, 8 bytes, 10 ms
+    7, 5, 0x81, 3, 8, 0, 10,
+};
+
+const int kGetDescriptor = 6;
+const int kSetConfiguration = 9;
+const int kSetReport = 9;
+const int kSetIdle = 10;
+const int kSetProtocol = 11;
+
+int CopyOut(uint8_t *data, int len, const uint8_t *src, size_t src_len) {
+  const int n = std::min<int>(len, src_len);
+  memcpy(data, src, n);
+  return n;
+}
+} // namespace
+
+namespace sim {
+BootKeyboard::BootKeyboard(uint16_t product_id) : product_id_{product_id} {}
+
+int BootKeyboard::Control(const usb::SetupData &setup, uint8_t *data, int len) {
+  const auto type = setup.request_type.bits.type;
+  const bool in = setup.request_type.bits.direction;
+
+  if (type == usb::request_type::kStandard && in && setup.request == kGetDescriptor) {
+    switch (setup.value >> 8) {
+    case usb::descriptor_type::kDevice: {
+      const uint8_t desc[] = {
+          18, 1, 0x00, 0x02, 0, 0, 0, 8,
+          kVendorID & 0xff, kVendorID >> 8, static_cast<uint8_t>(product_id_ & 0xff),
+          static_cast<uint8_t>(product_id_ >> 8), 0x00, 0x01, 0, 0, 0, 1,
+      };
+      return CopyOut(data, len, desc, sizeof(desc));
+    }
+    case usb::descriptor_type::kConfiguration:
+      return CopyOut(data, len, kConfigDescriptor, sizeof(kConfigDescriptor));
+    case usb::descriptor_type::kReport:
+      return CopyOut(data, len, kReportDescriptor, sizeof(kReportDescriptor));
+    default:
+      return -1;
+    }
+  }
+  if (type == usb::request_type::kStandard && !in && setup.request == kSetConfiguration) {
+    configuration_ = setup.value & 0xff;
+    return 0;
+  }
+  if (type == usb::request_type::kClass && !in) {
+    switch (setup.request) {
+    case kSetProtocol:
+      protocol_ = setup.value;
+      return 0;
+    case kSetIdle:
+      return 0;
+    case kSetReport: // LED の状態．受け取って捨てる．
+      return len;
+    }
+  }
+  return -1;
+}
+
+int BootKeyboard::In(int ep_num, uint8_t *buf, int len) {
+  if (ep_num != 1) {
+    return -1;
+  }
+  polled_ = true;
+  if (reports_.empty()) {
+    return -1;
+  }
+  const auto &report = reports_.front();
+  const int n = CopyOut(buf, len, report.data(), report.size());
+  reports_.pop_front();
+  return n;
+}
+
+void BootKeyboard::QueueReport(uint8_t modifier, std::array<uint8_t, 6> keys) {
+  std::array<uint8_t, 8> report{modifier, 0};
+  std::copy(keys.begin(), keys.end(), report.begin() + 2);
+  reports_.push_back(report);
+}
+
+void BootKeyboard::Tap(uint8_t keycode) {
+  QueueReport(0, {keycode});
+  QueueReport(0, {});
+}
+} // namespace sim
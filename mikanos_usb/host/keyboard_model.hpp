@@ -0,0 +1,47 @@
+/**
+ * @file host/keyboard_model.hpp
+ *
+ * ブートプロトコルに対応した Full Speed の USB キーボードのモデル．
+ */
+
+#pragma once
+
+#include "xhci_model.hpp"
+
+#include <array>
+#include <cstdint>
+#include <deque>
+
+namespace sim {
+class BootKeyboard : public FunctionModel {
+public:
+  static const uint16_t kVendorID = 0x1209;
+  static const uint16_t kDefaultProductID = 0x0001;
+
+  /** @brief product_id を変えると，ドライバのディスクリプタのキャッシュには別のデバイスに見える． */
+  explicit BootKeyboard(uint16_t product_id = kDefaultProductID);
+
+  int Speed() const override { return 1; }
+  int Control(const usb::SetupData &setup, uint8_t *data, int len) override;
+  int In(int ep_num, uint8_t *buf, int len) override;
+
+  /** @brief 次の割り込み IN 転送で返すレポートを積む． */
+  void QueueReport(uint8_t modifier, std::array<uint8_t, 6> keys);
+  /** @brief keycode のキーだけが押されたレポートと，全て離したレポートを積む． */
+  void Tap(uint8_t keycode);
+  size_t NumQueuedReports() const { return reports_.size(); }
+
+  /** @brief 割り込み IN エンドポイントが一度でもポーリングされたか */
+  bool Polled() const { return polled_; }
+  /** @brief SET_PROTOCOL で選ばれたプロトコル（0: ブート，1: レポート） */
+  int Protocol() const { return protocol_; }
+  int Configuration() const { return configuration_; }
+
+private:
+  uint16_t product_id_;
+  int configuration_ = 0;
+  int protocol_ = 1;
+  bool polled_ = false;
+  std::deque<std::array<uint8_t, 8>> reports_;
+};
+} // namespace sim
@@ -0,0 +1,79 @@
+/**
+ * @file host/record_trace.cpp
+ *
+ * replay_keyboard が使う記録 host/traces/keyboard_enumeration.trace を作り直す．
+ *
+ *   record_trace host/traces/keyboard_enumeration.trace
+ *
+ * キーボードをつないで割り込み IN 転送が始まるのを待ち，0x04, 0x05 のキーを順に押して離し，
+ * デバイスを外してスロットが解放されるまでのイベントを記録する．
+ * ドライバの変更で記録と食い違うようになり，それが意図した変更なら作り直して入れ替える．
+ */
+
+#include "harness.hpp"
+#include "keyboard_model.hpp"
+#include "replay.hpp"
+#include "usb/xhci/event_trace.hpp"
+
+#include <cstdio>
+#include <vector>
+
+namespace {
+const char kHeader[] =
+    "# BootKeyboard (1209:0001, full speed) on port 1: enumeration, Tap(0x04), Tap(0x05),\n"
+    "# then detach. Regenerate with record_trace; replayed by replay_keyboard.\n";
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+    return 2;
+  }
+
+  sim::Harness h;
+  if (!h.BringUp()) {
+    return 1;
+  }
+  usb::xhci::ResetEventTrace();
+  if (!usb::xhci::SetEventTraceEnabled(true)) {
+    fprintf(stderr, "built without MIKANOS_USB_EVENT_TRACE\n");
+    return 1;
+  }
+
+  sim::BootKeyboard keyboard;
+  h.Model().Attach(1, &keyboard);
+  if (!h.PumpUntil([&keyboard] { return keyboard.Polled(); })) {
+    fprintf(stderr, "the keyboard was not configured\n");
+    return 1;
+  }
+  keyboard.Tap(0x04);
+  keyboard.Tap(0x05);
+  if (!h.PumpUntil([&keyboard] { return keyboard.NumQueuedReports() == 0; })) {
+    fprintf(stderr, "the reports were not sent\n");
+    return 1;
+  }
+  // 最後のレポートの Transfer Event を処理させる
+  h.Pump();
+  h.Model().Detach(1);
+  if (!h.PumpUntil([&h] { return h.Model().NumEnabledSlots() == 0; })) {
+    fprintf(stderr, "the slot was not released\n");
+    return 1;
+  }
+  usb::xhci::SetEventTraceEnabled(false);
+
+  std::vector<usb::xhci::EventTraceRecord> records;
+  usb::xhci::EventTraceRecord record;
+  while (usb::xhci::ReadEventTrace(&record, 1) == 1) {
+    records.push_back(record);
+  }
+  if (usb::xhci::EventTraceDropped() != 0) {
+    fprintf(stderr, "%llu records were dropped\n",
+            static_cast<unsigned long long>(usb::xhci::EventTraceDropped()));
+    return 1;
+  }
+  if (!sim::SaveEventTrace(argv[1], kHeader, records)) {
+    return 1;
+  }
+  printf("recorded %zu events to %s\n", records.size(), argv[1]);
+  return 0;
+}
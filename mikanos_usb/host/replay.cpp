@@ -0,0 +1,155 @@
+#include "replay.hpp"
+
+#include "usb/xhci/trb.hpp"
+
+#include <cinttypes>
+#include <cstdio>
+
+namespace {
+using usb::xhci::EventTraceRecord;
+using usb::xhci::TRB;
+
+// Stopped, Stopped - Length Invalid, Stopped - Short Packet
+bool IsStoppedCode(uint8_t code) { return code == 26 || code == 27 || code == 28; }
+
+void Diverged(size_t index, const EventTraceRecord &record, const char *reason) {
+  const TRB trb{record.trb};
+  fprintf(stderr, "record %zu (type %u, slot %u, code %u): %s\n", index, trb.bits.trb_type,
+          record.trb[3] >> 24, record.trb[2] >> 24, reason);
+}
+} // namespace
+
+namespace sim {
+bool LoadEventTrace(const char *path, std::vector<EventTraceRecord> &records) {
+  FILE *file = fopen(path, "r");
+  if (file == nullptr) {
+    perror(path);
+    return false;
+  }
+
+  char line[256];
+  int line_num = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), file) != nullptr) {
+    ++line_num;
+    if (line[0] == '#' || line[0] == '\n') {
+      continue;
+    }
+    EventTraceRecord record{};
+    unsigned int interrupter;
+    if (sscanf(line, "%" SCNx64 " %x %" SCNx32 " %" SCNx32 " %" SCNx32 " %" SCNx32 " %" SCNx32,
+               &record.tsc, &interrupter, &record.portsc, &record.trb[0], &record.trb[1],
+               &record.trb[2], &record.trb[3]) != 7) {
+      fprintf(stderr, "%s:%d: malformed record\n", path, line_num);
+      ok = false;
+      break;
+    }
+    record.interrupter = interrupter;
+    records.push_back(record);
+  }
+  fclose(file);
+  return ok;
+}
+
+bool SaveEventTrace(const char *path, const char *header,
+                    const std::vector<EventTraceRecord> &records) {
+  FILE *file = fopen(path, "w");
+  if (file == nullptr) {
+    perror(path);
+    return false;
+  }
+  fputs(header, file);
+  fputs("# tsc interrupter portsc trb[0] trb[1] trb[2] trb[3]\n", file);
+  for (const auto &r : records) {
+    fprintf(file, "%016" PRIx64 " %04x %08" PRIx32 " %08" PRIx32 " %08" PRIx32 " %08" PRIx32
+                  " %08" PRIx32 "\n",
+            r.tsc, r.interrupter, r.portsc, r.trb[0], r.trb[1], r.trb[2], r.trb[3]);
+  }
+  return fclose(file) == 0;
+}
+
+TraceReplayer::TraceReplayer(Harness &h) : h_{h} { h_.Model().SetReplaying(true); }
+
+TraceReplayer::~TraceReplayer() { h_.Model().SetReplaying(false); }
+
+bool TraceReplayer::Replay(const std::vector<EventTraceRecord> &records) {
+  auto &xhc = h_.Controller();
+  for (size_t i = 0; i < records.size(); ++i) {
+    const auto &record = records[i];
+    // 前のイベントを受けてドライバが積んだ TRB をモデルに読ませる
+    h_.Model().Step();
+
+    TRB trb{record.trb};
+    if (!Translate(i, record, trb)) {
+      return false;
+    }
+
+    const uint16_t interrupter =
+        record.interrupter < xhc.NumInterrupters() ? record.interrupter : 0;
+    h_.Model().PostEvent(interrupter, trb);
+    if (usb::xhci::ProcessEvents(xhc, interrupter, 1) != 1) {
+      Diverged(i, record, "the event ring was full");
+      return false;
+    }
+    ++num_replayed_;
+  }
+  return true;
+}
+
+bool TraceReplayer::Translate(size_t index, const EventTraceRecord &record, TRB &trb) {
+  auto &model = h_.Model();
+  switch (trb.bits.trb_type) {
+  case usb::xhci::PortStatusChangeEventTRB::Type: {
+    const uint8_t port_id =
+        reinterpret_cast<const usb::xhci::PortStatusChangeEventTRB &>(trb).bits.port_id;
+    if (port_id == 0 || port_id > XhciModel::kMaxPorts) {
+      Diverged(index, record, "no such port");
+      return false;
+    }
+    model.ReplayPortStatus(port_id, record.portsc);
+    return true;
+  }
+  case usb::xhci::CommandCompletionEventTRB::Type: {
+    auto &event = reinterpret_cast<usb::xhci::CommandCompletionEventTRB &>(trb);
+    const uint8_t code = event.bits.completion_code;
+    TRB *command;
+    const uint8_t model_code = model.CompleteCommand(event.bits.slot_id, code, command);
+    if (command == nullptr) {
+      Diverged(index, record, "no command is waiting for completion");
+      return false;
+    }
+    if (model_code != code) {
+      fprintf(stderr, "the model completed the command with code %u\n", model_code);
+      Diverged(index, record, "the model disagrees with the recorded completion");
+      return false;
+    }
+    event.SetPointer(command);
+    return true;
+  }
+  case usb::xhci::TransferEventTRB::Type: {
+    auto &event = reinterpret_cast<usb::xhci::TransferEventTRB &>(trb);
+    if (IsStoppedCode(event.bits.completion_code)) {
+      // ドライバは止めた位置を使わないので，記録したときのアドレスを残さないだけにする
+      event.bits.trb_pointer = 0;
+      event.bits.event_data = false;
+      return true;
+    }
+    TRB completed;
+    if (!model.TakeTransferEvent(event.bits.slot_id, event.bits.endpoint_id, completed)) {
+      Diverged(index, record, "no transfer has completed on the endpoint");
+      return false;
+    }
+    const auto &live = reinterpret_cast<const usb::xhci::TransferEventTRB &>(completed);
+    if (live.bits.event_data != event.bits.event_data) {
+      Diverged(index, record, "the completed TRB is not the recorded kind");
+      return false;
+    }
+    event.bits.trb_pointer = live.bits.trb_pointer;
+    return true;
+  }
+  default:
+    // ポインタを含まないイベントは記録のまま書き込む
+    return true;
+  }
+}
+} // namespace sim
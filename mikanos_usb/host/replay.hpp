@@ -0,0 +1,61 @@
+/**
+ * @file host/replay.hpp
+ *
+ * イベントの記録（usb::xhci::EventTraceRecord の列）を，Harness の上で動くドライバに
+ * 記録した順に流し直す道具．
+ *
+ * 記録には TRB を指すポインタが記録したときのアドレスのまま入っているので，そのままでは
+ * 使えない．XhciModel を再生モードで動かしてドライバが積んだ TRB を読ませ，
+ * 記録のポインタを今回ドライバが積んだ TRB のものに置き換えてから書き込む．
+ * 完了コード，転送の残り長さ，スロット番号，PORTSC は記録のものを使う．
+ *
+ * 記録にはデータが入っていないので，ディスクリプタやレポートはポートにつないだ
+ * FunctionModel が返す．記録したときと同じように振る舞うモデルをつなぐこと．
+ */
+
+#pragma once
+
+#include "harness.hpp"
+#include "usb/xhci/event_trace.hpp"
+
+#include <cstddef>
+#include <vector>
+
+namespace sim {
+/** @brief path の記録を読み込む．読めなければメッセージを表示して false．
+ *
+ * 1 行が 1 つのレコードで，tsc, interrupter, portsc, trb[0..3] を 16 進で並べる．
+ * '#' で始まる行と空行は読み飛ばす．
+ */
+bool LoadEventTrace(const char *path, std::vector<usb::xhci::EventTraceRecord> &records);
+
+/** @brief records を LoadEventTrace で読める形式で path に書き出す．header は先頭のコメント． */
+bool SaveEventTrace(const char *path, const char *header,
+                    const std::vector<usb::xhci::EventTraceRecord> &records);
+
+class TraceReplayer {
+public:
+  /** @brief h のモデルを再生モードにする．BringUp() の後に作ること． */
+  explicit TraceReplayer(Harness &h);
+  ~TraceReplayer();
+  TraceReplayer(const TraceReplayer &) = delete;
+  TraceReplayer &operator=(const TraceReplayer &) = delete;
+
+  /** @brief records を 1 つずつ書き込み，その都度ドライバにイベントを処理させる．
+   *
+   * ドライバの動きが記録と食い違ったら（完了するはずのコマンドや転送が無い，
+   * モデルがコマンドを記録と違う結果で終えた），その位置を表示して false を返す．
+   */
+  bool Replay(const std::vector<usb::xhci::EventTraceRecord> &records);
+
+  /** @brief 書き込んで処理させたレコードの数 */
+  size_t NumReplayed() const { return num_replayed_; }
+
+private:
+  Harness &h_;
+  size_t num_replayed_ = 0;
+
+  /** @brief trb（index 番目のレコード）のポインタを今回積まれた TRB のものに置き換える． */
+  bool Translate(size_t index, const usb::xhci::EventTraceRecord &record, usb::xhci::TRB &trb);
+};
+} // namespace sim
@@ -0,0 +1,93 @@
+/**
+ * @file host/replay_keyboard.cpp
+ *
+ * record_trace で記録したキーボードの列挙のイベントを流し直し，ドライバが記録と同じ順に
+ * コマンドと転送を発行し，同じ結果になるかを確かめる回帰試験．
+ *
+ *   replay_keyboard host/traces/keyboard_enumeration.trace
+ *
+ * 記録のとおりにキーボードが設定され，押して離した 2 つのキーが入力キューに届き，
+ * 外したデバイスのスロットが解放されていれば成功．
+ */
+
+#include "harness.hpp"
+#include "keyboard_model.hpp"
+#include "replay.hpp"
+#include "usb/input_queue.hpp"
+
+#include <cstdio>
+#include <vector>
+
+namespace {
+const uint8_t kKeycodes[] = {0x04, 0x05};
+
+bool CheckInputs() {
+  auto queue = usb::GetInputQueue(usb::InputQueueID::kKeyboard);
+  const uint32_t head = queue->head.load(std::memory_order_acquire);
+  uint32_t tail = queue->tail.load();
+  if (head - tail != 2 * sizeof(kKeycodes)) {
+    fprintf(stderr, "%u keyboard records, expected %zu\n", head - tail, 2 * sizeof(kKeycodes));
+    return false;
+  }
+  for (auto keycode : kKeycodes) {
+    for (int released = 0; released < 2; ++released, ++tail) {
+      const auto &record = queue->records[tail % usb::InputQueue::kCapacity];
+      if (record.keycode != keycode || record.released != released) {
+        fprintf(stderr, "record %u: keycode %u, released %u\n", tail, record.keycode,
+                record.released);
+        return false;
+      }
+    }
+  }
+  queue->tail.store(tail, std::memory_order_release);
+  return true;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+    return 2;
+  }
+  std::vector<usb::xhci::EventTraceRecord> records;
+  if (!sim::LoadEventTrace(argv[1], records)) {
+    return 1;
+  }
+
+  sim::Harness h;
+  if (!h.BringUp()) {
+    return 1;
+  }
+  sim::TraceReplayer replayer{h};
+  // 記録したときと同じデバイスとレポートを用意する．イベントは記録から書き込む．
+  sim::BootKeyboard keyboard;
+  h.Model().Attach(1, &keyboard);
+  for (auto keycode : kKeycodes) {
+    keyboard.Tap(keycode);
+  }
+
+  if (!replayer.Replay(records)) {
+    return 1;
+  }
+  bool ok = CheckInputs();
+  if (keyboard.Configuration() != 1 || keyboard.Protocol() != 0 || !keyboard.Polled()) {
+    fprintf(stderr, "unexpected state: configuration %d, protocol %d, polled %d\n",
+            keyboard.Configuration(), keyboard.Protocol(), keyboard.Polled());
+    ok = false;
+  }
+  if (h.Model().NumEnabledSlots() != 0 || h.Model().NumPendingCommands() != 0) {
+    fprintf(stderr, "%d slots enabled, %zu commands not completed\n",
+            h.Model().NumEnabledSlots(), h.Model().NumPendingCommands());
+    ok = false;
+  }
+  if (h.Controller().Stats().event_errors != 0) {
+    fprintf(stderr, "%llu events failed\n",
+            static_cast<unsigned long long>(h.Controller().Stats().event_errors));
+    ok = false;
+  }
+  if (!ok) {
+    return 1;
+  }
+  printf("replayed %zu events\n", replayer.NumReplayed());
+  return 0;
+}
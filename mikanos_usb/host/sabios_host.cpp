@@ -0,0 +1,33 @@
+/**
+ * @file host/sabios_host.cpp
+ *
+ * カーネルが USB スタックに提供する関数（cxx_support.h）のホスト向けの実装．
+ */
+
+#include "cxx_support.h"
+
+#include <cstdio>
+#include <sys/mman.h>
+
+extern "C" int32_t sabios_log(int32_t level, const char *file, size_t file_len, uint32_t line,
+                              const char *msg, size_t msg_len, bool cont_line) {
+  if (!cont_line) {
+    fprintf(stderr, "[%d] %.*s:%u: ", level, static_cast<int>(file_len), file, line);
+  }
+  fwrite(msg, 1, msg_len, stderr);
+  return 0;
+}
+
+extern "C" uintptr_t sabios_alloc_dma_frames(size_t num_frames) {
+  // DCBAAP など 32 ビットのアドレスしか書けないレジスタがあるので，4 GiB 未満に割り当てる
+  void *p = mmap(nullptr, num_frames * 4096, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+  if (p == MAP_FAILED) {
+    return 0;
+  }
+  return reinterpret_cast<uintptr_t>(p);
+}
+
+extern "C" void sabios_free_dma_frames(uintptr_t base, size_t num_frames) {
+  munmap(reinterpret_cast<void *>(base), num_frames * 4096);
+}
@@ -0,0 +1,1015 @@
+#include "xhci_model.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+using usb::xhci::TRB;
+
+// レジスタ空間の配置（CAPLENGTH, RTSOFF, DBOFF が指す先）
+const uintptr_t kCAPLENGTH = 0x00;
+const uintptr_t kHCSPARAMS1 = 0x04;
+const uintptr_t kHCSPARAMS2 = 0x08;
+const uintptr_t kHCCPARAMS1 = 0x10;
+const uintptr_t kDBOFF = 0x14;
+const uintptr_t kRTSOFF = 0x18;
+
+const uintptr_t kOperational = 0x20;
+const uintptr_t kUSBCMD = kOperational + 0x00;
+const uintptr_t kUSBSTS = kOperational + 0x04;
+const uintptr_t kPAGESIZE = kOperational + 0x08;
+const uintptr_t kCRCR = kOperational + 0x18;
+const uintptr_t kDCBAAP = kOperational + 0x30;
+const uintptr_t kCONFIG = kOperational + 0x38;
+const uintptr_t kPorts = kOperational + 0x400;
+
+const uintptr_t kRuntime = 0x1000;
+const uintptr_t kMFINDEX = kRuntime;
+const uintptr_t kInterrupters = kRuntime + 0x20;
+const uintptr_t kIMAN = 0x00;
+const uintptr_t kERSTSZ = 0x08;
+const uintptr_t kERSTBA = 0x10;
+const uintptr_t kERDP = 0x18;
+
+const uintptr_t kDoorbells = 0x2000;
+const size_t kNumDoorbells = 256;
+const size_t kMMIOSize = 0x3000;
+
+// USBCMD, USBSTS のビット
+const uint32_t kRunStop = 1u << 0;
+const uint32_t kHCReset = 1u << 1;
+const uint32_t kHCHalted = 1u << 0;
+const uint32_t kEventInterrupt = 1u << 3;
+const uint32_t kPortChangeDetect = 1u << 4;
+const uint32_t kUSBSTSWriteClear = 0x0000041cu; // HSE, EINT, PCD, SRE
+
+// CRCR のビット
+const uint64_t kRingCycleState = 1u << 0;
+const uint64_t kCommandStop = 1u << 1;
+const uint64_t kCommandAbort = 1u << 2;
+const uint64_t kCommandRingRunning = 1u << 3;
+
+// PORTSC のビット
+const uint32_t kCCS = 1u << 0;
+const uint32_t kPED = 1u << 1;
+const uint32_t kPR = 1u << 4;
+const uint32_t kPLSMask = 0xfu << 5;
+const uint32_t kPP = 1u << 9;
+const uint32_t kSpeedShift = 10;
+const uint32_t kLWS = 1u << 16;
+const uint32_t kCSC = 1u << 17;
+const uint32_t kPRC = 1u << 21;
+const uint32_t kPortChangeBits = 0x00fe0000u;
+const uint32_t kPortWritableBits = 0x0e00c200u; // PP, PIC, WCE, WDE, WOE
+const uint32_t kPLSU0 = 0;
+const uint32_t kPLSRxDetect = 5;
+const uint32_t kPLSPolling = 7;
+
+// IMAN のビット
+const uint32_t kInterruptPending = 1u << 0;
+const uint32_t kInterruptEnable = 1u << 1;
+
+// ERDP のビット
+const uint64_t kEventHandlerBusy = 1u << 3;
+
+// TRB の dword 3 のビット
+const uint32_t kCycle = 1u << 0;
+const uint32_t kToggleCycle = 1u << 1;
+const uint32_t kISP = 1u << 2;
+const uint32_t kChain = 1u << 4;
+const uint32_t kIOC = 1u << 5;
+const uint32_t kIDT = 1u << 6;
+
+// Address Device の BSR，Configure Endpoint の DC
+const uint32_t kBlockSetAddress = 1u << 9;
+const uint32_t kDeconfigure = 1u << 9;
+
+// スロットの状態
+const uint32_t kSlotDisabled = 0;
+const uint32_t kSlotDefault = 1;
+const uint32_t kSlotAddressed = 2;
+const uint32_t kSlotConfigured = 3;
+
+// 完了コード
+const uint8_t kSuccess = 1;
+const uint8_t kUSBTransactionError = 4;
+const uint8_t kTRBError = 5;
+const uint8_t kStallError = 6;
+const uint8_t kNoSlotsAvailable = 9;
+const uint8_t kSlotNotEnabled = 11;
+const uint8_t kShortPacket = 13;
+const uint8_t kContextStateError = 19;
+const uint8_t kCommandRingStopped = 24;
+const uint8_t kStopped = 26;
+
+/** @brief Event Ring Segment Table の 1 エントリ */
+struct ERSTEntry {
+  uint64_t base;
+  uint32_t size;
+  uint32_t reserved;
+};
+
+std::array<sim::XhciModel *, 4> models{};
+
+uint32_t ReadControl(const TRB *trb) {
+  return *reinterpret_cast<const volatile uint32_t *>(&trb->data[3]);
+}
+
+uint64_t Parameter(const TRB *trb) {
+  return static_cast<uint64_t>(trb->data[1]) << 32 | trb->data[0];
+}
+
+unsigned int TRBType(uint32_t control) { return (control >> 10) & 0x3fu; }
+
+uint8_t SlotOf(const TRB &command) { return command.data[3] >> 24; }
+
+int DCIOf(const TRB &command) { return (command.data[3] >> 16) & 0x1fu; }
+} // namespace
+
+void MMIOWriteHook(volatile void *reg, size_t) {
+  for (auto model : models) {
+    if (model != nullptr && model->Contains(reg)) {
+      model->OnWrite(reinterpret_cast<uintptr_t>(reg) - model->MMIOBase());
+      return;
+    }
+  }
+}
+
+namespace sim {
+XhciModel::XhciModel() {
+  mmio_ = static_cast<uint8_t *>(std::aligned_alloc(4096, kMMIOSize));
+  memset(mmio_, 0, kMMIOSize);
+
+  Reg32(kCAPLENGTH) = 0x01100000u | kOperational; // HCIVERSION 1.1
+  Reg32(kHCSPARAMS1) = kMaxSlots | (kMaxInterrupters << 8) | (uint32_t{kMaxPorts} << 24);
+  Reg32(kHCSPARAMS2) = 1u << 4; // ERST Max = 1, スクラッチパッドなし
+  Reg32(kHCCPARAMS1) = 1u;      // AC64．xECP = 0 なので USBLEGSUP は無い
+  Reg32(kDBOFF) = kDoorbells;
+  Reg32(kRTSOFF) = kRuntime;
+
+  for (auto &model : models) {
+    if (model == nullptr) {
+      model = this;
+      break;
+    }
+  }
+  Reset();
+}
+
+XhciModel::~XhciModel() {
+  for (auto &model : models) {
+    if (model == this) {
+      model = nullptr;
+    }
+  }
+  std::free(mmio_);
+}
+
+bool XhciModel::Contains(volatile void *reg) const {
+  const auto p = reinterpret_cast<uintptr_t>(reg);
+  return MMIOBase() <= p && p < MMIOBase() + kMMIOSize;
+}
+
+volatile uint32_t &XhciModel::Reg32(uintptr_t offset) const {
+  return *reinterpret_cast<volatile uint32_t *>(mmio_ + offset);
+}
+
+volatile uint64_t &XhciModel::Reg64(uintptr_t offset) const {
+  return *reinterpret_cast<volatile uint64_t *>(mmio_ + offset);
+}
+
+volatile uint32_t &XhciModel::PORTSC(uint8_t port_num) const {
+  return Reg32(kPorts + 0x10u * (port_num - 1));
+}
+
+void XhciModel::Reset() {
+  // 能力レジスタ以外を初期値に戻す
+  memset(mmio_ + kOperational, 0, kMMIOSize - kOperational);
+  SetStatus(kHCHalted);
+  Reg32(kPAGESIZE) = 1; // 4 KiB
+
+  running_ = false;
+  command_dequeue_ = nullptr;
+  command_cycle_ = false;
+  command_ring_running_ = false;
+  pending_commands_.clear();
+  for (auto &slot : slots_) {
+    slot = Slot{};
+  }
+  for (auto &interrupter : interrupters_) {
+    interrupter = Interrupter{};
+  }
+  for (uint8_t port_num = 1; port_num <= kMaxPorts; ++port_num) {
+    auto &port = ports_[port_num];
+    port.reset_pending = false;
+    uint32_t portsc = kPP | kPLSRxDetect << 5;
+    if (port.function != nullptr) {
+      portsc = kPP | kCCS | kCSC | kPLSPolling << 5 |
+               static_cast<uint32_t>(port.function->Speed()) << kSpeedShift;
+    }
+    port.portsc = portsc;
+    PORTSC(port_num) = portsc;
+  }
+}
+
+void XhciModel::SetStatus(uint32_t usbsts) {
+  usbsts_ = usbsts;
+  Reg32(kUSBSTS) = usbsts;
+}
+
+void XhciModel::OnWrite(uintptr_t offset) {
+  if (offset == kUSBCMD) {
+    OnUSBCMDWritten();
+  } else if (offset == kUSBSTS) {
+    SetStatus(usbsts_ & ~(Reg32(kUSBSTS) & kUSBSTSWriteClear));
+  } else if (offset == kCRCR) {
+    OnCRCRWritten();
+  } else if (kPorts <= offset && offset < kPorts + 0x10u * kMaxPorts) {
+    if ((offset - kPorts) % 0x10u == 0) {
+      OnPORTSCWritten((offset - kPorts) / 0x10u + 1);
+    }
+  } else if (kInterrupters <= offset && offset < kInterrupters + 0x20u * kMaxInterrupters) {
+    const uint16_t index = (offset - kInterrupters) / 0x20u;
+    const uintptr_t base = kInterrupters + 0x20u * index;
+    auto &interrupter = interrupters_[index];
+    switch (offset - base) {
+    case kIMAN: {
+      const uint32_t value = Reg32(offset);
+      interrupter.iman &= ~(value & kInterruptPending);
+      interrupter.iman = (interrupter.iman & ~kInterruptEnable) | (value & kInterruptEnable);
+      Reg32(offset) = interrupter.iman;
+      break;
+    }
+    case kERSTBA:
+      ResetEventRing(index);
+      break;
+    case kERDP:
+      Reg64(offset) = Reg64(offset) & ~kEventHandlerBusy;
+      break;
+    }
+  } else if (kDoorbells <= offset && offset < kDoorbells + 4 * kNumDoorbells) {
+    OnDoorbellWritten((offset - kDoorbells) / 4);
+  }
+}
+
+void XhciModel::OnUSBCMDWritten() {
+  const uint32_t usbcmd = Reg32(kUSBCMD);
+  if (usbcmd & kHCReset) {
+    Reset();
+    return;
+  }
+
+  const bool run = usbcmd & kRunStop;
+  if (run && !running_) {
+    running_ = true;
+    SetStatus(usbsts_ & ~kHCHalted);
+    // 動き出す前に起きていたポートの状態変化を通知する
+    for (uint8_t port_num = 1; port_num <= kMaxPorts && !replaying_; ++port_num) {
+      if (ports_[port_num].portsc & kPortChangeBits) {
+        PostPortStatusChange(port_num);
+      }
+    }
+  } else if (!run && running_) {
+    running_ = false;
+    command_ring_running_ = false;
+    Reg64(kCRCR) = 0;
+    SetStatus(usbsts_ | kHCHalted);
+  }
+}
+
+void XhciModel::OnCRCRWritten() {
+  const uint64_t crcr = Reg64(kCRCR);
+  if (!command_ring_running_) {
+    command_dequeue_ = reinterpret_cast<TRB *>(crcr & ~uint64_t{0x3f});
+    command_cycle_ = crcr & kRingCycleState;
+  } else if (crcr & (kCommandStop | kCommandAbort)) {
+    // 実行中のコマンドは無い（Step() の中で完了させている）ので，止めたことだけを通知する
+    command_ring_running_ = false;
+    if (!replaying_) {
+      usb::xhci::CommandCompletionEventTRB event{};
+      event.SetPointer(command_dequeue_);
+      event.bits.completion_code = kCommandRingStopped;
+      PostEvent(0, TRB{event.data});
+    }
+  }
+  // Command Ring Pointer は読むと 0 になる
+  Reg64(kCRCR) = command_ring_running_ ? kCommandRingRunning : 0;
+}
+
+void XhciModel::OnPORTSCWritten(uint8_t port_num) {
+  auto &port = ports_[port_num];
+  const uint32_t value = PORTSC(port_num);
+  uint32_t portsc = port.portsc & ~(value & kPortChangeBits);
+  if (value & kPED) {
+    portsc &= ~kPED;
+  }
+  portsc = (portsc & ~kPortWritableBits) | (value & kPortWritableBits);
+  if (value & kLWS) {
+    portsc = (portsc & ~kPLSMask) | (value & kPLSMask);
+  }
+  if ((value & kPR) && (portsc & kCCS)) {
+    portsc |= kPR;
+    port.reset_pending = true;
+  }
+  SetPortStatus(port_num, portsc);
+}
+
+void XhciModel::OnDoorbellWritten(uint8_t index) {
+  const uint8_t target = Reg32(kDoorbells + 4u * index) & 0xffu;
+  Reg32(kDoorbells + 4u * index) = 0;
+  if (!running_) {
+    return;
+  }
+  if (index == 0) {
+    if (target == 0 && command_dequeue_ != nullptr) {
+      command_ring_running_ = true;
+      Reg64(kCRCR) = kCommandRingRunning;
+    }
+    return;
+  }
+  if (index > kMaxSlots || !slots_[index].enabled || target == 0 || target > 31) {
+    return;
+  }
+  if (slots_[index].endpoints[target].state == kStopped) {
+    SetEndpointState(index, target, kRunning);
+  }
+}
+
+void XhciModel::Attach(uint8_t port_num, FunctionModel *function) {
+  auto &port = ports_[port_num];
+  port.function = function;
+  port.reset_pending = false;
+  uint32_t portsc = port.portsc & ~(kPED | kPR | kPLSMask | 0xfu << kSpeedShift);
+  portsc |= kCCS | kCSC | kPLSPolling << 5 |
+            static_cast<uint32_t>(function->Speed()) << kSpeedShift;
+  SetPortStatus(port_num, portsc);
+}
+
+void XhciModel::Detach(uint8_t port_num) {
+  auto &port = ports_[port_num];
+  port.function = nullptr;
+  port.reset_pending = false;
+  // 切断後の Port Speed は不定なので，最後につながっていたデバイスの速度を残しておく
+  uint32_t portsc = port.portsc & ~(kCCS | kPED | kPR | kPLSMask);
+  portsc |= kCSC | kPLSRxDetect << 5;
+  SetPortStatus(port_num, portsc);
+}
+
+void XhciModel::SetPortStatus(uint8_t port_num, uint32_t portsc) {
+  const uint32_t raised = portsc & ~ports_[port_num].portsc & kPortChangeBits;
+  ports_[port_num].portsc = portsc;
+  PORTSC(port_num) = portsc;
+  if (raised != 0 && running_ && !replaying_) {
+    PostPortStatusChange(port_num);
+  }
+}
+
+void XhciModel::ReplayPortStatus(uint8_t port_num, uint32_t portsc) {
+  ports_[port_num].reset_pending = false;
+  ports_[port_num].portsc = portsc;
+  PORTSC(port_num) = portsc;
+}
+
+void XhciModel::PostPortStatusChange(uint8_t port_num) {
+  SetStatus(usbsts_ | kPortChangeDetect);
+  usb::xhci::PortStatusChangeEventTRB event{};
+  event.bits.port_id = port_num;
+  event.bits.completion_code = kSuccess;
+  PostEvent(0, TRB{event.data});
+}
+
+void XhciModel::ResetEventRing(uint16_t index) {
+  auto &interrupter = interrupters_[index];
+  interrupter.backlog.clear();
+  const auto base = kInterrupters + 0x20u * index;
+  const auto erst = reinterpret_cast<const ERSTEntry *>(Reg64(base + kERSTBA) & ~uint64_t{0x3f});
+  if (erst == nullptr || (Reg32(base + kERSTSZ) & 0xffffu) == 0) {
+    interrupter.enqueue = nullptr;
+    return;
+  }
+  interrupter.segment_index = 0;
+  interrupter.enqueue = reinterpret_cast<TRB *>(erst[0].base);
+  interrupter.segment_end = interrupter.enqueue + (erst[0].size & 0xffffu);
+  interrupter.cycle = true;
+}
+
+size_t XhciModel::EventRingCapacity(uint16_t index) const {
+  const auto base = kInterrupters + 0x20u * index;
+  const auto erst = reinterpret_cast<const ERSTEntry *>(Reg64(base + kERSTBA) & ~uint64_t{0x3f});
+  if (erst == nullptr) {
+    return 0;
+  }
+  size_t num_trbs = 0;
+  for (size_t i = 0; i < (Reg32(base + kERSTSZ) & 0xffffu); ++i) {
+    num_trbs += erst[i].size & 0xffffu;
+  }
+  return num_trbs > 0 ? num_trbs - 1 : 0;
+}
+
+bool XhciModel::WriteEvent(uint16_t index, const TRB &trb) {
+  auto &interrupter = interrupters_[index];
+  if (interrupter.enqueue == nullptr) {
+    return false;
+  }
+
+  const auto base = kInterrupters + 0x20u * index;
+  const auto erst = reinterpret_cast<const ERSTEntry *>(Reg64(base + kERSTBA) & ~uint64_t{0x3f});
+  size_t next_segment = interrupter.segment_index;
+  bool next_cycle = interrupter.cycle;
+  auto next = interrupter.enqueue + 1;
+  auto next_end = interrupter.segment_end;
+  if (next == interrupter.segment_end) {
+    if (++next_segment == (Reg32(base + kERSTSZ) & 0xffffu)) {
+      next_segment = 0;
+      next_cycle = !next_cycle;
+    }
+    next = reinterpret_cast<TRB *>(erst[next_segment].base);
+    next_end = next + (erst[next_segment].size & 0xffffu);
+  }
+  // 次の書き込み位置がデキューポインタに追いついたら満杯
+  const auto dequeue = reinterpret_cast<TRB *>(Reg64(base + kERDP) & ~uint64_t{0xf});
+  if (next == dequeue) {
+    return false;
+  }
+
+  auto dst = reinterpret_cast<volatile uint32_t *>(interrupter.enqueue->data.data());
+  for (int i = 0; i < 3; ++i) {
+    dst[i] = trb.data[i];
+  }
+  // cycle bit を含む dword 3 は最後に書く
+  dst[3] = (trb.data[3] & ~kCycle) | static_cast<uint32_t>(interrupter.cycle);
+
+  interrupter.enqueue = next;
+  interrupter.segment_end = next_end;
+  interrupter.segment_index = next_segment;
+  interrupter.cycle = next_cycle;
+
+  if (interrupter.iman & kInterruptEnable) {
+    interrupter.iman |= kInterruptPending;
+    Reg32(base + kIMAN) = interrupter.iman;
+  }
+  SetStatus(usbsts_ | kEventInterrupt);
+  ++counters_.events;
+  ++events_this_step_;
+  return true;
+}
+
+void XhciModel::PostEvent(uint16_t index, const TRB &trb) {
+  if (index >= kMaxInterrupters) {
+    index = 0;
+  }
+  auto &interrupter = interrupters_[index];
+  if (!interrupter.backlog.empty() || !WriteEvent(index, trb)) {
+    interrupter.backlog.push_back(trb);
+  }
+}
+
+void XhciModel::FlushBacklog() {
+  for (uint16_t index = 0; index < kMaxInterrupters; ++index) {
+    auto &backlog = interrupters_[index].backlog;
+    while (!backlog.empty() && WriteEvent(index, backlog.front())) {
+      backlog.pop_front();
+    }
+  }
+}
+
+size_t XhciModel::NumBacklogEvents() const {
+  size_t num_events = 0;
+  for (const auto &interrupter : interrupters_) {
+    num_events += interrupter.backlog.size();
+  }
+  return num_events;
+}
+
+int XhciModel::NumEnabledSlots() const {
+  int num_slots = 0;
+  for (uint8_t slot_id = 1; slot_id <= kMaxSlots; ++slot_id) {
+    num_slots += slots_[slot_id].enabled;
+  }
+  return num_slots;
+}
+
+size_t XhciModel::Step() {
+  ++counters_.steps;
+  events_this_step_ = 0;
+  FlushBacklog();
+
+  // MFINDEX はマイクロフレーム（125 us）ごとに進む 14 ビットのカウンタ
+  const auto now = std::chrono::steady_clock::now().time_since_epoch();
+  Reg32(kMFINDEX) =
+      std::chrono::duration_cast<std::chrono::microseconds>(now).count() / 125 & 0x3fffu;
+
+  if (!running_) {
+    return events_this_step_;
+  }
+
+  for (uint8_t port_num = 1; port_num <= kMaxPorts && !replaying_; ++port_num) {
+    auto &port = ports_[port_num];
+    if (!port.reset_pending) {
+      continue;
+    }
+    port.reset_pending = false;
+    const uint32_t portsc = (port.portsc & ~(kPR | kPLSMask)) | kPED | kPRC | kPLSU0 << 5;
+    SetPortStatus(port_num, portsc);
+  }
+
+  ProcessCommandRing();
+
+  for (uint8_t slot_id = 1; slot_id <= kMaxSlots; ++slot_id) {
+    if (!slots_[slot_id].enabled) {
+      continue;
+    }
+    for (int dci = 1; dci < 32; ++dci) {
+      ProcessTransferRing(slot_id, dci);
+    }
+  }
+  return events_this_step_;
+}
+
+void XhciModel::ProcessCommandRing() {
+  while (command_ring_running_) {
+    auto command = command_dequeue_;
+    const uint32_t control = ReadControl(command);
+    if ((control & kCycle) != command_cycle_) {
+      return;
+    }
+    if (TRBType(control) == usb::xhci::LinkTRB::Type) {
+      command_dequeue_ = reinterpret_cast<TRB *>(Parameter(command) & ~uint64_t{0xf});
+      if (control & kToggleCycle) {
+        command_cycle_ = !command_cycle_;
+      }
+      continue;
+    }
+
+    ++counters_.commands;
+    const TRB trb = *command;
+    command_dequeue_ = command + 1;
+    if (replaying_) {
+      pending_commands_.push_back(command);
+      continue;
+    }
+    uint8_t slot_id = SlotOf(trb);
+    const uint8_t code = ExecuteCommand(trb, slot_id);
+
+    usb::xhci::CommandCompletionEventTRB event{};
+    event.SetPointer(command);
+    event.bits.completion_code = code;
+    event.bits.slot_id = slot_id;
+    PostEvent(0, TRB{event.data});
+  }
+}
+
+uint8_t XhciModel::ExecuteCommand(const TRB &command, uint8_t &slot_id) {
+  const auto type = TRBType(command.data[3]);
+  if (type == usb::xhci::EnableSlotCommandTRB::Type) {
+    const int max_slots = std::min<int>(kMaxSlots, Reg32(kCONFIG) & 0xffu);
+    for (int id = 1; id <= max_slots; ++id) {
+      if (!slots_[id].enabled) {
+        EnableSlot(id);
+        slot_id = id;
+        return kSuccess;
+      }
+    }
+    slot_id = 0;
+    return kNoSlotsAvailable;
+  }
+  if (type == usb::xhci::NoOpCommandTRB::Type) {
+    slot_id = 0;
+    return kSuccess;
+  }
+
+  if (slot_id == 0 || slot_id > kMaxSlots || !slots_[slot_id].enabled) {
+    return kSlotNotEnabled;
+  }
+  switch (type) {
+  case usb::xhci::DisableSlotCommandTRB::Type:
+    DisableSlot(slot_id);
+    return kSuccess;
+  case usb::xhci::AddressDeviceCommandTRB::Type:
+    return AddressDevice(command);
+  case usb::xhci::ConfigureEndpointCommandTRB::Type:
+    return ConfigureEndpoint(command);
+  case usb::xhci::EvaluateContextCommandTRB::Type:
+    return EvaluateContext(command);
+  case usb::xhci::ResetEndpointCommandTRB::Type:
+    return ResetEndpoint(command);
+  case usb::xhci::StopEndpointCommandTRB::Type:
+    return StopEndpoint(command);
+  case usb::xhci::SetTRDequeuePointerCommandTRB::Type:
+    return SetTRDequeuePointer(command);
+  default:
+    return kTRBError;
+  }
+}
+
+void XhciModel::EnableSlot(uint8_t slot_id) {
+  slots_[slot_id] = Slot{};
+  slots_[slot_id].enabled = true;
+}
+
+uint8_t XhciModel::CompleteCommand(uint8_t slot_id, uint8_t code, TRB *&command) {
+  if (code == kCommandRingStopped) {
+    command = command_dequeue_;
+    command_ring_running_ = false;
+    Reg64(kCRCR) = 0;
+    return code;
+  }
+  if (pending_commands_.empty()) {
+    command = nullptr;
+    return code;
+  }
+  command = pending_commands_.front();
+  pending_commands_.pop_front();
+  if (code != kSuccess) {
+    return code;
+  }
+
+  const TRB trb = *command;
+  if (TRBType(trb.data[3]) == usb::xhci::EnableSlotCommandTRB::Type) {
+    if (slot_id == 0 || slot_id > kMaxSlots || slots_[slot_id].enabled) {
+      return kNoSlotsAvailable;
+    }
+    EnableSlot(slot_id);
+    return kSuccess;
+  }
+  uint8_t executed_slot_id = SlotOf(trb);
+  return ExecuteCommand(trb, executed_slot_id);
+}
+
+bool XhciModel::TakeTransferEvent(uint8_t slot_id, int dci, TRB &event) {
+  if (slot_id == 0 || slot_id > kMaxSlots || dci == 0 || dci > 31) {
+    return false;
+  }
+  auto &events = slots_[slot_id].endpoints[dci].replay_events;
+  if (events.empty()) {
+    return false;
+  }
+  event = events.front();
+  events.pop_front();
+  return true;
+}
+
+usb::xhci::DeviceContext *XhciModel::OutputContext(uint8_t slot_id) const {
+  const auto dcbaa = reinterpret_cast<uint64_t *>(Reg64(kDCBAAP) & ~uint64_t{0x3f});
+  if (dcbaa == nullptr) {
+    return nullptr;
+  }
+  return reinterpret_cast<usb::xhci::DeviceContext *>(dcbaa[slot_id]);
+}
+
+void XhciModel::SetEndpointState(uint8_t slot_id, int dci, EndpointState state) {
+  slots_[slot_id].endpoints[dci].state = state;
+  if (auto ctx = OutputContext(slot_id)) {
+    ctx->ep_contexts[dci - 1].bits.ep_state = state;
+  }
+}
+
+void XhciModel::LoadEndpoint(uint8_t slot_id, int dci) {
+  const auto &ctx = OutputContext(slot_id)->ep_contexts[dci - 1];
+  auto &ep = slots_[slot_id].endpoints[dci];
+  ep = Endpoint{};
+  // ストリームを使うエンドポイントの Transfer Ring は扱わない
+  if (ctx.bits.max_primary_streams == 0) {
+    ep.dequeue = ctx.TransferRingBuffer();
+    ep.cycle = ctx.bits.dequeue_cycle_state;
+  }
+  SetEndpointState(slot_id, dci, kRunning);
+}
+
+void XhciModel::DisableSlot(uint8_t slot_id) {
+  for (int dci = 1; dci < 32; ++dci) {
+    if (slots_[slot_id].endpoints[dci].state != kDisabled) {
+      SetEndpointState(slot_id, dci, kDisabled);
+    }
+  }
+  if (auto ctx = OutputContext(slot_id)) {
+    ctx->slot_context.bits.slot_state = kSlotDisabled;
+  }
+  slots_[slot_id] = Slot{};
+}
+
+uint8_t XhciModel::AddressDevice(const TRB &command) {
+  const uint8_t slot_id = SlotOf(command);
+  const auto input = reinterpret_cast<const usb::xhci::InputContext *>(Parameter(&command) &
+                                                                        ~uint64_t{0xf});
+  auto output = OutputContext(slot_id);
+  if (input == nullptr || output == nullptr) {
+    return kTRBError;
+  }
+  const uint8_t port_num = input->slot_context.bits.root_hub_port_num;
+  if (port_num == 0 || port_num > kMaxPorts || ports_[port_num].function == nullptr ||
+      !(ports_[port_num].portsc & kPED)) {
+    return kUSBTransactionError;
+  }
+
+  output->slot_context = input->slot_context;
+  output->ep_contexts[0] = input->ep_contexts[0];
+  if (command.data[3] & kBlockSetAddress) {
+    output->slot_context.bits.usb_device_address = 0;
+    output->slot_context.bits.slot_state = kSlotDefault;
+  } else {
+    output->slot_context.bits.usb_device_address = slot_id;
+    output->slot_context.bits.slot_state = kSlotAddressed;
+  }
+  slots_[slot_id].port_num = port_num;
+  LoadEndpoint(slot_id, 1);
+  return kSuccess;
+}
+
+uint8_t XhciModel::ConfigureEndpoint(const TRB &command) {
+  const uint8_t slot_id = SlotOf(command);
+  auto output = OutputContext(slot_id);
+  if (output == nullptr) {
+    return kTRBError;
+  }
+
+  if (command.data[3] & kDeconfigure) {
+    for (int dci = 2; dci < 32; ++dci) {
+      SetEndpointState(slot_id, dci, kDisabled);
+    }
+    output->slot_context.bits.slot_state = kSlotAddressed;
+    return kSuccess;
+  }
+
+  const auto input = reinterpret_cast<const usb::xhci::InputContext *>(Parameter(&command) &
+                                                                        ~uint64_t{0xf});
+  if (input == nullptr) {
+    return kTRBError;
+  }
+  const auto &icc = input->input_control_context;
+  for (int dci = 2; dci < 32; ++dci) {
+    if (icc.drop_context_flags & (1u << dci)) {
+      SetEndpointState(slot_id, dci, kDisabled);
+    }
+  }
+  for (int dci = 2; dci < 32; ++dci) {
+    if (icc.add_context_flags & (1u << dci)) {
+      output->ep_contexts[dci - 1] = input->ep_contexts[dci - 1];
+      LoadEndpoint(slot_id, dci);
+    }
+  }
+  if (icc.add_context_flags & 1u) {
+    const auto address = output->slot_context.bits.usb_device_address;
+    output->slot_context = input->slot_context;
+    output->slot_context.bits.usb_device_address = address;
+  }
+
+  bool configured = false;
+  for (int dci = 2; dci < 32; ++dci) {
+    configured |= slots_[slot_id].endpoints[dci].state != kDisabled;
+  }
+  output->slot_context.bits.slot_state = configured ? kSlotConfigured : kSlotAddressed;
+  return kSuccess;
+}
+
+uint8_t XhciModel::EvaluateContext(const TRB &command) {
+  const uint8_t slot_id = SlotOf(command);
+  const auto input = reinterpret_cast<const usb::xhci::InputContext *>(Parameter(&command) &
+                                                                        ~uint64_t{0xf});
+  auto output = OutputContext(slot_id);
+  if (input == nullptr || output == nullptr) {
+    return kTRBError;
+  }
+  const auto add = input->input_control_context.add_context_flags;
+  if (add & 1u) {
+    output->slot_context.bits.max_exit_latency = input->slot_context.bits.max_exit_latency;
+    output->slot_context.bits.interrupter_target = input->slot_context.bits.interrupter_target;
+  }
+  if (add & 2u) {
+    output->ep_contexts[0].bits.max_packet_size = input->ep_contexts[0].bits.max_packet_size;
+  }
+  return kSuccess;
+}
+
+uint8_t XhciModel::ResetEndpoint(const TRB &command) {
+  const uint8_t slot_id = SlotOf(command);
+  const int dci = DCIOf(command);
+  if (dci == 0 || slots_[slot_id].endpoints[dci].state != kHalted) {
+    return kContextStateError;
+  }
+  SetEndpointState(slot_id, dci, kStopped);
+  return kSuccess;
+}
+
+uint8_t XhciModel::StopEndpoint(const TRB &command) {
+  const uint8_t slot_id = SlotOf(command);
+  const int dci = DCIOf(command);
+  if (dci == 0) {
+    return kTRBError;
+  }
+  auto &ep = slots_[slot_id].endpoints[dci];
+  if (ep.state != kRunning) {
+    return kContextStateError;
+  }
+
+  // 処理しかけの TRB があれば，そこで止めたことを Transfer Event で知らせる
+  for (int i = 0; ep.dequeue != nullptr && i < 2; ++i) {
+    const uint32_t control = ReadControl(ep.dequeue);
+    if ((control & kCycle) != ep.cycle) {
+      break;
+    }
+    if (TRBType(control) == usb::xhci::LinkTRB::Type) {
+      ep.dequeue = reinterpret_cast<TRB *>(Parameter(ep.dequeue) & ~uint64_t{0xf});
+      if (control & kToggleCycle) {
+        ep.cycle = !ep.cycle;
+      }
+      continue;
+    }
+    PostTransferEvent(slot_id, dci, ep.dequeue, kStopped, ep.dequeue->data[2] & 0x1ffffu);
+    break;
+  }
+  SetEndpointState(slot_id, dci, kStopped);
+  return kSuccess;
+}
+
+uint8_t XhciModel::SetTRDequeuePointer(const TRB &command) {
+  const uint8_t slot_id = SlotOf(command);
+  const int dci = DCIOf(command);
+  if (dci == 0) {
+    return kTRBError;
+  }
+  auto &ep = slots_[slot_id].endpoints[dci];
+  if (ep.state != kStopped) {
+    return kContextStateError;
+  }
+  const uint64_t param = Parameter(&command);
+  ep.dequeue = reinterpret_cast<TRB *>(param & ~uint64_t{0xf});
+  ep.cycle = param & 1u;
+  ep.td_transferred = 0;
+  ep.short_td = false;
+  if (auto ctx = OutputContext(slot_id)) {
+    auto &ep_ctx = ctx->ep_contexts[dci - 1];
+    ep_ctx.SetTransferRingBuffer(ep.dequeue);
+    ep_ctx.bits.dequeue_cycle_state = ep.cycle;
+  }
+  return kSuccess;
+}
+
+void XhciModel::ProcessTransferRing(uint8_t slot_id, int dci) {
+  auto &ep = slots_[slot_id].endpoints[dci];
+  // 1 回の Step() で 1 つのエンドポイントが他を待たせ過ぎないよう，処理する TRB 数を抑える
+  for (int i = 0; i < 256 && ep.state == kRunning; ++i) {
+    if (!ExecuteTransfer(slot_id, dci, ep)) {
+      break;
+    }
+  }
+}
+
+void XhciModel::PostTransferEvent(uint8_t slot_id, int dci, const TRB *trb, uint8_t code,
+                                  uint32_t length, bool event_data) {
+  usb::xhci::TransferEventTRB event{};
+  event.bits.trb_pointer = event_data ? Parameter(trb) : reinterpret_cast<uint64_t>(trb);
+  event.bits.trb_transfer_length = length;
+  event.bits.completion_code = code;
+  event.bits.event_data = event_data;
+  event.bits.endpoint_id = dci;
+  event.bits.slot_id = slot_id;
+  if (replaying_) {
+    // Stop Endpoint の Transfer Event はコマンドの完了より先に届くので，再生側が記録から作る
+    if (code != kStopped) {
+      slots_[slot_id].endpoints[dci].replay_events.push_back(TRB{event.data});
+    }
+    return;
+  }
+  PostEvent(trb->data[2] >> 22, TRB{event.data});
+}
+
+bool XhciModel::ExecuteTransfer(uint8_t slot_id, int dci, Endpoint &ep) {
+  auto trb = ep.dequeue;
+  if (trb == nullptr) {
+    return false;
+  }
+  const uint32_t control = ReadControl(trb);
+  if ((control & kCycle) != ep.cycle) {
+    return false;
+  }
+  const auto type = TRBType(control);
+  if (type == usb::xhci::LinkTRB::Type) {
+    ep.dequeue = reinterpret_cast<TRB *>(Parameter(trb) & ~uint64_t{0xf});
+    if (control & kToggleCycle) {
+      ep.cycle = !ep.cycle;
+    }
+    return true;
+  }
+
+  auto end_td = [&ep, control]() {
+    if (!(control & kChain)) {
+      ep.td_transferred = 0;
+      ep.short_td = false;
+    }
+  };
+
+  if (ep.short_td) {
+    // Short Packet の後は TD の末尾まで読み飛ばす．Event Data TRB だけは通知する．
+    if (type == usb::xhci::EventDataTRB::Type && (control & kIOC)) {
+      PostTransferEvent(slot_id, dci, trb, kShortPacket, ep.td_transferred, true);
+    }
+    ep.dequeue = trb + 1;
+    end_td();
+    return true;
+  }
+
+  auto function = ports_[slots_[slot_id].port_num].function;
+  if (function == nullptr) {
+    // デバイスが外れた．応答が無いまま止まる．
+    return false;
+  }
+
+  const uint32_t length = trb->data[2] & 0x1ffffu;
+  auto buf = reinterpret_cast<uint8_t *>(Parameter(trb));
+  if (control & kIDT) {
+    buf = reinterpret_cast<uint8_t *>(trb->data.data());
+  }
+
+  auto stall = [&]() {
+    SetEndpointState(slot_id, dci, kHalted);
+    PostTransferEvent(slot_id, dci, trb, kStallError, length);
+    return false;
+  };
+
+  ++counters_.transfer_trbs;
+  switch (type) {
+  case usb::xhci::SetupStageTRB::Type:
+    memcpy(&ep.setup, trb->data.data(), sizeof(ep.setup));
+    ep.data_stage_done = false;
+    if (control & kIOC) {
+      PostTransferEvent(slot_id, dci, trb, kSuccess, 0);
+    }
+    break;
+  case usb::xhci::DataStageTRB::Type: {
+    int n = function->Control(ep.setup, buf, length);
+    if (n < 0) {
+      return stall();
+    }
+    n = std::min<int>(n, length);
+    ep.data_stage_done = true;
+    const uint32_t residual = length - n;
+    if (residual > 0 && (control & (kISP | kIOC))) {
+      PostTransferEvent(slot_id, dci, trb, kShortPacket, residual);
+    } else if (residual == 0 && (control & kIOC)) {
+      PostTransferEvent(slot_id, dci, trb, kSuccess, 0);
+    }
+    break;
+  }
+  case usb::xhci::StatusStageTRB::Type:
+    if (!ep.data_stage_done && function->Control(ep.setup, nullptr, 0) < 0) {
+      return stall();
+    }
+    if (control & kIOC) {
+      PostTransferEvent(slot_id, dci, trb, kSuccess, 0);
+    }
+    break;
+  case usb::xhci::NormalTRB::Type:
+  case usb::xhci::IsochTRB::Type: {
+    const int ep_num = dci / 2;
+    int n;
+    if (dci % 2 == 1) {
+      n = function->In(ep_num, buf, length);
+      if (n < 0) {
+        return false; // NAK
+      }
+    } else {
+      if (!function->Out(ep_num, buf, length)) {
+        return false; // NAK
+      }
+      n = length;
+    }
+    n = std::min<int>(n, length);
+    ep.td_transferred += n;
+    const uint32_t residual = length - n;
+    ep.dequeue = trb + 1;
+    if (residual > 0) {
+      if (control & (kISP | kIOC)) {
+        PostTransferEvent(slot_id, dci, trb, kShortPacket, residual);
+      }
+      if (control & kChain) {
+        ep.short_td = true;
+        return true;
+      }
+    } else if (control & kIOC) {
+      PostTransferEvent(slot_id, dci, trb, kSuccess, 0);
+    }
+    end_td();
+    return true;
+  }
+  case usb::xhci::EventDataTRB::Type:
+    if (control & kIOC) {
+      PostTransferEvent(slot_id, dci, trb, kSuccess, ep.td_transferred, true);
+    }
+    break;
+  case usb::xhci::NoOpTRB::Type:
+    if (control & kIOC) {
+      PostTransferEvent(slot_id, dci, trb, kSuccess, 0);
+    }
+    break;
+  default:
+    PostTransferEvent(slot_id, dci, trb, kTRBError, 0);
+    break;
+  }
+  ep.dequeue = trb + 1;
+  end_td();
+  return true;
+}
+} // namespace sim
@@ -0,0 +1,237 @@
+/**
+ * @file host/xhci_model.hpp
+ *
+ * ホスト上で USB スタックを動かすための，メモリ上に置いた xHCI のモデル．
+ *
+ * レジスタ空間は普通のメモリで，ドライバの書き込みは MMIOWriteHook() を通して
+ * その場で解釈する（RW1C のビット，ポートのリセット，ドアベルなど）．
+ * コマンドリングと Transfer Ring は Step() で読み進め，結果を Command Completion,
+ * Transfer, Port Status Change の各イベントとしてイベントリングに書き込む．
+ *
+ * ルートハブの先のハブ，ストリーム，アイソクロナス転送のスケジューリングは扱わない．
+ *
+ * 再生モード（SetReplaying）では，記録したイベントを流し直す TraceReplayer のために
+ * イベントを自分では書き込まない．リングは普段どおり読み進めてデバイスとデータをやりとりし，
+ * 書き込むはずだったイベントを TakeTransferEvent, CompleteCommand で渡す．
+ */
+
+#pragma once
+
+#include "usb/setupdata.hpp"
+#include "usb/xhci/context.hpp"
+#include "usb/xhci/trb.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+namespace sim {
+/** @brief ルートハブのポートにつなぐ USB デバイス（ファンクション）のモデル */
+class FunctionModel {
+public:
+  virtual ~FunctionModel() = default;
+
+  /** @brief PORTSC の Port Speed に示す速度（1: Full, 2: Low, 3: High, 4: Super） */
+  virtual int Speed() const = 0;
+  /** @brief コントロール転送を処理する．
+   *
+   * IN 転送なら応答を data に高々 len バイト書き込み，OUT 転送なら data の len バイトを読む．
+   * データステージが無ければ data は nullptr で len は 0．
+   *
+   * @return 転送したバイト数．STALL で応答するなら負の値．
+   */
+  virtual int Control(const usb::SetupData &setup, uint8_t *data, int len) = 0;
+  /** @brief ep_num 番の IN エンドポイントへの転送を処理する．
+   *
+   * @return 転送したバイト数．送るデータが無い（NAK）なら負の値．
+   */
+  virtual int In(int ep_num, uint8_t *buf, int len) { return -1; }
+  /** @brief ep_num 番の OUT エンドポイントへの転送を処理する．受け取れない（NAK）なら false． */
+  virtual bool Out(int ep_num, const uint8_t *buf, int len) { return true; }
+};
+
+class XhciModel {
+public:
+  static const uint8_t kMaxPorts = 4;
+  static const uint8_t kMaxSlots = 16;
+  static const uint16_t kMaxInterrupters = 4;
+
+  /** @brief Step() が数えた処理の量 */
+  struct Counters {
+    uint64_t steps;
+    uint64_t commands;
+    uint64_t transfer_trbs;
+    uint64_t events;
+  };
+
+  XhciModel();
+  XhciModel(const XhciModel &) = delete;
+  ~XhciModel();
+  XhciModel &operator=(const XhciModel &) = delete;
+
+  /** @brief Controller に渡すレジスタ空間の先頭 */
+  uintptr_t MMIOBase() const { return reinterpret_cast<uintptr_t>(mmio_); }
+
+  /** @brief port_num 番（1 始まり）のポートに function をつなぐ．
+   *
+   * 動作中なら Port Status Change Event が発生する．function はつないでいる間は有効でなければならない．
+   */
+  void Attach(uint8_t port_num, FunctionModel *function);
+  /** @brief port_num 番のポートからデバイスを外す． */
+  void Detach(uint8_t port_num);
+
+  /** @brief リングを処理し，結果のイベントをイベントリングに書き込む．
+   *
+   * @return イベントリングに書き込んだイベントの数
+   */
+  size_t Step();
+
+  /** @brief interrupter のイベントリングにイベントを書き込む．
+   *
+   * リングに空きが無ければ溜めておき，ドライバが ERDP を進めた後の Step() で書き込む．
+   * 実際のホストコントローラが生成しないイベントも渡せるので，ドライバの試験に使える．
+   */
+  void PostEvent(uint16_t interrupter, const usb::xhci::TRB &trb);
+  /** @brief interrupter のイベントリングが一度に保持できるイベントの数 */
+  size_t EventRingCapacity(uint16_t interrupter) const;
+  /** @brief イベントリングの空きを待っているイベントの数 */
+  size_t NumBacklogEvents() const;
+
+  /** @brief 再生モードにする（true）か戻す（false）．
+   *
+   * 再生モードでは Command Completion, Transfer, Port Status Change の各イベントを書き込まず，
+   * ポートのリセットも完了させない．イベントは PostEvent で外から書き込む．
+   */
+  void SetReplaying(bool replaying) { replaying_ = replaying; }
+  /** @brief 再生モードで，port_num 番のポートの PORTSC を portsc にする．イベントは発生しない． */
+  void ReplayPortStatus(uint8_t port_num, uint32_t portsc);
+  /** @brief 再生モードで，読み込んだうち最も古いコマンドを code で完了させる．
+   *
+   * code が成功なら，そのときにコマンドを実行する．Enable Slot は slot_id のスロットを有効にする．
+   * code が Command Ring Stopped なら，コマンドは完了させずに Command Ring を止める．
+   *
+   * @param command  完了させたコマンド TRB．完了を待っているコマンドが無ければ nullptr．
+   * @return モデルがコマンドを実行した結果の完了コード．実行しなければ code のまま．
+   */
+  uint8_t CompleteCommand(uint8_t slot_id, uint8_t code, usb::xhci::TRB *&command);
+  /** @brief 再生モードで完了を待っているコマンドの数 */
+  size_t NumPendingCommands() const { return pending_commands_.size(); }
+  /** @brief 再生モードで，エンドポイントの転送が書き込むはずだった最も古いイベントを取り出す．
+   *
+   * @return 取り出したら true．まだ転送が終わっていなければ false．
+   */
+  bool TakeTransferEvent(uint8_t slot_id, int dci, usb::xhci::TRB &event);
+
+  /** @brief 有効な（Enable Slot から Disable Slot までの）スロットの数 */
+  int NumEnabledSlots() const;
+  bool IsRunning() const { return running_; }
+  const Counters &Stats() const { return counters_; }
+
+  /** @brief レジスタ空間の offset への書き込みを解釈する．MMIOWriteHook() から呼ばれる． */
+  void OnWrite(uintptr_t offset);
+  bool Contains(volatile void *reg) const;
+
+private:
+  enum EndpointState : uint8_t {
+    kDisabled = 0,
+    kRunning = 1,
+    kHalted = 2,
+    kStopped = 3,
+  };
+
+  struct Endpoint {
+    EndpointState state;
+    /** 次に処理する TRB と，そこで期待する cycle bit（Consumer Cycle State） */
+    usb::xhci::TRB *dequeue;
+    bool cycle;
+    /** TD の先頭から転送したバイト数（Event Data TRB で報告する EDTLA） */
+    uint32_t td_transferred;
+    /** TD の途中で Short Packet になった．TD の末尾まで読み飛ばす． */
+    bool short_td;
+    /** Setup Stage で受け取ったリクエストと，データステージを済ませたか（EP0 のみ） */
+    usb::SetupData setup;
+    bool data_stage_done;
+    /** 再生モードで，書き込まずに取っておいた Transfer Event */
+    std::deque<usb::xhci::TRB> replay_events;
+  };
+
+  struct Slot {
+    bool enabled;
+    uint8_t port_num;
+    std::array<Endpoint, 32> endpoints; // index = dci
+  };
+
+  struct Port {
+    /** PORTSC の値．RW1C のビットを解釈するため，書き込まれる前の値を覚えておく． */
+    uint32_t portsc;
+    FunctionModel *function;
+    bool reset_pending;
+  };
+
+  struct Interrupter {
+    uint32_t iman;
+    size_t segment_index;
+    usb::xhci::TRB *enqueue;
+    usb::xhci::TRB *segment_end;
+    bool cycle;
+    std::deque<usb::xhci::TRB> backlog;
+  };
+
+  uint8_t *mmio_;
+
+  uint32_t usbsts_ = 0;
+  bool running_ = false;
+  usb::xhci::TRB *command_dequeue_ = nullptr;
+  bool command_cycle_ = false;
+  bool command_ring_running_ = false;
+  bool replaying_ = false;
+  /** 再生モードで読み込み，まだ完了させていないコマンド */
+  std::deque<usb::xhci::TRB *> pending_commands_;
+
+  std::array<Port, kMaxPorts + 1> ports_{};   // index = port_num
+  std::array<Slot, kMaxSlots + 1> slots_{};   // index = slot_id
+  std::array<Interrupter, kMaxInterrupters> interrupters_{};
+  Counters counters_{};
+  size_t events_this_step_ = 0;
+
+  volatile uint32_t &Reg32(uintptr_t offset) const;
+  volatile uint64_t &Reg64(uintptr_t offset) const;
+  volatile uint32_t &PORTSC(uint8_t port_num) const;
+
+  void Reset();
+  void SetStatus(uint32_t usbsts);
+  void OnUSBCMDWritten();
+  void OnCRCRWritten();
+  void OnPORTSCWritten(uint8_t port_num);
+  void OnDoorbellWritten(uint8_t index);
+
+  void SetPortStatus(uint8_t port_num, uint32_t portsc);
+  void PostPortStatusChange(uint8_t port_num);
+
+  void ResetEventRing(uint16_t index);
+  bool WriteEvent(uint16_t index, const usb::xhci::TRB &trb);
+  void FlushBacklog();
+
+  void ProcessCommandRing();
+  uint8_t ExecuteCommand(const usb::xhci::TRB &command, uint8_t &slot_id);
+  void EnableSlot(uint8_t slot_id);
+  uint8_t AddressDevice(const usb::xhci::TRB &command);
+  uint8_t ConfigureEndpoint(const usb::xhci::TRB &command);
+  uint8_t EvaluateContext(const usb::xhci::TRB &command);
+  uint8_t ResetEndpoint(const usb::xhci::TRB &command);
+  uint8_t StopEndpoint(const usb::xhci::TRB &command);
+  uint8_t SetTRDequeuePointer(const usb::xhci::TRB &command);
+  void DisableSlot(uint8_t slot_id);
+
+  usb::xhci::DeviceContext *OutputContext(uint8_t slot_id) const;
+  void SetEndpointState(uint8_t slot_id, int dci, EndpointState state);
+  void LoadEndpoint(uint8_t slot_id, int dci);
+
+  void ProcessTransferRing(uint8_t slot_id, int dci);
+  /** @brief エンドポイントの TRB を 1 つ処理する．NAK などで進めなかったら false． */
+  bool ExecuteTransfer(uint8_t slot_id, int dci, Endpoint &ep);
+  void PostTransferEvent(uint8_t slot_id, int dci, const usb::xhci::TRB *trb, uint8_t code,
+                         uint32_t length, bool event_data = false);
+};
+} // namespace sim
@@ -3,43 +3,285 @@
 #![warn(clippy::expect_used)]
 #![no_std]
 
-type MouseObserverType = extern "C" fn(buttons: u8, displacement_x: i8, displacement_y: i8);
-type KeyboardObserverType = extern "C" fn(modifier: u8, keycode: u8);
+use core::ffi::c_void;
+
+type MassStorageObserverType =
+    extern "C" fn(driver: *mut MassStorageDriver, num_blocks: u64, block_size: u32);
+type MassStorageCompletionType = extern "C" fn(context: *mut c_void, result: i32);
+type CdcObserverType = extern "C" fn(driver: *mut CdcDriver);
+type CdcReceiveType = extern "C" fn(context: *mut c_void, buf: *const u8, len: i32);
+type CdcSendType = extern "C" fn(context: *mut c_void, result: i32);
 
 extern "C" {
     fn cxx_xhci_controller_new(xhc_mmio_base: u64) -> *mut xhci::Controller;
-    fn cxx_xhci_controller_initialize(xhc: *mut xhci::Controller);
-    fn cxx_xhci_controller_run(xhc: *mut xhci::Controller) -> i32;
+    fn cxx_xhci_controller_initialize(
+        xhc: *mut xhci::Controller,
+        num_interrupters: u16,
+        event_ring_size: usize,
+    ) -> i32;
+    fn cxx_xhci_controller_num_interrupters(xhc: *mut xhci::Controller) -> u16;
+    fn cxx_xhci_controller_poll_bring_up(
+        xhc: *mut xhci::Controller,
+        now_ms: u64,
+        running: *mut bool,
+    ) -> i32;
+    fn cxx_xhci_controller_check_timeouts(xhc: *mut xhci::Controller, now_ms: u64) -> i32;
+    fn cxx_xhci_controller_set_interrupt_moderation(
+        xhc: *mut xhci::Controller,
+        interval: u16,
+        counter: u16,
+    );
     fn cxx_xhci_controller_configure_connected_ports(xhc: *mut xhci::Controller);
     fn cxx_xhci_controller_process_event(xhc: *mut xhci::Controller) -> i32;
+    fn cxx_xhci_controller_process_events(
+        xhc: *mut xhci::Controller,
+        interrupter: u16,
+        max_events: usize,
+    ) -> usize;
+    fn cxx_xhci_controller_set_polling_policy(
+        xhc: *mut xhci::Controller,
+        enabled: bool,
+        idle_poll_budget: u32,
+    );
+    fn cxx_xhci_controller_poll_events(xhc: *mut xhci::Controller, max_events: usize) -> bool;
     fn cxx_xhci_controller_has_event(xhc: *mut xhci::Controller) -> bool;
-    fn cxx_xhci_hid_mouse_driver_set_default_observer(observer: MouseObserverType);
-    fn cxx_xhci_hid_keyboard_driver_set_default_observer(observer: KeyboardObserverType);
+    fn cxx_xhci_controller_note_interrupt(xhc: *mut xhci::Controller);
+    fn cxx_xhci_controller_stats(xhc: *mut xhci::Controller, out: *mut xhci::ControllerStats);
+    fn cxx_xhci_controller_endpoint_stats(
+        xhc: *mut xhci::Controller,
+        slot_id: u8,
+        dci: u8,
+        out: *mut xhci::EndpointStats,
+    ) -> bool;
+    fn cxx_usb_async_control_queue(
+        queue: u8,
+        slot_id: u8,
+        request_type: u8,
+        request: u8,
+        value: u16,
+        index: u16,
+        length: u16,
+        data: *const u8,
+        token: *mut u32,
+    ) -> i32;
+    fn cxx_usb_async_take(
+        token: u32,
+        buf: *mut u8,
+        buf_len: usize,
+        out: *mut transfer::RawResult,
+    ) -> bool;
+    fn cxx_usb_async_release(token: u32);
+    fn cxx_usb_async_issue_queued(xhc: *mut xhci::Controller, queue: u8);
+    fn cxx_usb_async_set_notifier(notifier: transfer::Notifier);
+    fn cxx_input_queue(queue_id: u32) -> *mut input::InputQueue;
+    fn cxx_input_queue_set_notifier(notifier: input::Notifier);
+    fn cxx_input_pending_motion() -> *mut input::PendingMotion;
+    fn cxx_input_set_mouse_coalescing(enabled: bool);
+    fn cxx_xhci_mass_storage_driver_set_default_observer(observer: MassStorageObserverType);
+    fn cxx_xhci_mass_storage_driver_num_blocks(driver: *mut MassStorageDriver) -> u64;
+    fn cxx_xhci_mass_storage_driver_block_size(driver: *mut MassStorageDriver) -> u32;
+    fn cxx_xhci_mass_storage_driver_read(
+        driver: *mut MassStorageDriver,
+        lba: u64,
+        num_blocks: u32,
+        buf: *mut u8,
+        callback: MassStorageCompletionType,
+        context: *mut c_void,
+    ) -> i32;
+    fn cxx_xhci_mass_storage_driver_write(
+        driver: *mut MassStorageDriver,
+        lba: u64,
+        num_blocks: u32,
+        buf: *const u8,
+        callback: MassStorageCompletionType,
+        context: *mut c_void,
+    ) -> i32;
+    fn cxx_xhci_cdc_driver_set_default_observer(observer: CdcObserverType);
+    fn cxx_xhci_cdc_driver_kind(driver: *mut CdcDriver) -> u32;
+    fn cxx_xhci_cdc_driver_set_receiver(
+        driver: *mut CdcDriver,
+        callback: CdcReceiveType,
+        context: *mut c_void,
+    );
+    fn cxx_xhci_cdc_driver_send(
+        driver: *mut CdcDriver,
+        buf: *const u8,
+        len: i32,
+        callback: CdcSendType,
+        context: *mut c_void,
+    ) -> i32;
     fn cxx_set_memory_pool(pool_ptr: u64, pool_size: usize);
+    fn cxx_latency_trace_histogram(stage: u8, out: *mut trace::Histogram) -> bool;
+    fn cxx_latency_trace_read(buf: *mut trace::Record, max_records: usize) -> usize;
+    fn cxx_latency_trace_reset();
+    fn cxx_latency_trace_input_consumed(queue_id: u32, seq: u32);
+    fn cxx_event_trace_set_enabled(enabled: bool) -> bool;
+    fn cxx_event_trace_read(buf: *mut event_trace::Record, max_records: usize) -> usize;
+    fn cxx_event_trace_dropped() -> u64;
+    fn cxx_event_trace_reset();
+    fn cxx_set_log_level(level: i32);
+    fn cxx_flush_log(max_records: usize) -> usize;
 }
 
 pub struct CxxError(pub i32);
 
 pub mod xhci {
     use super::*;
+    use core::mem::MaybeUninit;
 
     // opaque type
     pub enum Controller {}
 
+    /// Interrupt moderation setting of an interrupter.
+    ///
+    /// Both `interval` and `counter` are in units of 250 ns.
+    #[derive(Debug, Clone, Copy, PartialEq, Eq)]
+    pub struct InterruptModeration {
+        pub interval: u16,
+        pub counter: u16,
+    }
+
+    impl InterruptModeration {
+        /// Raises an interrupt for every completion.
+        pub const DISABLED: Self = Self::new(0);
+        /// Suitable for latency sensitive devices such as HID (40 us).
+        pub const LOW_LATENCY: Self = Self::new(160);
+        /// Suitable for bulk storage, coalescing completions within 1 ms.
+        ///
+        /// The controller switches an interrupter other than 0 to this interval when every
+        /// configured slot it serves is a mass storage device.
+        pub const THROUGHPUT: Self = Self::new(4000);
+
+        pub const fn new(interval: u16) -> Self {
+            Self {
+                interval,
+                counter: 0,
+            }
+        }
+    }
+
+    /// How a controller learns about new events.
+    #[derive(Debug, Clone, Copy, PartialEq, Eq)]
+    pub enum PollingPolicy {
+        /// Every batch of events is announced by an interrupt.
+        InterruptOnly,
+        /// After an interrupt, interrupts are masked (IMAN.IE) and the event rings are polled
+        /// until `idle_poll_budget` consecutive polls find nothing, much like Linux's NAPI.
+        Hybrid { idle_poll_budget: u32 },
+    }
+
+    /// Number of completion codes counted separately in `EndpointStats::errors_by_code`.
+    pub const NUM_STATS_COMPLETION_CODES: usize = 37;
+
+    /// Controller-wide counters. Must match `usb::xhci::ControllerStats`.
+    #[repr(C)]
+    #[derive(Debug, Default, Clone, Copy)]
+    pub struct ControllerStats {
+        pub events: u64,
+        pub event_errors: u64,
+        /// Number of `process_events` calls that handled at least one event.
+        pub drain_batches: u64,
+        pub max_events_per_batch: u64,
+        /// Number of `note_interrupt` calls.
+        pub interrupts: u64,
+        pub commands: u64,
+        /// Cycles (TSC) from issuing a command to handling its completion.
+        pub total_command_cycles: u64,
+        pub max_command_cycles: u64,
+        /// Number of commands that timed out and were aborted.
+        pub command_timeouts: u64,
+        /// Number of switches from interrupts to polling.
+        pub polling_entries: u64,
+        /// Number of `poll_events` calls made while polling.
+        pub polls: u64,
+    }
+
+    /// Per-endpoint counters. Must match `usb::xhci::EndpointStats`.
+    #[repr(C)]
+    #[derive(Debug, Clone, Copy)]
+    pub struct EndpointStats {
+        /// Successful (including short packet) completions.
+        pub transfers: u64,
+        pub bytes: u64,
+        pub short_packets: u64,
+        pub errors: u64,
+        /// Failed completions by completion code. The last element counts all larger codes.
+        pub errors_by_code: [u32; NUM_STATS_COMPLETION_CODES + 1],
+        /// Maximum number of TRBs pending on the transfer ring.
+        pub peak_in_flight: u32,
+        _reserved: u32,
+        /// Gaps (TSC cycles) between handling a completion and queueing the next transfer.
+        pub rearms: u64,
+        pub total_rearm_gap_cycles: u64,
+        pub max_rearm_gap_cycles: u64,
+        _last_completion_tsc: u64,
+    }
+
     impl Controller {
-        pub unsafe fn new(xhc_mmio_base: u64) -> &'static mut Controller {
-            unsafe { &mut *cxx_xhci_controller_new(xhc_mmio_base) }
+        /// Creates a controller for the xHC whose registers are mapped at `xhc_mmio_base`.
+        ///
+        /// Each call creates an independent instance, so several xHCs can be driven at once.
+        /// Returns `None` if the USB memory pool is exhausted.
+        pub unsafe fn new(xhc_mmio_base: u64) -> Option<&'static mut Controller> {
+            unsafe { cxx_xhci_controller_new(xhc_mmio_base).as_mut() }
+        }
+
+        /// Starts initializing the controller with `num_interrupters` interrupters.
+        ///
+        /// This does not wait for the controller; call `poll_bring_up` until it reports that
+        /// the controller is running.
+        ///
+        /// Each interrupter has its own event ring which can hold `event_ring_size` events.
+        /// The number of interrupters is capped by the controller's capability, so it may be
+        /// smaller than requested (see `num_interrupters`).
+        pub fn init(
+            &mut self,
+            num_interrupters: u16,
+            event_ring_size: usize,
+        ) -> Result<(), CxxError> {
+            let res =
+                unsafe { cxx_xhci_controller_initialize(self, num_interrupters, event_ring_size) };
+            convert_res(res)
+        }
+
+        pub fn num_interrupters(&mut self) -> u16 {
+            unsafe { cxx_xhci_controller_num_interrupters(self) }
         }
 
-        pub fn init(&mut self) {
-            unsafe { cxx_xhci_controller_initialize(self) }
+        /// Advances the bring-up sequence (BIOS handoff, halt, reset, ring setup and run) as far
+        /// as the controller allows without waiting.
+        ///
+        /// Returns `Ok(true)` once the controller is running. Each step has a timeout measured
+        /// with `now_ms`, which must come from a monotonic clock.
+        pub fn poll_bring_up(&mut self, now_ms: u64) -> Result<bool, CxxError> {
+            let mut running = false;
+            let res = unsafe { cxx_xhci_controller_poll_bring_up(self, now_ms, &mut running) };
+            convert_res(res).map(|()| running)
         }
 
-        pub fn run(&mut self) -> Result<(), CxxError> {
-            let res = unsafe { cxx_xhci_controller_run(self) };
+        /// Gives up port resets that did not complete in time.
+        ///
+        /// Should be called periodically once the controller is running, with the same clock
+        /// as `poll_bring_up`.
+        pub fn check_timeouts(&mut self, now_ms: u64) -> Result<(), CxxError> {
+            let res = unsafe { cxx_xhci_controller_check_timeouts(self, now_ms) };
             convert_res(res)
         }
 
+        /// Sets the moderation of all interrupters.
+        ///
+        /// Configuring or detaching a device afterwards re-selects the moderation of the
+        /// interrupter serving its slot.
+        pub fn set_interrupt_moderation(&mut self, moderation: InterruptModeration) {
+            unsafe {
+                cxx_xhci_controller_set_interrupt_moderation(
+                    self,
+                    moderation.interval,
+                    moderation.counter,
+                )
+            }
+        }
+
         pub fn configure_connected_ports(&mut self) {
             unsafe { cxx_xhci_controller_configure_connected_ports(self) }
         }
@@ -49,31 +291,611 @@ pub mod xhci {
             convert_res(res)
         }
 
+        /// Counts an interrupt in the controller statistics.
+        pub fn note_interrupt(&mut self) {
+            unsafe { cxx_xhci_controller_note_interrupt(self) }
+        }
+
+        /// Returns a snapshot of the controller-wide counters.
+        pub fn stats(&mut self) -> ControllerStats {
+            let mut out = ControllerStats::default();
+            unsafe { cxx_xhci_controller_stats(self, &mut out) };
+            out
+        }
+
+        /// Returns a snapshot of the counters of endpoint `dci` (device context index) of the
+        /// device in `slot_id`, or `None` if the endpoint has no transfer ring.
+        pub fn endpoint_stats(&mut self, slot_id: u8, dci: u8) -> Option<EndpointStats> {
+            let mut out = MaybeUninit::<EndpointStats>::uninit();
+            let found =
+                unsafe { cxx_xhci_controller_endpoint_stats(self, slot_id, dci, out.as_mut_ptr()) };
+            found.then(|| unsafe { out.assume_init() })
+        }
+
+        /// Processes at most `max_events` events on the event ring of `interrupter`
+        /// and returns the number of processed events.
+        ///
+        /// Errors of each event are logged by the C++ side.
+        pub fn process_events(&mut self, interrupter: u16, max_events: usize) -> usize {
+            unsafe { cxx_xhci_controller_process_events(self, interrupter, max_events) }
+        }
+
         pub fn has_event(&mut self) -> bool {
             unsafe { cxx_xhci_controller_has_event(self) }
         }
+
+        /// Selects between interrupt-only and hybrid interrupt/poll event delivery.
+        pub fn set_polling_policy(&mut self, policy: PollingPolicy) {
+            let (enabled, idle_poll_budget) = match policy {
+                PollingPolicy::InterruptOnly => (false, 0),
+                PollingPolicy::Hybrid { idle_poll_budget } => (true, idle_poll_budget),
+            };
+            unsafe { cxx_xhci_controller_set_polling_policy(self, enabled, idle_poll_budget) }
+        }
+
+        /// Processes events of every event ring, on an interrupt or while polling.
+        ///
+        /// With [`PollingPolicy::InterruptOnly`] every ring is drained and `false` is returned.
+        /// With [`PollingPolicy::Hybrid`] the first call masks interrupts, each call handles at
+        /// most `max_events` events per ring, and `true` is returned until the rings have been
+        /// idle for the budget and interrupts are unmasked again. The caller should yield and
+        /// call this again while it returns `true`.
+        pub fn poll_events(&mut self, max_events: usize) -> bool {
+            unsafe { cxx_xhci_controller_poll_events(self, max_events) }
+        }
+    }
+}
+
+/// Control transfers issued without a class driver and completed through tokens.
+///
+/// The C++ side copies the data through a buffer of its own, so callers may pass ordinary
+/// memory and drop a pending [`Token`](transfer::Token) at any time.
+///
+/// Transfers are queued without the controller, from any core, and are put on the rings only
+/// when the owner of the controller calls [`issue_queued`](transfer::issue_queued). So the rings
+/// and the device slots are only ever touched with the controller locked. Each controller
+/// drains its own queue, numbered by the caller.
+///
+/// The in-flight table is shared by all controllers. Entries are allocated under a short spin
+/// lock on the C++ side, and results are handed over through an atomic state per entry.
+/// Queueing, [`Token::take`] and dropping a token may therefore run concurrently with event
+/// processing on any controller.
+pub mod transfer {
+    use super::*;
+    use core::convert::TryFrom;
+
+    /// Direction bit of `bmRequestType`.
+    const REQUEST_TYPE_IN: u8 = 0x80;
+
+    /// Maximum number of transfers in flight at once. Must match `usb::kMaxAsyncTransfers`.
+    pub const MAX_IN_FLIGHT: usize = 32;
+    /// Maximum length of the data stage. Must match `usb::kMaxAsyncTransferLength`.
+    pub const MAX_LENGTH: usize = 4096;
+
+    /// Called with the raw token of a transfer when it completes, fails to be issued or is
+    /// cancelled by a disconnect. Called with the controller locked, while it processes events
+    /// or issues queued transfers.
+    pub type Notifier = extern "C" fn(token: u32);
+
+    /// SETUP packet of a control transfer, without `wLength`.
+    #[derive(Debug, Clone, Copy, PartialEq, Eq)]
+    pub struct SetupPacket {
+        pub request_type: u8,
+        pub request: u8,
+        pub value: u16,
+        pub index: u16,
+    }
+
+    /// Must match `usb::AsyncTransferResult`.
+    #[repr(C)]
+    pub(crate) struct RawResult {
+        error: i32,
+        transferred: i32,
+    }
+
+    /// Returns the index in the in-flight table (below [`MAX_IN_FLIGHT`]) of a raw token.
+    pub fn slot_of(raw: u32) -> usize {
+        (raw & 0xff) as usize
+    }
+
+    pub fn set_notifier(notifier: Notifier) {
+        unsafe { cxx_usb_async_set_notifier(notifier) }
+    }
+
+    /// Handle of a submitted transfer. Dropping it before completion discards the result.
+    ///
+    /// Neither [`Token::take`] nor dropping needs the controller to be locked, so they may run
+    /// concurrently with event processing.
+    #[derive(Debug)]
+    pub struct Token(u32);
+
+    impl Token {
+        /// Index in the in-flight table, which is also what the notifier receives through
+        /// [`slot_of`].
+        pub fn slot(&self) -> usize {
+            slot_of(self.0)
+        }
+
+        /// Returns the number of transferred bytes once the transfer has completed, copying
+        /// received data into `buf`. Returns `None` while it is in flight.
+        ///
+        /// After a result is returned the token is spent and further calls fail.
+        pub fn take(&mut self, buf: &mut [u8]) -> Option<Result<usize, CxxError>> {
+            let mut out = RawResult {
+                error: 0,
+                transferred: 0,
+            };
+            let done = unsafe { cxx_usb_async_take(self.0, buf.as_mut_ptr(), buf.len(), &mut out) };
+            if !done {
+                return None;
+            }
+            self.0 = 0;
+            Some(convert_res(out.error).map(|()| out.transferred as usize))
+        }
+    }
+
+    impl Drop for Token {
+        fn drop(&mut self) {
+            if self.0 != 0 {
+                unsafe { cxx_usb_async_release(self.0) }
+            }
+        }
+    }
+
+    /// Queues a control IN transfer of at most `length` bytes to the default control pipe of
+    /// the device in `slot_id`. The direction bit of `request_type` is set.
+    ///
+    /// The transfer is only put on a ring by the next [`issue_queued`] for `queue`. Errors from
+    /// issuing it, such as a missing device, are reported through the token.
+    pub fn queue_control_in(
+        queue: u8,
+        slot_id: u8,
+        setup: SetupPacket,
+        length: u16,
+    ) -> Result<Token, CxxError> {
+        let setup = SetupPacket {
+            request_type: setup.request_type | REQUEST_TYPE_IN,
+            ..setup
+        };
+        unsafe { queue_control(queue, slot_id, setup, length, core::ptr::null()) }
+    }
+
+    /// Queues a control OUT transfer of `data` to the default control pipe of the device in
+    /// `slot_id`. The direction bit of `request_type` is cleared and `data` is copied before
+    /// this returns.
+    ///
+    /// The transfer is only put on a ring by the next [`issue_queued`] for `queue`.
+    pub fn queue_control_out(
+        queue: u8,
+        slot_id: u8,
+        setup: SetupPacket,
+        data: &[u8],
+    ) -> Result<Token, CxxError> {
+        // Longer data is rejected by the C++ side before it is read.
+        let length = u16::try_from(data.len()).unwrap_or(u16::MAX);
+        let setup = SetupPacket {
+            request_type: setup.request_type & !REQUEST_TYPE_IN,
+            ..setup
+        };
+        unsafe { queue_control(queue, slot_id, setup, length, data.as_ptr()) }
+    }
+
+    unsafe fn queue_control(
+        queue: u8,
+        slot_id: u8,
+        setup: SetupPacket,
+        length: u16,
+        data: *const u8,
+    ) -> Result<Token, CxxError> {
+        let mut token = 0;
+        let res = unsafe {
+            cxx_usb_async_control_queue(
+                queue,
+                slot_id,
+                setup.request_type,
+                setup.request,
+                setup.value,
+                setup.index,
+                length,
+                data,
+                &mut token,
+            )
+        };
+        convert_res(res).map(|()| Token(token))
+    }
+
+    /// Puts the transfers queued for `queue` on the rings of `xhc`, in the order they were
+    /// queued. Transfers that cannot be issued complete with the error.
+    pub fn issue_queued(xhc: &mut xhci::Controller, queue: u8) {
+        unsafe { cxx_usb_async_issue_queued(xhc, queue) }
+    }
+}
+
+/// Lock-free single-producer/single-consumer queues carrying HID input from the C++ drivers.
+pub mod input {
+    use super::*;
+    use core::{
+        cell::UnsafeCell,
+        sync::atomic::{self, AtomicBool, AtomicU32, AtomicU64, Ordering},
+    };
+
+    /// Fixed-size input record. Must match `usb::InputRecord`.
+    #[repr(C)]
+    #[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+    pub struct InputRecord {
+        /// Mouse buttons or keyboard modifier keys.
+        pub buttons: u8,
+        /// Keyboard keycode.
+        pub keycode: u8,
+        /// Mouse wheel rotation.
+        pub wheel: i8,
+        /// Keyboard: `1` if the key was released, `0` if it was pressed.
+        pub released: u8,
+        pub displacement_x: i16,
+        pub displacement_y: i16,
+    }
+
+    #[repr(u32)]
+    #[derive(Debug, Clone, Copy, PartialEq, Eq)]
+    pub enum QueueId {
+        Mouse = 0,
+        Keyboard = 1,
+    }
+
+    const NUM_QUEUES: usize = 2;
+    const CAPACITY: u32 = 256;
+
+    /// Called when a queue becomes non-empty. May be called spuriously.
+    pub type Notifier = extern "C" fn(queue_id: u32);
+
+    #[repr(C, align(64))]
+    struct Producer {
+        head: AtomicU32,
+        dropped: AtomicU32,
+    }
+
+    #[repr(C, align(64))]
+    struct Consumer {
+        tail: AtomicU32,
+    }
+
+    /// Must match the layout of `usb::InputQueue`.
+    #[repr(C)]
+    pub struct InputQueue {
+        producer: Producer,
+        consumer: Consumer,
+        records: [UnsafeCell<InputRecord>; CAPACITY as usize],
+    }
+
+    const _: () = assert!(core::mem::size_of::<InputQueue>() == 128 + 8 * CAPACITY as usize);
+
+    // One producer and one consumer, which synchronize through `head` and `tail`.
+    unsafe impl Sync for InputQueue {}
+
+    impl InputQueue {
+        /// Creates an empty queue owned by Rust whose first record gets the sequence number
+        /// `start`.
+        ///
+        /// The drivers publish only to the queues returned by [`QueueConsumer::take`]. A queue
+        /// created here stands in for them in tests, which play the producer with
+        /// [`InputQueue::publish`].
+        pub const fn new(start: u32) -> Self {
+            const EMPTY: UnsafeCell<InputRecord> = UnsafeCell::new(InputRecord {
+                buttons: 0,
+                keycode: 0,
+                wheel: 0,
+                released: 0,
+                displacement_x: 0,
+                displacement_y: 0,
+            });
+            Self {
+                producer: Producer {
+                    head: AtomicU32::new(start),
+                    dropped: AtomicU32::new(0),
+                },
+                consumer: Consumer {
+                    tail: AtomicU32::new(start),
+                },
+                records: [EMPTY; CAPACITY as usize],
+            }
+        }
+
+        /// Appends `record` the way `usb::PublishInput` does, without notifying. Returns `false`
+        /// and counts the record as dropped if the queue is full.
+        pub fn publish(&self, record: InputRecord) -> bool {
+            let head = self.producer.head.load(Ordering::Relaxed);
+            let tail = self.consumer.tail.load(Ordering::Acquire);
+            if head.wrapping_sub(tail) == CAPACITY {
+                self.producer.dropped.fetch_add(1, Ordering::Relaxed);
+                return false;
+            }
+            unsafe { *self.records[(head & (CAPACITY - 1)) as usize].get() = record };
+            self.producer
+                .head
+                .store(head.wrapping_add(1), Ordering::Release);
+            true
+        }
+
+        pub fn set_notifier(notifier: Notifier) {
+            unsafe { cxx_input_queue_set_notifier(notifier) }
+        }
+
+        /// Returns the number of records dropped because the queue was full.
+        pub fn dropped(&self) -> u32 {
+            self.producer.dropped.load(Ordering::Relaxed)
+        }
+
+        pub fn is_empty(&self) -> bool {
+            // Pairs with the fence the producer issues before checking whether to notify.
+            atomic::fence(Ordering::SeqCst);
+            let head = self.producer.head.load(Ordering::Acquire);
+            head == self.consumer.tail.load(Ordering::Relaxed)
+        }
+    }
+
+    /// The consuming side of an input queue.
+    ///
+    /// Only one `QueueConsumer` exists for each queue.
+    pub struct QueueConsumer {
+        queue: &'static InputQueue,
+    }
+
+    // The queue is shared only with the C++ producer, which synchronizes through atomics.
+    unsafe impl Send for QueueConsumer {}
+
+    static TAKEN: [AtomicBool; NUM_QUEUES] = [AtomicBool::new(false), AtomicBool::new(false)];
+
+    impl QueueConsumer {
+        /// Takes the consumer of the queue `id`. Returns `None` if it has already been taken.
+        pub fn take(id: QueueId) -> Option<Self> {
+            if TAKEN[id as usize].swap(true, Ordering::AcqRel) {
+                return None;
+            }
+            let queue = unsafe { &*cxx_input_queue(id as u32) };
+            Some(Self { queue })
+        }
+
+        /// Wraps a queue created with [`InputQueue::new`].
+        pub fn new(queue: &'static InputQueue) -> Self {
+            Self { queue }
+        }
+
+        pub fn queue(&self) -> &'static InputQueue {
+            self.queue
+        }
+
+        /// Returns the sequence number of the record the next `drain` starts from.
+        pub fn position(&self) -> u32 {
+            self.queue.consumer.tail.load(Ordering::Relaxed)
+        }
+
+        /// Moves as many records as fit into `buf` out of the queue and returns the count.
+        pub fn drain(&mut self, buf: &mut [InputRecord]) -> usize {
+            let tail = self.queue.consumer.tail.load(Ordering::Relaxed);
+            let head = self.queue.producer.head.load(Ordering::Acquire);
+            let len = usize::min(head.wrapping_sub(tail) as usize, buf.len());
+            for (i, dst) in buf[..len].iter_mut().enumerate() {
+                let index = tail.wrapping_add(i as u32) & (CAPACITY - 1);
+                *dst = unsafe { *self.queue.records[index as usize].get() };
+            }
+            self.queue
+                .consumer
+                .tail
+                .store(tail.wrapping_add(len as u32), Ordering::Release);
+            len
+        }
+    }
+
+    /// Mouse motion accumulated by the mouse drivers while coalescing is enabled.
+    ///
+    /// Must match the layout and bit assignment of `usb::PendingMotion`.
+    #[repr(C, align(64))]
+    pub struct PendingMotion {
+        packed: AtomicU64,
+    }
+
+    /// Motion taken out of [`PendingMotion`].
+    #[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+    pub struct MotionDelta {
+        /// The motion happened after the mouse queue record with this sequence number (modulo
+        /// 2^15) and every earlier one, and before all later records.
+        pub seq: u16,
+        pub x: i32,
+        pub y: i32,
+        pub wheel: i32,
+    }
+
+    impl MotionDelta {
+        /// Returns `true` if every record queued before the motion has been consumed, where
+        /// `position` is the sequence number of the next record to consume.
+        pub fn is_due(&self, position: u32) -> bool {
+            (position as u16 & 0x7fff) == self.seq
+        }
+    }
+
+    fn unpack(packed: u64, shift: u32, bits: u32) -> i32 {
+        // Shift the field to the top, then back down to sign-extend it.
+        ((packed << (64 - shift - bits)) as i64 >> (64 - bits)) as i32
+    }
+
+    impl PendingMotion {
+        /// Creates motion owned by Rust holding `packed`, in the bit layout of
+        /// `usb::PendingMotion`. The drivers add up motion only in [`PendingMotion::get`].
+        pub const fn new(packed: u64) -> Self {
+            Self {
+                packed: AtomicU64::new(packed),
+            }
+        }
+
+        pub fn get() -> &'static Self {
+            unsafe { &*cxx_input_pending_motion() }
+        }
+
+        /// Enables or disables motion coalescing in the mouse drivers.
+        ///
+        /// While enabled, reports that only move the mouse are added up here instead of being
+        /// queued, so the consumer must call [`PendingMotion::take`] whenever it is woken up.
+        pub fn set_coalescing(enabled: bool) {
+            unsafe { cxx_input_set_mouse_coalescing(enabled) }
+        }
+
+        /// Takes the accumulated motion, or returns `None` if nothing has accumulated.
+        pub fn take(&self) -> Option<MotionDelta> {
+            let packed = self.packed.swap(0, Ordering::Acquire);
+            if packed & 1 == 0 {
+                return None;
+            }
+            Some(MotionDelta {
+                seq: ((packed >> 1) & 0x7fff) as u16,
+                wheel: unpack(packed, 16, 8),
+                x: unpack(packed, 24, 20),
+                y: unpack(packed, 44, 20),
+            })
+        }
     }
 }
 
 // opaque type
-pub enum HidMouseDriver {}
+/// A block storage class driver: Bulk-Only Transport or USB Attached SCSI.
+pub enum MassStorageDriver {}
+
+/// Called when a mass storage device (BOT or UAS) becomes ready.
+pub type MassStorageObserver =
+    extern "C" fn(driver: *mut MassStorageDriver, num_blocks: u64, block_size: u32);
 
-pub type HidMouseObserver = extern "C" fn(buttons: u8, displacement_x: i8, displacement_y: i8);
+/// Called when a block I/O request completes. `result` is `0` on success or a C++ error code.
+pub type MassStorageCompletion = extern "C" fn(context: *mut c_void, result: i32);
 
-impl HidMouseDriver {
-    pub fn set_default_observer(observer: HidMouseObserver) {
-        unsafe { cxx_xhci_hid_mouse_driver_set_default_observer(observer) }
+impl MassStorageDriver {
+    pub fn set_default_observer(observer: MassStorageObserver) {
+        unsafe { cxx_xhci_mass_storage_driver_set_default_observer(observer) }
+    }
+
+    pub fn num_blocks(&mut self) -> u64 {
+        unsafe { cxx_xhci_mass_storage_driver_num_blocks(self) }
+    }
+
+    pub fn block_size(&mut self) -> u32 {
+        unsafe { cxx_xhci_mass_storage_driver_block_size(self) }
+    }
+
+    /// Starts reading `num_blocks` blocks from `lba` into `buf`.
+    ///
+    /// The request goes straight onto the device's transfer rings, so it takes `xhc`, the
+    /// locked controller the device is attached to: only its holder may produce on the rings.
+    ///
+    /// `callback` is called with `context` when the request completes. It may be called before
+    /// this method returns if the blocks are in the read-ahead buffer.
+    ///
+    /// # Safety
+    ///
+    /// `xhc` must be the controller the device is attached to. `buf` must point to
+    /// `num_blocks * block_size()` bytes of identity-mapped memory that stays valid until
+    /// `callback` is called. `callback` is called while the controller is processing events, so
+    /// it must not call back into the controller.
+    pub unsafe fn read(
+        &mut self,
+        _xhc: &mut xhci::Controller,
+        lba: u64,
+        num_blocks: u32,
+        buf: *mut u8,
+        callback: MassStorageCompletion,
+        context: *mut c_void,
+    ) -> Result<(), CxxError> {
+        let res = unsafe {
+            cxx_xhci_mass_storage_driver_read(self, lba, num_blocks, buf, callback, context)
+        };
+        convert_res(res)
+    }
+
+    /// Starts writing `num_blocks` blocks from `buf` to `lba`. Like [`MassStorageDriver::read`],
+    /// it takes the locked controller the device is attached to.
+    ///
+    /// # Safety
+    ///
+    /// Same as [`MassStorageDriver::read`].
+    pub unsafe fn write(
+        &mut self,
+        _xhc: &mut xhci::Controller,
+        lba: u64,
+        num_blocks: u32,
+        buf: *const u8,
+        callback: MassStorageCompletion,
+        context: *mut c_void,
+    ) -> Result<(), CxxError> {
+        let res = unsafe {
+            cxx_xhci_mass_storage_driver_write(self, lba, num_blocks, buf, callback, context)
+        };
+        convert_res(res)
     }
 }
 
 // opaque type
-pub enum HidKeyboardDriver {}
+/// A CDC class driver: a virtual serial port (ACM) or an Ethernet function (ECM).
+pub enum CdcDriver {}
 
-pub type HidKeyboardObserver = extern "C" fn(modifier: u8, keycode: u8);
+/// Must match `usb::CDCDriver::Function`.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum CdcFunction {
+    Acm,
+    Ecm,
+    Unknown(u32),
+}
 
-impl HidKeyboardDriver {
-    pub fn set_default_observer(observer: HidKeyboardObserver) {
-        unsafe { cxx_xhci_hid_keyboard_driver_set_default_observer(observer) }
+/// Called when a CDC device has posted its receive buffers and accepts sends.
+pub type CdcObserver = extern "C" fn(driver: *mut CdcDriver);
+
+/// Called with each received transfer. `buf` is reused for the next transfer after return.
+pub type CdcReceiver = extern "C" fn(context: *mut c_void, buf: *const u8, len: i32);
+
+/// Called when a send completes. `result` is `0` on success or a C++ error code.
+pub type CdcSendCompletion = extern "C" fn(context: *mut c_void, result: i32);
+
+impl CdcDriver {
+    pub fn set_default_observer(observer: CdcObserver) {
+        unsafe { cxx_xhci_cdc_driver_set_default_observer(observer) }
+    }
+
+    pub fn kind(&mut self) -> CdcFunction {
+        match unsafe { cxx_xhci_cdc_driver_kind(self) } {
+            0 => CdcFunction::Acm,
+            1 => CdcFunction::Ecm,
+            n => CdcFunction::Unknown(n),
+        }
+    }
+
+    /// Sets the callback that receives data from the device.
+    ///
+    /// # Safety
+    ///
+    /// `context` must stay valid while the receiver is set. `callback` is called while the
+    /// controller is processing events, so it must not call back into the controller.
+    pub unsafe fn set_receiver(&mut self, callback: CdcReceiver, context: *mut c_void) {
+        unsafe { cxx_xhci_cdc_driver_set_receiver(self, callback, context) }
+    }
+
+    /// Starts sending `len` bytes from `buf` without copying them. For ECM, `buf` is one
+    /// Ethernet frame.
+    ///
+    /// The transfer goes straight onto the device's transfer ring, so it takes `xhc`, the
+    /// locked controller the device is attached to: only its holder may produce on the rings.
+    ///
+    /// # Safety
+    ///
+    /// `xhc` must be the controller the device is attached to. `buf` must point to `len` bytes
+    /// of identity-mapped memory that stays valid until `callback` is called. `callback` is
+    /// called while the controller is processing events, so it must not call back into the
+    /// controller.
+    pub unsafe fn send(
+        &mut self,
+        _xhc: &mut xhci::Controller,
+        buf: *const u8,
+        len: i32,
+        callback: CdcSendCompletion,
+        context: *mut c_void,
+    ) -> Result<(), CxxError> {
+        let res = unsafe { cxx_xhci_cdc_driver_send(self, buf, len, callback, context) };
+        convert_res(res)
     }
 }
 
@@ -83,6 +905,169 @@ pub unsafe fn set_memory_pool(pool_ptr: u64, pool_size: usize) {
     }
 }
 
+/// Latency tracing of the USB stack, measured with the TSC.
+///
+/// Besides the latency of each stage of a transfer, the time spent in event dispatch, TRB writes
+/// and device enumeration is recorded, so runs on the same machine can be compared.
+///
+/// Only recorded when the C++ side is built with `MIKANOS_USB_LATENCY_TRACE`.
+pub mod trace {
+    use super::*;
+
+    /// Must match `usb::TraceStage`.
+    #[repr(u8)]
+    #[derive(Debug, Clone, Copy, PartialEq, Eq)]
+    pub enum Stage {
+        /// A doorbell was rung. No latency is recorded.
+        Doorbell = 0,
+        /// A transfer event was taken from the event ring (since the last doorbell of the endpoint).
+        EventArrival = 1,
+        /// `Device::OnTransferEventReceived` was entered.
+        TransferEvent = 2,
+        /// The class driver is about to handle the received data.
+        DataReceived = 3,
+        /// The Rust side finished handling an input record (since it was queued).
+        ObserverReturn = 4,
+        /// Time spent dispatching one event from the event ring.
+        EventDispatch = 5,
+        /// Time spent writing one TRB in `Ring::Push`.
+        RingPush = 6,
+        /// Time from detecting a connection to handing the configured device to its class driver.
+        Enumeration = 7,
+    }
+
+    impl Stage {
+        pub const ALL: [Stage; 8] = [
+            Stage::Doorbell,
+            Stage::EventArrival,
+            Stage::TransferEvent,
+            Stage::DataReceived,
+            Stage::ObserverReturn,
+            Stage::EventDispatch,
+            Stage::RingPush,
+            Stage::Enumeration,
+        ];
+    }
+
+    /// Distribution of the latency (in TSC cycles) of a stage. Must match `usb::LatencyHistogram`.
+    #[repr(C)]
+    #[derive(Debug, Default, Clone, Copy)]
+    pub struct Histogram {
+        pub count: u64,
+        pub total_cycles: u64,
+        pub max_cycles: u64,
+        /// `buckets[i]` counts latencies in `[2^i, 2^(i+1))` cycles.
+        pub buckets: [u32; 32],
+    }
+
+    /// An entry of the trace buffer. Must match `usb::TraceRecord`.
+    #[repr(C)]
+    #[derive(Debug, Default, Clone, Copy)]
+    pub struct Record {
+        pub tsc: u64,
+        /// Cycles since the previous stage (or the duration of the stage), saturated to 32 bits.
+        pub latency_cycles: u32,
+        pub stage: u8,
+        pub slot_id: u8,
+        pub dci: u8,
+        _reserved: u8,
+    }
+
+    /// Returns the latency distribution of `stage`, or `None` if tracing is disabled.
+    pub fn histogram(stage: Stage) -> Option<Histogram> {
+        let mut out = Histogram::default();
+        unsafe { cxx_latency_trace_histogram(stage as u8, &mut out) }.then(|| out)
+    }
+
+    /// Moves the oldest trace records into `buf` and returns the count.
+    pub fn read_records(buf: &mut [Record]) -> usize {
+        unsafe { cxx_latency_trace_read(buf.as_mut_ptr(), buf.len()) }
+    }
+
+    /// Clears the distributions and the trace buffer.
+    pub fn reset() {
+        unsafe { cxx_latency_trace_reset() }
+    }
+
+    /// Records that the input record `seq` of queue `id` has been handled.
+    pub fn input_consumed(id: input::QueueId, seq: u32) {
+        unsafe { cxx_latency_trace_input_consumed(id as u32, seq) }
+    }
+}
+
+/// Recording of the raw events taken from the event rings, in arrival order.
+///
+/// Only recorded when the C++ side is built with `MIKANOS_USB_EVENT_TRACE`, and only after
+/// [`event_trace::set_enabled`] turns it on.
+pub mod event_trace {
+    use super::*;
+
+    /// A recorded event. Must match `usb::xhci::EventTraceRecord`.
+    #[repr(C)]
+    #[derive(Debug, Default, Clone, Copy)]
+    pub struct Record {
+        /// TSC when the event was taken from the event ring.
+        pub tsc: u64,
+        /// The event TRB as written by the controller, including the cycle bit.
+        pub trb: [u32; 4],
+        /// PORTSC before the handler ran, for Port Status Change Events. Otherwise `0`.
+        pub portsc: u32,
+        pub interrupter: u16,
+        _reserved: u16,
+    }
+
+    /// Starts or stops recording. Returns `false` if recording is not built in.
+    pub fn set_enabled(enabled: bool) -> bool {
+        unsafe { cxx_event_trace_set_enabled(enabled) }
+    }
+
+    /// Moves the oldest records into `buf` and returns the count.
+    pub fn read_records(buf: &mut [Record]) -> usize {
+        unsafe { cxx_event_trace_read(buf.as_mut_ptr(), buf.len()) }
+    }
+
+    /// Number of records overwritten before they were read.
+    pub fn dropped() -> u64 {
+        unsafe { cxx_event_trace_dropped() }
+    }
+
+    /// Discards the records and the dropped count.
+    pub fn reset() {
+        unsafe { cxx_event_trace_reset() }
+    }
+}
+
+pub mod log {
+    use super::*;
+
+    /// Log level of the C++ side. Must match `LogLevel`.
+    #[repr(i32)]
+    #[derive(Debug, Clone, Copy, PartialEq, Eq)]
+    pub enum Level {
+        Error = 3,
+        Warn = 4,
+        Info = 6,
+        Debug = 7,
+        Trace = 8,
+    }
+
+    /// Sets the runtime log threshold of the C++ side.
+    ///
+    /// Messages below the threshold are dropped before being formatted.
+    /// Messages below the build-time threshold (`MIKANOS_USB_MAX_LOG_LEVEL`) are never emitted.
+    pub fn set_level(level: Level) {
+        unsafe { cxx_set_log_level(level as i32) }
+    }
+
+    /// Formats and emits at most `max_records` deferred log records.
+    ///
+    /// Records are only deferred when the C++ side is built with `MIKANOS_USB_BINARY_LOG`;
+    /// otherwise this always returns 0.
+    pub fn flush(max_records: usize) -> usize {
+        unsafe { cxx_flush_log(max_records) }
+    }
+}
+
 #[track_caller]
 fn convert_res(res: i32) -> Result<(), CxxError> {
     match res {
@@ -1,5 +1,10 @@
-use crate::log::{self, Level};
+use crate::{
+    log::{self, Level},
+    memory, paging,
+    prelude::*,
+};
 use core::{ptr, slice, str};
+use x86_64::{structures::paging::PhysFrame, PhysAddr};
 
 #[no_mangle]
 extern "C" fn sabios_log(
@@ -38,6 +43,56 @@ extern "C" fn sabios_log(
     msg_len as i32
 }
 
+/// Allocates `num_frames` physically contiguous frames for the USB stack's DMA memory pool and
+/// maps them at the same virtual address.
+///
+/// Returns the base address, or 0 if the frames cannot be allocated or mapped.
+#[no_mangle]
+extern "C" fn sabios_alloc_dma_frames(num_frames: usize) -> usize {
+    match alloc_dma_frames(num_frames) {
+        Ok(base_addr) => base_addr as usize,
+        Err(err) => {
+            warn!(
+                "failed to grow USB memory pool by {} frames: {}",
+                num_frames, err
+            );
+            0
+        }
+    }
+}
+
+// Lock order: the page table, the memory manager, then the USB stack's pool lock, which the
+// stack releases before calling into these functions. Both locks are only tried, so that
+// contention fails the request instead of panicking.
+
+fn alloc_dma_frames(num_frames: usize) -> Result<u64> {
+    // The page table is locked while the kernel is being initialized; the initial pool is
+    // large enough for that phase.
+    let mut mapper = paging::try_lock_mapper()?;
+    let mut allocator = memory::try_lock_memory_manager()?;
+    let frame_range = allocator.allocate(num_frames)?;
+    let base_addr = frame_range.start.start_address().as_u64();
+    // On failure the frames are left allocated, since some of them may already be mapped.
+    paging::make_identity_mapping(&mut mapper, &mut *allocator, base_addr, num_frames)?;
+    Ok(base_addr)
+}
+
+/// Gives back frames allocated by [`sabios_alloc_dma_frames`].
+#[no_mangle]
+extern "C" fn sabios_free_dma_frames(base_addr: usize, num_frames: usize) {
+    if let Err(err) = free_dma_frames(base_addr as u64, num_frames) {
+        warn!("failed to shrink USB memory pool: {}", err);
+    }
+}
+
+fn free_dma_frames(base_addr: u64, num_frames: usize) -> Result<()> {
+    let mut mapper = paging::try_lock_mapper()?;
+    paging::remove_identity_mapping(&mut mapper, base_addr, num_frames)?;
+    let start = PhysFrame::from_start_address(PhysAddr::new(base_addr))?;
+    memory::try_lock_memory_manager()?.free(PhysFrame::range(start, start + num_frames as u64));
+    Ok(())
+}
+
 extern "C" {
     fn __errno() -> *mut i32;
 }
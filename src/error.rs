@@ -2,7 +2,11 @@ use bootloader::boot_info::PixelFormat;
 use conquer_once::{TryGetError, TryInitError};
 use core::{fmt, num::TryFromIntError, panic::Location};
 use mikanos_usb::CxxError;
-use x86_64::structures::paging::{mapper::MapToError, page::AddressNotAligned, Size4KiB};
+use x86_64::structures::paging::{
+    mapper::{MapToError, UnmapError},
+    page::AddressNotAligned,
+    Size4KiB,
+};
 
 pub(crate) type Result<T> = core::result::Result<T, Error>;
 
@@ -46,6 +50,7 @@ impl fmt::Display for Error {
 pub(crate) enum ErrorKind {
     AddressNotAligned(AddressNotAligned),
     MapTo(MapToError<Size4KiB>),
+    Unmap(UnmapError),
     TryInit(TryInitError),
     TryGet(TryGetError),
     TryFromInt(TryFromIntError),
@@ -75,6 +80,9 @@ pub(crate) enum ErrorKind {
     UnknownXHCISpeedID,
     NoWaiter,
     EndpointNotInCharge,
+    RingFull,
+    Timeout,
+    TooManyEnumerations,
     NoPciMsi,
     Unknown,
 }
@@ -84,6 +92,7 @@ impl fmt::Display for ErrorKind {
         match self {
             ErrorKind::AddressNotAligned(err) => write!(f, "{}", err),
             ErrorKind::MapTo(err) => write!(f, "{:?}", err),
+            ErrorKind::Unmap(err) => write!(f, "{:?}", err),
             ErrorKind::TryInit(err) => write!(f, "{}", err),
             ErrorKind::TryGet(err) => write!(f, "{}", err),
             ErrorKind::UnsupportedPixelFormat(pixel_format) => {
@@ -109,6 +118,13 @@ impl From<MapToError<Size4KiB>> for Error {
     }
 }
 
+impl From<UnmapError> for Error {
+    #[track_caller]
+    fn from(err: UnmapError) -> Self {
+        Error::from(ErrorKind::Unmap(err))
+    }
+}
+
 impl From<TryInitError> for Error {
     #[track_caller]
     fn from(err: TryInitError) -> Self {
@@ -150,6 +166,10 @@ impl From<CxxError> for Error {
             13 => UnknownXHCISpeedID,
             14 => NoWaiter,
             15 => EndpointNotInCharge,
+            16 => RingFull,
+            17 => IndexOutOfRange,
+            18 => Timeout,
+            19 => TooManyEnumerations,
             _ => Unknown,
         };
         Error::from(kind)
@@ -11,9 +11,23 @@ use x86_64::structures::idt::{InterruptDescriptorTable, InterruptStackFrame, Pag
 pub(crate) enum InterruptIndex {
     Xhci = 0x40,
     Timer = 0x41,
+    Xhci1 = 0x42,
+    Xhci2 = 0x43,
+    Xhci3 = 0x44,
 }
 
 impl InterruptIndex {
+    /// Vector of the `index`-th xHC.
+    pub(crate) fn xhci(index: usize) -> Option<Self> {
+        match index {
+            0 => Some(Self::Xhci),
+            1 => Some(Self::Xhci1),
+            2 => Some(Self::Xhci2),
+            3 => Some(Self::Xhci3),
+            _ => None,
+        }
+    }
+
     pub(crate) fn as_u8(self) -> u8 {
         self as u8
     }
@@ -39,7 +53,10 @@ pub(crate) fn init() {
         idt.segment_not_present
             .set_handler_fn(segment_not_present_handler);
         idt.double_fault.set_handler_fn(double_fault_handler);
-        idt[InterruptIndex::Xhci.as_usize()].set_handler_fn(xhc::interrupt_handler);
+        idt[InterruptIndex::Xhci.as_usize()].set_handler_fn(xhc::interrupt_handler::<0>);
+        idt[InterruptIndex::Xhci1.as_usize()].set_handler_fn(xhc::interrupt_handler::<1>);
+        idt[InterruptIndex::Xhci2.as_usize()].set_handler_fn(xhc::interrupt_handler::<2>);
+        idt[InterruptIndex::Xhci3.as_usize()].set_handler_fn(xhc::interrupt_handler::<3>);
         idt[InterruptIndex::Timer.as_usize()].set_handler_fn(timer::lapic::interrupt_handler);
         idt
     });
@@ -1,10 +1,7 @@
-use crate::{
-    layer,
-    prelude::*,
-    sync::{mpsc, OnceCell},
-};
+use crate::{layer, prelude::*, xhc::InputReceiver};
 use core::future::Future;
 use enumflags2::{bitflags, BitFlags};
+use mikanos_usb as usb;
 
 const KEYCODE_MAP: [char; 256] = [
     '\0', '\0', '\0', '\0', 'a', 'b', 'c', 'd', // 0
@@ -94,6 +91,7 @@ pub(crate) enum Modifier {
 struct RawKeyboardEvent {
     modifier: BitFlags<Modifier>,
     keycode: u8,
+    pressed: bool,
 }
 
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
@@ -101,29 +99,30 @@ pub(crate) struct KeyboardEvent {
     pub(crate) modifier: BitFlags<Modifier>,
     pub(crate) keycode: u8,
     pub(crate) ascii: char,
+    /// `false` if the key was released.
+    pub(crate) pressed: bool,
 }
 
-static KEYBOARD_EVENT_TX: OnceCell<mpsc::Sender<RawKeyboardEvent>> = OnceCell::uninit();
-
-pub(crate) extern "C" fn observer(modifier: u8, keycode: u8) {
-    let modifier = BitFlags::<Modifier>::from_bits_truncate(modifier);
-    let event = RawKeyboardEvent { modifier, keycode };
-    let res = KEYBOARD_EVENT_TX.try_get().and_then(|tx| tx.send(event));
-
-    if let Err(err) = res {
-        error!("failed to enqueue to the queue: {}", err);
+impl From<usb::input::InputRecord> for RawKeyboardEvent {
+    fn from(record: usb::input::InputRecord) -> Self {
+        Self {
+            modifier: BitFlags::<Modifier>::from_bits_truncate(record.buttons),
+            keycode: record.keycode,
+            pressed: record.released == 0,
+        }
     }
 }
 
 pub(crate) fn handler_task() -> impl Future<Output = Result<()>> {
-    // Initialize KEYBOARD_EVENT_TX before co-task starts
-    let (tx, mut rx) = mpsc::channel(100);
-    KEYBOARD_EVENT_TX.init_once(|| tx);
+    // Take the input queue before co-task starts
+    let rx = InputReceiver::new(usb::input::QueueId::Keyboard);
 
     async move {
+        let mut rx = rx?;
         let tx = layer::event_tx();
 
-        while let Some(event) = rx.next().await {
+        while let Some(record) = rx.next().await {
+            let event = RawKeyboardEvent::from(record);
             let ascii = if event
                 .modifier
                 .intersects(Modifier::LShift | Modifier::RShift)
@@ -136,6 +135,7 @@ pub(crate) fn handler_task() -> impl Future<Output = Result<()>> {
                 modifier: event.modifier,
                 keycode: event.keycode,
                 ascii,
+                pressed: event.pressed,
             };
             tx.keyboard_event(event).await?;
         }
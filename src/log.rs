@@ -1,5 +1,6 @@
 use crate::{print, println, serial_print, serial_println};
 use core::fmt;
+use mikanos_usb as usb;
 
 static CONSOLE_LOG_LEVEL: spin::RwLock<Level> = spin::RwLock::new(Level::Warn);
 static SERIAL_LOG_LEVEL: spin::RwLock<Level> = spin::RwLock::new(Level::Info);
@@ -29,6 +30,16 @@ impl fmt::Display for Level {
 pub(crate) fn set_level(console_level: Level, serial_level: Level) {
     *CONSOLE_LOG_LEVEL.write() = console_level;
     *SERIAL_LOG_LEVEL.write() = serial_level;
+
+    // Let the USB stack drop messages nobody would print before formatting them.
+    let usb_level = match console_level.max(serial_level) {
+        Level::Error => usb::log::Level::Error,
+        Level::Warn => usb::log::Level::Warn,
+        Level::Info => usb::log::Level::Info,
+        Level::Debug => usb::log::Level::Debug,
+        Level::Trace => usb::log::Level::Trace,
+    };
+    usb::log::set_level(usb_level);
 }
 
 #[doc(hidden)]
@@ -84,7 +84,8 @@ fn init(boot_info: &'static mut BootInfo) -> Result<()> {
     graphics::init(frame_buffer)?;
 
     // Initialize memory mapping / frame allocator / heap
-    let mut mapper = unsafe { paging::init(physical_memory_offset) };
+    unsafe { paging::init(physical_memory_offset) };
+    let mut mapper = paging::lock_mapper();
     {
         let mut allocator = memory::lock_memory_manager();
 
@@ -106,6 +107,7 @@ fn init(boot_info: &'static mut BootInfo) -> Result<()> {
 
     // Initialize LAPIC timer
     unsafe { acpi::init(&mut mapper, rsdp) }?;
+    drop(mapper);
     timer::lapic::init();
 
     // Initialize file system
@@ -127,7 +129,9 @@ fn start_window() -> ! {
 
     // Initialize executor & co-tasks
     let mut executor = Executor::new(task_id);
-    executor.spawn(CoTask::new(xhc::handler_task()));
+    for index in 0..xhc::num_controllers() {
+        executor.spawn(CoTask::new(xhc::handler_task(index)));
+    }
     executor.spawn(CoTask::new(timer::lapic::handler_task()));
     executor.spawn(CoTask::new(mouse::handler_task().unwrap()));
     executor.spawn(CoTask::new(keyboard::handler_task().unwrap()));
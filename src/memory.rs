@@ -48,6 +48,11 @@ pub(crate) fn lock_memory_manager() -> SpinMutexGuard<'static, BitmapMemoryManag
     MEMORY_MANAGER.lock()
 }
 
+/// Locks the memory manager without spinning, failing if it is already locked.
+pub(crate) fn try_lock_memory_manager() -> Result<SpinMutexGuard<'static, BitmapMemoryManager>> {
+    MEMORY_MANAGER.try_lock()
+}
+
 impl BitmapMemoryManager {
     pub(crate) fn init(&mut self, regions: &[MemoryRegion]) -> Result<()> {
         let regions = MergedMemoryRegion::new(regions);
@@ -101,15 +106,15 @@ impl BitmapMemoryManager {
         }
     }
 
-    // fn mark_freed(&mut self, range: PhysFrameRange) {
-    //     for frame in range {
-    //         self.set_bit(frame, false)
-    //     }
-    //     // update range if needed
-    //     if self.range.start <= range.end {
-    //         self.range.start = range.start;
-    //     }
-    // }
+    fn mark_freed(&mut self, range: PhysFrameRange) {
+        for frame in range {
+            self.set_bit(frame, false)
+        }
+        // update range if needed
+        if range.start < self.range.start {
+            self.range.start = range.start;
+        }
+    }
 
     pub(crate) fn allocate(&mut self, num_frames: usize) -> Result<PhysFrameRange> {
         let mut start_frame = self.range.start;
@@ -130,11 +135,9 @@ impl BitmapMemoryManager {
         }
     }
 
-    // pub(crate) fn free(&mut self, range: PhysFrameRange) {
-    //     for frame in range {
-    //         self.set_bit(frame, false)
-    //     }
-    // }
+    pub(crate) fn free(&mut self, range: PhysFrameRange) {
+        self.mark_freed(range);
+    }
 
     fn get_bit(&self, frame: PhysFrame) -> bool {
         let frame_index = frame.start_address().as_u64() / BYTES_PER_FRAME;
@@ -2,11 +2,12 @@ use crate::{
     graphics::{Color, Draw, Offset, Point, ScreenInfo},
     layer,
     prelude::*,
-    sync::{mpsc, OnceCell},
     window::Window,
+    xhc::{MouseInput, MouseReceiver},
 };
 use core::future::Future;
 use enumflags2::{bitflags, BitFlags};
+use mikanos_usb as usb;
 
 const TRANSPARENT_COLOR: Color = Color::RED;
 const MOUSE_CURSOR_WIDTH: usize = 15;
@@ -64,19 +65,15 @@ pub(crate) struct MouseEvent {
     pub(crate) pos_diff: Offset<i32>,
 }
 
-static MOUSE_EVENT_TX: OnceCell<mpsc::Sender<RawMouseEvent>> = OnceCell::uninit();
-
-pub(crate) extern "C" fn observer(buttons: u8, displacement_x: i8, displacement_y: i8) {
-    let buttons = BitFlags::<MouseButton>::from_bits_truncate(buttons);
-    let event = RawMouseEvent {
-        buttons,
-        displacement: Offset::new(i32::from(displacement_x), i32::from(displacement_y)),
-    };
-
-    let res = MOUSE_EVENT_TX.try_get().and_then(|tx| tx.send(event));
-
-    if let Err(err) = res {
-        error!("failed to enqueue to the queue: {}", err);
+impl From<usb::input::InputRecord> for RawMouseEvent {
+    fn from(record: usb::input::InputRecord) -> Self {
+        Self {
+            buttons: BitFlags::<MouseButton>::from_bits_truncate(record.buttons),
+            displacement: Offset::new(
+                i32::from(record.displacement_x),
+                i32::from(record.displacement_y),
+            ),
+        }
     }
 }
 
@@ -95,11 +92,11 @@ fn draw(drawer: &mut dyn Draw) {
 }
 
 pub(crate) fn handler_task() -> impl Future<Output = Result<()>> {
-    // Initialize MOUSE_EVENT_TX before co-task starts
-    let (tx, mut rx) = mpsc::channel(100);
-    MOUSE_EVENT_TX.init_once(|| tx);
+    // Take the input queue before co-task starts
+    let rx = MouseReceiver::new();
 
     async move {
+        let mut rx = rx?;
         let mut cursor_pos = Point::new(300, 200);
         let screen_info = ScreenInfo::get();
 
@@ -129,7 +126,14 @@ pub(crate) fn handler_task() -> impl Future<Output = Result<()>> {
         .await?;
 
         let mut buttons = BitFlags::empty();
-        while let Some(event) = rx.next().await {
+        while let Some(input) = rx.next().await {
+            let event = match input {
+                MouseInput::Record(record) => RawMouseEvent::from(record),
+                MouseInput::Motion(motion) => RawMouseEvent {
+                    buttons,
+                    displacement: Offset::new(motion.x, motion.y),
+                },
+            };
             let prev_cursor_pos = cursor_pos;
             let prev_buttons = buttons;
 
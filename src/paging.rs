@@ -1,10 +1,16 @@
-use crate::{memory::BitmapMemoryManager, prelude::*};
+use crate::{
+    memory::BitmapMemoryManager,
+    prelude::*,
+    sync::{OnceCell, SpinMutex, SpinMutexGuard},
+};
 use x86_64::{
-    structures::paging::{Mapper, OffsetPageTable, Page, PageTable, PhysFrame},
+    structures::paging::{Mapper, OffsetPageTable, Page, PageTable, PhysFrame, Size4KiB},
     PhysAddr, VirtAddr,
 };
 
-/// Initialize a new OffsetPageTable.
+static MAPPER: OnceCell<SpinMutex<OffsetPageTable<'static>>> = OnceCell::uninit();
+
+/// Initialize the kernel's OffsetPageTable.
 ///
 /// # Safety
 ///
@@ -12,9 +18,20 @@ use x86_64::{
 /// complete physical memory is mapped to virtual memory at the passed
 /// `physical_memory_offset`. Also, this function must be only called once
 /// to avoid aliasing `&mut` references (which is undefined behavior).
-pub(crate) unsafe fn init(physical_memory_offset: VirtAddr) -> OffsetPageTable<'static> {
+pub(crate) unsafe fn init(physical_memory_offset: VirtAddr) {
     let level_4_table = unsafe { active_level_4_table(physical_memory_offset) };
-    unsafe { OffsetPageTable::new(level_4_table, physical_memory_offset) }
+    let mapper = unsafe { OffsetPageTable::new(level_4_table, physical_memory_offset) };
+    MAPPER.init_once(|| SpinMutex::new(mapper));
+}
+
+pub(crate) fn lock_mapper() -> SpinMutexGuard<'static, OffsetPageTable<'static>> {
+    MAPPER.get().lock()
+}
+
+/// Locks the page table without spinning, failing if it is already locked (e.g. while the kernel
+/// is still being initialized).
+pub(crate) fn try_lock_mapper() -> Result<SpinMutexGuard<'static, OffsetPageTable<'static>>> {
+    MAPPER.try_get()?.try_lock()
 }
 
 /// Returns a mutable reference to the active level 4 table.
@@ -54,3 +71,19 @@ pub(crate) fn make_identity_mapping(
     }
     Ok(())
 }
+
+/// Removes the identity mapping created by [`make_identity_mapping`].
+///
+/// The frames themselves are not freed.
+pub(crate) fn remove_identity_mapping(
+    mapper: &mut OffsetPageTable,
+    base_addr: u64,
+    num_pages: usize,
+) -> Result<()> {
+    let base_page = Page::<Size4KiB>::from_start_address(VirtAddr::new(base_addr))?;
+    for i in 0..num_pages {
+        let (_frame, flush) = mapper.unmap(base_page + i as u64)?;
+        flush.flush();
+    }
+    Ok(())
+}
@@ -250,6 +250,9 @@ impl Terminal {
     fn handle_event(&mut self, event: FramedWindowEvent) {
         match event {
             FramedWindowEvent::Keyboard(event) => {
+                if !event.pressed {
+                    return;
+                }
                 self.draw_cursor(false);
                 match event.ascii {
                     '\0' if event.keycode == 0x51 => {
@@ -57,7 +57,7 @@ impl TextWindow {
     fn handle_event(&mut self, event: FramedWindowEvent) {
         match event {
             FramedWindowEvent::Keyboard(event) => {
-                if event.ascii == '\0' {
+                if !event.pressed || event.ascii == '\0' {
                     return;
                 }
 
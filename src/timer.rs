@@ -70,6 +70,14 @@ pub(crate) mod lapic {
         initial_count().write(0);
     }
 
+    /// Interval between LAPIC timer interrupts (ticks) in milliseconds.
+    pub(crate) const TICK_MILLISECONDS: u64 = 10;
+
+    /// Returns the number of ticks since the LAPIC timer was started.
+    pub(crate) fn current_tick() -> u64 {
+        TOTAL_INTERRUPTED_COUNT.load(Ordering::Relaxed)
+    }
+
     pub(crate) fn oneshot(timeout: u64) -> Result<oneshot::Receiver<u64>> {
         let (tx, rx) = oneshot::channel();
         let timer = Timer { timeout, tx };
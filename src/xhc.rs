@@ -1,45 +1,153 @@
 use crate::{
+    co_task,
     interrupt::{self, InterruptContextGuard, InterruptIndex},
-    keyboard, memory, mouse, paging,
+    memory, paging,
     pci::{self, Device, MsiDeliveryMode, MsiTriggerMode},
     prelude::*,
-    sync::{OnceCell, SpinMutex},
+    sync::{OnceCell, SpinMutex, SpinMutexGuard},
+    timer,
 };
 use core::{
+    convert::TryFrom,
+    future::Future,
     pin::Pin,
-    sync::atomic::{AtomicBool, Ordering},
+    sync::atomic::{AtomicBool, AtomicUsize, Ordering},
     task::{Context, Poll},
 };
-use futures_util::{task::AtomicWaker, Stream};
+use futures_util::{future, select_biased, task::AtomicWaker, Stream};
 use mikanos_usb as usb;
 use x86_64::structures::{idt::InterruptStackFrame, paging::OffsetPageTable};
 
-static XHC: OnceCell<SpinMutex<&'static mut usb::xhci::Controller>> = OnceCell::uninit();
+/// Maximum number of xHCs driven at once. Each one gets its own MSI vector.
+const MAX_CONTROLLERS: usize = 4;
+
+/// State shared between a controller's interrupt handler and its handler task.
+///
+/// Locking:
+///
+/// * `xhc` serializes everything that touches the controller's rings, device slots and class
+///   drivers: event processing, bring-up, timeouts and issuing queued transfers. Completions
+///   and class driver callbacks run with it held, so they may submit further transfers.
+/// * Other tasks submit without `xhc`. They queue transfers in the async transfer table and
+///   set `queued`, and `handler_task` issues them. The holder of `xhc` is thus the only
+///   producer on every transfer ring and on the command ring, and the only reader of the device
+///   slots, so these need no locks of their own. Class driver calls that put TRBs on the
+///   rings directly, such as `MassStorageDriver::read` and `CdcDriver::send`, take the locked
+///   controller as an argument, so they can only be made while holding `xhc`.
+/// * Async transfer results are handed over through an atomic state per token, so waiting
+///   for, taking and abandoning a transfer never takes `xhc` and does not contend with event
+///   processing.
+/// * The DMA memory pool, the async transfer table and the deferred log are shared by all
+///   controllers and have their own locks on the C++ side. They are always taken after `xhc`,
+///   never before.
+struct ControllerSlot {
+    xhc: OnceCell<SpinMutex<&'static mut usb::xhci::Controller>>,
+    interrupted: AtomicBool,
+    waker: AtomicWaker,
+    /// Set when transfers have been queued for `handler_task` to issue.
+    queued: AtomicBool,
+    queue_waker: AtomicWaker,
+}
+
+impl ControllerSlot {
+    const fn new() -> Self {
+        Self {
+            xhc: OnceCell::uninit(),
+            interrupted: AtomicBool::new(false),
+            waker: AtomicWaker::new(),
+            queued: AtomicBool::new(false),
+            queue_waker: AtomicWaker::new(),
+        }
+    }
+
+    fn lock(&self) -> SpinMutexGuard<'_, &'static mut usb::xhci::Controller> {
+        self.xhc.get().lock()
+    }
+
+    /// Asks `handler_task` to issue the transfers queued for this controller.
+    fn notify_queued(&self) {
+        self.queued.store(true, Ordering::Relaxed);
+        self.queue_waker.wake();
+    }
+}
+
+static CONTROLLERS: [ControllerSlot; MAX_CONTROLLERS] = [
+    ControllerSlot::new(),
+    ControllerSlot::new(),
+    ControllerSlot::new(),
+    ControllerSlot::new(),
+];
+static NUM_CONTROLLERS: AtomicUsize = AtomicUsize::new(0);
+
+/// Number of xHC interrupters (event rings) of each controller.
+///
+/// sabios runs only on the BSP and MSI-X is not supported yet, so all interrupters of a
+/// controller share its MSI vector and its `handler_task` drains every event ring.
+const NUM_INTERRUPTERS: u16 = 1;
+
+/// Number of events each event ring can hold before the xHC reports "Event Ring Full".
+const EVENT_RING_SIZE: usize = 256;
 
 pub(crate) fn init(devices: &[Device], mapper: &mut OffsetPageTable) -> Result<()> {
-    let mut xhc_dev = None;
-    for dev in devices {
-        // is the device is xHC?
-        if dev.class_code.test3(0x0c, 0x03, 0x30) {
-            xhc_dev = Some(dev);
-
-            if dev.vendor_id == 0x8086 {
-                // prefer Intel's xHC
-                break;
+    let mut xhc_devs = devices
+        .iter()
+        .filter(|dev| dev.class_code.test3(0x0c, 0x03, 0x30))
+        .peekable();
+    if xhc_devs.peek().is_none() {
+        bail!(ErrorKind::XhcNotFound);
+    }
+
+    // The DMA memory pool is shared by all controllers.
+    alloc_memory_pool(mapper)?;
+    usb::input::InputQueue::set_notifier(input_notifier);
+    usb::transfer::set_notifier(transfer_notifier);
+    usb::MassStorageDriver::set_default_observer(mass_storage_observer);
+    usb::CdcDriver::set_default_observer(cdc_observer);
+
+    let mut num_controllers = 0;
+    for xhc_dev in xhc_devs {
+        if num_controllers == MAX_CONTROLLERS {
+            warn!("too many xHCs, ignoring {}", xhc_dev);
+            continue;
+        }
+        info!("xHC has been found: {}", xhc_dev);
+        match init_controller(devices, xhc_dev, mapper, num_controllers) {
+            Ok(xhc) => {
+                CONTROLLERS[num_controllers]
+                    .xhc
+                    .init_once(move || SpinMutex::new(xhc));
+                num_controllers += 1;
             }
+            Err(err) => warn!("failed to initialize xHC {}: {}", xhc_dev, err),
         }
     }
+    if num_controllers == 0 {
+        bail!(ErrorKind::XhcNotFound);
+    }
+    NUM_CONTROLLERS.store(num_controllers, Ordering::Release);
 
-    let xhc_dev = xhc_dev.ok_or(ErrorKind::XhcNotFound)?;
-    info!("xHC has been found: {}", xhc_dev);
+    Ok(())
+}
+
+/// Number of controllers initialized by `init`. `handler_task` should be spawned for each.
+pub(crate) fn num_controllers() -> usize {
+    NUM_CONTROLLERS.load(Ordering::Acquire)
+}
 
+fn init_controller(
+    devices: &[Device],
+    xhc_dev: &Device,
+    mapper: &mut OffsetPageTable,
+    index: usize,
+) -> Result<&'static mut usb::xhci::Controller> {
+    let vector = InterruptIndex::xhci(index).ok_or(ErrorKind::IndexOutOfRange)?;
     let bsp_local_apic_id = unsafe { *(0xfee00020 as *const u32) } >> 24;
     pci::configure_msi_fixed_destination(
         xhc_dev,
         bsp_local_apic_id,
         MsiTriggerMode::Level,
         MsiDeliveryMode::Fixed,
-        InterruptIndex::Xhci,
+        vector,
         0,
     )?;
 
@@ -49,26 +157,35 @@ pub(crate) fn init(devices: &[Device], mapper: &mut OffsetPageTable) -> Result<(
     debug!("xHC mmio_base = {:08x}", xhc_mmio_base);
 
     map_xhc_mmio(mapper, xhc_mmio_base)?;
-    alloc_memory_pool(mapper)?;
 
-    let xhc = unsafe { usb::xhci::Controller::new(xhc_mmio_base) };
+    let xhc =
+        unsafe { usb::xhci::Controller::new(xhc_mmio_base) }.ok_or(ErrorKind::NoEnoughMemory)?;
 
     if xhc_dev.vendor_id == 0x8086 {
         switch_ehci_to_xhci(devices, xhc_dev);
     }
 
-    xhc.init();
-    debug!("xhc starting");
-    xhc.run()?;
-
-    usb::HidMouseDriver::set_default_observer(mouse::observer);
-    usb::HidKeyboardDriver::set_default_observer(keyboard::observer);
+    // Only starts the bring-up sequence; `handler_task` drives it to completion.
+    xhc.init(NUM_INTERRUPTERS, EVENT_RING_SIZE)?;
 
-    xhc.configure_connected_ports();
+    Ok(xhc)
+}
 
-    XHC.init_once(move || SpinMutex::new(xhc));
+extern "C" fn mass_storage_observer(
+    _driver: *mut usb::MassStorageDriver,
+    num_blocks: u64,
+    block_size: u32,
+) {
+    info!(
+        "USB mass storage attached: {} blocks of {} bytes",
+        num_blocks, block_size
+    );
+}
 
-    Ok(())
+extern "C" fn cdc_observer(driver: *mut usb::CdcDriver) {
+    // SAFETY: the driver outlives the observer call
+    let kind = unsafe { &mut *driver }.kind();
+    info!("USB CDC device attached: {:?}", kind);
 }
 
 fn map_xhc_mmio(mapper: &mut OffsetPageTable, xhc_mmio_base: u64) -> Result<()> {
@@ -77,12 +194,20 @@ fn map_xhc_mmio(mapper: &mut OffsetPageTable, xhc_mmio_base: u64) -> Result<()>
     paging::make_identity_mapping(mapper, &mut *allocator, xhc_mmio_base, 16)
 }
 
+/// Gives the USB stack its initial DMA memory pool.
+///
+/// The pool grows on demand through `sabios_alloc_dma_frames` once the kernel is initialized.
 fn alloc_memory_pool(mapper: &mut OffsetPageTable) -> Result<()> {
     let num_frames = 32;
-    let mut allocator = memory::lock_memory_manager();
-    let frame_range = allocator.allocate(num_frames)?;
-    let base_addr = frame_range.start.start_address().as_u64();
-    paging::make_identity_mapping(mapper, &mut *allocator, base_addr, num_frames)?;
+    let base_addr = {
+        let mut allocator = memory::lock_memory_manager();
+        let frame_range = allocator.allocate(num_frames)?;
+        let base_addr = frame_range.start.start_address().as_u64();
+        paging::make_identity_mapping(mapper, &mut *allocator, base_addr, num_frames)?;
+        base_addr
+    };
+    // The memory manager is released before taking the pool lock, following the lock order in
+    // `cxx_support`. The page table is still locked by the caller, which the pool never takes.
     unsafe { usb::set_memory_pool(base_addr, num_frames * (memory::BYTES_PER_FRAME as usize)) };
     Ok(())
 }
@@ -106,32 +231,40 @@ fn switch_ehci_to_xhci(devices: &[Device], xhc_dev: &Device) {
     );
 }
 
-static INTERRUPTED_FLAG: AtomicBool = AtomicBool::new(false);
-static WAKER: AtomicWaker = AtomicWaker::new();
-
-#[derive(Debug)]
-struct InterruptStream {
-    _private: (),
+/// Yields each time `flag` has been set, clearing it.
+struct SignalStream {
+    flag: &'static AtomicBool,
+    waker: &'static AtomicWaker,
 }
 
-impl InterruptStream {
-    fn new() -> Self {
-        Self { _private: () }
+impl SignalStream {
+    fn interrupts(slot: &'static ControllerSlot) -> Self {
+        Self {
+            flag: &slot.interrupted,
+            waker: &slot.waker,
+        }
+    }
+
+    fn queued(slot: &'static ControllerSlot) -> Self {
+        Self {
+            flag: &slot.queued,
+            waker: &slot.queue_waker,
+        }
     }
 }
 
-impl Stream for InterruptStream {
+impl Stream for SignalStream {
     type Item = ();
 
     fn poll_next(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Option<Self::Item>> {
         // fast path
-        if INTERRUPTED_FLAG.swap(false, Ordering::Relaxed) {
+        if self.flag.swap(false, Ordering::Relaxed) {
             return Poll::Ready(Some(()));
         }
 
-        WAKER.register(cx.waker());
-        if INTERRUPTED_FLAG.swap(false, Ordering::Relaxed) {
-            WAKER.take();
+        self.waker.register(cx.waker());
+        if self.flag.swap(false, Ordering::Relaxed) {
+            self.waker.take();
             Poll::Ready(Some(()))
         } else {
             Poll::Pending
@@ -139,21 +272,556 @@ impl Stream for InterruptStream {
     }
 }
 
-pub(crate) extern "x86-interrupt" fn interrupt_handler(_stack_frame: InterruptStackFrame) {
+/// Interrupt handler of the `N`-th controller.
+pub(crate) extern "x86-interrupt" fn interrupt_handler<const N: usize>(
+    _stack_frame: InterruptStackFrame,
+) {
     let _guard = InterruptContextGuard::new();
-    INTERRUPTED_FLAG.store(true, Ordering::Relaxed);
-    WAKER.wake();
+    let slot = &CONTROLLERS[N];
+    slot.interrupted.store(true, Ordering::Relaxed);
+    slot.waker.wake();
     interrupt::notify_end_of_interrupt();
 }
 
-pub(crate) async fn handler_task() {
-    let mut interrupts = InterruptStream::new();
-    while let Some(()) = interrupts.next().await {
-        let mut xhc = XHC.get().lock();
-        while xhc.has_event() {
-            if let Err(err) = xhc.process_event().map_err(Error::from) {
-                error!("error while process_event: {}", err);
+/// Maximum number of events processed with a single FFI call.
+const EVENT_BATCH_SIZE: usize = 32;
+/// Maximum number of deferred log records formatted at once.
+const LOG_FLUSH_BATCH_SIZE: usize = 32;
+
+/// Number of consecutive empty polls after which interrupts are unmasked again.
+///
+/// Each poll yields to the other co-tasks once, so this bounds the time spent polling an idle
+/// controller to a few dozen executor rounds.
+const IDLE_POLL_BUDGET: u32 = 64;
+
+/// Interval (in timer ticks) of checking for port resets that never complete.
+const TIMEOUT_CHECK_INTERVAL: u64 = 10;
+
+fn now_ms() -> u64 {
+    timer::lapic::current_tick() * timer::lapic::TICK_MILLISECONDS
+}
+
+/// Drives the controller bring-up without spinning on its registers.
+///
+/// The registers are polled once per timer tick, so other co-tasks keep running while the
+/// controller is being reset.
+async fn bring_up(slot: &ControllerSlot) -> Result<()> {
+    debug!("xhc starting");
+    loop {
+        let running = slot.lock().poll_bring_up(now_ms())?;
+        if running {
+            break;
+        }
+        timer::lapic::oneshot(timer::lapic::current_tick() + 1)?.await;
+    }
+
+    let mut xhc = slot.lock();
+    // HID devices are latency sensitive, so favour latency over coalescing. Interrupters that
+    // serve only mass storage slots switch to THROUGHPUT as their devices get configured.
+    xhc.set_interrupt_moderation(usb::xhci::InterruptModeration::LOW_LATENCY);
+    // Under sustained input or storage traffic, poll instead of taking an interrupt per batch.
+    xhc.set_polling_policy(usb::xhci::PollingPolicy::Hybrid {
+        idle_poll_budget: IDLE_POLL_BUDGET,
+    });
+    xhc.configure_connected_ports();
+    while usb::log::flush(LOG_FLUSH_BATCH_SIZE) == LOG_FLUSH_BATCH_SIZE {}
+    Ok(())
+}
+
+/// Drives the `index`-th controller initialized by `init`.
+pub(crate) async fn handler_task(index: usize) {
+    let slot = match CONTROLLERS.get(index) {
+        Some(slot) if index < num_controllers() => slot,
+        _ => {
+            error!("xHC #{} does not exist", index);
+            return;
+        }
+    };
+    if let Err(err) = bring_up(slot).await {
+        error!("failed to bring up xHC #{}: {}", index, err);
+        return;
+    }
+
+    let mut interrupts = SignalStream::interrupts(slot);
+    let mut queued = SignalStream::queued(slot);
+    let mut timeouts =
+        match timer::lapic::interval(timer::lapic::current_tick(), TIMEOUT_CHECK_INTERVAL) {
+            Ok(timeouts) => timeouts,
+            Err(err) => {
+                error!("failed to start xHC timeout timer: {}", err);
+                return;
+            }
+        };
+    // True while interrupts are masked and the event rings are polled instead.
+    let mut polling = false;
+    loop {
+        select_biased! {
+            interrupt = interrupts.next().fuse() => {
+                if interrupt.is_none() {
+                    break;
+                }
+                let mut xhc = slot.lock();
+                xhc.note_interrupt();
+                polling = xhc.poll_events(EVENT_BATCH_SIZE);
+            }
+            _ = poll_tick(polling).fuse() => {
+                polling = slot.lock().poll_events(EVENT_BATCH_SIZE);
+            }
+            signal = queued.next().fuse() => {
+                if signal.is_none() {
+                    break;
+                }
+                usb::transfer::issue_queued(&mut slot.lock(), queue_of(index));
+            }
+            timeout = timeouts.next().fuse() => {
+                match timeout {
+                    Some(Ok(_)) => {}
+                    Some(Err(err)) => {
+                        error!("xHC timeout timer failed: {}", err);
+                        break;
+                    }
+                    None => break,
+                }
+                if let Err(err) = slot.lock().check_timeouts(now_ms()) {
+                    warn!("failed to handle xHC timeouts: {}", Error::from(err));
+                }
             }
         }
+        // Deferred (binary) log records are formatted here, off the event processing path.
+        // The log has its own lock on the C++ side, so this needs no controller lock.
+        while usb::log::flush(LOG_FLUSH_BATCH_SIZE) == LOG_FLUSH_BATCH_SIZE {}
+    }
+}
+
+/// Completes after yielding once if `polling`, otherwise never.
+async fn poll_tick(polling: bool) {
+    if polling {
+        co_task::yield_now().await;
+    } else {
+        future::pending::<()>().await;
+    }
+}
+
+/// Maximum number of input records moved out of an input queue at once.
+const INPUT_BATCH_SIZE: usize = 32;
+
+static INPUT_WAKERS: [AtomicWaker; 2] = [AtomicWaker::new(), AtomicWaker::new()];
+
+extern "C" fn input_notifier(queue_id: u32) {
+    if let Some(waker) = INPUT_WAKERS.get(queue_id as usize) {
+        waker.wake();
+    }
+}
+
+/// Receives input records published by the HID class drivers.
+///
+/// Records are moved out of the shared queue in batches, so the C++ side never calls into the
+/// consumers while processing USB events.
+pub(crate) struct InputReceiver {
+    id: usb::input::QueueId,
+    consumer: usb::input::QueueConsumer,
+    waker: &'static AtomicWaker,
+    buf: [usb::input::InputRecord; INPUT_BATCH_SIZE],
+    /// Sequence number of `buf[0]` in the queue.
+    base: u32,
+    pos: usize,
+    len: usize,
+    /// Sequence number of the record handed out last, reported to the latency tracer once the
+    /// consumer comes back for the next one.
+    handed_out: Option<u32>,
+}
+
+impl InputReceiver {
+    pub(crate) fn new(id: usb::input::QueueId) -> Result<Self> {
+        let consumer = usb::input::QueueConsumer::take(id).ok_or(ErrorKind::AlreadyAllocated)?;
+        Ok(Self::from_consumer(id, consumer))
+    }
+
+    fn from_consumer(id: usb::input::QueueId, consumer: usb::input::QueueConsumer) -> Self {
+        Self {
+            id,
+            waker: &INPUT_WAKERS[id as usize],
+            buf: [usb::input::InputRecord::default(); INPUT_BATCH_SIZE],
+            base: consumer.position(),
+            pos: 0,
+            len: 0,
+            handed_out: None,
+            consumer,
+        }
+    }
+
+    /// Sequence number of the next record handed out.
+    fn position(&self) -> u32 {
+        self.base.wrapping_add(self.pos as u32)
+    }
+
+    fn refill(&mut self) -> bool {
+        self.base = self.consumer.position();
+        self.pos = 0;
+        self.len = self.consumer.drain(&mut self.buf);
+        self.len > 0
+    }
+
+    fn hand_out(&mut self) -> usb::input::InputRecord {
+        let record = self.buf[self.pos];
+        self.handed_out = Some(self.base.wrapping_add(self.pos as u32));
+        self.pos += 1;
+        record
+    }
+}
+
+impl Stream for InputReceiver {
+    type Item = usb::input::InputRecord;
+
+    fn poll_next(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Option<Self::Item>> {
+        // Polled again, so the consumer has finished with the previous record.
+        if let Some(seq) = self.handed_out.take() {
+            usb::trace::input_consumed(self.id, seq);
+        }
+
+        // fast path
+        if self.pos < self.len || self.refill() {
+            return Poll::Ready(Some(self.hand_out()));
+        }
+
+        self.waker.register(cx.waker());
+        if !self.consumer.queue().is_empty() && self.refill() {
+            self.waker.take();
+            Poll::Ready(Some(self.hand_out()))
+        } else {
+            Poll::Pending
+        }
+    }
+}
+
+/// Input from the mouse drivers.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) enum MouseInput {
+    /// A queued report. With coalescing enabled, only reports changing the buttons are queued.
+    Record(usb::input::InputRecord),
+    /// Motion added up by the drivers since it was last taken.
+    Motion(usb::input::MotionDelta),
+}
+
+/// Receives mouse input with motion coalescing enabled.
+///
+/// Motion is taken once each time the consumer comes back, however many reports it spans, and is
+/// handed out in order with the queued records.
+pub(crate) struct MouseReceiver {
+    records: InputReceiver,
+    motion: &'static usb::input::PendingMotion,
+    /// Motion already taken, waiting for the records queued before it.
+    pending: Option<usb::input::MotionDelta>,
+}
+
+impl MouseReceiver {
+    pub(crate) fn new() -> Result<Self> {
+        let records = InputReceiver::new(usb::input::QueueId::Mouse)?;
+        Ok(Self::from_parts(records, usb::input::PendingMotion::get()))
+    }
+
+    fn from_parts(records: InputReceiver, motion: &'static usb::input::PendingMotion) -> Self {
+        usb::input::PendingMotion::set_coalescing(true);
+        Self {
+            records,
+            motion,
+            pending: None,
+        }
+    }
+}
+
+impl Drop for MouseReceiver {
+    fn drop(&mut self) {
+        usb::input::PendingMotion::set_coalescing(false);
+    }
+}
+
+impl Stream for MouseReceiver {
+    type Item = MouseInput;
+
+    fn poll_next(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Option<Self::Item>> {
+        loop {
+            if self.pending.is_none() {
+                self.pending = self.motion.take();
+            }
+            if let Some(motion) = self.pending {
+                if motion.is_due(self.records.position()) {
+                    self.pending = None;
+                    return Poll::Ready(Some(MouseInput::Motion(motion)));
+                }
+            }
+
+            match Pin::new(&mut self.records).poll_next(cx) {
+                Poll::Ready(record) => return Poll::Ready(record.map(MouseInput::Record)),
+                Poll::Pending => {
+                    // The driver notifies only when motion starts to accumulate, which may have
+                    // happened before the waker was registered.
+                    if self.pending.is_none() {
+                        self.pending = self.motion.take();
+                        if self.pending.is_some() {
+                            continue;
+                        }
+                    }
+                    return Poll::Pending;
+                }
+            }
+        }
+    }
+}
+
+const NEW_WAKER: AtomicWaker = AtomicWaker::new();
+static TRANSFER_WAKERS: [AtomicWaker; usb::transfer::MAX_IN_FLIGHT] =
+    [NEW_WAKER; usb::transfer::MAX_IN_FLIGHT];
+
+extern "C" fn transfer_notifier(token: u32) {
+    if let Some(waker) = TRANSFER_WAKERS.get(usb::transfer::slot_of(token)) {
+        waker.wake();
+    }
+}
+
+/// Number of the async transfer queue issued by the handler task of the controller `index`.
+fn queue_of(index: usize) -> u8 {
+    // `index` is below `MAX_CONTROLLERS`
+    index as u8
+}
+
+/// Returns the controller `index` once its handler task has been spawned.
+fn controller_slot(index: usize) -> Result<&'static ControllerSlot> {
+    match CONTROLLERS.get(index) {
+        Some(slot) if index < num_controllers() => Ok(slot),
+        _ => bail!(ErrorKind::IndexOutOfRange),
+    }
+}
+
+/// Issues a control IN transfer to the default control pipe of the device in `slot_id` of
+/// the `index`-th controller and waits for it. Returns the number of bytes received in `buf`.
+#[allow(dead_code)]
+pub(crate) async fn control_in(
+    index: usize,
+    slot_id: u8,
+    setup: usb::transfer::SetupPacket,
+    buf: &mut [u8],
+) -> Result<usize> {
+    let slot = controller_slot(index)?;
+    let length = u16::try_from(buf.len()).unwrap_or(u16::MAX);
+    let token = usb::transfer::queue_control_in(queue_of(index), slot_id, setup, length)?;
+    slot.notify_queued();
+    Transfer::new(token, buf).await
+}
+
+/// Issues a control OUT transfer of `data` to the default control pipe of the device in
+/// `slot_id` of the `index`-th controller and waits for it.
+#[allow(dead_code)]
+pub(crate) async fn control_out(
+    index: usize,
+    slot_id: u8,
+    setup: usb::transfer::SetupPacket,
+    data: &[u8],
+) -> Result<()> {
+    let slot = controller_slot(index)?;
+    let token = usb::transfer::queue_control_out(queue_of(index), slot_id, setup, data)?;
+    slot.notify_queued();
+    Transfer::new(token, &mut []).await.map(|_| ())
+}
+
+/// Completes when the transfer of `token` completes. Dropping it abandons the transfer.
+struct Transfer<'a> {
+    token: Option<usb::transfer::Token>,
+    buf: &'a mut [u8],
+}
+
+impl<'a> Transfer<'a> {
+    fn new(token: usb::transfer::Token, buf: &'a mut [u8]) -> Self {
+        Self {
+            token: Some(token),
+            buf,
+        }
+    }
+
+    fn take(&mut self) -> Option<Result<usize>> {
+        // Results are published atomically, so this does not need the controller lock.
+        let token = self.token.as_mut()?;
+        let res = token.take(self.buf)?;
+        self.token = None;
+        Some(res.map_err(Error::from))
+    }
+}
+
+impl Future for Transfer<'_> {
+    type Output = Result<usize>;
+
+    fn poll(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
+        let index = match &self.token {
+            Some(token) => token.slot(),
+            None => return Poll::Ready(Err(ErrorKind::InvalidPhase.into())),
+        };
+        let waker = &TRANSFER_WAKERS[index];
+        // fast path
+        if let Some(res) = self.take() {
+            return Poll::Ready(res);
+        }
+
+        waker.register(cx.waker());
+        match self.take() {
+            Some(res) => {
+                waker.take();
+                Poll::Ready(res)
+            }
+            None => Poll::Pending,
+        }
+    }
+}
+
+impl Drop for Transfer<'_> {
+    fn drop(&mut self) {
+        // Abandoning an in-flight transfer is safe without the controller lock.
+        drop(self.token.take());
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use futures_util::task::noop_waker_ref;
+    use usb::input::{InputQueue, InputRecord, MotionDelta, PendingMotion, QueueConsumer, QueueId};
+
+    fn record(keycode: u8) -> InputRecord {
+        InputRecord {
+            keycode,
+            ..InputRecord::default()
+        }
+    }
+
+    fn poll<S: Stream + Unpin>(stream: &mut S) -> Poll<Option<S::Item>> {
+        let mut cx = Context::from_waker(noop_waker_ref());
+        Pin::new(stream).poll_next(&mut cx)
+    }
+
+    /// Packs motion in the bit assignment of `usb::PendingMotion`.
+    const fn pack(seq: u16, x: i32, y: i32, wheel: i32) -> u64 {
+        1 | (seq as u64 & 0x7fff) << 1
+            | (wheel as u64 & 0xff) << 16
+            | (x as u64 & 0xf_ffff) << 24
+            | (y as u64 & 0xf_ffff) << 44
+    }
+
+    #[test_case]
+    fn drain_across_wrap() {
+        static QUEUE: InputQueue = InputQueue::new(u32::MAX - 2);
+        let mut consumer = QueueConsumer::new(&QUEUE);
+        for keycode in 0..6 {
+            assert!(QUEUE.publish(record(keycode)));
+        }
+
+        let mut buf = [InputRecord::default(); 4];
+        assert_eq!(consumer.drain(&mut buf), 4);
+        assert_eq!(consumer.position(), 1);
+        assert!(buf.iter().map(|r| r.keycode).eq(0..4));
+
+        assert_eq!(consumer.drain(&mut buf), 2);
+        assert_eq!(consumer.position(), 3);
+        assert!(buf[..2].iter().map(|r| r.keycode).eq(4..6));
+
+        assert_eq!(consumer.drain(&mut buf), 0);
+        assert!(QUEUE.is_empty());
+    }
+
+    #[test_case]
+    fn receiver_across_wrap() {
+        static QUEUE: InputQueue = InputQueue::new(u32::MAX - 1);
+        let consumer = QueueConsumer::new(&QUEUE);
+        let mut receiver = InputReceiver::from_consumer(QueueId::Keyboard, consumer);
+        assert!(matches!(poll(&mut receiver), Poll::Pending));
+
+        for keycode in 0..3 {
+            assert!(QUEUE.publish(record(keycode)));
+        }
+        for keycode in 0..3 {
+            assert_eq!(poll(&mut receiver), Poll::Ready(Some(record(keycode))));
+        }
+        assert_eq!(receiver.position(), 1);
+        assert!(matches!(poll(&mut receiver), Poll::Pending));
+    }
+
+    #[test_case]
+    fn unpack_sign_extension() {
+        let min = PendingMotion::new(pack(5, -1, -(1 << 19), -128));
+        let expected = MotionDelta {
+            seq: 5,
+            x: -1,
+            y: -(1 << 19),
+            wheel: -128,
+        };
+        assert_eq!(min.take(), Some(expected));
+        assert_eq!(min.take(), None);
+
+        let max = PendingMotion::new(pack(0x7fff, (1 << 19) - 1, 1, 127));
+        let expected = MotionDelta {
+            seq: 0x7fff,
+            x: (1 << 19) - 1,
+            y: 1,
+            wheel: 127,
+        };
+        assert_eq!(max.take(), Some(expected));
+
+        assert_eq!(PendingMotion::new(0).take(), None);
+    }
+
+    #[test_case]
+    fn motion_due_at_wrap() {
+        let last = MotionDelta {
+            seq: 0x7fff,
+            ..MotionDelta::default()
+        };
+        assert!(last.is_due(0x7fff));
+        assert!(last.is_due(0xffff));
+        assert!(last.is_due(u32::MAX));
+        assert!(!last.is_due(0x8000));
+        assert!(!last.is_due(0));
+
+        let first = MotionDelta::default();
+        assert!(first.is_due(0x8000));
+        assert!(first.is_due(0));
+        assert!(!first.is_due(u32::MAX));
+    }
+
+    #[test_case]
+    fn motion_after_queued_records() {
+        static QUEUE: InputQueue = InputQueue::new(u32::MAX - 1);
+        // The motion came in after the records with sequence numbers `u32::MAX - 1` and
+        // `u32::MAX`, so it is due once the position wraps to 0.
+        static MOTION: PendingMotion = PendingMotion::new(pack(0, 3, -4, 1));
+        let consumer = QueueConsumer::new(&QUEUE);
+        let records = InputReceiver::from_consumer(QueueId::Mouse, consumer);
+        let mut receiver = MouseReceiver::from_parts(records, &MOTION);
+
+        // Two records, then motion, then one more record, as the drivers queue them.
+        assert!(QUEUE.publish(record(1)));
+        assert!(QUEUE.publish(record(2)));
+        assert!(QUEUE.publish(record(3)));
+
+        assert_eq!(
+            poll(&mut receiver),
+            Poll::Ready(Some(MouseInput::Record(record(1))))
+        );
+        assert_eq!(
+            poll(&mut receiver),
+            Poll::Ready(Some(MouseInput::Record(record(2))))
+        );
+        let expected = MotionDelta {
+            seq: 0,
+            x: 3,
+            y: -4,
+            wheel: 1,
+        };
+        assert_eq!(
+            poll(&mut receiver),
+            Poll::Ready(Some(MouseInput::Motion(expected)))
+        );
+        assert_eq!(
+            poll(&mut receiver),
+            Poll::Ready(Some(MouseInput::Record(record(3))))
+        );
+        assert!(matches!(poll(&mut receiver), Poll::Pending));
     }
 }